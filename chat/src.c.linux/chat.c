@@ -1,418 +1,1726 @@
 #include "chat.h"
 
 /***********************************************
- * Message Broker
+ * Object pools
  ***********************************************/
 
-static int
-msg_add_bin(msg_t *msg, char *data, size_t size)
-{
-    if (!msg) {
-        return -1;
-    }
-    uint16_t cursor = msg->hdr.len;
-    msg->hdr.len += (size + msg->hdr.len > UINT16_MAX) ? UINT16_MAX : ((uint16_t)size + msg->hdr.len);
-    if (msg->data_sz < msg->hdr.len) {
-        msg->data_sz = msg->hdr.len;
-        msg->data = realloc(msg->data, msg->data_sz);
-    }
-    if (msg->data_sz && !msg->data) {
-        goto error;
-    }
-    memcpy(&msg->data[cursor], data, msg->hdr.len - cursor);
-
-    return 0;
-error:
-    free(msg->data);
-    memset(msg, 0, sizeof(*msg));
-    return -1;
-}
+static pool_t pools[POOL_ID_MAX] = {
+    [POOL_MSG]    = POOL_INITIALIZER(POOL_MSG,    "msg_t",          msg_t,          1024, 256),
+    [POOL_MSGP]   = POOL_INITIALIZER(POOL_MSGP,   "msgp_t",         msgp_t,         4096, 1024),
+    [POOL_CONN]   = POOL_INITIALIZER(POOL_CONN,   "conn_t",         conn_t,         256,  64),
+    [POOL_CFGOBJ] = POOL_INITIALIZER(POOL_CFGOBJ, "cfg_obj_t",      cfg_obj_t,      1024, 0),
+    [POOL_XFER]   = POOL_INITIALIZER(POOL_XFER,   "reactor_xfer_t", reactor_xfer_t, 1024, 256),
+};
+static __thread pool_cache_t pool_caches[POOL_ID_MAX];
 
 static int
-msg_add_fmt(msg_t *msg, const char * format, ...)
+pool_grow(pool_t *pool)
 {
-    va_list args;
-    va_start(args, format);
-    int rc = msg_add_va(msg, format, args);
-    va_end(args);
-
-    return rc;
-}
+    /* called with the pool lock held */
+    size_t stride = POOL_STRIDE(pool->obj_sz);
+    size_t offset = POOL_STRIDE(sizeof(pool_slab_t));
 
-static int
-msg_add_va(msg_t *msg, const char * format, va_list args)
-{
-    if (!msg) {
+    pool_slab_t *slab = malloc(offset + stride * pool->slab_objs);
+    if (!slab) {
         return -1;
     }
-    int size = vsnprintf (NULL, 0, format, args);
-    if (size < 0) {
-        goto error;
-    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
 
-    uint16_t cursor = msg->hdr.len;
-    msg->hdr.len += (size + msg->hdr.len > UINT16_MAX) ? UINT16_MAX : ((uint16_t)size + msg->hdr.len);
-    if (msg->data_sz < msg->hdr.len) {
-        msg->data_sz = msg->hdr.len;
-        msg->data = realloc(msg->data, msg->data_sz);
-    }
-    if (msg->data_sz && !msg->data) {
-        goto error;
+    for (size_t i = pool->slab_objs; i > 0; i--) {
+        pool_obj_t *obj = (pool_obj_t *)((char *)slab + offset + (i - 1) * stride);
+        obj->next = pool->free;
+        pool->free = obj;
     }
-
-    vsnprintf (&msg->data[cursor], msg->hdr.len - cursor, format, args);
+    pool->total += pool->slab_objs;
     return 0;
-
-error:
-    free(msg->data);
-    memset(msg, 0, sizeof(*msg));
-    return -1;
 }
 
-static int
-msg_io_read(msg_t *msg, int fd, size_t *cursor)
+static void *
+pool_get(pool_t *pool)
 {
-    char  *buffer;
-    size_t expected;
+    pool_cache_t *cache = &pool_caches[pool->id];
+    pool_obj_t   *obj   = NULL;
 
-    if (*cursor < sizeof(msg->hdr)) {
-        buffer = (char *)&msg->hdr + *cursor;
-        expected = sizeof(msg->hdr) - *cursor;
-    } else {
-        if (msg->data_sz < msg->hdr.len) {
-            msg->data_sz = msg->hdr.len;
-            msg->data = realloc(msg->data, msg->data_sz);
-            if (!msg->data) {
-                errno = ENOMEM;
-                return MSG_IO_ERR;
+    if (pool->cache_max) {
+        if (!cache->free) {
+            /* refill half of the cache from the shared list at once */
+            pthread_mutex_lock(&pool->lock);
+            while (cache->count < pool->cache_max / 2 && (pool->free || pool_grow(pool) == 0)) {
+                obj = pool->free;
+                pool->free = obj->next;
+                obj->next = cache->free;
+                cache->free = obj;
+                cache->count++;
             }
+            pthread_mutex_unlock(&pool->lock);
         }
-        buffer = msg->data + *cursor - sizeof(msg->hdr);
-        expected = msg->hdr.len - (*cursor - sizeof(msg->hdr));
+        if ((obj = cache->free)) {
+            cache->free = obj->next;
+            cache->count--;
+        }
+    } else {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->free || pool_grow(pool) == 0) {
+            obj = pool->free;
+            pool->free = obj->next;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (!obj) {
+        return NULL;
     }
 
-    int rc = recv(fd, buffer, expected, 0);
-    *cursor += (rc > 0 ? rc : 0);
+    size_t live  = __atomic_add_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+    size_t hiwat = __atomic_load_n(&pool->hiwat, __ATOMIC_RELAXED);
+    while (live > hiwat && !__atomic_compare_exchange_n(&pool->hiwat, &hiwat, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-    if (rc < expected) {
-        return (rc == -1) ? MSG_IO_ERR : ( (rc == 0) ? MSG_IO_DOWN : MSG_IO_AGAIN);
-    }
-    if (*cursor == sizeof(msg->hdr)) {
-        rc = msg_io_read(msg, fd, cursor);
-        if (rc < expected) {
-            return (rc == -1) ? MSG_IO_ERR : ( (rc == 0) ? MSG_IO_DOWN : MSG_IO_AGAIN);
-        }
-    }
-    return MSG_IO_OK;
+    memset(obj, 0, pool->obj_sz);
+    return obj;
 }
 
-static int
-msg_io_write(msg_t *msg, int fd, size_t *cursor)
+static void
+pool_put(pool_t *pool, void *ptr)
 {
-    char  *buffer;
-    size_t expected;
+    pool_cache_t *cache = &pool_caches[pool->id];
+    pool_obj_t   *obj   = ptr;
 
-    if (*cursor < sizeof(msg->hdr)) {
-        buffer = (char *)&msg->hdr + *cursor;
-        expected = sizeof(msg->hdr) - *cursor;
-    } else  {
-        buffer = msg->data + *cursor - sizeof(msg->hdr);
-        expected = msg->hdr.len - (*cursor - sizeof(msg->hdr));
+    if (!obj) {
+        return;
     }
+    __atomic_sub_fetch(&pool->live, 1, __ATOMIC_RELAXED);
 
-    int rc = send(fd, buffer, expected, 0);
-    *cursor += (rc > 0 ? rc : 0);
-
-    if (rc < expected) {
-        return (rc == -1) ? MSG_IO_ERR : ( (rc == 0) ? MSG_IO_DOWN : MSG_IO_AGAIN);
-    }
-    if (*cursor == sizeof(msg->hdr)) {
-        rc = msg_io_write(msg, fd, cursor);
-        if (rc < expected) {
-            return (rc == -1) ? MSG_IO_ERR : ( (rc == 0) ? MSG_IO_DOWN : MSG_IO_AGAIN);
+    if (pool->cache_max) {
+        obj->next = cache->free;
+        cache->free = obj;
+        if (++cache->count >= pool->cache_max) {
+            /* spill half of the cache back to the shared list */
+            pthread_mutex_lock(&pool->lock);
+            while (cache->count > pool->cache_max / 2) {
+                obj = cache->free;
+                cache->free = obj->next;
+                cache->count--;
+                obj->next = pool->free;
+                pool->free = obj;
+            }
+            pthread_mutex_unlock(&pool->lock);
         }
+    } else {
+        pthread_mutex_lock(&pool->lock);
+        obj->next = pool->free;
+        pool->free = obj;
+        pthread_mutex_unlock(&pool->lock);
     }
-    return MSG_IO_OK;
 }
 
-static int
-mbr_add_logi(msg_broker_t *broker, const char * format, ...)
+static void
+pool_stats(pool_t *pool, pool_stats_t *stats)
 {
-    msg_t  *msg  = mbr_grow(broker, MSG_TYP_LI | MSG_COMMIT, NULL);
-    if (!msg) {
-        return -1;
-    }
-
-    va_list args;
-    va_start(args, format);
-    int rc = msg_add_va(msg, format, args);
-    va_end(args);
-
-    return 0;
+    pthread_mutex_lock(&pool->lock);
+    stats->live  = __atomic_load_n(&pool->live, __ATOMIC_RELAXED);
+    stats->hiwat = __atomic_load_n(&pool->hiwat, __ATOMIC_RELAXED);
+    stats->free  = pool->total > stats->live ? pool->total - stats->live : 0;
+    pthread_mutex_unlock(&pool->lock);
 }
 
-static int
-mbr_add_loge(msg_broker_t *broker, const char * format, ...)
+static void
+pool_destroy(pool_t *pool)
 {
-    msg_t  *msg  = mbr_grow(broker, MSG_TYP_LE | MSG_COMMIT, NULL);
-    if (!msg) {
-        return -1;
+    /* objects cached by the threads live in the slabs, no one may use the pool anymore */
+    pthread_mutex_lock(&pool->lock);
+    while (pool->slabs) {
+        pool_slab_t *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
     }
+    pool->free  = NULL;
+    pool->total = 0;
+    pthread_mutex_unlock(&pool->lock);
+    pool_caches[pool->id] = (pool_cache_t){0};
+}
 
-    va_list args;
-    va_start(args, format);
-    int rc = msg_add_va(msg, format, args);
-    va_end(args);
+/***********************************************
+ * Hash tables
+ ***********************************************/
 
-    if (errno != 0) {
-        msg_add_fmt(msg, " (%d: %s)", errno, strerror(errno));
+static uint32_t
+htab_hash(const char *key, size_t key_sz)
+{
+    /* FNV-1a, zero is reserved for empty slots */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key_sz; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619u;
     }
-    return 0;
+    return hash ? hash : 1;
 }
 
-static msg_t *
-mbr_grow(msg_broker_t *broker, uint16_t options, conn_t *conn)
+static void
+htab_init(htab_t *htab, htab_key_of_t key_of)
 {
-    msg_t  *msg  = NULL;
+    *htab = (htab_t){ .key_of = key_of };
+}
 
-    if (CIRCLEQ_EMPTY(&broker->ml_pool) || CIRCLEQ_LAST(&broker->ml_pool)->commit) {
-        if (!(msg = calloc(1, sizeof(msg_t)))) {
-            goto error;
-        }
-        CIRCLEQ_INSERT_TAIL(&broker->ml_pool, msg, cq_entry);
-    } else {
-        msg = CIRCLEQ_LAST(&broker->ml_pool);
-    }
-    msg->hdr.ops = options;
-    msg->commit = options & MSG_COMMIT;
+static htab_slot_t *
+htab_lookup(htab_t *htab, uint32_t hash, const char *key, size_t key_sz)
+{
+    /* returns the slot holding the key or the empty slot ending its probe chain */
+    size_t mask   = htab->cap - 1;
+    size_t inl_sz = key_sz < HTAB_KEY_INLINE ? key_sz : HTAB_KEY_INLINE;
 
-    if (msg->commit && (options & (MSG_TYP_LI | MSG_TYP_LE) )) {
-        msgp_t *msgp = calloc(1, sizeof(msgp_t));
-        if (msgp) {
-            msgp->msg = msg;
-            CIRCLEQ_INSERT_TAIL(&broker->mpl_local, msgp, cq_entry);
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        htab_slot_t *slot = &htab->slots[i];
+        if (!slot->hash) {
+            return slot;
+        }
+        if (slot->hash == hash && slot->key_sz == key_sz && memcmp(slot->key, key, inl_sz) == 0
+            && (key_sz == inl_sz || memcmp(htab->key_of(slot->val) + inl_sz, key + inl_sz, key_sz - inl_sz) == 0)) {
+            return slot;
         }
     }
-
-    return msg;
-
-error:
-    if (msg) {
-        CIRCLEQ_REMOVE(&broker->ml_pool, msg, cq_entry);
-        free(msg->data);
-        free(msg);
-    }
-    return NULL;
 }
 
-static void
-mbr_flush_locals(msg_broker_t *broker)
+static int
+htab_resize(htab_t *htab, size_t cap)
 {
-    while (!CIRCLEQ_EMPTY(&broker->mpl_local)) {
-        msgp_t *msgp = CIRCLEQ_FIRST(&broker->mpl_local);
-        char *sf_long = msgp->msg->hdr.ops & MSG_TYP_LE ? "EEE\n" : "iii\n";
-        char *sf_shrt = msgp->msg->hdr.ops & MSG_TYP_LE ? "E  "   : "i  ";
-
-        fprintf(stderr, "%s%s\n", strchr(msgp->msg->data, '\n') ? sf_long : sf_shrt, msgp->msg->data);
-        CIRCLEQ_REMOVE(&broker->ml_pool, msgp->msg, cq_entry);
-        CIRCLEQ_REMOVE(&broker->mpl_local, msgp, cq_entry);
-        free(msgp->msg->data);
-        free(msgp->msg);
-        free(msgp);
+    htab_slot_t *slots = calloc(cap, sizeof(htab_slot_t));
+    if (!slots) {
+        return -1;
+    }
+    for (size_t i = 0; i < htab->cap; i++) {
+        if (htab->slots[i].hash) {
+            size_t j = htab->slots[i].hash & (cap - 1);
+            while (slots[j].hash) {
+                j = (j + 1) & (cap - 1);
+            }
+            slots[j] = htab->slots[i];
+        }
     }
+    free(htab->slots);
+    htab->slots = slots;
+    htab->cap = cap;
+    return 0;
 }
 
-static void
-mbr_clean(msg_broker_t *broker)
+static int
+htab_reserve(htab_t *htab, size_t count)
 {
-    msg_t *msg;
-    CIRCLEQ_FOREACH(msg, &broker->ml_pool, cq_entry) {
+    /* one resize ahead of a bulk insert instead of doubling along the way */
+    size_t cap = htab->cap ? htab->cap : 16;
+    while (count * 4 > cap * 3) {
+        cap *= 2;
     }
+    return cap == htab->cap ? 0 : htab_resize(htab, cap);
 }
 
-/***********************
- * comparison
- ***********************/
-static int
-roommates_compar(const void *mate_l, const void *mate_r)
+static void *
+htab_find(htab_t *htab, const char *key, size_t key_sz)
 {
-    return strcmp(((roommate_t *)mate_l)->name, ((roommate_t *)mate_r)->name);
+    return htab_find_hashed(htab, htab_hash(key, key_sz), key, key_sz);
 }
 
-static int
-rooms_compar(const void *room_l, const void *room_r)
+static void *
+htab_find_hashed(htab_t *htab, uint32_t hash, const char *key, size_t key_sz)
 {
-    return strcmp(((room_t *)room_l)->name, ((room_t *)room_r)->name);
+    if (!htab->count) {
+        return NULL;
+    }
+    htab_slot_t *slot = htab_lookup(htab, hash, key, key_sz);
+    return slot->hash ? slot->val : NULL;
 }
 
 static int
-conns_compar(const void *conn_l, const void *conn_r)
+htab_insert(htab_t *htab, const char *key, size_t key_sz, void *val)
 {
-    if (((conn_t *)conn_l)->fd > ((conn_t *)conn_r)->fd) {
-        return 1;
-    } else if (((conn_t *)conn_l)->fd < ((conn_t *)conn_r)->fd) {
-        return -1;
-    } else {
-        return 0;
-    }
+    return htab_insert_hashed(htab, htab_hash(key, key_sz), key, key_sz, val);
 }
 
-/***********************
- * room mates handling
- ***********************/
 static int
-roommate_create(roommate_t **mate, cfg_obj_t *cfgmate)
+htab_insert_hashed(htab_t *htab, uint32_t hash, const char *key, size_t key_sz, void *val)
 {
-    if (!cfgmate->val_sz || !cfgmate->ext_sz) {
+    if (key_sz > UINT16_MAX) {
         return -1;
     }
-    if ((*mate = calloc(1, sizeof(roommate_t))) == NULL) {
-        goto error;
-    }
-    if (((*mate)->name = strndup(cfgmate->val, cfgmate->val_sz)) == NULL) {
-        goto error;
+    if ((htab->count + 1) * 4 > htab->cap * 3 && htab_resize(htab, htab->cap ? htab->cap * 2 : 16) < 0) {
+        return -1;
     }
-    if (((*mate)->passwd = strndup(cfgmate->ext, cfgmate->ext_sz)) == NULL) {
-        goto error;
+    htab_slot_t *slot = htab_lookup(htab, hash, key, key_sz);
+    if (slot->hash) {
+        /* already exists */
+        return 1;
     }
+    slot->hash   = hash;
+    slot->key_sz = (uint16_t)key_sz;
+    slot->val    = val;
+    memcpy(slot->key, key, key_sz < HTAB_KEY_INLINE ? key_sz : HTAB_KEY_INLINE);
+    htab->count++;
     return 0;
+}
 
-error:
+static void *
+htab_remove(htab_t *htab, const char *key, size_t key_sz)
+{
+    if (!htab->count) {
+        return NULL;
+    }
+    htab_slot_t *slot = htab_lookup(htab, htab_hash(key, key_sz), key, key_sz);
+    if (!slot->hash) {
+        return NULL;
+    }
+    void *val = slot->val;
 
-    if (*mate) {
-        free((*mate)->name);
-        free((*mate)->passwd);
-        free((*mate));
-        *mate = NULL;
+    /* pull the rest of the probe chain into the hole, no tombstones needed */
+    size_t mask = htab->cap - 1;
+    size_t hole = slot - htab->slots;
+    for (size_t i = (hole + 1) & mask; htab->slots[i].hash; i = (i + 1) & mask) {
+        size_t home = htab->slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            htab->slots[hole] = htab->slots[i];
+            hole = i;
+        }
     }
-    return -1;
+    htab->slots[hole] = (htab_slot_t){0};
+    htab->count--;
+    return val;
 }
 
 static void
-roommate_del(roommate_t *mate)
+htab_free(htab_t *htab)
+{
+    free(htab->slots);
+    htab->slots = NULL;
+    htab->cap = htab->count = 0;
+}
+
+static size_t
+pset_home(pset_t *set, const void *ptr)
 {
-    while (mate->rooms) {
-        room_t *troom = *(room_t **)(mate->rooms);
-        tdelete(mate, &troom->mates, roommates_compar);
-        tdelete(troom, &mate->rooms, rooms_compar);
-   }
-   free(mate->name);
-   free(mate->passwd);
-   free(mate);
+    return (size_t)(((uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ull) >> 32) & (set->cap - 1);
 }
 
 static int
-roommates_add(roommates_t **mates, cfg_objlist_t *cfgmates)
+pset_resize(pset_t *set, size_t cap)
 {
-    cfg_obj_t *cmate;
-    LIST_FOREACH(cmate, cfgmates, lentry) {
-        if (!cmate->val_sz || !cmate->ext_sz) {
-//            msg_add(
-//                    NULL, MSG_TYP_LE,
-//                    "Room Mate name and password must be set. Ignore object '%.*s:%.*s'",
-//                    (int)(cmate->val_sz), cmate->val,
-//                    (int)(cmate->ext_sz), cmate->ext);
-            continue;
-        }
-        roommate_t *roommate;
-        if (roommate_create(&roommate, cmate) >= 0) {
-            void *pmate = tsearch(roommate, mates, roommates_compar);
-            if (!pmate) {
-                /* allocation error */
-                roommate_del(roommate);
-                return -1;
-            } else if (*(roommate_t **)pmate != roommate) {
-//                msg_add(NULL, MSG_TYP_LE,  "Room Mate %s exists. Can't create new one with same name");
-                roommate_del(roommate);
-            }
+    void **slots = calloc(cap, sizeof(void *));
+    if (!slots) {
+        return -1;
+    }
+    pset_t nset = { .slots = slots, .cap = cap, .count = set->count };
+    PSET_FOREACH(set, i) {
+        size_t j = pset_home(&nset, set->slots[i]);
+        while (slots[j]) {
+            j = (j + 1) & (cap - 1);
         }
+        slots[j] = set->slots[i];
     }
+    free(set->slots);
+    *set = nset;
     return 0;
 }
 
 static int
-roommates_del(roommates_t **mates, cfg_objlist_t *cfgmates)
+pset_reserve(pset_t *set, size_t count)
 {
-    cfg_obj_t *cmate;
-    LIST_FOREACH(cmate, cfgmates, lentry) {
-        roommate_t kmate = {
-            .name = strndup(cmate->val, cmate->val_sz)
-        };
-        if (kmate.name) {
-            void *pmate = tfind(&kmate, mates, roommates_compar);
-            if (pmate) {
-                roommate_t *tmate = *(roommate_t **)pmate;
-                tdelete(tmate, mates, roommates_compar);
-                roommate_del(tmate);
-            }
-        }
-        free(kmate.name);
+    size_t cap = set->cap ? set->cap : 4;
+    while (count * 4 > cap * 3) {
+        cap *= 2;
     }
-    return 0;
+    return cap == set->cap ? 0 : pset_resize(set, cap);
 }
 
 static int
-roommates_clear(roommates_t **mates)
+pset_add(pset_t *set, void *ptr)
 {
-    while (*mates) {
-        roommate_t *tmate = *(roommate_t **)(*mates);
-        tdelete(tmate, mates, roommates_compar);
-        roommate_del(tmate);
+    if ((set->count + 1) * 4 > set->cap * 3 && pset_resize(set, set->cap ? set->cap * 2 : 4) < 0) {
+        return -1;
+    }
+    size_t i = pset_home(set, ptr);
+    for (; set->slots[i]; i = (i + 1) & (set->cap - 1)) {
+        if (set->slots[i] == ptr) {
+            return 1;
+        }
     }
+    set->slots[i] = ptr;
+    set->count++;
     return 0;
 }
 
-/******************
- * rooms handling
- ******************/
-static int
-room_create(room_t **room, char *name, size_t name_sz)
+static bool
+pset_has(pset_t *set, const void *ptr)
 {
-    if ((*room = calloc(1, sizeof(room_t))) == NULL) {
-        goto error;
+    if (!set->count) {
+        return false;
     }
-    if (((*room)->name = strndup(name, name_sz)) == NULL) {
-        goto error;
+    for (size_t i = pset_home(set, ptr); set->slots[i]; i = (i + 1) & (set->cap - 1)) {
+        if (set->slots[i] == ptr) {
+            return true;
+        }
     }
-    return 0;
+    return false;
+}
 
-error:
-    if (*room) {
-        free((*room)->name);
-        *room = NULL;
+static bool
+pset_del(pset_t *set, const void *ptr)
+{
+    if (!set->count) {
+        return false;
     }
-    return -1;
+    size_t mask = set->cap - 1;
+    size_t hole = pset_home(set, ptr);
+    for (; set->slots[hole] != ptr; hole = (hole + 1) & mask) {
+        if (!set->slots[hole]) {
+            return false;
+        }
+    }
+    for (size_t i = (hole + 1) & mask; set->slots[i]; i = (i + 1) & mask) {
+        size_t home = pset_home(set, set->slots[i]);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            set->slots[hole] = set->slots[i];
+            hole = i;
+        }
+    }
+    set->slots[hole] = NULL;
+    set->count--;
+
+    /* give memory back once a large set got mostly empty */
+    if (set->cap > 16 && set->count * 8 < set->cap) {
+        pset_resize(set, set->cap / 2);
+    }
+    return true;
 }
 
 static void
-room_del(room_t *room)
+pset_free(pset_t *set)
 {
-    while (room->mates) {
-        roommate_t *tmate = *(roommate_t **)(room->mates);
-        tdelete(room, &tmate->rooms, rooms_compar);
-        tdelete(tmate, &room->mates, roommates_compar);
+    free(set->slots);
+    *set = (pset_t){0};
+}
+
+/***********************************************
+ * LZ codec
+ ***********************************************/
+
+static size_t
+lz_len_put(uint8_t *op, size_t len)
+{
+    /* the rest of a length over the token nibble, in bytes of 255 and a last smaller one */
+    size_t n = 0;
+    for (; len >= 255; len -= 255) {
+        op[n++] = 255;
     }
-    free(room->name);
-    free(room);
+    op[n++] = (uint8_t)len;
+    return n;
 }
 
 static int
-room_add_mates(rooms_t **rooms, roommates_t **mates, char *room_name, size_t room_name_sz, cfg_objlist_t *cfgmates)
+lz_compress(const uint8_t *src, size_t src_sz, uint8_t *dst, size_t dst_cap)
 {
-    room_t *room;
-    if (room_create(&room, room_name, room_name_sz) < 0) {
-//        msg_add(NULL, MSG_TYP_LE, "can't create new room '%.*s'", (int)room_name_sz, room_name);
-        return -1;
-    }
-    void *proom = tsearch(room, rooms, rooms_compar);
-    if (!proom) {
-        /* allocation error */
-        room_del(room);
+    uint16_t       table[1 << LZ_HASH_LOG] = {0};
+    const uint8_t *ip     = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end    = src + src_sz;
+    uint8_t       *op     = dst;
+    uint8_t       *oend   = dst + dst_cap;
+    size_t         misses = 0;
+
+    if (src_sz > UINT16_MAX + 1) {
+        return -1;
+    }
+    while (src_sz > LZ_MFLIMIT && ip < end - LZ_MFLIMIT) {
+        uint32_t seq, ref_seq;
+        memcpy(&seq, ip, sizeof(seq));
+        uint32_t       hash = (seq * 2654435761U) >> (32 - LZ_HASH_LOG);
+        const uint8_t *ref  = src + table[hash];
+        table[hash] = (uint16_t)(ip - src);
+        memcpy(&ref_seq, ref, sizeof(ref_seq));
+        if (ref >= ip || ref_seq != seq) {
+            /* data that doesn't repeat is skipped faster and faster */
+            ip += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        /* the match grows back over the literals and forward up to the last literals */
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        const uint8_t *mp    = ip + LZ_MIN_MATCH;
+        const uint8_t *mlast = end - LZ_LAST_LITERALS;
+        while (mp + sizeof(uint64_t) <= mlast) {
+            uint64_t a, b;
+            memcpy(&a, mp, sizeof(a));
+            memcpy(&b, ref + (mp - ip), sizeof(b));
+            if (a != b) {
+                mp += __builtin_ctzll(a ^ b) >> 3;
+                break;
+            }
+            mp += sizeof(a);
+        }
+        while (mp < mlast && *mp == ref[mp - ip]) {
+            mp++;
+        }
+        size_t lit_sz = ip - anchor;
+        size_t mlen   = mp - ip - LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < 1 + lit_sz / 255 + 1 + lit_sz + 2 + mlen / 255 + 1) {
+            return -1;
+        }
+
+        uint8_t *token = op++;
+        *token = (uint8_t)((lit_sz < 15 ? lit_sz : 15) << 4 | (mlen < 15 ? mlen : 15));
+        if (lit_sz >= 15) {
+            op += lz_len_put(op, lit_sz - 15);
+        }
+        memcpy(op, anchor, lit_sz);
+        op += lit_sz;
+        *op++ = (uint8_t)(ip - ref);
+        *op++ = (uint8_t)((ip - ref) >> 8);
+        if (mlen >= 15) {
+            op += lz_len_put(op, mlen - 15);
+        }
+        ip = anchor = mp;
+    }
+
+    /* the block ends with the literals left */
+    size_t lit_sz = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit_sz / 255 + 1 + lit_sz) {
+        return -1;
+    }
+    *op++ = (uint8_t)((lit_sz < 15 ? lit_sz : 15) << 4);
+    if (lit_sz >= 15) {
+        op += lz_len_put(op, lit_sz - 15);
+    }
+    memcpy(op, anchor, lit_sz);
+    op += lit_sz;
+    return (int)(op - dst);
+}
+
+static int
+lz_decompress(const uint8_t *src, size_t src_sz, uint8_t *dst, size_t dst_cap)
+{
+    const uint8_t *ip   = src;
+    const uint8_t *iend = src + src_sz;
+    uint8_t       *op   = dst;
+    uint8_t       *oend = dst + dst_cap;
+
+    while (ip < iend) {
+        uint8_t token  = *ip++;
+        size_t  lit_sz = token >> 4;
+        uint8_t b      = 255;
+        while (lit_sz >= 15 && b == 255) {
+            if (ip == iend) {
+                return -1;
+            }
+            lit_sz += (b = *ip++);
+        }
+        if (lit_sz > (size_t)(iend - ip) || lit_sz > (size_t)(oend - op)) {
+            return -1;
+        }
+        /* short runs are copied in one fixed move while there is room, the excess is overwritten */
+        if (lit_sz <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, lit_sz);
+        }
+        op += lit_sz;
+        ip += lit_sz;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t off  = ip[0] | (size_t)ip[1] << 8;
+        size_t mlen = token & 0x0F;
+        ip += 2;
+        for (b = 255; mlen >= 15 && b == 255; ) {
+            if (ip == iend) {
+                return -1;
+            }
+            mlen += (b = *ip++);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (!off || off > (size_t)(op - dst) || mlen > (size_t)(oend - op)) {
+            return -1;
+        }
+        /* the match may overlap the bytes it produces */
+        if (off >= 16 && mlen <= 16 && oend - op >= 16) {
+            memcpy(op, op - off, 16);
+        } else if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+        } else {
+            for (size_t i = 0; i < mlen; i++) {
+                op[i] = op[i - off];
+            }
+        }
+        op += mlen;
+    }
+    return (int)(op - dst);
+}
+
+/***********************************************
+ * Timer wheel
+ ***********************************************/
+
+static void
+wheel_init(wheel_t *wheel, uint64_t ts)
+{
+    *wheel = (wheel_t){.origin = ts};
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            LIST_INIT(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+static void
+wheel_place(wheel_t *wheel, wheel_timer_t *timer)
+{
+    /* the level is the one the delay fits in, the slot is taken from the tick itself,
+     * so a slot of a higher level is cascaded just as the ticks of its timers begin */
+    uint64_t delta = timer->expires - wheel->now;
+    int      level = 0;
+    while (level < WHEEL_LEVELS - 1 && (delta >> (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+
+    timer->level = level;
+    timer->slot  = slot;
+    LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, lentry);
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+static void
+wheel_arm(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires)
+{
+    if (timer->is_armed) {
+        wheel_cancel(wheel, timer);
+    }
+
+    /* a tick gone by fires with the next one */
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    } else if (expires - wheel->now >= WHEEL_SPAN) {
+        expires = wheel->now + WHEEL_SPAN - 1;
+    }
+    timer->expires  = expires;
+    timer->is_armed = true;
+    wheel->armed++;
+    wheel_place(wheel, timer);
+}
+
+static void
+wheel_cancel(wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (!timer->is_armed) {
+        return;
+    }
+    LIST_REMOVE(timer, lentry);
+    if (LIST_EMPTY(&wheel->slots[timer->level][timer->slot])) {
+        wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+    timer->is_armed = false;
+    wheel->armed--;
+}
+
+static void
+wheel_advance(wheel_t *wheel, struct reactor_s *reactor, uint64_t ts)
+{
+    uint64_t       target = ts > wheel->origin ? (ts - wheel->origin) / (WHEEL_TICK_MS * 1000000ULL) : 0;
+    wheel_timer_t *timer;
+
+    while (wheel->now < target) {
+        if (!wheel->armed) {
+            wheel->now = target;
+            break;
+        }
+        uint64_t tick = wheel->now + 1;
+        if (!wheel->occupied[0] && (tick & (WHEEL_SLOTS - 1))) {
+            /* nothing to fire up to the next cascade */
+            uint64_t last = tick | (WHEEL_SLOTS - 1);
+            wheel->now = last < target ? last : target;
+            continue;
+        }
+        wheel->now = tick;
+
+        /* the higher levels first, a timer may go down more than one level at once */
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if (tick & ((1ULL << (WHEEL_BITS * level)) - 1)) {
+                continue;
+            }
+            int           slot = (tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            wheel_slot_t *head = &wheel->slots[level][slot];
+            while ((timer = LIST_FIRST(head)) != NULL) {
+                LIST_REMOVE(timer, lentry);
+                wheel_place(wheel, timer);
+            }
+            wheel->occupied[level] &= ~(1ULL << slot);
+        }
+
+        /* a timer is off the wheel when its callback runs, so it may arm itself again */
+        wheel_slot_t *head = &wheel->slots[0][tick & (WHEEL_SLOTS - 1)];
+        while ((timer = LIST_FIRST(head)) != NULL) {
+            wheel_cancel(wheel, timer);
+            timer->cb(reactor, timer);
+        }
+    }
+}
+
+static int
+wheel_timeout(wheel_t *wheel, uint64_t ts)
+{
+    if (!wheel->armed) {
+        return -1;
+    }
+
+    /* the nearest of the next cascade and the next occupied slot of the lowest level */
+    uint64_t next     = (wheel->now | (WHEEL_SLOTS - 1)) + 1;
+    uint64_t occupied = wheel->occupied[0];
+    if (occupied) {
+        unsigned from = (wheel->now + 1) & (WHEEL_SLOTS - 1);
+        uint64_t bits = from ? (occupied >> from) | (occupied << (WHEEL_SLOTS - from)) : occupied;
+        uint64_t tick = wheel->now + 1 + __builtin_ctzll(bits);
+        next = tick < next ? tick : next;
+    }
+
+    uint64_t at = wheel->origin + next * WHEEL_TICK_MS * 1000000ULL;
+    if (at <= ts) {
+        return 0;
+    }
+    uint64_t ms = (at - ts + 999999) / 1000000;
+    return ms < INT_MAX ? (int)ms : INT_MAX;
+}
+
+/***********************************************
+ * Message Broker
+ ***********************************************/
+
+static mbr_log_t mbr_log = {.event_fd = -1};
+
+static int
+msg_add_bin(msg_t *msg, char *data, size_t size)
+{
+    if (!msg) {
+        return -1;
+    }
+    uint16_t cursor = msg->hdr.len;
+    msg->hdr.len = (size + msg->hdr.len > UINT16_MAX) ? UINT16_MAX : ((uint16_t)size + msg->hdr.len);
+    if (msg->data_sz < msg->hdr.len) {
+        msg->data_sz = msg->hdr.len;
+        msg->data = realloc(msg->data, msg->data_sz);
+    }
+    if (msg->data_sz && !msg->data) {
+        goto error;
+    }
+    memcpy(&msg->data[cursor], data, msg->hdr.len - cursor);
+
+    return 0;
+error:
+    free(msg->data);
+    msg->data = NULL;
+    msg->data_sz = 0;
+    msg->hdr.len = 0;
+    return -1;
+}
+
+static int
+msg_add_fmt(msg_t *msg, const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int rc = msg_add_va(msg, format, args);
+    va_end(args);
+
+    return rc;
+}
+
+static int
+msg_add_va(msg_t *msg, const char * format, va_list args)
+{
+    if (!msg) {
+        return -1;
+    }
+    va_list args_sz;
+    va_copy(args_sz, args);
+    int size = vsnprintf (NULL, 0, format, args_sz);
+    va_end(args_sz);
+    if (size < 0) {
+        goto error;
+    }
+
+    /* keep the data NUL-terminated, the terminator is not counted in hdr.len */
+    uint16_t cursor = msg->hdr.len;
+    msg->hdr.len = (size + msg->hdr.len > UINT16_MAX) ? UINT16_MAX : ((uint16_t)size + msg->hdr.len);
+    if (msg->data_sz < (size_t)msg->hdr.len + 1) {
+        msg->data_sz = (size_t)msg->hdr.len + 1;
+        msg->data = realloc(msg->data, msg->data_sz);
+    }
+    if (msg->data_sz && !msg->data) {
+        goto error;
+    }
+
+    vsnprintf (&msg->data[cursor], msg->hdr.len - cursor + 1, format, args);
+    return 0;
+
+error:
+    free(msg->data);
+    msg->data = NULL;
+    msg->data_sz = 0;
+    msg->hdr.len = 0;
+    return -1;
+}
+
+static int
+msg_io_read(msg_t *msg, int fd, size_t *cursor)
+{
+    char  *buffer;
+    size_t expected;
+
+    if (*cursor < sizeof(msg->hdr)) {
+        buffer = (char *)&msg->hdr + *cursor;
+        expected = sizeof(msg->hdr) - *cursor;
+    } else {
+        if (msg->data_sz < msg->hdr.len) {
+            msg->data_sz = msg->hdr.len;
+            msg->data = realloc(msg->data, msg->data_sz);
+            if (!msg->data) {
+                errno = ENOMEM;
+                return MSG_IO_ERR;
+            }
+        }
+        buffer = msg->data + *cursor - sizeof(msg->hdr);
+        expected = msg->hdr.len - (*cursor - sizeof(msg->hdr));
+    }
+
+    ssize_t rc = recv(fd, buffer, expected, 0);
+    *cursor += (rc > 0 ? rc : 0);
+
+    if (rc < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? MSG_IO_AGAIN : MSG_IO_ERR;
+    } else if (rc == 0) {
+        return MSG_IO_DOWN;
+    } else if ((size_t)rc < expected) {
+        return MSG_IO_AGAIN;
+    }
+    if (*cursor == sizeof(msg->hdr) && msg->hdr.len) {
+        return msg_io_read(msg, fd, cursor);
+    }
+    return MSG_IO_OK;
+}
+
+static int
+msg_io_iov(msg_t *msg, size_t cursor, struct iovec *iov)
+{
+    int iovcnt = 0;
+
+    if (cursor < sizeof(msg->hdr)) {
+        iov[iovcnt].iov_base = (char *)&msg->hdr + cursor;
+        iov[iovcnt].iov_len  = sizeof(msg->hdr) - cursor;
+        iovcnt++;
+        cursor = sizeof(msg->hdr);
+    }
+    if (cursor - sizeof(msg->hdr) < msg->hdr.len) {
+        iov[iovcnt].iov_base = msg->data + cursor - sizeof(msg->hdr);
+        iov[iovcnt].iov_len  = msg->hdr.len - (cursor - sizeof(msg->hdr));
+        iovcnt++;
+    }
+    return iovcnt;
+}
+
+static void
+mbr_init(msg_broker_t *broker)
+{
+    CIRCLEQ_INIT(&broker->ml_pool);
+    CIRCLEQ_INIT(&broker->mpl_local);
+    LIST_INIT(&broker->cl_pending);
+}
+
+static int
+mbr_add_logi(msg_broker_t *broker, const char * format, ...)
+{
+    msg_t  *msg  = mbr_grow(broker, MSG_TYP_LI | MSG_COMMIT, NULL);
+    if (!msg) {
+        return -1;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int rc = msg_add_va(msg, format, args);
+    va_end(args);
+
+    return 0;
+}
+
+static int
+mbr_add_loge(msg_broker_t *broker, const char * format, ...)
+{
+    msg_t  *msg  = mbr_grow(broker, MSG_TYP_LE | MSG_COMMIT, NULL);
+    if (!msg) {
+        return -1;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int rc = msg_add_va(msg, format, args);
+    va_end(args);
+
+    if (errno != 0) {
+        msg_add_fmt(msg, " (%d: %s)", errno, strerror(errno));
+    }
+    return 0;
+}
+
+static msg_t *
+mbr_grow(msg_broker_t *broker, uint16_t options, conn_t *conn)
+{
+    msg_t  *msg  = NULL;
+
+    if (CIRCLEQ_EMPTY(&broker->ml_pool) || CIRCLEQ_LAST(&broker->ml_pool)->commit) {
+        if (!(msg = pool_get(&pools[POOL_MSG]))) {
+            goto error;
+        }
+        CIRCLEQ_INSERT_TAIL(&broker->ml_pool, msg, cq_entry);
+    } else {
+        msg = CIRCLEQ_LAST(&broker->ml_pool);
+    }
+    msg->hdr.ops = options & ~MSG_COMMIT;
+    msg->commit = options & MSG_COMMIT;
+
+    int type = MSG_TYP_MASK(options);
+    if (msg->commit && (type == MSG_TYP_LI || type == MSG_TYP_LE)) {
+        msgp_t *msgp = pool_get(&pools[POOL_MSGP]);
+        if (msgp) {
+            msgp->msg = msg;
+            CIRCLEQ_INSERT_TAIL(&broker->mpl_local, msgp, cq_entry);
+        }
+    }
+
+    return msg;
+
+error:
+    if (msg) {
+        CIRCLEQ_REMOVE(&broker->ml_pool, msg, cq_entry);
+        free(msg->data);
+        pool_put(&pools[POOL_MSG], msg);
+    }
+    return NULL;
+}
+
+static void
+mbr_flush_locals(msg_broker_t *broker)
+{
+    uint64_t ts = state_clock();
+
+    while (!CIRCLEQ_EMPTY(&broker->mpl_local)) {
+        msgp_t *msgp   = CIRCLEQ_FIRST(&broker->mpl_local);
+        msg_t  *msg    = msgp->msg;
+        bool    is_err = MSG_TYP_MASK(msg->hdr.ops) == MSG_TYP_LE;
+
+        /* the writer thread takes the text over, it is written right here when there is none */
+        if (!__atomic_load_n(&mbr_log.running, __ATOMIC_ACQUIRE)) {
+            char prefix[64];
+            mbr_log_prefix(prefix, sizeof(prefix), ts, is_err, msg->data);
+            fprintf(stderr, "%s%s\n", prefix, msg->data ? msg->data : "");
+            free(msg->data);
+        } else {
+            mbr_log_push(ts, is_err, msg->data);
+        }
+        msg->data = NULL;
+
+        CIRCLEQ_REMOVE(&broker->ml_pool, msg, cq_entry);
+        CIRCLEQ_REMOVE(&broker->mpl_local, msgp, cq_entry);
+        pool_put(&pools[POOL_MSG], msg);
+        pool_put(&pools[POOL_MSGP], msgp);
+    }
+}
+
+static size_t
+mbr_log_prefix(char *buf, size_t buf_sz, uint64_t ts, bool is_err, const char *data)
+{
+    /* multi-line text starts on a line of its own */
+    bool  is_long = data && strchr(data, '\n');
+    char *sf      = is_long ? (is_err ? "EEE\n" : "iii\n") : (is_err ? "E  " : "i  ");
+    int   len     = snprintf(buf, buf_sz, "[%5llu.%06llu] %s",
+                             (unsigned long long)(ts / 1000000000ULL),
+                             (unsigned long long)(ts % 1000000000ULL / 1000), sf);
+    return len < 0 ? 0 : ((size_t)len < buf_sz ? (size_t)len : buf_sz - 1);
+}
+
+static int
+mbr_log_push(uint64_t ts, bool is_err, char *data)
+{
+    mbr_log_slot_t *slot;
+    uint64_t        pos = __atomic_load_n(&mbr_log.head, __ATOMIC_RELAXED);
+
+    /* claim a slot, a full ring drops the line rather than stall the reactor */
+    for (;;) {
+        slot = &mbr_log.slots[pos & (MBR_LOG_RING_SZ - 1)];
+        int64_t dif = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&mbr_log.head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            __atomic_add_fetch(&mbr_log.dropped, 1, __ATOMIC_RELAXED);
+            free(data);
+            return -1;
+        } else {
+            pos = __atomic_load_n(&mbr_log.head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->ts     = ts;
+    slot->is_err = is_err;
+    slot->data   = data;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&mbr_log.sleeping, false, __ATOMIC_SEQ_CST)) {
+        eventfd_write(mbr_log.event_fd, 1);
+    }
+    return 0;
+}
+
+static void
+mbr_log_write(const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t wr = write(STDERR_FILENO, buf, len);
+        if (wr < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += wr;
+        len -= wr;
+    }
+}
+
+static void *
+mbr_log_writer(void *arg)
+{
+    char     *batch     = arg;
+    size_t    batch_len = 0;
+    uint64_t  dropped   = 0;
+
+    for (;;) {
+        mbr_log_slot_t *slot = &mbr_log.slots[mbr_log.tail & (MBR_LOG_RING_SZ - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == mbr_log.tail + 1) {
+            char   prefix[64];
+            char  *data     = slot->data ? slot->data : "";
+            size_t data_len = strlen(data);
+            size_t pref_len = mbr_log_prefix(prefix, sizeof(prefix), slot->ts, slot->is_err, slot->data);
+
+            if (batch_len + pref_len + data_len + 1 > MBR_LOG_BATCH_SZ) {
+                mbr_log_write(batch, batch_len);
+                batch_len = 0;
+            }
+            if (pref_len + data_len + 1 > MBR_LOG_BATCH_SZ) {
+                mbr_log_write(prefix, pref_len);
+                mbr_log_write(data, data_len);
+                mbr_log_write("\n", 1);
+            } else {
+                memcpy(batch + batch_len, prefix, pref_len);
+                memcpy(batch + batch_len + pref_len, data, data_len);
+                batch_len += pref_len + data_len;
+                batch[batch_len++] = '\n';
+            }
+            free(slot->data);
+            slot->data = NULL;
+            __atomic_store_n(&slot->seq, mbr_log.tail + MBR_LOG_RING_SZ, __ATOMIC_RELEASE);
+            mbr_log.tail++;
+            continue;
+        }
+
+        /* the ring is drained, write the batch out and report the losses */
+        uint64_t lost = __atomic_load_n(&mbr_log.dropped, __ATOMIC_RELAXED);
+        if (lost != dropped) {
+            char   prefix[64];
+            size_t pref_len = mbr_log_prefix(prefix, sizeof(prefix), state_clock(), true, NULL);
+            int    len = snprintf(batch + batch_len, MBR_LOG_BATCH_SZ - batch_len, "%.*s%llu log lines dropped\n",
+                                  (int)pref_len, prefix, (unsigned long long)(lost - dropped));
+            batch_len += (len > 0 && (size_t)len < MBR_LOG_BATCH_SZ - batch_len) ? (size_t)len : 0;
+            dropped = lost;
+        }
+        if (batch_len) {
+            mbr_log_write(batch, batch_len);
+            batch_len = 0;
+        }
+        if (!__atomic_load_n(&mbr_log.running, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        /* sleep only when the ring is still empty once producers can see the flag */
+        __atomic_store_n(&mbr_log.sleeping, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == mbr_log.tail + 1) {
+            __atomic_store_n(&mbr_log.sleeping, false, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        eventfd_t cnt;
+        eventfd_read(mbr_log.event_fd, &cnt);
+    }
+    free(batch);
+    return NULL;
+}
+
+static int
+mbr_log_start(void)
+{
+    char *batch = malloc(MBR_LOG_BATCH_SZ);
+
+    mbr_log.slots = calloc(MBR_LOG_RING_SZ, sizeof(mbr_log_slot_t));
+    if (!batch || !mbr_log.slots) {
+        goto error;
+    }
+    for (uint64_t i = 0; i < MBR_LOG_RING_SZ; i++) {
+        mbr_log.slots[i].seq = i;
+    }
+    mbr_log.head = mbr_log.tail = mbr_log.dropped = 0;
+    mbr_log.event_fd = eventfd(0, EFD_CLOEXEC);
+    if (mbr_log.event_fd < 0) {
+        goto error;
+    }
+
+    /* signals are left to the reactors */
+    sigset_t sigmask, sigmask_orig;
+    sigfillset(&sigmask);
+    pthread_sigmask(SIG_BLOCK, &sigmask, &sigmask_orig);
+    __atomic_store_n(&mbr_log.running, true, __ATOMIC_RELEASE);
+    int rc = pthread_create(&mbr_log.thread, NULL, mbr_log_writer, batch);
+    pthread_sigmask(SIG_SETMASK, &sigmask_orig, NULL);
+    if (rc != 0) {
+        __atomic_store_n(&mbr_log.running, false, __ATOMIC_RELEASE);
+        goto error;
+    }
+    return 0;
+
+error:
+    if (mbr_log.event_fd >= 0) {
+        close(mbr_log.event_fd);
+        mbr_log.event_fd = -1;
+    }
+    free(mbr_log.slots);
+    mbr_log.slots = NULL;
+    free(batch);
+    return -1;
+}
+
+static void
+mbr_log_stop(void)
+{
+    if (!__atomic_load_n(&mbr_log.running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    /* the writer drains the ring before it leaves, nobody pushes anymore */
+    __atomic_store_n(&mbr_log.running, false, __ATOMIC_RELEASE);
+    eventfd_write(mbr_log.event_fd, 1);
+    pthread_join(mbr_log.thread, NULL);
+
+    close(mbr_log.event_fd);
+    mbr_log.event_fd = -1;
+    free(mbr_log.slots);
+    mbr_log.slots = NULL;
+}
+
+static void
+mbr_clean(msg_broker_t *broker)
+{
+    /* committed messages left behind by the error paths, the local ones wait
+     * for mbr_flush_locals and the last one may still be growing */
+    msg_t *msg = CIRCLEQ_FIRST(&broker->ml_pool);
+    while (msg != (void *)&broker->ml_pool) {
+        msg_t *next = CIRCLEQ_NEXT(msg, cq_entry);
+        int    type = MSG_TYP_MASK(msg->hdr.ops);
+        if (type != MSG_TYP_LI && type != MSG_TYP_LE) {
+            mbr_release(broker, msg);
+        }
+        msg = next;
+    }
+}
+
+static int
+mbr_add_reply(msg_broker_t *broker, conn_t *conn, uint16_t options, const char * format, ...)
+{
+    if (!MSG_WID_MASK(options)) {
+        options |= MSG_WID_AC;
+    }
+    msg_t  *msg  = mbr_grow(broker, options | MSG_COMMIT, conn);
+    if (!msg) {
+        return -1;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int rc = msg_add_va(msg, format, args);
+    va_end(args);
+
+    mbr_route(broker, msg, conn);
+    return rc;
+}
+
+static msgp_t *
+mbr_msgp_get(msg_t *msg)
+{
+    msgp_t *msgp = pool_get(&pools[POOL_MSGP]);
+    if (!msgp) {
+        return NULL;
+    }
+    msgp->msg = msg;
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+    return msgp;
+}
+
+static void
+mbr_msgp_put(msgp_t *msgp)
+{
+    msg_t *msg = msgp->msg;
+
+    pool_put(&pools[POOL_MSGP], msgp);
+    mbr_unref(msg);
+}
+
+static void
+mbr_release(msg_broker_t *broker, msg_t *msg)
+{
+    /* committed message which was never routed has no more readers */
+    if (msg->commit && !msg->is_routed && msg->refs <= 0) {
+        CIRCLEQ_REMOVE(&broker->ml_pool, msg, cq_entry);
+        free(msg->data);
+        pool_put(&pools[POOL_MSG], msg);
+    }
+}
+
+static void
+mbr_unref(msg_t *msg)
+{
+    /* routed message may be shared by several reactors, the last one frees it */
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (msg->zip && msg->zip != msg) {
+            mbr_unref(msg->zip);
+        }
+        free(msg->data);
+        pool_put(&pools[POOL_MSG], msg);
+    }
+}
+
+static msg_t *
+mbr_zip(reactor_t *reactor, msg_t *msg)
+{
+    msg_t *zip = __atomic_load_n(&msg->zip, __ATOMIC_ACQUIRE);
+    if (zip) {
+        return zip;
+    }
+
+    /* compressed once for every connection of every reactor, the first one to need it pays */
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts0);
+    zip = pool_get(&pools[POOL_MSG]);
+    if (zip) {
+        *zip = (msg_t){.hdr.ops = msg->hdr.ops | MSG_ZIP, .commit = true, .is_routed = true, .refs = 1};
+        zip->data_sz = msg->hdr.len;
+        zip->data    = malloc(zip->data_sz);
+    }
+    int size = (zip && zip->data && msg->hdr.len > sizeof(msg_zip_t))
+             ? lz_compress((uint8_t *)msg->data, msg->hdr.len, (uint8_t *)zip->data + sizeof(msg_zip_t),
+                           msg->hdr.len - sizeof(msg_zip_t) - 1)
+             : -1;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts1);
+    REACTOR_STAT_ADD(reactor, zip_ns, (ts1.tv_sec - ts0.tv_sec) * 1000000000LL + ts1.tv_nsec - ts0.tv_nsec);
+
+    if (size < 0) {
+        /* doesn't shrink, the raw frame stands for its twin */
+        if (zip) {
+            free(zip->data);
+            pool_put(&pools[POOL_MSG], zip);
+        }
+        zip = msg;
+    } else {
+        msg_zip_t hdr = {.len = msg->hdr.len};
+        memcpy(zip->data, &hdr, sizeof(hdr));
+        zip->hdr.len = (uint16_t)(sizeof(hdr) + size);
+    }
+
+    msg_t *none = NULL;
+    if (!__atomic_compare_exchange_n(&msg->zip, &none, zip, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* another reactor was first */
+        if (zip != msg) {
+            mbr_unref(zip);
+        }
+        return none;
+    }
+    if (zip != msg) {
+        REACTOR_STAT_ADD(reactor, zip_frames, 1);
+        REACTOR_STAT_ADD(reactor, zip_in, msg->hdr.len);
+        REACTOR_STAT_ADD(reactor, zip_out, zip->hdr.len);
+    }
+    return zip;
+}
+
+static msg_t *
+mbr_adopt(msg_broker_t *broker, msg_t *msg_in, conn_t *conn)
+{
+    uint16_t ops = MSG_TYP_MASK(msg_in->hdr.ops) | MSG_WID_MASK(msg_in->hdr.ops) | (msg_in->hdr.ops & (MSG_CHUNK | MSG_CHUNK_END));
+    msg_t   *msg = mbr_grow(broker, ops | MSG_COMMIT, conn);
+    if (!msg) {
+        return NULL;
+    }
+
+    /* take the payload buffer over, the connection allocates a new one for the next message */
+    msg->hdr.len  = msg_in->hdr.len;
+    msg->data     = msg_in->data;
+    msg->data_sz  = msg_in->data_sz;
+    msg_in->hdr   = (struct msg_hdr_s){0};
+    msg_in->data  = NULL;
+    msg_in->data_sz = 0;
+
+    return msg;
+}
+
+static msg_t *
+mbr_clone(msg_broker_t *broker, msg_t *msg_in, conn_t *conn)
+{
+    uint16_t ops = MSG_TYP_MASK(msg_in->hdr.ops) | MSG_WID_MASK(msg_in->hdr.ops) | (msg_in->hdr.ops & (MSG_CHUNK | MSG_CHUNK_END));
+    msg_t   *msg = mbr_grow(broker, ops | MSG_COMMIT, conn);
+    if (!msg) {
+        return NULL;
+    }
+
+    /* the payload is borrowed from the input ring, which is reused right away */
+    if (msg_add_bin(msg, msg_in->data, msg_in->hdr.len) < 0) {
+        mbr_release(broker, msg);
+        return NULL;
+    }
+    return msg;
+}
+
+static void
+mbr_route_set(mbr_route_ctx_t *rctx, pset_t *conns)
+{
+    PSET_FOREACH(conns, i) {
+        conn_t *tconn = conns->slots[i];
+        if (tconn != rctx->except) {
+            conn_enqueue(rctx->broker, tconn, rctx->msg);
+            rctx->count++;
+        }
+    }
+}
+
+static int
+mbr_route(msg_broker_t *broker, msg_t *msg, conn_t *conn)
+{
+    mbr_route_ctx_t rctx = {
+        .broker = broker,
+        .msg    = msg,
+        .except = NULL,
+        .count  = 0
+    };
+    conns_set_t *targets = NULL;
+
+    /* the message leaves the pool and lives while referenced, routing holds one reference */
+    CIRCLEQ_REMOVE(&broker->ml_pool, msg, cq_entry);
+    msg->commit = true;
+    msg->is_routed = true;
+    msg->refs = 1;
+
+    switch (MSG_WID_MASK(msg->hdr.ops)) {
+    case MSG_WID_AC:
+        conn_enqueue(broker, conn, msg);
+        rctx.count++;
+        break;
+    case MSG_WID_MT:
+        rctx.except = conn;
+        /* fall through */
+    case MSG_WID_MTA:
+        targets = conn->roommate ? &conn->roommate->conns : NULL;
+        break;
+    case MSG_WID_RM:
+        rctx.except = conn;
+        /* fall through */
+    case MSG_WID_RMA:
+        targets = conn->room ? &conn->room->conns : NULL;
+        break;
+    }
+    bool is_room_chat = targets && conn->room && targets == &conn->room->conns
+                      && MSG_TYP_MASK(msg->hdr.ops) == MSG_TYP_CM && !(msg->hdr.ops & MSG_CHUNK);
+    if (is_room_chat && conn->room->journal && journal_append(conn->room->journal, msg) < 0
+        && __atomic_fetch_add(&conn->room->journal->failed, 1, __ATOMIC_RELAXED) == 0) {
+        /* the room goes on without history, once is enough to tell */
+        mbr_add_loge(broker, "can't write journal of room %s", conn->room->name);
+    }
+    if (is_room_chat && conn->room->window) {
+        room_window_append(conn->room->window, msg);
+    }
+    if (targets && conn->room && targets == &conn->room->conns && conn->room->bcast) {
+        /* large room gets one copy, the members read it from their cursors */
+        room_bcast_t *bcast = conn->room->bcast;
+        state_t      *state = conn->reactor->state;
+        msg_t        *zip   = NULL;
+        if (__atomic_load_n(&state->zip_conns, __ATOMIC_RELAXED) && msg->hdr.len >= state->zip_min) {
+            /* and one compressed copy for the members with a codec */
+            zip = mbr_zip(conn->reactor, msg);
+        }
+        uint64_t      pos   = room_bcast_append(bcast, msg, zip != msg ? zip : NULL, rctx.except);
+        if (rctx.except && conn->bcast == bcast && conn->bcast_pos == pos) {
+            /* the sender keeps up with its own frames, nothing else is in flight from the ring */
+            conn->bcast_pos = __atomic_load_n(&bcast->head, __ATOMIC_ACQUIRE);
+            conn->bcast_seq++;
+        }
+        reactor_bcast_kick(conn->reactor, bcast);
+        rctx.count++;
+        targets = NULL;
+    }
+    if (targets) {
+        reactor_t *reactor = conn->reactor;
+        pset_t    *local   = conns_local(targets, reactor->id);
+        if (local) {
+            mbr_route_set(&rctx, local);
+        }
+
+        /* connections of the other reactors get the message through their inboxes */
+        uint64_t remote = __atomic_load_n(&targets->reactors, __ATOMIC_ACQUIRE) & ~(1ULL << reactor->id);
+        for (; remote; remote &= remote - 1) {
+            reactor_xfer(&reactor->state->reactors[__builtin_ctzll(remote)], targets, msg);
+        }
+    }
+
+    mbr_unref(msg);
+    return rctx.count;
+}
+
+/***********************************************
+ * Commands
+ ***********************************************/
+
+static const cmd_def_t cmd_defs[CMD_OP_MAX] = {
+    [CMD_OP_LOGMATE]   = {":logmate",   2, false, srv_cmd_logmate},
+    [CMD_OP_LOGADM]    = {":logadm",    1, false, srv_cmd_logadm},
+    [CMD_OP_ENTER]     = {":enter",     1, false, srv_cmd_enter},
+    [CMD_OP_HISTORY]   = {":history",   1, false, srv_cmd_history},
+    [CMD_OP_PROTO]     = {":proto",     1, false, srv_cmd_proto},
+    [CMD_OP_COMPRESS]  = {":compress",  1, false, srv_cmd_compress},
+    [CMD_OP_STATUS]    = {":status",    0, false, srv_cmd_status},
+    [CMD_OP_ROOMMATES] = {":roommates", 2, true,  srv_cmd_registry},
+    [CMD_OP_ROOMS]     = {":rooms",     3, true,  srv_cmd_registry},
+    [CMD_OP_QUIT]      = {":quit",      0, false, NULL},
+    [CMD_OP_SNAPSHOT]  = {":snapshot",  0, false, srv_cmd_snapshot},
+    [CMD_OP_RESUME]    = {":resume",    2, false, srv_cmd_resume},
+    [CMD_OP_PONG]      = {":pong",      0, false, srv_cmd_pong},
+};
+
+static const char *
+cmd_text_token(const char *p, const char *end, cmd_arg_t *token)
+{
+    while (p < end && CMD_BLANK(*p)) {
+        p++;
+    }
+    token->ptr = p;
+    while (p < end && !CMD_BLANK(*p)) {
+        p++;
+    }
+    token->len = p - token->ptr;
+    return p;
+}
+
+static int
+cmd_text_parse(const char *line, size_t len, cmd_t *cmd)
+{
+    const char *end = line + len;
+    const char *p   = line;
+
+    *cmd = (cmd_t){.op = CMD_OP_NONE};
+    p = cmd_text_token(p, end, &cmd->name);
+    if (!cmd->name.len) {
+        return -1;
+    }
+    for (int op = CMD_OP_NONE + 1; op < CMD_OP_MAX; op++) {
+        if (cmd_arg_is(&cmd->name, cmd_defs[op].name)) {
+            cmd->op = op;
+            break;
+        }
+    }
+    if (cmd->op == CMD_OP_NONE) {
+        /* unknown, the name tells which one */
+        return 0;
+    }
+
+    /* the arguments over the count are ignored, unless the last one takes the rest */
+    const cmd_def_t *def = &cmd_defs[cmd->op];
+    while (cmd->argc < def->argc_max) {
+        cmd_arg_t *arg = &cmd->argv[cmd->argc];
+        if (def->is_rest && cmd->argc == def->argc_max - 1) {
+            while (p < end && CMD_BLANK(*p)) {
+                p++;
+            }
+            while (end > p && CMD_BLANK(end[-1])) {
+                end--;
+            }
+            *arg = (cmd_arg_t){.ptr = p, .len = end - p};
+        } else {
+            p = cmd_text_token(p, end, arg);
+        }
+        if (!arg->len) {
+            break;
+        }
+        cmd->argc++;
+    }
+    return 0;
+}
+
+static int
+cmd_bin_parse(const char *data, size_t len, cmd_t *cmd)
+{
+    const uint8_t *p   = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+
+    *cmd = (cmd_t){.op = CMD_OP_NONE};
+    if (p == end || *p == CMD_OP_NONE || *p >= CMD_OP_MAX) {
+        return -1;
+    }
+    cmd->op = *p++;
+    while (p < end) {
+        size_t arg_len = *p & 0x7F;
+        if (*p++ & 0x80) {
+            if (p == end) {
+                return -1;
+            }
+            arg_len |= (size_t)*p++ << 7;
+        }
+        if (cmd->argc == CMD_ARGS_MAX || arg_len > (size_t)(end - p)) {
+            return -1;
+        }
+        cmd->argv[cmd->argc++] = (cmd_arg_t){.ptr = (const char *)p, .len = arg_len};
+        p += arg_len;
+    }
+    return cmd->argc <= cmd_defs[cmd->op].argc_max ? 0 : -1;
+}
+
+static int
+cmd_bin_encode(char *buf, size_t cap, cmd_op_t op, int argc, const char **argv)
+{
+    size_t len = 0;
+
+    if (!cap || argc > CMD_ARGS_MAX) {
+        return -1;
+    }
+    buf[len++] = (char)op;
+    for (int i = 0; i < argc; i++) {
+        size_t arg_len = strlen(argv[i]);
+        if (arg_len > CMD_ARG_MAX || cap - len < 2 + arg_len) {
+            return -1;
+        }
+        if (arg_len < 0x80) {
+            buf[len++] = (char)arg_len;
+        } else {
+            buf[len++] = (char)(0x80 | (arg_len & 0x7F));
+            buf[len++] = (char)(arg_len >> 7);
+        }
+        memcpy(buf + len, argv[i], arg_len);
+        len += arg_len;
+    }
+    return (int)len;
+}
+
+static bool
+cmd_arg_is(const cmd_arg_t *arg, const char *str)
+{
+    size_t len = strlen(str);
+    return arg->len == len && memcmp(arg->ptr, str, len) == 0;
+}
+
+static int
+cmd_arg_num(const cmd_arg_t *arg, uint64_t *val)
+{
+    /* decimal digits only, short enough not to overflow */
+    if (!arg->len || arg->len > 19) {
+        return -1;
+    }
+    *val = 0;
+    for (size_t i = 0; i < arg->len; i++) {
+        if (!isdigit((unsigned char)arg->ptr[i])) {
+            return -1;
+        }
+        *val = *val * 10 + (arg->ptr[i] - '0');
+    }
+    return 0;
+}
+
+/***********************
+ * comparison
+ ***********************/
+static const char *
+roommate_key(const void *mate)
+{
+    return ((roommate_t *)mate)->name;
+}
+
+static const char *
+room_key(const void *room)
+{
+    return ((room_t *)room)->name;
+}
+
+/***********************
+ * room mates handling
+ ***********************/
+static int
+roommate_create(roommate_t **mate, cfg_obj_t *cfgmate)
+{
+    if (!cfgmate->val_sz || !cfgmate->ext_sz) {
+        return -1;
+    }
+    /* name and password follow the mate in the same block */
+    if ((*mate = calloc(1, sizeof(roommate_t) + cfgmate->val_sz + cfgmate->ext_sz + 2)) == NULL) {
+        return -1;
+    }
+    (*mate)->name   = (char *)(*mate + 1);
+    (*mate)->passwd = (*mate)->name + cfgmate->val_sz + 1;
+    memcpy((*mate)->name, cfgmate->val, cfgmate->val_sz);
+    memcpy((*mate)->passwd, cfgmate->ext, cfgmate->ext_sz);
+    return 0;
+}
+
+static void
+roommate_del(roommate_t *mate, pset_t *gone)
+{
+    for (uint64_t reactors = mate->conns.reactors; reactors; reactors &= reactors - 1) {
+        pset_t *local = &mate->conns.slots[__builtin_ctzll(reactors)];
+        PSET_FOREACH(local, i) {
+            ((conn_t *)local->slots[i])->roommate = NULL;
+        }
+    }
+    conns_free(&mate->conns);
+
+    PSET_FOREACH(&mate->rooms, i) {
+        pset_del(&((room_t *)mate->rooms.slots[i])->mates, mate);
+    }
+    pset_free(&mate->rooms);
+    if (mate->is_slab) {
+        return;
+    }
+    if (gone) {
+        /* a transfer queued by another reactor may still point at its connections */
+        pset_add(gone, mate);
+        return;
+    }
+    free(mate);
+}
+
+static int
+roommates_add(roommates_t *mates, cfg_objlist_t *cfgmates)
+{
+    cfg_obj_t *cmate;
+    LIST_FOREACH(cmate, cfgmates, lentry) {
+        if (!cmate->val_sz || !cmate->ext_sz) {
+//            msg_add(
+//                    NULL, MSG_TYP_LE,
+//                    "Room Mate name and password must be set. Ignore object '%.*s:%.*s'",
+//                    (int)(cmate->val_sz), cmate->val,
+//                    (int)(cmate->ext_sz), cmate->ext);
+            continue;
+        }
+        if (htab_find(mates, cmate->val, cmate->val_sz)) {
+//            msg_add(NULL, MSG_TYP_LE,  "Room Mate %s exists. Can't create new one with same name");
+            continue;
+        }
+        roommate_t *roommate;
+        if (roommate_create(&roommate, cmate) >= 0) {
+            if (htab_insert(mates, roommate->name, cmate->val_sz, roommate) < 0) {
+                /* allocation error */
+                roommate_del(roommate, NULL);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+roommates_del(roommates_t *mates, cfg_objlist_t *cfgmates, pset_t *gone)
+{
+    cfg_obj_t *cmate;
+    LIST_FOREACH(cmate, cfgmates, lentry) {
+        roommate_t *tmate = htab_remove(mates, cmate->val, cmate->val_sz);
+        if (tmate) {
+            roommate_del(tmate, gone);
+        }
+    }
+    return 0;
+}
+
+static int
+roommates_clear(roommates_t *mates, pset_t *gone)
+{
+    HTAB_FOREACH(mates, i) {
+        roommate_del(mates->slots[i].val, gone);
+    }
+    htab_free(mates);
+    return 0;
+}
+
+/******************
+ * rooms handling
+ ******************/
+static int
+room_create(room_t **room, char *name, size_t name_sz)
+{
+    if ((*room = calloc(1, sizeof(room_t) + name_sz + 1)) == NULL) {
+        return -1;
+    }
+    (*room)->name = (char *)(*room + 1);
+    memcpy((*room)->name, name, name_sz);
+    return 0;
+}
+
+static void
+room_del(room_t *room)
+{
+    for (uint64_t reactors = room->conns.reactors; reactors; reactors &= reactors - 1) {
+        pset_t *local = &room->conns.slots[__builtin_ctzll(reactors)];
+        PSET_FOREACH(local, i) {
+            conn_t *conn = local->slots[i];
+            conn->room = NULL;
+            if (room->bcast && conn->bcast == room->bcast) {
+                conn->bcast = NULL;
+            }
+        }
+    }
+    conns_free(&room->conns);
+    room_bcast_free(room);
+    room_window_free(room);
+    journal_close(room);
+
+    room_clear_mates(room);
+    free(room);
+}
+
+static room_t *
+room_take(rooms_t *rooms, uint32_t hash, const char *name, size_t name_sz)
+{
+    /* the room by name, created when it does not exist yet */
+    room_t *room = htab_find_hashed(rooms, hash, name, name_sz);
+    if (room) {
+        return room;
+    }
+    if (room_create(&room, (char *)name, name_sz) < 0) {
+        return NULL;
+    }
+    if (htab_insert_hashed(rooms, hash, room->name, name_sz, room) < 0) {
+        /* allocation error */
+        room_del(room);
+        return NULL;
+    }
+    return room;
+}
+
+static int
+room_add_mates(rooms_t *rooms, roommates_t *mates, char *room_name, size_t room_name_sz, cfg_objlist_t *cfgmates)
+{
+    room_t *room = room_take(rooms, htab_hash(room_name, room_name_sz), room_name, room_name_sz);
+    if (!room) {
         return -1;
-    } else if (*(room_t **)proom != room) {
-        /* already exists */
-        room_del(room);
-        room = *(room_t **)proom;
     }
 
     /* add mates to the room */
@@ -422,304 +1730,4727 @@ room_add_mates(rooms_t **rooms, roommates_t **mates, char *room_name, size_t roo
             room->is_open = true;
             continue;
         }
-        roommate_t kmate = {
-            .name = strndup(cmate->val, cmate->val_sz)
-        };
-        if (!kmate.name) {
-            /* allocation error */
+        roommate_t *tmate = htab_find(mates, cmate->val, cmate->val_sz);
+        if (tmate) {
+            if (pset_add(&room->mates, tmate) < 0 || pset_add(&tmate->rooms, room) < 0) {
+                /* allocation error */
+                pset_del(&room->mates, tmate);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+room_del_mates(rooms_t *rooms, roommates_t *mates, char *name, size_t name_sz, cfg_objlist_t *cfgmates)
+{
+    /* find the room by name */
+    room_t *troom = htab_find(rooms, name, name_sz);
+    if (!troom) {
+        /* the room does not exists */
+        return -1;
+    }
+
+    /* delete mates from the room */
+    cfg_obj_t *cmate;
+    LIST_FOREACH(cmate, cfgmates, lentry) {
+        if (cmate->val_sz == 1 && cmate->val[0] == '*') {
+            troom->is_open = false;
+            continue;
+        }
+        roommate_t *tmate = htab_find(mates, cmate->val, cmate->val_sz);
+        if (tmate && pset_del(&troom->mates, tmate)) {
+            pset_del(&tmate->rooms, troom);
+        }
+    }
+    return 0;
+}
+
+static int
+room_clear_mates(room_t *room)
+{
+    PSET_FOREACH(&room->mates, i) {
+        pset_del(&((roommate_t *)room->mates.slots[i])->rooms, room);
+    }
+    pset_free(&room->mates);
+    return 0;
+}
+
+static int
+room_bcast_create(room_t *room, size_t cap)
+{
+    room_bcast_t *bcast = calloc(1, sizeof(room_bcast_t));
+    if (!bcast) {
+        return -1;
+    }
+    if ((bcast->buf = malloc(cap)) == NULL) {
+        free(bcast);
+        return -1;
+    }
+    bcast->room = room;
+    bcast->cap  = cap;
+
+    /* the appends of a busy room get in between the flushes of its members */
+    pthread_rwlockattr_t lockattr;
+    pthread_rwlockattr_init(&lockattr);
+    pthread_rwlockattr_setkind_np(&lockattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&bcast->lock, &lockattr);
+    pthread_rwlockattr_destroy(&lockattr);
+    room->bcast = bcast;
+    return 0;
+}
+
+static void
+room_bcast_free(room_t *room)
+{
+    if (!room->bcast) {
+        return;
+    }
+    pthread_rwlock_destroy(&room->bcast->lock);
+    free(room->bcast->buf);
+    free(room->bcast);
+    room->bcast = NULL;
+}
+
+static void
+room_bcast_join(room_bcast_t *bcast, conn_t *conn)
+{
+    /* the member gets the frames appended from now on, its output switches over at a frame boundary */
+    if (bcast) {
+        pthread_rwlock_rdlock(&bcast->lock);
+        conn->bcast_join     = bcast->head;
+        conn->bcast_join_seq = bcast->seq;
+        pthread_rwlock_unlock(&bcast->lock);
+    }
+}
+
+static void
+room_bcast_copy(room_bcast_t *bcast, uint64_t pos, const void *data, size_t size)
+{
+    size_t off   = pos & (bcast->cap - 1);
+    size_t first = size < bcast->cap - off ? size : bcast->cap - off;
+
+    memcpy(bcast->buf + off, data, first);
+    memcpy(bcast->buf, (const char *)data + first, size - first);
+}
+
+static uint64_t
+room_bcast_append(room_bcast_t *bcast, msg_t *msg, msg_t *zip, conn_t *except)
+{
+    room_bcast_rec_t rec = {.origin = (uintptr_t)except, .flags = zip ? ROOM_BCAST_REC_TWINNED : 0, .hdr = msg->hdr};
+
+    /* one copy for the whole room, the readers see it once the head moves */
+    pthread_rwlock_wrlock(&bcast->lock);
+    uint64_t head = bcast->head;
+    uint64_t tail = head + sizeof(rec) + msg->hdr.len;
+    room_bcast_copy(bcast, head, &rec, sizeof(rec));
+    if (msg->hdr.len) {
+        room_bcast_copy(bcast, head + sizeof(rec), msg->data, msg->hdr.len);
+    }
+    if (zip) {
+        /* the twin counts as the same message */
+        room_bcast_rec_t zrec = {.origin = (uintptr_t)except, .hdr = zip->hdr};
+        room_bcast_copy(bcast, tail, &zrec, sizeof(zrec));
+        room_bcast_copy(bcast, tail + sizeof(zrec), zip->data, zip->hdr.len);
+        tail += sizeof(zrec) + zip->hdr.len;
+    }
+    bcast->seq++;
+    __atomic_store_n(&bcast->head, tail, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&bcast->lock);
+    return head;
+}
+
+static void
+room_bcast_read(room_bcast_t *bcast, uint64_t pos, void *data, size_t size)
+{
+    size_t off   = pos & (bcast->cap - 1);
+    size_t first = size < bcast->cap - off ? size : bcast->cap - off;
+
+    memcpy(data, bcast->buf + off, first);
+    memcpy((char *)data + first, bcast->buf, size - first);
+}
+
+static void
+room_bcast_peek(room_bcast_t *bcast, uint64_t pos, room_bcast_rec_t *rec)
+{
+    room_bcast_read(bcast, pos, rec, sizeof(*rec));
+}
+
+static int
+room_bcast_iov(room_bcast_t *bcast, uint64_t pos, size_t size, struct iovec *iov)
+{
+    size_t off   = pos & (bcast->cap - 1);
+    size_t first = size < bcast->cap - off ? size : bcast->cap - off;
+
+    iov[0] = (struct iovec){.iov_base = bcast->buf + off, .iov_len = first};
+    if (first == size) {
+        return 1;
+    }
+    iov[1] = (struct iovec){.iov_base = bcast->buf, .iov_len = size - first};
+    return 2;
+}
+
+static int
+room_window_create(room_t *room, uint32_t cap)
+{
+    room_window_t *window = calloc(1, sizeof(room_window_t));
+    if (!window || !(window->msgs = calloc(cap, sizeof(msg_t *)))) {
+        free(window);
+        return -1;
+    }
+    window->cap = cap;
+    pthread_mutex_init(&window->lock, NULL);
+    room->window = window;
+    return 0;
+}
+
+static void
+room_window_free(room_t *room)
+{
+    room_window_t *window = room->window;
+    if (!window) {
+        return;
+    }
+    for (uint32_t i = 0; i < window->cap; i++) {
+        if (window->msgs[i]) {
+            mbr_unref(window->msgs[i]);
+        }
+    }
+    pthread_mutex_destroy(&window->lock);
+    free(window->msgs);
+    free(window);
+    room->window = NULL;
+}
+
+static void
+room_window_append(room_window_t *window, msg_t *msg)
+{
+    /* the routed message is shared, the window holds one more reference */
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&window->lock);
+    msg_t **slot = &window->msgs[window->seq % window->cap];
+    msg_t  *old  = *slot;
+    *slot = msg;
+    window->seq++;
+    pthread_mutex_unlock(&window->lock);
+    if (old) {
+        mbr_unref(old);
+    }
+}
+
+static uint64_t
+room_window_seq(room_window_t *window)
+{
+    pthread_mutex_lock(&window->lock);
+    uint64_t seq = window->seq;
+    pthread_mutex_unlock(&window->lock);
+    return seq;
+}
+
+static int
+room_window_copy(room_window_t *window, uint64_t *seq, uint64_t *lost, char **buf, size_t *len)
+{
+    /* the frames from seq on, copied to one buffer for a single write; seq moves to the
+     * first one kept when the older are gone and to the end, lost tells how many are gone */
+    pthread_mutex_lock(&window->lock);
+    uint64_t end   = window->seq;
+    uint64_t first = end > window->cap ? end - window->cap : 0;
+    uint64_t from  = *seq > end ? end : *seq;
+    *lost = from < first ? first - from : 0;
+    from  = from < first ? first : from;
+
+    size_t size = 0;
+    for (uint64_t i = from; i < end; i++) {
+        size += sizeof(struct msg_hdr_s) + window->msgs[i % window->cap]->hdr.len;
+    }
+    *buf = NULL;
+    *len = 0;
+    if (size && !(*buf = malloc(size))) {
+        pthread_mutex_unlock(&window->lock);
+        return -1;
+    }
+    for (uint64_t i = from; i < end; i++) {
+        msg_t *msg = window->msgs[i % window->cap];
+        memcpy(*buf + *len, &msg->hdr, sizeof(msg->hdr));
+        if (msg->hdr.len) {
+            memcpy(*buf + *len + sizeof(msg->hdr), msg->data, msg->hdr.len);
+        }
+        *len += sizeof(msg->hdr) + msg->hdr.len;
+    }
+    pthread_mutex_unlock(&window->lock);
+
+    *seq = end;
+    return (int)(end - from);
+}
+
+static int
+rooms_clear(rooms_t *rooms)
+{
+    HTAB_FOREACH(rooms, i) {
+        room_del(rooms->slots[i].val);
+    }
+    htab_free(rooms);
+    return 0;
+}
+
+/*****************************
+ * connection sets
+ *****************************/
+static int
+conns_join(conns_set_t *set, conn_t *conn)
+{
+    reactor_t *reactor = conn->reactor;
+    pset_t    *slots   = __atomic_load_n(&set->slots, __ATOMIC_ACQUIRE);
+
+    if (!slots) {
+        /* allocated on the first join, reactors may race for it */
+        pset_t *nslots = calloc(reactor->state->workers, sizeof(pset_t));
+        if (!nslots) {
+            return -1;
+        }
+        if (__atomic_compare_exchange_n(&set->slots, &slots, nslots, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            slots = nslots;
+        } else {
+            free(nslots);
+        }
+    }
+
+    if (pset_add(&slots[reactor->id], conn) < 0) {
+        return -1;
+    }
+    __atomic_or_fetch(&set->reactors, 1ULL << reactor->id, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void
+conns_leave(conns_set_t *set, conn_t *conn)
+{
+    reactor_t *reactor = conn->reactor;
+    pset_t    *slots   = __atomic_load_n(&set->slots, __ATOMIC_ACQUIRE);
+
+    if (slots && pset_del(&slots[reactor->id], conn) && !slots[reactor->id].count) {
+        __atomic_and_fetch(&set->reactors, ~(1ULL << reactor->id), __ATOMIC_RELEASE);
+        pset_free(&slots[reactor->id]);
+    }
+}
+
+static pset_t *
+conns_local(conns_set_t *set, int reactor_id)
+{
+    pset_t *slots = __atomic_load_n(&set->slots, __ATOMIC_ACQUIRE);
+    return (slots && slots[reactor_id].count) ? &slots[reactor_id] : NULL;
+}
+
+static size_t
+conns_count(conns_set_t *set)
+{
+    /* the slots belong to the other reactors, the sum is a snapshot */
+    pset_t  *slots = __atomic_load_n(&set->slots, __ATOMIC_ACQUIRE);
+    size_t   count = 0;
+    for (uint64_t reactors = __atomic_load_n(&set->reactors, __ATOMIC_ACQUIRE); slots && reactors; reactors &= reactors - 1) {
+        count += __atomic_load_n(&slots[__builtin_ctzll(reactors)].count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+static void
+conns_free(conns_set_t *set)
+{
+    for (uint64_t reactors = set->reactors; reactors; reactors &= reactors - 1) {
+        pset_free(&set->slots[__builtin_ctzll(reactors)]);
+    }
+    free(set->slots);
+    set->slots = NULL;
+    set->reactors = 0;
+}
+
+/*****************************
+ * connection table
+ *****************************/
+static int
+conn_tab_add(conn_tab_t *tab, conn_t *conn)
+{
+    size_t fd = (size_t)conn->fd;
+
+    if (fd >= tab->cap) {
+        size_t cap = tab->cap ? tab->cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        conn_t **conns = realloc(tab->conns, cap * sizeof(conn_t *));
+        if (!conns) {
+            return -1;
+        }
+        tab->conns = conns;
+        uint32_t *gens = realloc(tab->gens, cap * sizeof(uint32_t));
+        if (!gens) {
+            return -1;
+        }
+        tab->gens = gens;
+        memset(&tab->conns[tab->cap], 0, (cap - tab->cap) * sizeof(conn_t *));
+        memset(&tab->gens[tab->cap], 0, (cap - tab->cap) * sizeof(uint32_t));
+        tab->cap = cap;
+    }
+    if (tab->conns[fd]) {
+        return -1;
+    }
+
+    /* zero generation is never given out */
+    tab->gens[fd] = (tab->gens[fd] + 1) & CONN_TAB_GEN_MASK;
+    if (tab->gens[fd] == 0) {
+        tab->gens[fd] = 1;
+    }
+    conn->gen = tab->gens[fd];
+    tab->conns[fd] = conn;
+    tab->count++;
+    return 0;
+}
+
+static void
+conn_tab_del(conn_tab_t *tab, conn_t *conn)
+{
+    size_t fd = (size_t)conn->fd;
+
+    if (fd < tab->cap && tab->conns[fd] == conn) {
+        tab->conns[fd] = NULL;
+        tab->count--;
+    }
+}
+
+static conn_t *
+conn_tab_get(conn_tab_t *tab, uint64_t key)
+{
+    size_t  fd   = (size_t)CONN_TAB_KEY_FD(key);
+    conn_t *conn = fd < tab->cap ? tab->conns[fd] : NULL;
+
+    return (conn && conn->gen == CONN_TAB_KEY_GEN(key)) ? conn : NULL;
+}
+
+static void
+conn_tab_free(conn_tab_t *tab)
+{
+    free(tab->conns);
+    free(tab->gens);
+    *tab = (conn_tab_t){0};
+}
+
+/**************************
+ * Room journal
+ **************************/
+static uint64_t
+journal_clock(void)
+{
+    /* the history outlives the process, so it is stamped with the wall clock */
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+journal_seg_path(journal_t *journal, uint64_t no, char *path, size_t path_sz)
+{
+    snprintf(path, path_sz, "%s/%016llx.seg", journal->dir, (unsigned long long)no);
+}
+
+static journal_seg_t *
+journal_seg_create(journal_t *journal, uint64_t no)
+{
+    char path[PATH_MAX];
+    journal_seg_path(journal, no, path, sizeof(path));
+
+    journal_seg_t *seg = calloc(1, sizeof(journal_seg_t));
+    if (!seg) {
+        return NULL;
+    }
+    seg->no = no;
+    seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg->fd < 0 || ftruncate(seg->fd, JOURNAL_SEG_SZ) < 0) {
+        goto error;
+    }
+
+    /* populated up front, the reactor filling it takes no page faults on the way */
+    seg->map = mmap(NULL, JOURNAL_SEG_SZ, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        goto error;
+    }
+    seg->end  = seg->synced = JOURNAL_DATA_OFF;
+    seg->refs = 1;
+    return seg;
+
+error:
+    if (seg->fd >= 0) {
+        close(seg->fd);
+        unlink(path);
+    }
+    free(seg);
+    return NULL;
+}
+
+static journal_seg_t *
+journal_seg_load(journal_t *journal, uint64_t no)
+{
+    char path[PATH_MAX];
+    journal_seg_path(journal, no, path, sizeof(path));
+
+    journal_seg_t *seg = calloc(1, sizeof(journal_seg_t));
+    if (!seg) {
+        return NULL;
+    }
+    seg->no  = no;
+    seg->map = MAP_FAILED;
+    struct stat st;
+    seg->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (seg->fd < 0 || fstat(seg->fd, &st) < 0 || st.st_size != JOURNAL_SEG_SZ) {
+        goto error;
+    }
+    seg->map = mmap(NULL, JOURNAL_SEG_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        goto error;
+    }
+    journal_seg_hdr_t *hdr = (journal_seg_hdr_t *)seg->map;
+    if (hdr->magic != JOURNAL_MAGIC) {
+        /* a spare which never took a frame */
+        unlink(path);
+        goto error;
+    }
+    seg->first_seq = hdr->first_seq;
+    seg->first_ts  = hdr->first_ts;
+
+    /* the frames end at the first empty header after the last index entry */
+    journal_idx_t *idx = (journal_idx_t *)(seg->map + sizeof(journal_seg_hdr_t));
+    while (seg->idx_cnt < JOURNAL_IDX_CNT && idx[seg->idx_cnt].ts) {
+        seg->idx_cnt++;
+    }
+    uint64_t at;
+    seg->end    = JOURNAL_SEG_SZ;
+    seg->end    = journal_seek(seg, UINT64_MAX, 0, &at);
+    seg->synced = seg->end;
+    seg->refs   = 1;
+    return seg;
+
+error:
+    if (seg->map != MAP_FAILED) {
+        munmap(seg->map, JOURNAL_SEG_SZ);
+    }
+    if (seg->fd >= 0) {
+        close(seg->fd);
+    }
+    free(seg);
+    return NULL;
+}
+
+static void
+journal_seg_unref(journal_seg_t *seg)
+{
+    if (__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(seg->map, JOURNAL_SEG_SZ);
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+static int
+journal_seg_cmp(const void *a, const void *b)
+{
+    const journal_seg_t *sa = *(journal_seg_t * const *)a;
+    const journal_seg_t *sb = *(journal_seg_t * const *)b;
+
+    return sa->first_seq < sb->first_seq ? -1 : sa->first_seq > sb->first_seq;
+}
+
+static int
+journal_open(journals_t *journals, room_t *room)
+{
+    journal_seg_t **segs     = NULL;
+    size_t          segs_cnt = 0;
+    DIR            *dir      = NULL;
+
+    /* the room name becomes a directory, it may not lead out of the journal one */
+    if (!room->name[0] || strchr(room->name, '/') || strcmp(room->name, ".") == 0 || strcmp(room->name, "..") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    journal_t *journal = calloc(1, sizeof(journal_t));
+    if (!journal) {
+        return -1;
+    }
+    TAILQ_INIT(&journal->segs);
+    pthread_mutex_init(&journal->lock, NULL);
+    journal->room  = room;
+    journal->owner = journals;
+    journal->refs  = 1;
+    if (asprintf(&journal->dir, "%s/%s", journals->dir, room->name) < 0) {
+        journal->dir = NULL;
+        goto error;
+    }
+    if (mkdir(journal->dir, 0755) < 0 && errno != EEXIST) {
+        goto error;
+    }
+
+    /* segments left by the previous run, in the order of their frames */
+    if ((dir = opendir(journal->dir)) == NULL) {
+        goto error;
+    }
+    struct dirent *dent;
+    while ((dent = readdir(dir)) != NULL) {
+        char    *endp;
+        uint64_t no = strtoull(dent->d_name, &endp, 16);
+        if (endp == dent->d_name || strcmp(endp, ".seg") != 0) {
+            continue;
+        }
+        journal->next_no = no >= journal->next_no ? no + 1 : journal->next_no;
+
+        journal_seg_t *seg = journal_seg_load(journal, no);
+        if (!seg) {
+            continue;
+        }
+        journal_seg_t **nsegs = realloc(segs, (segs_cnt + 1) * sizeof(segs[0]));
+        if (!nsegs) {
+            journal_seg_unref(seg);
+            goto error;
+        }
+        segs = nsegs;
+        segs[segs_cnt++] = seg;
+    }
+    closedir(dir);
+    dir = NULL;
+
+    if (segs_cnt) {
+        qsort(segs, segs_cnt, sizeof(segs[0]), journal_seg_cmp);
+    }
+    for (size_t i = 0; i < segs_cnt; i++) {
+        TAILQ_INSERT_TAIL(&journal->segs, segs[i], tq_entry);
+        journal->bytes += JOURNAL_SEG_SZ;
+    }
+    free(segs);
+    if (!TAILQ_EMPTY(&journal->segs)) {
+        journal_seek(TAILQ_LAST(&journal->segs, journal_seg_list_s), UINT64_MAX, 0, &journal->seq);
+    }
+
+    pthread_mutex_lock(&journals->lock);
+    LIST_INSERT_HEAD(&journals->list, journal, lentry);
+    pthread_mutex_unlock(&journals->lock);
+    room->journal = journal;
+    return 0;
+
+error:
+    if (dir) {
+        closedir(dir);
+    }
+    for (size_t i = 0; i < segs_cnt; i++) {
+        journal_seg_unref(segs[i]);
+    }
+    free(segs);
+    journal_unref(journal);
+    return -1;
+}
+
+static void
+journal_unref(journal_t *journal)
+{
+    if (__atomic_sub_fetch(&journal->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    /* nobody appends anymore, what is left goes to the disk right here */
+    while (!TAILQ_EMPTY(&journal->segs)) {
+        journal_seg_t *seg = TAILQ_FIRST(&journal->segs);
+        TAILQ_REMOVE(&journal->segs, seg, tq_entry);
+        if (seg->synced != seg->end) {
+            msync(seg->map, seg->end, MS_SYNC);
+        }
+        journal_seg_unref(seg);
+    }
+    if (journal->spare) {
+        char path[PATH_MAX];
+        journal_seg_path(journal, journal->spare->no, path, sizeof(path));
+        unlink(path);
+        journal_seg_unref(journal->spare);
+    }
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->dir);
+    free(journal);
+}
+
+static void
+journal_close(room_t *room)
+{
+    journal_t *journal = room->journal;
+    if (!journal) {
+        return;
+    }
+
+    /* the flusher walks the list under its lock, so it is done with the journal after that */
+    pthread_mutex_lock(&journal->owner->lock);
+    LIST_REMOVE(journal, lentry);
+    pthread_mutex_unlock(&journal->owner->lock);
+
+    journal->room = NULL;
+    room->journal = NULL;
+    journal_unref(journal);
+}
+
+static journal_seg_t *
+journal_roll(journal_t *journal, uint64_t ts)
+{
+    journal_seg_t *seg = journal->spare;
+
+    /* the flusher prepares the next segment, it is created in place only when it is late */
+    journal->spare = NULL;
+    if (!seg && !(seg = journal_seg_create(journal, journal->next_no++))) {
+        return NULL;
+    }
+    journal_seg_hdr_t *hdr = (journal_seg_hdr_t *)seg->map;
+    hdr->first_seq = seg->first_seq = journal->seq;
+    hdr->first_ts  = seg->first_ts  = ts;
+    hdr->magic     = JOURNAL_MAGIC;
+    seg->synced    = 0;
+
+    TAILQ_INSERT_TAIL(&journal->segs, seg, tq_entry);
+    journal->bytes += JOURNAL_SEG_SZ;
+    return seg;
+}
+
+static int
+journal_append(journal_t *journal, msg_t *msg)
+{
+    size_t   frame_sz = sizeof(msg->hdr) + msg->hdr.len;
+    uint64_t ts       = journal_clock();
+
+    /* a copy into the page cache, the flusher makes it durable later */
+    pthread_mutex_lock(&journal->lock);
+    journal_seg_t *seg = TAILQ_LAST(&journal->segs, journal_seg_list_s);
+    if (!seg || seg->end + frame_sz > JOURNAL_SEG_SZ) {
+        if ((seg = journal_roll(journal, ts)) == NULL) {
+            pthread_mutex_unlock(&journal->lock);
+            return -1;
+        }
+    }
+    if (seg->end - JOURNAL_DATA_OFF >= seg->idx_cnt * JOURNAL_IDX_STEP) {
+        /* the first frame at or past every index step */
+        journal_idx_t *idx = (journal_idx_t *)(seg->map + sizeof(journal_seg_hdr_t));
+        idx[seg->idx_cnt++] = (journal_idx_t){.seq = journal->seq, .ts = ts, .off = seg->end};
+    }
+    memcpy(seg->map + seg->end, &msg->hdr, sizeof(msg->hdr));
+    if (msg->hdr.len) {
+        memcpy(seg->map + seg->end + sizeof(msg->hdr), msg->data, msg->hdr.len);
+    }
+    seg->end += frame_sz;
+    journal->seq++;
+    pthread_mutex_unlock(&journal->lock);
+    return 0;
+}
+
+static size_t
+journal_seek(journal_seg_t *seg, uint64_t seq, uint64_t ts, uint64_t *at)
+{
+    journal_idx_t *idx = (journal_idx_t *)(seg->map + sizeof(journal_seg_hdr_t));
+    size_t         lo  = 0;
+    size_t         hi  = seg->idx_cnt;
+
+    /* the last index entry not past the target, a time stays with it */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ts ? idx[mid].ts <= ts : idx[mid].seq <= seq) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t off = lo ? idx[lo - 1].off : JOURNAL_DATA_OFF;
+    *at = lo ? idx[lo - 1].seq : seg->first_seq;
+
+    /* a sequence number is reached frame by frame, a step at most */
+    while (!ts && *at < seq && off + sizeof(struct msg_hdr_s) <= seg->end) {
+        struct msg_hdr_s hdr;
+        memcpy(&hdr, seg->map + off, sizeof(hdr));
+        if (!MSG_TYP_MASK(hdr.ops) || off + sizeof(hdr) + hdr.len > seg->end) {
+            break;
+        }
+        off += sizeof(hdr) + hdr.len;
+        (*at)++;
+    }
+    return off;
+}
+
+static void
+journal_commit(journal_t *journal)
+{
+    journals_t        *journals = journal->owner;
+    journal_seg_t     *sync[JOURNAL_SYNC_MAX];
+    size_t             sync_end[JOURNAL_SYNC_MAX];
+    int                sync_cnt = 0;
+    journal_seg_list_t dropped;
+    journal_seg_t     *seg;
+    uint64_t           now = journal_clock();
+
+    /* the segments are taken under the lock and synced without it, the appends go on meanwhile */
+    TAILQ_INIT(&dropped);
+    pthread_mutex_lock(&journal->lock);
+    TAILQ_FOREACH(seg, &journal->segs, tq_entry) {
+        if (sync_cnt < JOURNAL_SYNC_MAX && seg->synced != seg->end) {
+            __atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+            sync_end[sync_cnt] = seg->end;
+            sync[sync_cnt++]   = seg;
+        }
+    }
+
+    /* retention drops whole segments, the last one always stays */
+    while ((seg = TAILQ_FIRST(&journal->segs)) != TAILQ_LAST(&journal->segs, journal_seg_list_s)) {
+        uint64_t last_ts = TAILQ_NEXT(seg, tq_entry)->first_ts;
+        bool     expired = journals->age && now > last_ts && now - last_ts > journals->age * 1000000000ULL;
+        if (journal->bytes <= journals->keep && !expired) {
+            break;
+        }
+        TAILQ_REMOVE(&journal->segs, seg, tq_entry);
+        TAILQ_INSERT_TAIL(&dropped, seg, tq_entry);
+        seg->is_dropped = true;
+        journal->bytes -= JOURNAL_SEG_SZ;
+    }
+
+    seg = TAILQ_LAST(&journal->segs, journal_seg_list_s);
+    bool     spare    = !journal->spare && seg && seg->end > JOURNAL_SEG_SZ / 2;
+    uint64_t spare_no = spare ? journal->next_no++ : 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    for (int i = 0; i < sync_cnt; i++) {
+        if (msync(sync[i]->map, sync_end[i], MS_SYNC) == 0) {
+            sync[i]->synced = sync_end[i];
+        }
+        journal_seg_unref(sync[i]);
+    }
+    while (!TAILQ_EMPTY(&dropped)) {
+        char path[PATH_MAX];
+        seg = TAILQ_FIRST(&dropped);
+        TAILQ_REMOVE(&dropped, seg, tq_entry);
+        journal_seg_path(journal, seg->no, path, sizeof(path));
+        unlink(path);
+        journal_seg_unref(seg);
+    }
+    if (spare && (seg = journal_seg_create(journal, spare_no)) != NULL) {
+        pthread_mutex_lock(&journal->lock);
+        if (!journal->spare) {
+            journal->spare = seg;
+            seg = NULL;
+        }
+        pthread_mutex_unlock(&journal->lock);
+        if (seg) {
+            char path[PATH_MAX];
+            journal_seg_path(journal, seg->no, path, sizeof(path));
+            unlink(path);
+            journal_seg_unref(seg);
+        }
+    }
+}
+
+static void *
+journal_flusher(void *arg)
+{
+    journals_t *journals = arg;
+    journal_t  *journal;
+
+    /* group commit, every period takes the frames of all the reactors at once */
+    while (__atomic_load_n(&journals->running, __ATOMIC_ACQUIRE)) {
+        poll(NULL, 0, JOURNAL_COMMIT_MS);
+        pthread_mutex_lock(&journals->lock);
+        LIST_FOREACH(journal, &journals->list, lentry) {
+            journal_commit(journal);
+        }
+        pthread_mutex_unlock(&journals->lock);
+    }
+    return NULL;
+}
+
+static int
+journals_start(journals_t *journals)
+{
+    /* signals are left to the reactors */
+    sigset_t sigmask, sigmask_orig;
+    sigfillset(&sigmask);
+    pthread_sigmask(SIG_BLOCK, &sigmask, &sigmask_orig);
+    __atomic_store_n(&journals->running, true, __ATOMIC_RELEASE);
+    int rc = pthread_create(&journals->thread, NULL, journal_flusher, journals);
+    pthread_sigmask(SIG_SETMASK, &sigmask_orig, NULL);
+    if (rc != 0) {
+        __atomic_store_n(&journals->running, false, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+journals_stop(journals_t *journals)
+{
+    /* the journals sync the rest when they are closed */
+    if (__atomic_exchange_n(&journals->running, false, __ATOMIC_ACQ_REL)) {
+        pthread_join(journals->thread, NULL);
+    }
+}
+
+static int
+journal_replay_start(journal_t *journal, conn_t *conn, uint64_t *seq, uint64_t ts, uint64_t *count)
+{
+    journal_seg_t *seg = NULL;
+    journal_seg_t *it;
+
+    /* the segment holding the start, the history kept starts later at worst */
+    pthread_mutex_lock(&journal->lock);
+    TAILQ_FOREACH(it, &journal->segs, tq_entry) {
+        if (seg && (ts ? it->first_ts > ts : it->first_seq > *seq)) {
+            break;
+        }
+        seg = it;
+    }
+    *count = 0;
+    if (!seg) {
+        pthread_mutex_unlock(&journal->lock);
+        return 0;
+    }
+    size_t off = journal_seek(seg, *seq, ts, seq);
+    *count = journal->seq - *seq;
+    if (!*count) {
+        pthread_mutex_unlock(&journal->lock);
+        return 0;
+    }
+
+    journal_replay_t *replay = calloc(1, sizeof(journal_replay_t));
+    if (!replay) {
+        pthread_mutex_unlock(&journal->lock);
+        return -1;
+    }
+    journal_seg_t *tail = TAILQ_LAST(&journal->segs, journal_seg_list_s);
+    replay->journal  = journal;
+    replay->seg      = seg;
+    replay->off      = off;
+    replay->stop_no  = tail->no;
+    replay->stop_off = tail->end;
+    __atomic_add_fetch(&journal->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&journal->lock);
+
+    conn->replay = replay;
+    return 0;
+}
+
+static void
+journal_replay_free(conn_t *conn)
+{
+    journal_replay_t *replay = conn->replay;
+    if (replay) {
+        if (replay->journal) {
+            journal_seg_unref(replay->seg);
+            journal_unref(replay->journal);
+        }
+        free(replay->buf);
+        free(replay);
+        conn->replay = NULL;
+    }
+}
+
+/**************************
+ * Sessions
+ **************************/
+static const char *
+session_key(const void *val)
+{
+    return ((const session_t *)val)->token;
+}
+
+static void
+sessions_expire(sessions_t *sessions, uint64_t now)
+{
+    session_t *session;
+
+    /* closed in order, so the expired ones are at the head */
+    while ((session = TAILQ_FIRST(&sessions->closed)) != NULL
+           && now - session->closed > (uint64_t)sessions->ttl * 1000000000ULL) {
+        TAILQ_REMOVE(&sessions->closed, session, tq_entry);
+        htab_remove(&sessions->tab, session->token, SESSION_TOKEN_SZ);
+        free(session);
+    }
+}
+
+static int
+session_open(sessions_t *sessions, conn_t *conn, uint64_t gen, char *token)
+{
+    pthread_mutex_lock(&sessions->lock);
+    sessions_expire(sessions, state_clock());
+
+    /* a new login of the connection takes the place of its previous one */
+    session_t *session = conn->session;
+    if (session) {
+        htab_remove(&sessions->tab, session->token, SESSION_TOKEN_SZ);
+        conn->session = NULL;
+    } else if (sessions->tab.count >= SESSIONS_MAX && (session = TAILQ_FIRST(&sessions->closed)) != NULL) {
+        TAILQ_REMOVE(&sessions->closed, session, tq_entry);
+        htab_remove(&sessions->tab, session->token, SESSION_TOKEN_SZ);
+    } else if (sessions->tab.count >= SESSIONS_MAX || !(session = malloc(sizeof(session_t)))) {
+        pthread_mutex_unlock(&sessions->lock);
+        return -1;
+    }
+
+    uint64_t rnd;
+    do {
+        if (getrandom(&rnd, sizeof(rnd), 0) != sizeof(rnd)) {
+            free(session);
+            pthread_mutex_unlock(&sessions->lock);
+            return -1;
+        }
+        snprintf(token, SESSION_TOKEN_SZ + 1, "%016llx", (unsigned long long)rnd);
+    } while (htab_find(&sessions->tab, token, SESSION_TOKEN_SZ));
+
+    *session = (session_t){.roommate = conn->roommate, .room = conn->room, .conn = conn, .gen = gen};
+    memcpy(session->token, token, SESSION_TOKEN_SZ + 1);
+    if (htab_insert(&sessions->tab, session->token, SESSION_TOKEN_SZ, session) < 0) {
+        free(session);
+        pthread_mutex_unlock(&sessions->lock);
+        return -1;
+    }
+    conn->session = session;
+    pthread_mutex_unlock(&sessions->lock);
+    return 0;
+}
+
+static void
+session_enter(sessions_t *sessions, conn_t *conn)
+{
+    pthread_mutex_lock(&sessions->lock);
+    if (conn->session) {
+        conn->session->room = conn->room;
+    }
+    pthread_mutex_unlock(&sessions->lock);
+}
+
+static int
+session_take(sessions_t *sessions, conn_t *conn, const char *token, size_t token_sz, uint64_t gen,
+        roommate_t **mate, room_t **room)
+{
+    pthread_mutex_lock(&sessions->lock);
+    sessions_expire(sessions, state_clock());
+
+    session_t *session = token_sz == SESSION_TOKEN_SZ ? htab_find(&sessions->tab, token, token_sz) : NULL;
+    if (!session || session->gen != gen) {
+        /* the mates and rooms it refers to may be gone since */
+        if (session && !session->conn) {
+            TAILQ_REMOVE(&sessions->closed, session, tq_entry);
+            htab_remove(&sessions->tab, session->token, SESSION_TOKEN_SZ);
+            free(session);
+        }
+        pthread_mutex_unlock(&sessions->lock);
+        return -1;
+    }
+
+    /* a connection which is not known to be dead yet loses it */
+    if (session->conn) {
+        session->conn->session = NULL;
+    } else {
+        TAILQ_REMOVE(&sessions->closed, session, tq_entry);
+    }
+    session->conn = conn;
+    conn->session = session;
+    *mate = session->roommate;
+    *room = session->room;
+    pthread_mutex_unlock(&sessions->lock);
+    return 0;
+}
+
+static void
+session_close(sessions_t *sessions, conn_t *conn)
+{
+    pthread_mutex_lock(&sessions->lock);
+    session_t *session = conn->session;
+    if (session && session->conn == conn) {
+        session->conn   = NULL;
+        session->closed = state_clock();
+        TAILQ_INSERT_TAIL(&sessions->closed, session, tq_entry);
+    }
+    conn->session = NULL;
+    pthread_mutex_unlock(&sessions->lock);
+}
+
+static void
+sessions_free(sessions_t *sessions)
+{
+    HTAB_FOREACH(&sessions->tab, i) {
+        free(sessions->tab.slots[i].val);
+    }
+    htab_free(&sessions->tab);
+    TAILQ_INIT(&sessions->closed);
+    pthread_mutex_destroy(&sessions->lock);
+}
+
+/**************************
+ * State of the process
+ **************************/
+static int
+state_init(state_t *state)
+{
+    *state = (state_t){0};
+    mbr_init(&state->mbroker);
+    htab_init(&state->mates, roommate_key);
+    htab_init(&state->rooms, room_key);
+    state->workers = 1;
+    state->accept_burst   = SRV_ACCEPT_BURST_DEF;
+    state->listen_backlog = SRV_LISTEN_BACKLOG_DEF;
+    state->epoll_batch    = SRV_EPOLL_BATCH_DEF;
+    state->bcast_min      = -1;
+    state->bcast_ring     = ROOM_BCAST_RING_DEF;
+    state->bcast_lag      = ROOM_BCAST_RESYNC;
+    state->journals.keep  = JOURNAL_KEEP_DEF;
+    state->out_limit      = CONN_OUT_LIMIT_DEF;
+    state->out_policy     = CONN_OUT_DISCONNECT;
+    state->mem_policy     = CONN_OUT_DROP_OLDEST;
+    state->zip_min        = MSG_ZIP_MIN_DEF;
+    state->sessions.window = ROOM_WINDOW_DEF;
+    state->sessions.ttl    = SESSION_TTL_DEF;
+    state->heartbeat      = CONN_HEARTBEAT_DEF;
+    state->login_timeout  = CONN_LOGIN_DEF;
+    htab_init(&state->sessions.tab, session_key);
+    TAILQ_INIT(&state->sessions.closed);
+    pthread_mutex_init(&state->sessions.lock, NULL);
+    LIST_INIT(&state->journals.list);
+    pthread_mutex_init(&state->journals.lock, NULL);
+    pthread_mutex_init(&state->snap_lock, NULL);
+    pthread_mutex_init(&state->status_lock, NULL);
+
+    pthread_rwlockattr_t lockattr;
+    pthread_rwlockattr_init(&lockattr);
+    pthread_rwlockattr_setkind_np(&lockattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&state->lock, &lockattr);
+    pthread_rwlockattr_destroy(&lockattr);
+    return 0;
+}
+
+static void
+state_free(state_t *state)
+{
+    sessions_free(&state->sessions);
+    rooms_clear(&state->rooms);
+    roommates_clear(&state->mates, NULL);
+    PSET_FOREACH(&state->mates_gone, i) {
+        free(state->mates_gone.slots[i]);
+    }
+    pset_free(&state->mates_gone);
+    conns_free(&state->admin.conns);
+    free(state->admin.passwd);
+    state->admin.passwd = NULL;
+    free(state->stats_path);
+    state->stats_path = NULL;
+    free(state->journals.dir);
+    state->journals.dir = NULL;
+    pthread_mutex_destroy(&state->journals.lock);
+    free(state->snap_path);
+    state->snap_path = NULL;
+    free(state->snap_slab);
+    state->snap_slab = NULL;
+    pthread_mutex_destroy(&state->snap_lock);
+    state_status_unref(state->status_mates);
+    state->status_mates = NULL;
+    state_status_unref(state->status_members);
+    state->status_members = NULL;
+    pthread_mutex_destroy(&state->status_lock);
+
+    /* client frames which were never sent */
+    mbr_clean(&state->mbroker);
+    mbr_flush_locals(&state->mbroker);
+    pthread_rwlock_destroy(&state->lock);
+}
+
+static void
+rooms_bcast_update(state_t *state, msg_broker_t *broker)
+{
+    if (state->bcast_min < 0) {
+        return;
+    }
+
+    /* called before the reactors start or under the write lock, the members can't race */
+    HTAB_FOREACH(&state->rooms, i) {
+        room_t *room = state->rooms.slots[i].val;
+        if (room->bcast || (!room->is_open && (long)room->mates.count < state->bcast_min)) {
+            continue;
+        }
+        if (room_bcast_create(room, state->bcast_ring) < 0) {
+            mbr_add_loge(broker, "can't allocate broadcast ring of room %s", room->name);
+            continue;
+        }
+        for (uint64_t reactors = room->conns.reactors; reactors; reactors &= reactors - 1) {
+            pset_t *local = &room->conns.slots[__builtin_ctzll(reactors)];
+            PSET_FOREACH(local, c) {
+                room_bcast_join(room->bcast, local->slots[c]);
+            }
+        }
+        mbr_add_logi(broker, "room %s: broadcast ring of %zu bytes", room->name, room->bcast->cap);
+    }
+}
+
+static void
+rooms_journal_update(state_t *state, msg_broker_t *broker)
+{
+    if (!state->journals.dir) {
+        return;
+    }
+    if (mkdir(state->journals.dir, 0755) < 0 && errno != EEXIST) {
+        mbr_add_loge(broker, "can't create journal directory %s", state->journals.dir);
+        return;
+    }
+
+    /* called before the reactors start or under the write lock, like rooms_bcast_update */
+    HTAB_FOREACH(&state->rooms, i) {
+        room_t *room = state->rooms.slots[i].val;
+        if (room->journal) {
+            continue;
+        }
+        if (journal_open(&state->journals, room) < 0) {
+            mbr_add_loge(broker, "can't open journal of room %s", room->name);
+            continue;
+        }
+        mbr_add_logi(broker, "room %s: journal of %llu messages", room->name,
+                (unsigned long long)room->journal->seq);
+    }
+}
+
+static void
+rooms_window_update(state_t *state, msg_broker_t *broker)
+{
+    if (!state->sessions.window) {
+        return;
+    }
+
+    /* called before the reactors start or under the write lock, like rooms_journal_update */
+    HTAB_FOREACH(&state->rooms, i) {
+        room_t *room = state->rooms.slots[i].val;
+        if (!room->window && room_window_create(room, state->sessions.window) < 0) {
+            mbr_add_loge(broker, "can't create window of room %s, its sessions resume without messages", room->name);
+        }
+    }
+}
+
+static void
+state_registry_touch(state_t *state)
+{
+    /* the rendered listings go stale, the next request renders them anew */
+    __atomic_add_fetch(&state->registry_gen, 1, __ATOMIC_RELEASE);
+}
+
+static int
+state_registry_edit(state_t *state, msg_broker_t *broker, cmd_t *cmd)
+{
+    cfg_objlist_t objs;
+    cmd_arg_t    *subcmd = &cmd->argv[0];
+    int           rc     = -1;
+
+    /* :roommates add|del|clear and :rooms addmates|delmates, the caller holds the write lock,
+     * the lines about the new rings, journals and windows go out with its broker */
+    LIST_INIT(&objs);
+    if (cmd->op == CMD_OP_ROOMMATES && cmd->argc > 1 && (cmd_arg_is(subcmd, "add") || cmd_arg_is(subcmd, "del"))) {
+        cfg_objstring_parse((char *)cmd->argv[1].ptr, cmd->argv[1].len, &objs, CFG_OBJ_VE);
+        if (!LIST_EMPTY(&objs) && subcmd->ptr[0] == 'a') {
+            rc = roommates_add(&state->mates, &objs);
+        } else if (!LIST_EMPTY(&objs)) {
+            rc = roommates_del(&state->mates, &objs, &state->mates_gone);
+        }
+    } else if (cmd->op == CMD_OP_ROOMMATES && cmd->argc == 1 && cmd_arg_is(subcmd, "clear")) {
+        rc = roommates_clear(&state->mates, &state->mates_gone);
+    } else if (cmd->op == CMD_OP_ROOMS && cmd->argc > 2
+               && (cmd_arg_is(subcmd, "addmates") || cmd_arg_is(subcmd, "delmates"))) {
+        char  *rname    = (char *)cmd->argv[1].ptr;
+        size_t rname_sz = cmd->argv[1].len;
+        cfg_objstring_parse((char *)cmd->argv[2].ptr, cmd->argv[2].len, &objs, CFG_OBJ_VE);
+        if (!LIST_EMPTY(&objs) && subcmd->ptr[0] == 'a') {
+            rc = room_add_mates(&state->rooms, &state->mates, rname, rname_sz, &objs);
+            rooms_bcast_update(state, broker);
+            rooms_journal_update(state, broker);
+            rooms_window_update(state, broker);
+        } else if (!LIST_EMPTY(&objs)) {
+            rc = room_del_mates(&state->rooms, &state->mates, rname, rname_sz, &objs);
+        }
+    }
+    cfg_objlist_clear(&objs);
+    if (rc == 0) {
+        state_registry_touch(state);
+    }
+    return rc;
+}
+
+static uint64_t
+state_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void
+state_status_mates_wlk_short(const void *ptr, void *ctx)
+{
+    roommate_t *mate = (roommate_t *) ptr;
+    fprintf(((state_status_ctx_t *)ctx)->out, "%s  ", mate->name);
+}
+static void
+state_status_mates_wlk_long(const void *ptr, void *ctx)
+{
+    roommate_t *mate = (roommate_t *) ptr;
+    FILE       *out  = ((state_status_ctx_t *)ctx)->out;
+    fprintf(out, "  * name: %s\n", mate->name);
+    fprintf(out, "    rooms: ");
+    PSET_FOREACH(&mate->rooms, i) {
+        state_status_rooms_wlk_short(mate->rooms.slots[i], ctx);
+    }
+    fprintf(out, "\n");
+}
+static void
+state_status_rooms_wlk_short(const void *ptr, void *ctx)
+{
+    room_t *room = (room_t *) ptr;
+    fprintf(((state_status_ctx_t *)ctx)->out, "%s  ", room->name);
+}
+static void
+state_status_rooms_wlk_long(const void *ptr, void *ctx)
+{
+    room_t             *room   = (room_t *) ptr;
+    state_status_ctx_t *stctx  = ctx;
+    uint64_t            msgs   = __atomic_load_n(&room->msgs, __ATOMIC_RELAXED);
+    uint64_t            mark   = __atomic_exchange_n(&room->msgs_mark, msgs, __ATOMIC_RELAXED);
+
+    /* the roommates of the room are listed by the cached part */
+    fprintf(stctx->out, "  * name: %s, open: %s, large: %s, members: %zu, online: %zu, messages: %llu, rate: %.1f/s\n",
+            room->name, room->is_open ? "yes" : "no", room->bcast ? "yes" : "no", room->mates.count, conns_count(&room->conns),
+            (unsigned long long)msgs, stctx->elapsed > 0 ? (msgs - mark) / stctx->elapsed : 0.0);
+}
+
+static void
+state_status_take(state_t *state, FILE *out)
+{
+    uint64_t now  = state_clock();
+    uint64_t mark = __atomic_exchange_n(&state->stats_mark, now, __ATOMIC_RELAXED);
+    state_status_ctx_t stctx = {.out = out, .elapsed = (now - mark) / 1e9};
+
+    reactor_stats_t sum;
+    reactor_stats_sum(state, &sum);
+    fprintf(out, "uptime: %.1fs, reactors: %d\n", (now - state->started) / 1e9, state->workers);
+    fprintf(out, "connections: %llu\n", (unsigned long long)sum.conns);
+    fprintf(out, "input: %llu messages, %llu bytes\n",
+            (unsigned long long)sum.msgs_in, (unsigned long long)sum.bytes_in);
+    fprintf(out, "output: %llu bytes, queued: %llu bytes\n",
+            (unsigned long long)sum.bytes_out, (unsigned long long)sum.queued);
+    fprintf(out, "backpressure: dropped oldest %llu, dropped chat %llu, disconnected %llu, refused %llu\n",
+            (unsigned long long)sum.drops_oldest, (unsigned long long)sum.drops_chat,
+            (unsigned long long)sum.kicks, (unsigned long long)sum.refused);
+    fprintf(out, "compression: %llu frames, %llu to %llu bytes, ratio %.2f, cpu %.3f ms\n",
+            (unsigned long long)sum.zip_frames, (unsigned long long)sum.zip_in, (unsigned long long)sum.zip_out,
+            sum.zip_out ? (double)sum.zip_in / sum.zip_out : 0.0, sum.zip_ns / 1e6);
+    fprintf(out, "wakeups: %llu, events: %llu, per wakeup: %.2f\n",
+            (unsigned long long)sum.wakeups, (unsigned long long)sum.events,
+            sum.wakeups ? (double)sum.events / sum.wakeups : 0.0);
+
+    fprintf(out, "reactors: \n");
+    for (int r = 0; r < state->workers && state->reactors; r++) {
+        reactor_t *reactor = &state->reactors[r];
+        uint64_t   wakeups = REACTOR_STAT_GET(reactor, wakeups);
+        fprintf(out, "  * id: %d, %s, connections: %llu, queued: %llu bytes, per wakeup: %.2f\n",
+                r, reactor->uring ? "io_uring" : "epoll",
+                (unsigned long long)REACTOR_STAT_GET(reactor, conns),
+                (unsigned long long)REACTOR_STAT_GET(reactor, queued),
+                wakeups ? (double)REACTOR_STAT_GET(reactor, events) / wakeups : 0.0);
+    }
+
+    fprintf(out, "pools: \n");
+    for (int p = 0; p < POOL_ID_MAX; p++) {
+        pool_stats_t stats;
+        pool_stats(&pools[p], &stats);
+        fprintf(out, "  * %s: live %zu, free %zu, high-water %zu\n",
+                pools[p].name, stats.live, stats.free, stats.hiwat);
+    }
+
+    fprintf(out, "rooms: \n");
+    HTAB_FOREACH(&state->rooms, i) {
+        state_status_rooms_wlk_long(state->rooms.slots[i].val, &stctx);
+    }
+}
+
+static void
+state_status_mates(state_t *state, FILE *out)
+{
+    state_status_ctx_t stctx = {.out = out};
+
+    fprintf(out, "roommates: \n");
+    HTAB_FOREACH(&state->mates, i) {
+        state_status_mates_wlk_long(state->mates.slots[i].val, &stctx);
+    }
+}
+
+static void
+state_status_members(state_t *state, FILE *out)
+{
+    state_status_ctx_t stctx = {.out = out};
+
+    fprintf(out, "roommates of rooms: \n");
+    HTAB_FOREACH(&state->rooms, i) {
+        room_t *room = state->rooms.slots[i].val;
+        fprintf(out, "  * name: %s\n", room->name);
+        fprintf(out, "    roommates: ");
+        PSET_FOREACH(&room->mates, j) {
+            state_status_mates_wlk_short(room->mates.slots[j], &stctx);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+static status_text_t *
+state_status_render(state_t *state, status_render_t render)
+{
+    status_text_t *text = calloc(1, sizeof(status_text_t));
+    FILE          *out  = text ? open_memstream(&text->buf, &text->len) : NULL;
+    if (!out) {
+        free(text);
+        return NULL;
+    }
+    render(state, out);
+    if (fclose(out) != 0) {
+        free(text->buf);
+        free(text);
+        return NULL;
+    }
+    text->refs = 1;
+    return text;
+}
+
+static status_text_t *
+state_status_cached(state_t *state, status_text_t **cache, status_render_t render)
+{
+    /* the registries don't change under the read lock, so the generation holds while rendering */
+    uint64_t gen = __atomic_load_n(&state->registry_gen, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&state->status_lock);
+    status_text_t *text = *cache;
+    if (!text || text->gen != gen) {
+        status_text_t *fresh = state_status_render(state, render);
+        if (fresh) {
+            fresh->gen = gen;
+            state_status_unref(text);
+            *cache = fresh;
+        }
+        text = fresh;
+    }
+    if (text) {
+        __atomic_add_fetch(&text->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&state->status_lock);
+    return text;
+}
+
+static void
+state_status_unref(status_text_t *text)
+{
+    if (text && __atomic_sub_fetch(&text->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(text->buf);
+        free(text);
+    }
+}
+
+static void
+state_status_json_str(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(out, "\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned char)*str);
+        } else {
+            fputc(*str, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void
+state_status_json(state_t *state, FILE *out)
+{
+    /* counters only, the rates are left to the scraper */
+    fprintf(out, "{\"uptime\":%.3f,\"reactors\":[", (state_clock() - state->started) / 1e9);
+    for (int r = 0; r < state->workers && state->reactors; r++) {
+        reactor_t *reactor = &state->reactors[r];
+        fprintf(out, "%s{\"id\":%d,\"backend\":\"%s\",\"conns\":%llu,\"accepted\":%llu,"
+                "\"msgs_in\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,\"queued\":%llu,"
+                "\"wakeups\":%llu,\"events\":%llu,\"drops_oldest\":%llu,\"drops_chat\":%llu,"
+                "\"kicks\":%llu,\"refused\":%llu,\"zip_frames\":%llu,\"zip_in\":%llu,\"zip_out\":%llu,"
+                "\"zip_ns\":%llu}",
+                r ? "," : "", r, reactor->uring ? "io_uring" : "epoll",
+                (unsigned long long)REACTOR_STAT_GET(reactor, conns),
+                (unsigned long long)__atomic_load_n(&reactor->acc_total, __ATOMIC_RELAXED),
+                (unsigned long long)REACTOR_STAT_GET(reactor, msgs_in),
+                (unsigned long long)REACTOR_STAT_GET(reactor, bytes_in),
+                (unsigned long long)REACTOR_STAT_GET(reactor, bytes_out),
+                (unsigned long long)REACTOR_STAT_GET(reactor, queued),
+                (unsigned long long)REACTOR_STAT_GET(reactor, wakeups),
+                (unsigned long long)REACTOR_STAT_GET(reactor, events),
+                (unsigned long long)REACTOR_STAT_GET(reactor, drops_oldest),
+                (unsigned long long)REACTOR_STAT_GET(reactor, drops_chat),
+                (unsigned long long)REACTOR_STAT_GET(reactor, kicks),
+                (unsigned long long)REACTOR_STAT_GET(reactor, refused),
+                (unsigned long long)REACTOR_STAT_GET(reactor, zip_frames),
+                (unsigned long long)REACTOR_STAT_GET(reactor, zip_in),
+                (unsigned long long)REACTOR_STAT_GET(reactor, zip_out),
+                (unsigned long long)REACTOR_STAT_GET(reactor, zip_ns));
+    }
+
+    fprintf(out, "],\"pools\":{");
+    for (int p = 0; p < POOL_ID_MAX; p++) {
+        pool_stats_t stats;
+        pool_stats(&pools[p], &stats);
+        fprintf(out, "%s\"%s\":{\"live\":%zu,\"free\":%zu,\"hiwat\":%zu}",
+                p ? "," : "", pools[p].name, stats.live, stats.free, stats.hiwat);
+    }
+
+    fprintf(out, "},\"rooms\":[");
+    bool first = true;
+    HTAB_FOREACH(&state->rooms, i) {
+        room_t *room = state->rooms.slots[i].val;
+        fprintf(out, "%s{\"name\":", first ? "" : ",");
+        state_status_json_str(out, room->name);
+        fprintf(out, ",\"open\":%s,\"members\":%zu,\"online\":%zu,\"msgs\":%llu}",
+                room->is_open ? "true" : "false", room->mates.count, conns_count(&room->conns),
+                (unsigned long long)__atomic_load_n(&room->msgs, __ATOMIC_RELAXED));
+        first = false;
+    }
+    fprintf(out, "]}\n");
+}
+
+static void
+state_stats_dump(reactor_t *reactor)
+{
+    state_t *state = reactor->state;
+
+    if (!state->stats_path) {
+        pthread_rwlock_rdlock(&state->lock);
+        state_status_json(state, stderr);
+        pthread_rwlock_unlock(&state->lock);
+        return;
+    }
+
+    /* the scraper never sees a partial file */
+    char   *tmp_path = NULL;
+    FILE   *out      = NULL;
+    if (asprintf(&tmp_path, "%s.tmp", state->stats_path) < 0) {
+        tmp_path = NULL;
+        goto error;
+    }
+    if ((out = fopen(tmp_path, "w")) == NULL) {
+        goto error;
+    }
+    pthread_rwlock_rdlock(&state->lock);
+    state_status_json(state, out);
+    pthread_rwlock_unlock(&state->lock);
+    if (fclose(out) != 0) {
+        out = NULL;
+        goto error;
+    }
+    out = NULL;
+    if (rename(tmp_path, state->stats_path) < 0) {
+        goto error;
+    }
+    free(tmp_path);
+    return;
+
+error:
+    mbr_add_loge(&reactor->mbroker, "can't dump statistics to %s", state->stats_path);
+    if (out) {
+        fclose(out);
+    }
+    if (tmp_path) {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+}
+
+/**************************
+ * Snapshot
+ **************************/
+static int
+snap_idx_cmp(const void *a, const void *b)
+{
+    uint32_t ia = *(const uint32_t *)a;
+    uint32_t ib = *(const uint32_t *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+static int
+snap_save(state_t *state, msg_broker_t *broker)
+{
+    /* called under the read lock or with the reactors stopped, the registries hold still */
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    pthread_mutex_lock(&state->snap_lock);
+
+    snap_hdr_t hdr = {.magic = SNAP_MAGIC, .mates_cap = state->mates.cap};
+    uint64_t   mate_strs = 0;
+    HTAB_FOREACH(&state->mates, i) {
+        roommate_t *mate = state->mates.slots[i].val;
+        mate->snap_idx = (uint32_t)hdr.mates_cnt++;
+        mate_strs += state->mates.slots[i].key_sz + strlen(mate->passwd);
+    }
+    hdr.strs_sz = mate_strs;
+    HTAB_FOREACH(&state->rooms, i) {
+        room_t *room = state->rooms.slots[i].val;
+        hdr.rooms_cnt++;
+        hdr.links_cnt += room->mates.count;
+        hdr.strs_sz   += state->rooms.slots[i].key_sz;
+    }
+
+    /* the previous snapshot stays in place until the new one is complete */
+    char     *tmp_path = NULL;
+    FILE     *out      = NULL;
+    int       fd       = -1;
+    uint32_t *links    = NULL;
+    size_t    links_sz = 0;
+    if (asprintf(&tmp_path, "%s.XXXXXX", state->snap_path) < 0) {
+        tmp_path = NULL;
+        goto error;
+    }
+    if ((fd = mkstemp(tmp_path)) < 0 || (out = fdopen(fd, "w")) == NULL) {
+        goto error;
+    }
+    fd = -1;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    uint64_t str = 0;
+    HTAB_FOREACH(&state->mates, i) {
+        roommate_t *mate  = state->mates.slots[i].val;
+        snap_mate_t smate = {
+            .str       = str,
+            .hash      = state->mates.slots[i].hash,
+            .name_sz   = state->mates.slots[i].key_sz,
+            .passwd_sz = (uint16_t)strlen(mate->passwd)
+        };
+        str += smate.name_sz + smate.passwd_sz;
+        fwrite(&smate, sizeof(smate), 1, out);
+    }
+    HTAB_FOREACH(&state->rooms, i) {
+        room_t     *room  = state->rooms.slots[i].val;
+        snap_room_t sroom = {
+            .str       = str,
+            .hash      = state->rooms.slots[i].hash,
+            .mates_cnt = (uint32_t)room->mates.count,
+            .name_sz   = state->rooms.slots[i].key_sz,
+            .flags     = room->is_open ? SNAP_ROOM_OPEN : 0
+        };
+        str += sroom.name_sz;
+        fwrite(&sroom, sizeof(sroom), 1, out);
+    }
+    /* members in the order of the mates, the load walks the mates forward */
+    HTAB_FOREACH(&state->rooms, i) {
+        room_t *room = state->rooms.slots[i].val;
+        if (room->mates.count > links_sz) {
+            uint32_t *tmp = realloc(links, room->mates.count * sizeof(uint32_t));
+            if (!tmp) {
+                goto error;
+            }
+            links    = tmp;
+            links_sz = room->mates.count;
+        }
+        size_t links_cn = 0;
+        PSET_FOREACH(&room->mates, j) {
+            links[links_cn++] = ((roommate_t *)room->mates.slots[j])->snap_idx;
+        }
+        qsort(links, links_cn, sizeof(uint32_t), snap_idx_cmp);
+        fwrite(links, sizeof(uint32_t), links_cn, out);
+    }
+    if (hdr.links_cnt % 2) {
+        uint32_t pad = 0;
+        fwrite(&pad, sizeof(pad), 1, out);
+    }
+    HTAB_FOREACH(&state->mates, i) {
+        roommate_t *mate = state->mates.slots[i].val;
+        fwrite(mate->name, 1, state->mates.slots[i].key_sz, out);
+        fwrite(mate->passwd, 1, strlen(mate->passwd), out);
+    }
+    HTAB_FOREACH(&state->rooms, i) {
+        fwrite(((room_t *)state->rooms.slots[i].val)->name, 1, state->rooms.slots[i].key_sz, out);
+    }
+
+    if (fflush(out) != 0 || ferror(out) || fsync(fileno(out)) < 0) {
+        goto error;
+    }
+    if (fclose(out) != 0) {
+        out = NULL;
+        goto error;
+    }
+    out = NULL;
+    if (rename(tmp_path, state->snap_path) < 0) {
+        goto error;
+    }
+    pthread_mutex_unlock(&state->snap_lock);
+    free(tmp_path);
+    free(links);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    mbr_add_logi(broker, "snapshot %s: %llu room mates, %llu rooms, %.1f ms", state->snap_path,
+            (unsigned long long)hdr.mates_cnt, (unsigned long long)hdr.rooms_cnt,
+            (ts1.tv_sec - ts0.tv_sec) * 1e3 + (ts1.tv_nsec - ts0.tv_nsec) / 1e6);
+    return 0;
+
+error:
+    mbr_add_loge(broker, "can't write snapshot %s: %s", state->snap_path, strerror(errno));
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (out) {
+        fclose(out);
+    }
+    if (tmp_path) {
+        unlink(tmp_path);
+    }
+    pthread_mutex_unlock(&state->snap_lock);
+    free(tmp_path);
+    free(links);
+    return -1;
+}
+
+static int
+snap_load(state_t *state)
+{
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+    struct stat st;
+    int         fd = open(state->snap_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        /* the first start, the registries come from the options */
+        return 1;
+    }
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        mbr_add_loge(&state->mbroker, "can't open snapshot %s: %s", state->snap_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t size = st.st_size;
+    char  *map  = size >= sizeof(snap_hdr_t) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        mbr_add_loge(&state->mbroker, "can't map snapshot %s", state->snap_path);
+        return -1;
+    }
+
+    /* every count and offset is checked against the file before it is followed */
+    snap_hdr_t *hdr = (snap_hdr_t *)map;
+    int         rc  = -1;
+    if (hdr->magic != SNAP_MAGIC || hdr->mates_cnt > size || hdr->rooms_cnt > size
+        || hdr->links_cnt > size || hdr->strs_sz > size || hdr->mates_cap > 4 * hdr->mates_cnt + 16) {
+        goto finalize;
+    }
+    size_t mates_off = sizeof(snap_hdr_t);
+    size_t rooms_off = mates_off + hdr->mates_cnt * sizeof(snap_mate_t);
+    size_t links_off = rooms_off + hdr->rooms_cnt * sizeof(snap_room_t);
+    size_t strs_off  = links_off + (hdr->links_cnt + hdr->links_cnt % 2) * sizeof(uint32_t);
+    if (strs_off + hdr->strs_sz != size) {
+        goto finalize;
+    }
+    snap_mate_t *smates = (snap_mate_t *)(map + mates_off);
+    snap_room_t *srooms = (snap_room_t *)(map + rooms_off);
+    uint32_t    *links  = (uint32_t *)(map + links_off);
+    const char  *strs   = map + strs_off;
+
+    /* the mates and their strings take one block, the table gets the size it had,
+     * so the mates written in its slot order are put in place one after another */
+    roommate_t *mates = calloc(1, hdr->mates_cnt * (sizeof(roommate_t) + 2) + hdr->strs_sz + 1);
+    size_t      need  = state->mates.count + hdr->mates_cnt;
+    if (!mates || htab_reserve(&state->mates, need > hdr->mates_cap * 3 / 4 ? need : hdr->mates_cap * 3 / 4) < 0
+        || htab_reserve(&state->rooms, state->rooms.count + hdr->rooms_cnt) < 0) {
+        free(mates);
+        goto finalize;
+    }
+    free(state->snap_slab);
+    state->snap_slab = mates;
+
+    char *str = (char *)(mates + hdr->mates_cnt);
+    for (size_t i = 0; i < hdr->mates_cnt; i++) {
+        snap_mate_t *smate = &smates[i];
+        if (!smate->name_sz || !smate->passwd_sz || smate->str > hdr->strs_sz
+            || hdr->strs_sz - smate->str < (size_t)smate->name_sz + smate->passwd_sz) {
+            goto finalize;
+        }
+        roommate_t *mate = &mates[i];
+        mate->is_slab = true;
+        mate->name    = str;
+        memcpy(str, strs + smate->str, smate->name_sz);
+        str += smate->name_sz + 1;
+        mate->passwd  = str;
+        memcpy(str, strs + smate->str + smate->name_sz, smate->passwd_sz);
+        str += smate->passwd_sz + 1;
+        if (htab_insert_hashed(&state->mates, smate->hash, mate->name, smate->name_sz, mate) != 0) {
+            /* a repeated name is a damaged file as well */
+            goto finalize;
+        }
+    }
+    for (size_t i = 0, link = 0; i < hdr->rooms_cnt; i++) {
+        snap_room_t *sroom = &srooms[i];
+        if (sroom->str > hdr->strs_sz || hdr->strs_sz - sroom->str < sroom->name_sz
+            || hdr->links_cnt - link < sroom->mates_cnt) {
+            goto finalize;
+        }
+        room_t *room = room_take(&state->rooms, sroom->hash, strs + sroom->str, sroom->name_sz);
+        if (!room || pset_reserve(&room->mates, room->mates.count + sroom->mates_cnt) < 0) {
+            goto finalize;
+        }
+        room->is_open = sroom->flags & SNAP_ROOM_OPEN;
+        for (uint32_t j = 0; j < sroom->mates_cnt; j++, link++) {
+            if (links[link] >= hdr->mates_cnt) {
+                goto finalize;
+            }
+            roommate_t *mate = &mates[links[link]];
+            if (pset_add(&room->mates, mate) < 0 || pset_add(&mate->rooms, room) < 0) {
+                pset_del(&room->mates, mate);
+                goto finalize;
+            }
+        }
+    }
+    rc = 0;
+
+finalize:
+    if (rc < 0) {
+        mbr_add_loge(&state->mbroker, "snapshot %s is damaged or out of memory", state->snap_path);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &ts1);
+        mbr_add_logi(&state->mbroker, "snapshot %s: %llu room mates, %llu rooms, %.1f ms", state->snap_path,
+                (unsigned long long)hdr->mates_cnt, (unsigned long long)hdr->rooms_cnt,
+                (ts1.tv_sec - ts0.tv_sec) * 1e3 + (ts1.tv_nsec - ts0.tv_nsec) / 1e6);
+    }
+    munmap(map, size);
+    return rc;
+}
+
+/**************************
+ * Network communication
+ **************************/
+
+volatile sig_atomic_t signal_quit_flag;
+
+void signal_quit_handler(int signum)
+{
+    signal_quit_flag = signum;
+}
+
+volatile sig_atomic_t signal_stats_flag;
+
+void signal_stats_handler(int signum)
+{
+    signal_stats_flag = signum;
+}
+
+static void
+conn_enqueue(msg_broker_t *broker, conn_t *conn, msg_t *msg)
+{
+    if ((msg->hdr.ops & MSG_CHUNK) && conn->proto < MSG_PROTO_STREAM) {
+        /* the base protocol can't take a chunk, the streamed payload is not for it */
+        return;
+    }
+    state_t *state = conn->reactor->state;
+    if (conn->codec && msg->hdr.len >= state->zip_min && !(msg->hdr.ops & MSG_ZIP)) {
+        /* the twin is shared by every connection with the codec */
+        msg = mbr_zip(conn->reactor, msg);
+    }
+    if (!conn_out_admit(broker, conn, msg)) {
+        return;
+    }
+    msgp_t *msgp = mbr_msgp_get(msg);
+    if (!msgp) {
+        return;
+    }
+    CIRCLEQ_INSERT_TAIL(&conn->mpl_out, msgp, cq_entry);
+    conn->out_bytes += sizeof(msg->hdr) + msg->hdr.len;
+    REACTOR_STAT_ADD(conn->reactor, queued, sizeof(msg->hdr) + msg->hdr.len);
+    if (!conn->is_pending) {
+        LIST_INSERT_HEAD(&broker->cl_pending, conn, lentry_pending);
+        conn->is_pending = true;
+    }
+}
+
+static bool
+conn_out_admit(msg_broker_t *broker, conn_t *conn, msg_t *msg)
+{
+    reactor_t        *reactor  = conn->reactor;
+    state_t          *state    = reactor->state;
+    size_t            frame_sz = sizeof(msg->hdr) + msg->hdr.len;
+    size_t            limit;
+    conn_out_policy_t policy;
+
+    /* a connection on its way out takes its notice only */
+    if (conn->is_finishing) {
+        return msg->hdr.ops & MSG_NET_FIN;
+    }
+    if (state->out_limit && conn->out_bytes + frame_sz > state->out_limit) {
+        limit  = state->out_limit;
+        policy = state->out_policy;
+    } else if (reactor->mem_over && conn->out_bytes + frame_sz > CONN_OUT_SLOW) {
+        /* over the watermark the slow connections pay, the healthy ones keep short queues */
+        limit  = CONN_OUT_SLOW;
+        policy = state->mem_policy;
+    } else {
+        return true;
+    }
+
+    switch (policy) {
+    case CONN_OUT_DROP_OLDEST:
+        REACTOR_STAT_ADD(reactor, drops_oldest, conn_out_drop(conn, limit > frame_sz ? limit - frame_sz : 0));
+        return true;
+    case CONN_OUT_DROP_CHAT:
+        if (MSG_TYP_MASK(msg->hdr.ops) == MSG_TYP_CM) {
+            REACTOR_STAT_ADD(reactor, drops_chat, 1);
+            return false;
+        }
+        return true;
+    case CONN_OUT_DISCONNECT:
+    default:
+        conn_out_fin(broker, conn, limit);
+        return false;
+    }
+}
+
+static size_t
+conn_out_drop(conn_t *conn, size_t keep)
+{
+    reactor_t *reactor = conn->reactor;
+    size_t     busy    = conn->cursor_out;
+    size_t     skip    = 0;
+    size_t     dropped = 0;
+    msgp_t    *msgp    = CIRCLEQ_FIRST(&conn->mpl_out);
+
+    /* a frame being written stays, an io_uring writev holds its whole gather */
+    if (reactor->uring && conn->is_epout) {
+        busy += conn->gather_out;
+    }
+    while (msgp != (void *)&conn->mpl_out && conn->out_bytes > keep) {
+        msgp_t *next     = CIRCLEQ_NEXT(msgp, cq_entry);
+        size_t  frame_sz = sizeof(msgp->msg->hdr) + msgp->msg->hdr.len;
+        if (skip < busy) {
+            skip += frame_sz;
+            msgp  = next;
+            continue;
+        }
+        if (conn->replay && msgp == conn->replay->anchor) {
+            /* the history goes right after it */
+            break;
+        }
+        CIRCLEQ_REMOVE(&conn->mpl_out, msgp, cq_entry);
+        conn->out_bytes -= frame_sz;
+        REACTOR_STAT_SUB(reactor, queued, frame_sz);
+        mbr_msgp_put(msgp);
+        dropped++;
+        msgp = next;
+    }
+    return dropped;
+}
+
+static void
+conn_out_fin(msg_broker_t *broker, conn_t *conn, size_t limit)
+{
+    reactor_t *reactor = conn->reactor;
+
+    /* the queue goes for a notice, the connection is closed once it is written */
+    conn_out_drop(conn, 0);
+    conn->is_finishing = true;
+    conn_fin_deadline(reactor, conn);
+    REACTOR_STAT_ADD(reactor, kicks, 1);
+    mbr_add_logi(&reactor->mbroker, "connection %d output is over %zu bytes, disconnected", conn->fd, limit);
+
+    msg_t *msg = pool_get(&pools[POOL_MSG]);
+    if (!msg) {
+        return;
+    }
+    *msg = (msg_t){.hdr.ops = MSG_TYP_SE | MSG_WID_AC | MSG_NET_FIN, .commit = true, .is_routed = true, .refs = 1};
+    msg_add_fmt(msg, "output queue is over %zu bytes, disconnected", limit);
+    conn_enqueue(broker, conn, msg);
+    mbr_unref(msg);
+}
+
+static int
+conn_gather(conn_t *conn, struct iovec *iov, size_t *expected)
+{
+    int     iovcnt = 0;
+    size_t  cursor = conn->cursor_out;
+    bool    fin    = false;
+    msgp_t *msgp;
+
+    /* gather queued frames into one writev, the first one resumes from cursor_out */
+    conn->gather_out = 0;
+    CIRCLEQ_FOREACH(msgp, &conn->mpl_out, cq_entry) {
+        if (iovcnt + 2 > CONN_IOV_MAX) {
+            break;
+        }
+        int cnt = msg_io_iov(msgp->msg, cursor, &iov[iovcnt]);
+        for (int i = 0; i < cnt; i++) {
+            conn->gather_out += iov[iovcnt + i].iov_len;
+        }
+        iovcnt += cnt;
+        cursor = 0;
+        if (msgp->msg->hdr.ops & MSG_NET_FIN) {
+            /* nothing goes after the final message */
+            fin = true;
+            break;
+        }
+        if (conn->replay && msgp == conn->replay->anchor) {
+            /* the history goes next */
+            break;
+        }
+    }
+
+    /* frames of a large room follow right from its ring */
+    *expected = conn->gather_out;
+    if (!fin && !conn->replay && !conn->is_finishing) {
+        size_t gather_bcast = 0;
+        int    cnt          = conn_gather_bcast(conn, &iov[iovcnt], CONN_IOV_MAX - iovcnt, &gather_bcast);
+        if (cnt < 0) {
+            return -1;
+        }
+        iovcnt    += cnt;
+        *expected += gather_bcast;
+    }
+    return iovcnt;
+}
+
+static bool
+conn_bcast_skips(conn_t *conn, room_bcast_rec_t *rec)
+{
+    /* own frames, the chunks a base protocol connection can't take and the twin it doesn't read */
+    if (rec->origin == (uintptr_t)conn || ((rec->hdr.ops & MSG_CHUNK) && conn->proto < MSG_PROTO_STREAM)) {
+        return true;
+    }
+    return conn->codec ? (rec->flags & ROOM_BCAST_REC_TWINNED) : (rec->hdr.ops & MSG_ZIP);
+}
+
+static int
+conn_gather_bcast(conn_t *conn, struct iovec *iov, int iovmax, size_t *expected)
+{
+    room_bcast_t *want   = conn->room ? conn->room->bcast : NULL;
+    int           iovcnt = 0;
+
+    /* the ring of the entered room takes over, the cursor is always on a record */
+    if (conn->bcast != want) {
+        conn->bcast     = want;
+        conn->bcast_pos = conn->bcast_join;
+        conn->bcast_seq = conn->bcast_join_seq;
+    }
+    room_bcast_t *bcast = conn->bcast;
+    if (!bcast) {
+        return 0;
+    }
+
+    /* a reader further behind than the lag is moved before anything of it goes out,
+     * the appends wait for conn_flush, so the head doesn't move during the gather */
+    uint64_t head = __atomic_load_n(&bcast->head, __ATOMIC_ACQUIRE);
+    while (head - conn->bcast_pos > ROOM_BCAST_LAG(bcast)) {
+        if (conn_bcast_lag(conn->reactor, conn) < 0) {
+            return -1;
+        }
+        head = __atomic_load_n(&bcast->head, __ATOMIC_ACQUIRE);
+    }
+    uint64_t pos = conn->bcast_pos;
+    while (pos != head && iovcnt + 2 <= iovmax) {
+        room_bcast_rec_t rec;
+        room_bcast_peek(bcast, pos, &rec);
+        size_t rec_sz = sizeof(rec) + rec.hdr.len;
+
+        if (conn_bcast_skips(conn, &rec)) {
+            /* skipped frames in front are passed right away, the others by conn_advance_bcast */
+            if (!iovcnt) {
+                conn->bcast_pos = pos + rec_sz;
+                conn->bcast_seq += !(rec.hdr.ops & MSG_ZIP);
+            }
+            pos += rec_sz;
+            continue;
+        }
+        size_t frame_sz = sizeof(rec.hdr) + rec.hdr.len;
+        iovcnt    += room_bcast_iov(bcast, pos + offsetof(room_bcast_rec_t, hdr), frame_sz, &iov[iovcnt]);
+        *expected += frame_sz;
+        pos       += rec_sz;
+    }
+    return iovcnt;
+}
+
+static int
+conn_advance_bcast(conn_t *conn, size_t sent)
+{
+    room_bcast_t *bcast = conn->bcast;
+    if (!bcast || !sent) {
+        return 0;
+    }
+
+    while (sent) {
+        room_bcast_rec_t rec;
+        room_bcast_peek(bcast, conn->bcast_pos, &rec);
+        size_t rec_sz   = sizeof(rec) + rec.hdr.len;
+        size_t frame_sz = sizeof(rec.hdr) + rec.hdr.len;
+
+        if (!conn_bcast_skips(conn, &rec) && sent < frame_sz) {
+            /* the rest of a partially written frame leaves the ring, which may be
+             * overwritten before the socket takes more */
+            msg_t *msg = pool_get(&pools[POOL_MSG]);
+            if (!msg) {
+                return -1;
+            }
+            *msg = (msg_t){.hdr = rec.hdr, .commit = true, .is_routed = true, .refs = 1};
+            if (msg->hdr.len && !(msg->data = malloc(msg->data_sz = msg->hdr.len))) {
+                pool_put(&pools[POOL_MSG], msg);
+                return -1;
+            }
+            room_bcast_read(bcast, conn->bcast_pos + sizeof(rec), msg->data, msg->hdr.len);
+
+            msgp_t *msgp = mbr_msgp_get(msg);
+            mbr_unref(msg);
+            if (!msgp) {
+                return -1;
+            }
+            CIRCLEQ_INSERT_HEAD(&conn->mpl_out, msgp, cq_entry);
+            conn->cursor_out = sent;
+            conn->out_bytes += frame_sz - sent;
+            REACTOR_STAT_ADD(conn->reactor, queued, frame_sz - sent);
+            sent = 0;
+        } else if (!conn_bcast_skips(conn, &rec)) {
+            sent -= frame_sz;
+        }
+        conn->bcast_pos += rec_sz;
+        conn->bcast_seq += !(rec.hdr.ops & MSG_ZIP);
+    }
+    return 0;
+}
+
+static int
+conn_advance(conn_t *conn, size_t sent)
+{
+    /* mpl_out goes first in the gather, the ring takes the rest */
+    size_t sent_out   = sent < conn->gather_out ? sent : conn->gather_out;
+    size_t sent_bcast = sent - sent_out;
+
+    REACTOR_STAT_ADD(conn->reactor, bytes_out, sent);
+    REACTOR_STAT_SUB(conn->reactor, queued, sent_out);
+    conn->out_bytes -= sent_out;
+
+    /* drop completely sent frames, keep the position inside the partial one */
+    size_t written = conn->cursor_out + sent_out;
+    while (!CIRCLEQ_EMPTY(&conn->mpl_out)) {
+        msgp_t *msgp = CIRCLEQ_FIRST(&conn->mpl_out);
+        size_t frame_sz = sizeof(msgp->msg->hdr) + msgp->msg->hdr.len;
+        if (written < frame_sz) {
+            break;
+        }
+        written -= frame_sz;
+        bool fin = msgp->msg->hdr.ops & MSG_NET_FIN;
+        if (conn->replay && msgp == conn->replay->anchor) {
+            conn->replay->anchor = NULL;
+        }
+
+        CIRCLEQ_REMOVE(&conn->mpl_out, msgp, cq_entry);
+        mbr_msgp_put(msgp);
+        if (fin) {
+            conn->cursor_out = 0;
+            return MSG_IO_DOWN;
+        }
+    }
+    conn->cursor_out = written;
+
+    if (conn_advance_bcast(conn, sent_bcast) < 0) {
+        return MSG_IO_ERR;
+    }
+    return MSG_IO_OK;
+}
+
+static bool
+conn_has_output(conn_t *conn)
+{
+    room_bcast_t *want = conn->room ? conn->room->bcast : NULL;
+
+    if (!CIRCLEQ_EMPTY(&conn->mpl_out) || conn->bcast != want || conn->replay) {
+        return true;
+    }
+    return want && conn->bcast_pos != __atomic_load_n(&want->head, __ATOMIC_ACQUIRE);
+}
+
+static int
+conn_bcast_lag(reactor_t *reactor, conn_t *conn)
+{
+    room_bcast_t *bcast = conn->bcast;
+
+    /* a reader of the ring of its room is moved at a record boundary */
+    if (!bcast || !conn->room || bcast != conn->room->bcast) {
+        return 0;
+    }
+    if (__atomic_load_n(&bcast->head, __ATOMIC_ACQUIRE) - conn->bcast_pos <= ROOM_BCAST_LAG(bcast)) {
+        return 0;
+    }
+
+    room_bcast_policy_t policy = reactor->state->bcast_lag;
+    if (policy == ROOM_BCAST_DISCONNECT) {
+        mbr_add_logi(&reactor->mbroker, "connection %d fell behind room %s, disconnected", conn->fd, conn->room->name);
+        return -1;
+    }
+    /* conn_flush holds the ring, the head and the count agree */
+    uint64_t head = bcast->head;
+    uint64_t seq  = bcast->seq;
+
+    uint64_t skipped = seq - conn->bcast_seq;
+    conn->bcast_pos = head;
+    conn->bcast_seq = seq;
+    if (policy == ROOM_BCAST_RESYNC) {
+        mbr_add_reply(&reactor->mbroker, conn, MSG_TYP_SI, "skipped %llu messages of room %s",
+                (unsigned long long)skipped, conn->room->name);
+    }
+    return 0;
+}
+
+static int
+conn_flush(conn_t *conn)
+{
+    struct iovec iov[CONN_IOV_MAX];
+
+    conn_listing(conn->reactor, conn);
+    while (conn_has_output(conn)) {
+        int rrc = conn_replay(conn->reactor, conn);
+        if (rrc != MSG_IO_OK) {
+            return rrc;
+        }
+        if (!conn_has_output(conn)) {
+            break;
+        }
+
+        /* the frames of the ring stay until the write is accounted, the appends wait */
+        room_bcast_t *bcast = conn->room ? conn->room->bcast : NULL;
+        bool          idle  = false;
+        if (bcast) {
+            pthread_rwlock_rdlock(&bcast->lock);
+        }
+        int rc = conn_write(conn, iov, &idle);
+        if (bcast) {
+            pthread_rwlock_unlock(&bcast->lock);
+        }
+        if (rc != MSG_IO_OK) {
+            return rc;
+        }
+        if (idle) {
+            /* nothing but own frames of the room were left */
+            break;
+        }
+    }
+    /* the rest of a listing goes on the next turn, after the other connections */
+    return conn->listing ? MSG_IO_AGAIN : MSG_IO_OK;
+}
+
+static int
+conn_write(conn_t *conn, struct iovec *iov, bool *idle)
+{
+    size_t  expected;
+    int     iovcnt = conn_gather(conn, iov, &expected);
+    if (iovcnt < 0) {
+        /* fell behind the ring of its room and the policy disconnects */
+        return MSG_IO_ERR;
+    }
+    ssize_t rc = iovcnt ? writev(conn->fd, iov, iovcnt) : 0;
+    if (rc < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? MSG_IO_AGAIN : MSG_IO_ERR;
+    }
+    int arc = conn_advance(conn, rc);
+    if (arc != MSG_IO_OK) {
+        return arc;
+    }
+    *idle = !iovcnt;
+    return (size_t)rc < expected ? MSG_IO_AGAIN : MSG_IO_OK;
+}
+
+static int
+conn_replay(reactor_t *reactor, conn_t *conn)
+{
+    journal_replay_t *replay = conn->replay;
+
+    /* the output queued before the request goes first */
+    if (!replay || replay->anchor) {
+        return MSG_IO_OK;
+    }
+
+    /* frames of a room window, all of them in one write unless the socket is full */
+    while (replay->buf && replay->off < replay->len) {
+        ssize_t rc = write(conn->fd, replay->buf + replay->off, replay->len - replay->off);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? MSG_IO_AGAIN : MSG_IO_ERR;
+        }
+        REACTOR_STAT_ADD(reactor, bytes_out, rc);
+        replay->off += rc;
+    }
+    if (replay->buf) {
+        journal_replay_free(conn);
+        return MSG_IO_OK;
+    }
+
+    /* straight from the segment files, the page cache holds what the mappings wrote */
+    for (;;) {
+        journal_t     *journal = replay->journal;
+        journal_seg_t *next    = NULL;
+
+        pthread_mutex_lock(&journal->lock);
+        bool   last = replay->seg->no == replay->stop_no;
+        size_t end  = last ? replay->stop_off : replay->seg->end;
+        if (replay->off >= end && !last) {
+            /* retention may drop the segment being sent, the oldest kept one goes on then */
+            next = replay->seg->is_dropped ? TAILQ_FIRST(&journal->segs) : TAILQ_NEXT(replay->seg, tq_entry);
+            if (next) {
+                __atomic_add_fetch(&next->refs, 1, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&journal->lock);
+
+        if (replay->off < end) {
+            off_t   off = replay->off;
+            ssize_t rc  = sendfile(conn->fd, replay->seg->fd, &off, end - replay->off);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc < 0) {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? MSG_IO_AGAIN : MSG_IO_ERR;
+            }
+            REACTOR_STAT_ADD(reactor, bytes_out, rc);
+            replay->off = off;
+            if (rc > 0) {
+                continue;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        journal_seg_unref(replay->seg);
+        replay->seg = next;
+        replay->off = JOURNAL_DATA_OFF;
+    }
+    journal_replay_free(conn);
+    return MSG_IO_OK;
+}
+
+static int
+conn_listing_start(conn_t *conn, status_text_t **texts, int texts_cnt)
+{
+    status_listing_t *listing = calloc(1, sizeof(status_listing_t));
+    if (!listing) {
+        for (int i = 0; i < texts_cnt; i++) {
+            state_status_unref(texts[i]);
+        }
+        return -1;
+    }
+    for (int i = 0; i < texts_cnt; i++) {
+        listing->texts[i] = texts[i];
+    }
+    listing->texts_cnt = texts_cnt;
+    conn->listing = listing;
+    return 0;
+}
+
+static void
+conn_listing_free(conn_t *conn)
+{
+    status_listing_t *listing = conn->listing;
+    if (listing) {
+        for (int i = 0; i < listing->texts_cnt; i++) {
+            state_status_unref(listing->texts[i]);
+        }
+        free(listing);
+        conn->listing = NULL;
+    }
+}
+
+static void
+conn_listing(reactor_t *reactor, conn_t *conn)
+{
+    status_listing_t *listing = conn->listing;
+
+    /* one page per turn, queued once the output before it is mostly gone */
+    if (!listing || conn->out_bytes >= STATUS_PAGE_SZ) {
+        return;
+    }
+    status_text_t *text = listing->texts[listing->cur];
+    const char    *page = text->buf + listing->off;
+    size_t         size = text->len - listing->off;
+    if (size > STATUS_PAGE_SZ) {
+        /* a page ends on a line, the client prints them one after another */
+        const char *eol = memrchr(page, '\n', STATUS_PAGE_SZ);
+        size = eol ? (size_t)(eol - page) + 1 : STATUS_PAGE_SZ;
+    }
+    if (size && mbr_add_reply(&reactor->mbroker, conn, MSG_TYP_SI, "%.*s", (int)size, page) < 0) {
+        conn_listing_free(conn);
+        return;
+    }
+
+    listing->off += size;
+    if (listing->off == text->len) {
+        listing->off = 0;
+        if (++listing->cur == listing->texts_cnt) {
+            conn_listing_free(conn);
+        }
+    }
+}
+
+static int
+srv_conn_output(reactor_t *reactor, conn_t *conn)
+{
+    if (reactor->uring) {
+        return uring_conn_output(reactor, conn);
+    }
+    int rc = conn_flush(conn);
+    if (rc == MSG_IO_ERR || rc == MSG_IO_DOWN) {
+        conn_close(reactor, conn);
+        return rc;
+    }
+
+    /* wait for EPOLLOUT only while there is something left to send, an edge-triggered
+     * socket that stays writable for the rest of a listing gives no event without a re-arm */
+    bool epout = rc == MSG_IO_AGAIN;
+    if (epout != conn->is_epout || (conn->listing && conn->ring_in.buf)) {
+        struct epoll_event epev_ctl = {
+            .events   = EPOLLIN | (epout ? EPOLLOUT : 0) | (conn->ring_in.buf ? EPOLLET : 0),
+            .data.u64 = CONN_TAB_KEY(conn)
+        };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &epev_ctl) < 0) {
+            mbr_add_loge(&reactor->mbroker, "can't modify client socket events in epoll");
+            conn_close(reactor, conn);
+            return MSG_IO_ERR;
+        }
+        conn->is_epout = epout;
+    }
+    return rc;
+}
+
+static void
+conn_close(reactor_t *reactor, conn_t *conn)
+{
+    if (!conn->is_closed) {
+        conn->is_closed = true;
+        wheel_cancel(&reactor->wheel, &conn->timer);
+        if (conn->room) {
+            conns_leave(&conn->room->conns, conn);
+        }
+        if (conn->roommate) {
+            conns_leave(&conn->roommate->conns, conn);
+        }
+        if (conn->is_adm) {
+            conns_leave(&reactor->state->admin.conns, conn);
+        }
+        if (reactor->state->sessions.window) {
+            /* the session is kept for a while to be resumed by a new connection */
+            session_close(&reactor->state->sessions, conn);
+        }
+        if (conn->codec) {
+            __atomic_sub_fetch(&reactor->state->zip_conns, 1, __ATOMIC_RELAXED);
+        }
+        if (conn->is_pending) {
+            LIST_REMOVE(conn, lentry_pending);
+            conn->is_pending = false;
+        }
+
+        /* the kernel still refers to the buffers, the last completion closes the connection */
+        if (conn->uring_ops) {
+            uring_cancel(reactor, conn->fd);
+            return;
+        }
+    } else if (conn->uring_ops) {
+        return;
+    }
+    conn_tab_del(&reactor->conns, conn);
+    REACTOR_STAT_SUB(reactor, conns, 1);
+
+    /* the unsent output leaves the queue, the partial frame was accounted up to cursor_out */
+    REACTOR_STAT_ADD(reactor, queued, conn->cursor_out);
+    while (!CIRCLEQ_EMPTY(&conn->mpl_out)) {
+        msgp_t *msgp = CIRCLEQ_FIRST(&conn->mpl_out);
+        CIRCLEQ_REMOVE(&conn->mpl_out, msgp, cq_entry);
+        REACTOR_STAT_SUB(reactor, queued, sizeof(msgp->msg->hdr) + msgp->msg->hdr.len);
+        mbr_msgp_put(msgp);
+    }
+    journal_replay_free(conn);
+    conn_listing_free(conn);
+    free(conn->msg_in.data);
+    free(conn->ring_in.buf);
+    free(conn->iov_out);
+    close(conn->fd);
+    pool_put(&pools[POOL_CONN], conn);
+}
+
+static void
+conn_fin_deadline(reactor_t *reactor, conn_t *conn)
+{
+    /* a peer which doesn't read its notice is cut off anyway */
+    conn->fin_at = reactor->wheel.now + WHEEL_TICKS(CONN_FIN_GRACE_MS);
+    wheel_arm(&reactor->wheel, &conn->timer, conn->fin_at);
+}
+
+static void
+conn_timer(reactor_t *reactor, wheel_timer_t *timer)
+{
+    conn_t  *conn  = (conn_t *)((char *)timer - offsetof(conn_t, timer));
+    state_t *state = reactor->state;
+    uint64_t now   = reactor->wheel.now;
+    uint64_t next  = UINT64_MAX;
+    uint64_t at;
+
+    if (conn->is_finishing) {
+        if (now >= conn->fin_at) {
+            mbr_add_logi(&reactor->mbroker, "connection %d didn't take its last message, closed", conn->fd);
+            conn_close(reactor, conn);
+        } else {
+            wheel_arm(&reactor->wheel, timer, conn->fin_at);
+        }
+        return;
+    }
+
+    /* the deadlines are checked when the nearest one comes, input doesn't touch the wheel */
+    if (state->login_timeout && !conn->roommate && !conn->is_adm) {
+        at = conn->born + WHEEL_TICKS(state->login_timeout * 1000);
+        if (now >= at) {
+            mbr_add_logi(&reactor->mbroker, "connection %d didn't log in within %ld seconds, disconnected",
+                    conn->fd, state->login_timeout);
+            mbr_add_reply(&reactor->mbroker, conn, MSG_TYP_SE | MSG_NET_FIN, "log in within %ld seconds", state->login_timeout);
+            conn->is_finishing = true;
+            conn_fin_deadline(reactor, conn);
+            return;
+        }
+        next = at;
+    }
+    if (state->idle_timeout) {
+        at = conn->last_in + WHEEL_TICKS(state->idle_timeout * 1000);
+        if (now >= at) {
+            mbr_add_logi(&reactor->mbroker, "connection %d is silent for %ld seconds, closed", conn->fd, state->idle_timeout);
+            conn_close(reactor, conn);
+            return;
+        }
+        next = at < next ? at : next;
+    }
+    if (state->heartbeat) {
+        /* a half-open peer fails the write of the :ping sooner or later */
+        uint64_t beat = WHEEL_TICKS(state->heartbeat * 1000);
+        at = (conn->last_in > conn->last_beat ? conn->last_in : conn->last_beat) + beat;
+        if (now >= at) {
+            mbr_add_reply(&reactor->mbroker, conn, MSG_TYP_SC, ":ping");
+            conn->last_beat = now;
+            at = now + beat;
+        }
+        next = at < next ? at : next;
+    }
+    if (next != UINT64_MAX) {
+        wheel_arm(&reactor->wheel, timer, next);
+    }
+}
+
+static conn_t *
+srv_conn_new(reactor_t *reactor, int fd, struct sockaddr_in *addr, socklen_t addr_len)
+{
+    conn_t *conn = pool_get(&pools[POOL_CONN]);
+    if (!conn) {
+        mbr_add_loge(&reactor->mbroker, "can't create new client connection");
+        close(fd);
+        return NULL;
+    }
+    CIRCLEQ_INIT(&conn->mpl_out);
+    conn->fd       = fd;
+    conn->reactor  = reactor;
+    conn->addr     = *addr;
+    conn->addr_len = addr_len;
+    conn->proto    = MSG_PROTO_BASE;
+    conn->born     = reactor->wheel.now;
+    conn->last_in  = conn->born;
+    conn->last_beat = conn->born;
+    conn->timer.cb = conn_timer;
+    if (reactor->state->edge_input || reactor->uring) {
+        conn->ring_in.buf = malloc(CONN_RING_SZ);
+        if (!conn->ring_in.buf) {
+            mbr_add_loge(&reactor->mbroker, "can't allocate input ring of new client connection");
+            goto error;
+        }
+    }
+    if (conn_tab_add(&reactor->conns, conn) < 0) {
+        mbr_add_loge(&reactor->mbroker, "can't add new connection to the reactor table");
+        goto error;
+    }
+    if (!reactor->uring) {
+        struct epoll_event epev_ctl = {
+            .events   = EPOLLIN | (conn->ring_in.buf ? EPOLLET : 0),
+            .data.u64 = CONN_TAB_KEY(conn)
+        };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &epev_ctl) < 0) {
+            mbr_add_loge(&reactor->mbroker, "can't add client socket to epoll");
+            conn_tab_del(&reactor->conns, conn);
+            goto error;
+        }
+    }
+    REACTOR_STAT_ADD(reactor, conns, 1);
+
+    /* the first run of the timer works the deadlines out */
+    wheel_arm(&reactor->wheel, &conn->timer, conn->born + 1);
+    return conn;
+
+error:
+    free(conn->ring_in.buf);
+    close(fd);
+    pool_put(&pools[POOL_CONN], conn);
+    return NULL;
+}
+
+static int
+srv_conn_accept(reactor_t *reactor)
+{
+    int accepted = 0;
+
+    /* drain the accept queue, the rest of it fires the level-triggered listen_fd again */
+    while (accepted < reactor->state->accept_burst) {
+        struct sockaddr_in addr;
+        socklen_t          addr_len = sizeof(addr);
+
+        int fd = accept4(reactor->listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                mbr_add_loge(&reactor->mbroker, "can't accept new client connection");
+            }
+            break;
+        }
+        accepted++;
+        srv_conn_new(reactor, fd, &addr, addr_len);
+    }
+    if (accepted == reactor->state->accept_burst) {
+        reactor->acc_capped++;
+    }
+    reactor_acc_count(reactor, accepted);
+    return accepted;
+}
+
+static int
+srv_conn_input(reactor_t *reactor, conn_t *conn)
+{
+    if (conn->ring_in.buf) {
+        return srv_conn_input_ring(reactor, conn);
+    }
+
+    /* level-triggered connection gets one frame per event */
+    int rc = msg_io_read(&conn->msg_in, conn->fd, &conn->cursor_in);
+    if (rc == MSG_IO_OK) {
+        conn->cursor_in = 0;
+        srv_msg_input(reactor, conn, &conn->msg_in);
+    } else if (rc != MSG_IO_AGAIN) {
+        conn_close(reactor, conn);
+    }
+    return rc;
+}
+
+static size_t
+conn_ring_reserve(conn_ring_t *ring)
+{
+    /* move the incomplete frame to the front, the ring always fits a whole one */
+    if (ring->head == ring->tail) {
+        ring->head = ring->tail = 0;
+    } else if (CONN_RING_SZ - ring->tail < sizeof(struct msg_hdr_s) + UINT16_MAX) {
+        memmove(ring->buf, ring->buf + ring->head, ring->tail - ring->head);
+        ring->tail -= ring->head;
+        ring->head  = 0;
+    }
+    return CONN_RING_SZ - ring->tail;
+}
+
+static void
+srv_conn_input_frames(reactor_t *reactor, conn_t *conn)
+{
+    conn_ring_t *ring = &conn->ring_in;
+
+    /* every complete frame is handled right from the ring */
+    while (ring->tail - ring->head >= sizeof(struct msg_hdr_s)) {
+        msg_t msg = {0};
+        memcpy(&msg.hdr, ring->buf + ring->head, sizeof(msg.hdr));
+        if (ring->tail - ring->head < sizeof(msg.hdr) + msg.hdr.len) {
+            break;
+        }
+        msg.data    = ring->buf + ring->head + sizeof(msg.hdr);
+        ring->head += sizeof(msg.hdr) + msg.hdr.len;
+        srv_msg_input(reactor, conn, &msg);
+    }
+}
+
+static int
+srv_conn_input_ring(reactor_t *reactor, conn_t *conn)
+{
+    conn_ring_t *ring = &conn->ring_in;
+    int          rc   = MSG_IO_AGAIN;
+
+    /* edge-triggered connection reads until the socket is drained */
+    while (rc == MSG_IO_AGAIN) {
+        size_t  expected = conn_ring_reserve(ring);
+        ssize_t rd       = recv(conn->fd, ring->buf + ring->tail, expected, 0);
+        if (rd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = (errno == EAGAIN || errno == EWOULDBLOCK) ? MSG_IO_OK : MSG_IO_ERR;
+            break;
+        } else if (rd == 0) {
+            rc = MSG_IO_DOWN;
+        } else if ((size_t)rd < expected) {
+            /* short read drained the socket, the next data raises a new edge */
+            rc = MSG_IO_OK;
+        }
+        ring->tail += (rd > 0 ? rd : 0);
+        srv_conn_input_frames(reactor, conn);
+    }
+
+    if (rc == MSG_IO_ERR || rc == MSG_IO_DOWN) {
+        conn_close(reactor, conn);
+    }
+    return rc;
+}
+
+static int
+srv_cmd_exec(reactor_t *reactor, conn_t *conn, msg_t *msg)
+{
+    msg_broker_t *broker = &reactor->mbroker;
+    cmd_t         cmd;
+
+    /* the arguments point into the input frame, nothing is copied */
+    if (MSG_TYP_MASK(msg->hdr.ops) == MSG_TYP_CB) {
+        if (cmd_bin_parse(msg->data ? msg->data : "", msg->hdr.len, &cmd) < 0) {
+            mbr_add_reply(broker, conn, MSG_TYP_SE, "malformed command");
+            return 0;
+        }
+    } else if (cmd_text_parse(msg->data ? msg->data : "", msg->hdr.len, &cmd) < 0) {
+        return -1;
+    }
+
+    cmd_handler_t handler = cmd_defs[cmd.op].handler;
+    if (!handler) {
+        if (cmd.name.len) {
+            mbr_add_reply(broker, conn, MSG_TYP_SE, "unknown command '%.*s'", (int)cmd.name.len, cmd.name.ptr);
+        } else {
+            mbr_add_reply(broker, conn, MSG_TYP_SE, "unknown command %d", cmd.op);
+        }
+        return 0;
+    }
+    return handler(reactor, conn, &cmd);
+}
+
+static int
+srv_cmd_logmate(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    state_t      *state  = reactor->state;
+    msg_broker_t *broker = &reactor->mbroker;
+    cmd_arg_t    *name   = &cmd->argv[0];
+    cmd_arg_t    *pass   = &cmd->argv[1];
+
+    roommate_t *tmate = cmd->argc > 0 ? htab_find(&state->mates, name->ptr, name->len) : NULL;
+    if (!tmate || cmd->argc < 2 || !cmd_arg_is(pass, tmate->passwd)) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "wrong room mate name or password");
+    } else if (conn->roommate != tmate) {
+        if (conn->roommate) {
+            conns_leave(&conn->roommate->conns, conn);
+        }
+        conn->roommate = tmate;
+        conns_join(&tmate->conns, conn);
+
+        /* the token lets a new connection take the login over with :resume */
+        char     token[SESSION_TOKEN_SZ + 1];
+        uint64_t gen = __atomic_load_n(&state->registry_gen, __ATOMIC_ACQUIRE);
+        if (state->sessions.window && session_open(&state->sessions, conn, gen, token) == 0) {
+            mbr_add_reply(broker, conn, MSG_TYP_SI, "welcome, %s, session %s", tmate->name, token);
+        } else {
+            mbr_add_reply(broker, conn, MSG_TYP_SI, "welcome, %s", tmate->name);
+        }
+    }
+    return 0;
+}
+
+static int
+srv_cmd_logadm(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    state_t      *state  = reactor->state;
+    msg_broker_t *broker = &reactor->mbroker;
+
+    if (!cmd->argc || !state->admin.passwd || !cmd_arg_is(&cmd->argv[0], state->admin.passwd)) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "wrong admin password");
+    } else if (!conn->is_adm) {
+        conn->is_adm = true;
+        conns_join(&state->admin.conns, conn);
+        mbr_add_reply(broker, conn, MSG_TYP_SI, "welcome, admin");
+    }
+    return 0;
+}
+
+static int
+srv_cmd_enter(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    state_t      *state  = reactor->state;
+    msg_broker_t *broker = &reactor->mbroker;
+    cmd_arg_t    *name   = &cmd->argv[0];
+
+    room_t *troom = cmd->argc ? htab_find(&state->rooms, name->ptr, name->len) : NULL;
+    if (!conn->roommate) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "log in as a room mate first");
+    } else if (!troom) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "room '%.*s' does not exist", (int)name->len, cmd->argc ? name->ptr : "");
+    } else if (!troom->is_open && !pset_has(&troom->mates, conn->roommate)) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "room '%s' is closed for %s", troom->name, conn->roommate->name);
+    } else if (conn->room != troom) {
+        if (conn->room) {
+            conns_leave(&conn->room->conns, conn);
+        }
+        conn->room = troom;
+        conns_join(&troom->conns, conn);
+        room_bcast_join(troom->bcast, conn);
+        if (troom->window) {
+            /* the client counts the chat frames of the room from here, its own ones included */
+            session_enter(&state->sessions, conn);
+            mbr_add_reply(broker, conn, MSG_TYP_SI, "entered %s at %llu",
+                    troom->name, (unsigned long long)room_window_seq(troom->window));
+        } else {
+            mbr_add_reply(broker, conn, MSG_TYP_SI, "entered %s", troom->name);
+        }
+    }
+    return 0;
+}
+
+static int
+srv_cmd_resume(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    state_t      *state  = reactor->state;
+    msg_broker_t *broker = &reactor->mbroker;
+    cmd_arg_t    *token  = &cmd->argv[0];
+    uint64_t      gen    = __atomic_load_n(&state->registry_gen, __ATOMIC_ACQUIRE);
+    uint64_t      seq    = 0;
+    roommate_t   *tmate  = NULL;
+    room_t       *troom  = NULL;
+
+    if (!state->sessions.window) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "sessions are not kept");
+    } else if (cmd->argc < 2 || cmd_arg_num(&cmd->argv[1], &seq) < 0) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "resume needs a session token and a message number");
+    } else if (conn->roommate || conn->is_adm) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "logged in already");
+    } else if (session_take(&state->sessions, conn, token->ptr, token->len, gen, &tmate, &troom) < 0) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "session '%.*s' is unknown or expired", (int)token->len, token->ptr);
+    } else if (!troom) {
+        conn->roommate = tmate;
+        conns_join(&tmate->conns, conn);
+        mbr_add_reply(broker, conn, MSG_TYP_SI, "welcome back, %s", tmate->name);
+    } else {
+        conn->roommate = tmate;
+        conns_join(&tmate->conns, conn);
+        conn->room = troom;
+        conns_join(&troom->conns, conn);
+        room_bcast_join(troom->bcast, conn);
+
+        /* taken after the join, a frame routed meanwhile may come twice but none goes missing */
+        journal_replay_t *replay = calloc(1, sizeof(journal_replay_t));
+        uint64_t          lost   = 0;
+        int               count  = replay && troom->window
+                                 ? room_window_copy(troom->window, &seq, &lost, &replay->buf, &replay->len) : -1;
+        if (count < 0) {
+            free(replay);
+            mbr_add_reply(broker, conn, MSG_TYP_SI, "welcome back, %s", tmate->name);
+            mbr_add_reply(broker, conn, MSG_TYP_SE, "can't resend the missed messages of room %s", troom->name);
+            return 0;
+        }
+        mbr_add_reply(broker, conn, MSG_TYP_SI, "welcome back, %s, room %s at %llu: %d missed messages, %llu lost",
+                tmate->name, troom->name, (unsigned long long)seq, count, (unsigned long long)lost);
+        if (!count) {
+            free(replay);
+            return 0;
+        }
+        /* the missed frames go right after the notice, like the history */
+        conn->replay = replay;
+        conn->replay->anchor = CIRCLEQ_EMPTY(&conn->mpl_out) ? NULL : CIRCLEQ_LAST(&conn->mpl_out);
+    }
+    return 0;
+}
+
+static int
+srv_cmd_history(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    msg_broker_t *broker  = &reactor->mbroker;
+    cmd_arg_t    *since   = cmd->argc ? &cmd->argv[0] : NULL;
+    journal_t    *journal = conn->room ? conn->room->journal : NULL;
+    uint64_t      seq     = 0;
+    uint64_t      ts      = 0;
+    uint64_t      count   = 0;
+    int           rc      = 0;
+
+    /* messages since a sequence number, or since a unix time after '@' */
+    if (since && since->len && since->ptr[0] == '@') {
+        cmd_arg_t secs = {.ptr = since->ptr + 1, .len = since->len - 1};
+        rc  = cmd_arg_num(&secs, &ts);
+        ts *= 1000000000ULL;
+    } else if (since) {
+        rc  = cmd_arg_num(since, &seq);
+    }
+    if (!conn->room) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "enter a room first");
+    } else if (!journal) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "room '%s' keeps no history", conn->room->name);
+    } else if (!since) {
+        pthread_mutex_lock(&journal->lock);
+        uint64_t first = TAILQ_EMPTY(&journal->segs) ? journal->seq : TAILQ_FIRST(&journal->segs)->first_seq;
+        uint64_t next  = journal->seq;
+        pthread_mutex_unlock(&journal->lock);
+        if (first == next) {
+            mbr_add_reply(broker, conn, MSG_TYP_SI, "room %s keeps no messages", conn->room->name);
+        } else {
+            mbr_add_reply(broker, conn, MSG_TYP_SI, "room %s keeps messages %llu..%llu",
+                    conn->room->name, (unsigned long long)first, (unsigned long long)next - 1);
+        }
+    } else if (rc < 0) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "unexpected history start '%.*s'", (int)since->len, since->ptr);
+    } else if (conn->replay) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "history is being sent already");
+    } else if (journal_replay_start(journal, conn, &seq, ts, &count) < 0) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "can't send history of room '%s'", conn->room->name);
+    } else if (!count) {
+        mbr_add_reply(broker, conn, MSG_TYP_SI, "no messages of room %s since %.*s",
+                conn->room->name, (int)since->len, since->ptr);
+    } else {
+        /* the notice marks where the history goes into the output */
+        mbr_add_reply(broker, conn, MSG_TYP_SI, "history of room %s: %llu messages from %llu",
+                conn->room->name, (unsigned long long)count, (unsigned long long)seq);
+        conn->replay->anchor = CIRCLEQ_EMPTY(&conn->mpl_out) ? NULL : CIRCLEQ_LAST(&conn->mpl_out);
+    }
+    return 0;
+}
+
+static int
+srv_cmd_proto(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    msg_broker_t *broker  = &reactor->mbroker;
+    cmd_arg_t    *version = &cmd->argv[0];
+    uint64_t      proto   = 0;
+
+    /* the highest protocol both sides speak, the client knows what it got from the reply */
+    if (!cmd->argc || cmd_arg_num(version, &proto) < 0 || proto < MSG_PROTO_BASE) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "unexpected protocol '%.*s'", (int)version->len, cmd->argc ? version->ptr : "");
+    } else {
+        conn->proto = proto < MSG_PROTO_STREAM ? (int)proto : MSG_PROTO_STREAM;
+        mbr_add_reply(broker, conn, MSG_TYP_SI, "protocol %d", conn->proto);
+    }
+    return 0;
+}
+
+static int
+srv_cmd_compress(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    state_t      *state  = reactor->state;
+    msg_broker_t *broker = &reactor->mbroker;
+    cmd_arg_t    *codec  = &cmd->argv[0];
+    int           want   = !cmd->argc ? -1
+                         : cmd_arg_is(codec, "lz") ? MSG_CODEC_LZ
+                         : cmd_arg_is(codec, "none") ? MSG_CODEC_NONE : -1;
+
+    if (want < 0) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "unknown codec '%.*s'", (int)codec->len, cmd->argc ? codec->ptr : "");
+    } else {
+        if (!conn->codec != !want) {
+            __atomic_add_fetch(&state->zip_conns, want ? 1 : -1, __ATOMIC_RELAXED);
+        }
+        /* the reply itself goes with the new codec, it is short enough to go raw */
+        conn->codec = want;
+        mbr_add_reply(broker, conn, MSG_TYP_SI, "compression %s", want ? "lz" : "none");
+    }
+    return 0;
+}
+
+static int
+srv_cmd_status(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    state_t      *state  = reactor->state;
+    msg_broker_t *broker = &reactor->mbroker;
+
+    if (!conn->is_adm) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "log in as admin first");
+    } else if (conn->listing) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "a listing is being sent already");
+    } else {
+        /* the counters are fresh, the roommates are rendered once per registry change */
+        status_text_t *texts[STATUS_LISTING_TEXTS];
+        int            texts_cnt = 0;
+        if (cmd->op == CMD_OP_STATUS) {
+            texts[texts_cnt++] = state_status_render(state, state_status_take);
+            texts[texts_cnt++] = state_status_cached(state, &state->status_members, state_status_members);
+        } else {
+            texts[texts_cnt++] = state_status_cached(state, &state->status_mates, state_status_mates);
+        }
+        bool failed = false;
+        for (int i = 0; i < texts_cnt; i++) {
+            failed |= !texts[i];
+        }
+        if (failed || conn_listing_start(conn, texts, texts_cnt) < 0) {
+            for (int i = 0; failed && i < texts_cnt; i++) {
+                state_status_unref(texts[i]);
+            }
+            mbr_add_reply(broker, conn, MSG_TYP_SE, "can't render the listing");
+        } else {
+            /* the first page goes after the output queued before, the rest on later turns */
+            conn_listing(reactor, conn);
+        }
+    }
+    return 0;
+}
+
+static int
+srv_cmd_registry(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    state_t      *state  = reactor->state;
+    msg_broker_t *broker = &reactor->mbroker;
+    cmd_arg_t    *subcmd = &cmd->argv[0];
+
+    if (cmd->op == CMD_OP_ROOMMATES && cmd->argc && cmd_arg_is(subcmd, "show")) {
+        return srv_cmd_status(reactor, conn, cmd);
+    }
+    if (!conn->is_adm) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "log in as admin first");
+        return 0;
+    }
+
+    /* the reactor leaves its read section, the others finish their batches before the change */
+    pthread_rwlock_unlock(&state->lock);
+    pthread_rwlock_wrlock(&state->lock);
+    int    rc    = state_registry_edit(state, broker, cmd);
+    size_t mates = state->mates.count;
+    size_t rooms = state->rooms.count;
+    pthread_rwlock_unlock(&state->lock);
+    pthread_rwlock_rdlock(&state->lock);
+
+    if (rc < 0) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "can't run '%s %.*s'",
+                cmd_defs[cmd->op].name, (int)subcmd->len, cmd->argc ? subcmd->ptr : "");
+    } else {
+        mbr_add_reply(broker, conn, MSG_TYP_SI, "%s %.*s: %zu room mates, %zu rooms",
+                cmd_defs[cmd->op].name, (int)subcmd->len, subcmd->ptr, mates, rooms);
+    }
+    return 0;
+}
+
+static int
+srv_cmd_snapshot(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    state_t      *state  = reactor->state;
+    msg_broker_t *broker = &reactor->mbroker;
+
+    (void)cmd;
+    if (!conn->is_adm) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "log in as admin first");
+    } else if (!state->snap_path) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "no --snapshot file is set");
+    } else if (snap_save(state, broker) < 0) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "can't write snapshot");
+    } else {
+        /* the reactor stalls for the write, it is an admin request */
+        mbr_add_reply(broker, conn, MSG_TYP_SI, "snapshot of %zu room mates, %zu rooms is written",
+                state->mates.count, state->rooms.count);
+    }
+    return 0;
+}
+
+static int
+srv_cmd_pong(reactor_t *reactor, conn_t *conn, cmd_t *cmd)
+{
+    /* the frame itself is the answer, the idle and heartbeat deadlines count from it */
+    (void)cmd;
+    conn->last_in = reactor->wheel.now;
+    return 0;
+}
+
+static int
+srv_msg_chunk(reactor_t *reactor, conn_t *conn, msg_t *msg_in)
+{
+    msg_broker_t *broker = &reactor->mbroker;
+    msg_chunk_t   chunk;
+
+    if (conn->proto < MSG_PROTO_STREAM) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "ask for protocol %d to stream messages", MSG_PROTO_STREAM);
+        return -1;
+    }
+    if (!(msg_in->hdr.ops & MSG_CHUNK) || msg_in->hdr.len < sizeof(chunk)) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "malformed chunk");
+        conn->stream_left = 0;
+        return -1;
+    }
+    memcpy(&chunk, msg_in->data, sizeof(chunk));
+    uint32_t size = msg_in->hdr.len - sizeof(chunk);
+
+    if (chunk.offset == 0) {
+        /* a new stream, an unfinished one is given up */
+        conn->stream_id    = __atomic_add_fetch(&reactor->state->streams, 1, __ATOMIC_RELAXED);
+        conn->stream_total = chunk.total;
+        conn->stream_left  = chunk.total;
+    } else if (!conn->stream_left) {
+        /* the rest of a stream given up before, told once already */
+        return -1;
+    } else if (chunk.total != conn->stream_total || chunk.offset != conn->stream_total - conn->stream_left) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "chunk at %u of %u bytes is out of stream", chunk.offset, chunk.total);
+        conn->stream_left = 0;
+        return -1;
+    }
+    if (size > conn->stream_left || (size == conn->stream_left) != !!(msg_in->hdr.ops & MSG_CHUNK_END)) {
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "chunk of %u bytes at %u doesn't fit stream of %u bytes",
+                size, chunk.offset, conn->stream_total);
+        conn->stream_left = 0;
+        return -1;
+    }
+    conn->stream_left -= size;
+
+    /* the frame goes on as it is, but under the id of the server */
+    chunk.stream = conn->stream_id;
+    memcpy(msg_in->data, &chunk, sizeof(chunk));
+    return 0;
+}
+
+static int
+srv_msg_input(reactor_t *reactor, conn_t *conn, msg_t *msg_in)
+{
+    msg_broker_t *broker = &reactor->mbroker;
+
+    REACTOR_STAT_ADD(reactor, msgs_in, 1);
+    REACTOR_STAT_ADD(reactor, bytes_in, sizeof(msg_in->hdr) + msg_in->hdr.len);
+    conn->last_in = reactor->wheel.now;
+
+    switch (MSG_TYP_MASK(msg_in->hdr.ops)) {
+    case MSG_TYP_CM:
+        if (!MSG_WID_MASK(msg_in->hdr.ops)) {
+            msg_in->hdr.ops |= MSG_WID_RM;
+        }
+        if (MSG_WID_MASK(msg_in->hdr.ops) >= MSG_WID_RM) {
+            if (!conn->room) {
+                mbr_add_reply(broker, conn, MSG_TYP_SE, "enter a room first");
+                return 0;
+            }
+        }
+        bool is_chunk = msg_in->hdr.ops & (MSG_CHUNK | MSG_CHUNK_END);
+        if (reactor->mem_over && !(is_chunk && conn->stream_left)) {
+            /* admission control, no new fanout while the queues are over the watermark,
+             * a stream once started goes on */
+            REACTOR_STAT_ADD(reactor, refused, 1);
+            mbr_add_reply(broker, conn, MSG_TYP_SE, "server is busy, message is not sent");
+            return 0;
+        }
+        if (is_chunk && srv_msg_chunk(reactor, conn, msg_in) < 0) {
+            return 0;
+        }
+        if (MSG_WID_MASK(msg_in->hdr.ops) >= MSG_WID_RM) {
+            /* shared by the reactors, one add per message rather than per delivery */
+            __atomic_add_fetch(&conn->room->msgs, 1, __ATOMIC_RELAXED);
+        }
+
+        /* routed message outlives the input, so it owns the payload */
+        msg_t *msg = conn->ring_in.buf ? mbr_clone(broker, msg_in, conn) : mbr_adopt(broker, msg_in, conn);
+        if (!msg) {
+            mbr_add_loge(broker, "can't take input message from connection %d", conn->fd);
+            return -1;
+        }
+        return mbr_route(broker, msg, conn);
+    case MSG_TYP_CC:
+    case MSG_TYP_CB:
+        /* commands are executed right from the input buffer */
+        return srv_cmd_exec(reactor, conn, msg_in);
+    default:
+        mbr_add_reply(broker, conn, MSG_TYP_SE, "unexpected message type %d", MSG_TYP_MASK(msg_in->hdr.ops));
+        return -1;
+    }
+}
+
+static int
+reactor_init(reactor_t *reactor, state_t *state, int id)
+{
+    *reactor = (reactor_t) {
+        .id        = id,
+        .epoll_fd  = -1,
+        .listen_fd = -1,
+        .event_fd  = -1,
+        .state     = state
+    };
+    mbr_init(&reactor->mbroker);
+    wheel_init(&reactor->wheel, state_clock());
+    reactor->housekeep.cb = reactor_housekeep;
+    wheel_arm(&reactor->wheel, &reactor->housekeep, WHEEL_TICKS(SRV_HOUSEKEEP_MS));
+
+    /*
+     * configure listening socket, every reactor binds its own one to the same port
+     */
+    reactor->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (reactor->listen_fd < 0) {
+        mbr_add_loge(&state->mbroker, "can't create listen socket");
+        goto error;
+    }
+    int sockopt = 1;
+    setsockopt(reactor->listen_fd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+    if (setsockopt(reactor->listen_fd, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof(sockopt)) < 0) {
+        mbr_add_loge(&state->mbroker, "can't set SO_REUSEPORT on listen socket");
+        goto error;
+    }
+
+    struct sockaddr_in listen_addr = {0};
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_port = state->net_port;
+    listen_addr.sin_addr = state->net_addr;
+
+    if (bind(reactor->listen_fd, (struct sockaddr *)(&listen_addr), sizeof(listen_addr)) < 0) {
+        mbr_add_loge(
+                &state->mbroker, "can't bind listen socket to %s:%d",
+                inet_ntoa(listen_addr.sin_addr),
+                ntohs(listen_addr.sin_port));
+        goto error;
+    }
+    if (listen(reactor->listen_fd, state->listen_backlog) < 0) {
+        mbr_add_loge(&state->mbroker, "listen socket error");
+        goto error;
+    }
+
+    reactor->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (reactor->event_fd < 0) {
+        mbr_add_loge(&state->mbroker, "eventfd creation error");
+        goto error;
+    }
+    if (state->use_uring) {
+        if (uring_init(reactor) == 0) {
+            return 0;
+        }
+        mbr_add_loge(&state->mbroker, "reactor %d: io_uring is not available, falling back to epoll", id);
+    }
+
+    /*
+     * configure event poll
+     */
+    reactor->epoll_fd = epoll_create1(0);
+    if (reactor->epoll_fd < 0) {
+        mbr_add_loge(&state->mbroker, "epoll instance creation error");
+        goto error;
+    }
+
+    struct epoll_event epev_ctl;
+    epev_ctl.data.u64 = reactor->listen_fd;
+    epev_ctl.events   = EPOLLIN;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &epev_ctl) < 0) {
+        mbr_add_loge(&state->mbroker, "can't add listen socket to epoll");
+        goto error;
+    }
+    epev_ctl.data.u64 = reactor->event_fd;
+    epev_ctl.events   = EPOLLIN;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &epev_ctl) < 0) {
+        mbr_add_loge(&state->mbroker, "can't add eventfd to epoll");
+        goto error;
+    }
+    return 0;
+
+error:
+    reactor_free(reactor);
+    return -1;
+}
+
+static void
+reactor_free(reactor_t *reactor)
+{
+    if (reactor->uring) {
+        uring_stop(reactor);
+        uring_free(reactor);
+    }
+    CONN_TAB_FOREACH(&reactor->conns, fd) {
+        conn_close(reactor, reactor->conns.conns[fd]);
+    }
+    conn_tab_free(&reactor->conns);
+
+    reactor_xfer_t *xfer = __atomic_exchange_n(&reactor->inbox, NULL, __ATOMIC_ACQUIRE);
+    while (xfer) {
+        reactor_xfer_t *next = xfer->next;
+        if (xfer->msg) {
+            mbr_unref(xfer->msg);
+        }
+        pool_put(&pools[POOL_XFER], xfer);
+        xfer = next;
+    }
+    free(reactor->bcast_dirty);
+    reactor->bcast_dirty = NULL;
+    reactor->bcast_dirty_cnt = reactor->bcast_dirty_cap = 0;
+    mbr_flush_locals(&reactor->mbroker);
+
+    if (reactor->event_fd >= 0) {
+        close(reactor->event_fd);
+    }
+    if (reactor->epoll_fd >= 0) {
+        close(reactor->epoll_fd);
+    }
+    if (reactor->listen_fd >= 0) {
+        close(reactor->listen_fd);
+    }
+    reactor->event_fd = reactor->epoll_fd = reactor->listen_fd = -1;
+}
+
+static void
+reactor_bcast_kick(reactor_t *reactor, room_bcast_t *bcast)
+{
+    uint64_t reactors = __atomic_load_n(&bcast->room->conns.reactors, __ATOMIC_ACQUIRE);
+
+    /* every reactor with members flushes them once per batch, however many frames came */
+    for (; reactors; reactors &= reactors - 1) {
+        int      id  = __builtin_ctzll(reactors);
+        uint64_t bit = 1ULL << id;
+        if (__atomic_fetch_or(&bcast->dirty, bit, __ATOMIC_ACQ_REL) & bit) {
+            continue;
+        }
+        if (id == reactor->id) {
+            reactor_bcast_dirty(reactor, bcast);
+            continue;
+        }
+        reactor_xfer_t *xfer = pool_get(&pools[POOL_XFER]);
+        if (!xfer) {
+            __atomic_and_fetch(&bcast->dirty, ~bit, __ATOMIC_ACQ_REL);
+            continue;
+        }
+        *xfer = (reactor_xfer_t){.bcast = bcast};
+        reactor_push(&reactor->state->reactors[id], xfer);
+    }
+}
+
+static void
+reactor_bcast_dirty(reactor_t *reactor, room_bcast_t *bcast)
+{
+    if (reactor->bcast_dirty_cnt == reactor->bcast_dirty_cap) {
+        size_t         cap   = reactor->bcast_dirty_cap ? reactor->bcast_dirty_cap * 2 : 16;
+        room_bcast_t **dirty = realloc(reactor->bcast_dirty, cap * sizeof(room_bcast_t *));
+        if (!dirty) {
+            /* the next frame of the room tries again */
+            __atomic_and_fetch(&bcast->dirty, ~(1ULL << reactor->id), __ATOMIC_ACQ_REL);
+            return;
+        }
+        reactor->bcast_dirty     = dirty;
+        reactor->bcast_dirty_cap = cap;
+    }
+    reactor->bcast_dirty[reactor->bcast_dirty_cnt++] = bcast;
+}
+
+static void
+reactor_xfer(reactor_t *reactor, conns_set_t *targets, msg_t *msg)
+{
+    reactor_xfer_t *xfer = pool_get(&pools[POOL_XFER]);
+    if (!xfer) {
+        return;
+    }
+    xfer->msg     = msg;
+    xfer->targets = targets;
+    xfer->bcast   = NULL;
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+    reactor_push(reactor, xfer);
+}
+
+static void
+reactor_push(reactor_t *reactor, reactor_xfer_t *xfer)
+{
+    reactor_xfer_t *head = __atomic_load_n(&reactor->inbox, __ATOMIC_RELAXED);
+    do {
+        xfer->next = head;
+    } while (!__atomic_compare_exchange_n(&reactor->inbox, &head, xfer, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* the reactor takes the whole inbox at once, wake it up only when it was empty */
+    if (!head) {
+        eventfd_write(reactor->event_fd, 1);
+    }
+}
+
+static void
+reactor_inbox(reactor_t *reactor)
+{
+    eventfd_t evcnt;
+    eventfd_read(reactor->event_fd, &evcnt);
+
+    /* take everything pushed so far and restore the push order */
+    reactor_xfer_t *xfer = __atomic_exchange_n(&reactor->inbox, NULL, __ATOMIC_ACQUIRE);
+    reactor_xfer_t *fifo = NULL;
+    while (xfer) {
+        reactor_xfer_t *next = xfer->next;
+        xfer->next = fifo;
+        fifo = xfer;
+        xfer = next;
+    }
+
+    while (fifo) {
+        if (fifo->bcast) {
+            reactor_bcast_dirty(reactor, fifo->bcast);
+        } else {
+            mbr_route_ctx_t rctx = {
+                .broker = &reactor->mbroker,
+                .msg    = fifo->msg,
+                .except = NULL,
+                .count  = 0
+            };
+            pset_t *local = conns_local(fifo->targets, reactor->id);
+            if (local) {
+                mbr_route_set(&rctx, local);
+            }
+            mbr_unref(fifo->msg);
+        }
+
+        reactor_xfer_t *next = fifo->next;
+        pool_put(&pools[POOL_XFER], fifo);
+        fifo = next;
+    }
+}
+
+static void
+reactor_acc_count(reactor_t *reactor, int accepted)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec != reactor->acc_win) {
+        reactor->acc_win     = now.tv_sec;
+        reactor->acc_win_cnt = 0;
+    }
+    reactor->acc_win_cnt += accepted;
+    if (reactor->acc_win_cnt > reactor->acc_rate_peak) {
+        reactor->acc_rate_peak = reactor->acc_win_cnt;
+    }
+    __atomic_store_n(&reactor->acc_total, reactor->acc_total + accepted, __ATOMIC_RELAXED);
+}
+
+static void
+reactor_stats_sum(state_t *state, reactor_stats_t *sum)
+{
+    *sum = (reactor_stats_t){0};
+    for (int r = 0; r < state->workers && state->reactors; r++) {
+        reactor_t *reactor = &state->reactors[r];
+        sum->conns     += REACTOR_STAT_GET(reactor, conns);
+        sum->msgs_in   += REACTOR_STAT_GET(reactor, msgs_in);
+        sum->bytes_in  += REACTOR_STAT_GET(reactor, bytes_in);
+        sum->bytes_out += REACTOR_STAT_GET(reactor, bytes_out);
+        sum->queued    += REACTOR_STAT_GET(reactor, queued);
+        sum->wakeups   += REACTOR_STAT_GET(reactor, wakeups);
+        sum->events    += REACTOR_STAT_GET(reactor, events);
+        sum->drops_oldest += REACTOR_STAT_GET(reactor, drops_oldest);
+        sum->drops_chat   += REACTOR_STAT_GET(reactor, drops_chat);
+        sum->kicks        += REACTOR_STAT_GET(reactor, kicks);
+        sum->refused      += REACTOR_STAT_GET(reactor, refused);
+        sum->zip_frames   += REACTOR_STAT_GET(reactor, zip_frames);
+        sum->zip_in       += REACTOR_STAT_GET(reactor, zip_in);
+        sum->zip_out      += REACTOR_STAT_GET(reactor, zip_out);
+        sum->zip_ns       += REACTOR_STAT_GET(reactor, zip_ns);
+    }
+}
+
+static void
+reactor_mem_check(reactor_t *reactor)
+{
+    state_t *state  = reactor->state;
+    uint64_t queued = 0;
+
+    if (!state->mem_mark) {
+        return;
+    }
+
+    /* once per batch, the counters are read without stopping their writers */
+    for (int r = 0; r < state->workers; r++) {
+        queued += REACTOR_STAT_GET(&state->reactors[r], queued);
+    }
+    reactor->mem_over = queued > state->mem_mark;
+}
+
+static void
+reactor_pending(reactor_t *reactor)
+{
+    /* large rooms with new frames wake their local members up */
+    for (size_t i = 0; i < reactor->bcast_dirty_cnt; i++) {
+        room_bcast_t *bcast = reactor->bcast_dirty[i];
+        __atomic_and_fetch(&bcast->dirty, ~(1ULL << reactor->id), __ATOMIC_ACQ_REL);
+
+        pset_t *local = conns_local(&bcast->room->conns, reactor->id);
+        if (!local) {
+            continue;
+        }
+        PSET_FOREACH(local, c) {
+            conn_t *conn = local->slots[c];
+            if (!conn->is_pending && !conn->is_epout) {
+                LIST_INSERT_HEAD(&reactor->mbroker.cl_pending, conn, lentry_pending);
+                conn->is_pending = true;
+            }
+        }
+    }
+    reactor->bcast_dirty_cnt = 0;
+
+    /* deliver routed messages, connections waiting for the socket are flushed by its event */
+    while (!LIST_EMPTY(&reactor->mbroker.cl_pending)) {
+        conn_t *conn = LIST_FIRST(&reactor->mbroker.cl_pending);
+        LIST_REMOVE(conn, lentry_pending);
+        conn->is_pending = false;
+
+        if (!conn->is_epout) {
+            srv_conn_output(reactor, conn);
+        }
+    }
+}
+
+static void
+reactor_housekeep(reactor_t *reactor, wheel_timer_t *timer)
+{
+    state_t *state = reactor->state;
+
+    mbr_clean(&reactor->mbroker);
+    if (reactor->id == 0 && state->sessions.window) {
+        /* closed sessions go at their ttl, even when nobody logs in */
+        pthread_mutex_lock(&state->sessions.lock);
+        sessions_expire(&state->sessions, state_clock());
+        pthread_mutex_unlock(&state->sessions.lock);
+    }
+    wheel_arm(&reactor->wheel, timer, reactor->wheel.now + WHEEL_TICKS(SRV_HOUSEKEEP_MS));
+}
+
+static bool
+reactor_stopped(reactor_t *reactor)
+{
+    if (signal_quit_flag) {
+        if (reactor->id == 0) {
+            errno = 0;
+            mbr_add_loge(&reactor->mbroker, "interrupted by %d signal", signal_quit_flag);
+        }
+        return true;
+    }
+    return __atomic_load_n(&reactor->state->quit, __ATOMIC_ACQUIRE);
+}
+
+static void
+reactor_loop_epoll(reactor_t *reactor)
+{
+    state_t            *state      = reactor->state;
+    const  int          EPEV_WPOOL = state->epoll_batch;
+    struct epoll_event *epev_wpool = calloc(EPEV_WPOOL, sizeof(struct epoll_event));
+
+    if (!epev_wpool) {
+        mbr_add_loge(&reactor->mbroker, "can't allocate epoll events of reactor %d", reactor->id);
+        return;
+    }
+    for (;;) {
+        /* the signal breaks the wait, the dump goes before the next one so errno stays for it */
+        if (signal_stats_flag && reactor->id == 0) {
+            signal_stats_flag = 0;
+            state_stats_dump(reactor);
+        }
+        /* the wheel sets the timeout, there is no timer thread nor timerfd */
+        int epev_cnt = epoll_wait(reactor->epoll_fd, epev_wpool, EPEV_WPOOL, wheel_timeout(&reactor->wheel, state_clock()));
+        if (reactor_stopped(reactor)) {
+            break;
+        }
+        if (epev_cnt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            mbr_add_loge(&reactor->mbroker, "epoll_wait error");
+            break;
+        }
+
+        REACTOR_STAT_ADD(reactor, wakeups, 1);
+        REACTOR_STAT_ADD(reactor, events, epev_cnt);
+        reactor_mem_check(reactor);
+
+        pthread_rwlock_rdlock(&state->lock);
+        wheel_advance(&reactor->wheel, reactor, state_clock());
+        for (int iev = 0; iev < epev_cnt; iev++) {
+            int fd = CONN_TAB_KEY_FD(epev_wpool[iev].data.u64);
+            if (fd == reactor->listen_fd) {
+                /* got input event from the listen_fd. Establish new connections */
+                srv_conn_accept(reactor);
+
+            } else if (fd == reactor->event_fd) {
+                /* messages routed by the other reactors */
+                reactor_inbox(reactor);
+
+            } else {
+                conn_t *conn = conn_tab_get(&reactor->conns, epev_wpool[iev].data.u64);
+                if (!conn) {
+                    /* the connection was closed earlier in this batch */
+                    continue;
+                }
+                if (epev_wpool[iev].events & EPOLLOUT) {
+                    /* client socket is writable again, resume the output queue */
+                    int rc = srv_conn_output(reactor, conn);
+                    if (rc == MSG_IO_ERR || rc == MSG_IO_DOWN) {
+                        continue;
+                    }
+                }
+                if (epev_wpool[iev].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    /* input event from the client connection */
+                    srv_conn_input(reactor, conn);
+                }
+            }
+        }
+        reactor_pending(reactor);
+        pthread_rwlock_unlock(&state->lock);
+        mbr_flush_locals(&reactor->mbroker);
+    }
+    free(epev_wpool);
+}
+
+static void *
+reactor_loop(void *arg)
+{
+    reactor_t *reactor = arg;
+    state_t   *state   = reactor->state;
+
+    if (reactor->uring) {
+        reactor_loop_uring(reactor);
+    } else {
+        reactor_loop_epoll(reactor);
+    }
+
+    /* stop the others as well */
+    __atomic_store_n(&state->quit, true, __ATOMIC_RELEASE);
+    for (int r = 0; r < state->workers; r++) {
+        if (r != reactor->id) {
+            eventfd_write(state->reactors[r].event_fd, 1);
+        }
+    }
+    mbr_flush_locals(&reactor->mbroker);
+    return NULL;
+}
+
+static int
+srv_loop(state_t *state)
+{
+    struct sigaction sigact;
+    sigact.sa_handler = signal_quit_handler;
+    sigemptyset(&sigact.sa_mask);
+    sigact.sa_flags = 0;
+
+    sigaction(SIGHUP,  &sigact, NULL);
+    sigaction(SIGINT,  &sigact, NULL);
+    sigaction(SIGTERM, &sigact, NULL);
+
+    sigact.sa_handler = signal_stats_handler;
+    sigaction(SIGUSR1, &sigact, NULL);
+
+    sigact.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sigact, NULL);
+
+    state->started    = state_clock();
+    state->stats_mark = state->started;
+    rooms_bcast_update(state, &state->mbroker);
+    rooms_journal_update(state, &state->mbroker);
+    rooms_window_update(state, &state->mbroker);
+    if (state->journals.dir && journals_start(&state->journals) < 0) {
+        mbr_add_loge(&state->mbroker, "can't start journal flusher, the history is synced on close only");
+    }
+
+    /*
+     * configure reactors, each one owns its listen socket, event poll and connections
+     */
+    state->reactors = aligned_alloc(_Alignof(reactor_t), state->workers * sizeof(reactor_t));
+    if (!state->reactors) {
+        mbr_add_loge(&state->mbroker, "can't allocate reactors");
+        journals_stop(&state->journals);
+        return -1;
+    }
+    memset(state->reactors, 0, state->workers * sizeof(reactor_t));
+    int ready = 0;
+    for (; ready < state->workers; ready++) {
+        if (reactor_init(&state->reactors[ready], state, ready) < 0) {
+            break;
+        }
+    }
+    if (ready < state->workers) {
+        for (int r = 0; r < ready; r++) {
+            reactor_free(&state->reactors[r]);
+        }
+        free(state->reactors);
+        state->reactors = NULL;
+        journals_stop(&state->journals);
+        return -1;
+    }
+
+    /* signals are handled by the first reactor running in the main thread */
+    sigset_t sigmask, sigmask_orig;
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGHUP);
+    sigaddset(&sigmask, SIGINT);
+    sigaddset(&sigmask, SIGTERM);
+    sigaddset(&sigmask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigmask, &sigmask_orig);
+
+    int started = 1;
+    for (; started < state->workers; started++) {
+        reactor_t *reactor = &state->reactors[started];
+        if (pthread_create(&reactor->thread, NULL, reactor_loop, reactor) != 0) {
+            mbr_add_loge(&state->mbroker, "can't start reactor %d", started);
+            __atomic_store_n(&state->quit, true, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &sigmask_orig, NULL);
+
+    if (!__atomic_load_n(&state->quit, __ATOMIC_ACQUIRE)) {
+        reactor_loop(&state->reactors[0]);
+    }
+    for (int r = 1; r < started; r++) {
+        eventfd_write(state->reactors[r].event_fd, 1);
+        pthread_join(state->reactors[r].thread, NULL);
+    }
+    journals_stop(&state->journals);
+
+    for (int r = 0; r < state->workers; r++) {
+        reactor_t *reactor = &state->reactors[r];
+        mbr_add_logi(&state->mbroker, "reactor %d: accepted %llu, peak rate %u/s, capped wakeups %llu",
+                r, (unsigned long long)reactor->acc_total, reactor->acc_rate_peak,
+                (unsigned long long)reactor->acc_capped);
+        reactor_free(reactor);
+    }
+    free(state->reactors);
+    state->reactors = NULL;
+
+    /* the log lines waiting above hold their nodes, the stats are about the connections */
+    mbr_flush_locals(&state->mbroker);
+    pool_stats_t stats[POOL_ID_MAX];
+    for (int p = 0; p < POOL_ID_MAX; p++) {
+        pool_stats(&pools[p], &stats[p]);
+    }
+    for (int p = 0; p < POOL_ID_MAX; p++) {
+        mbr_add_logi(&state->mbroker, "pool %s: live %zu, free %zu, high-water %zu",
+                pools[p].name, stats[p].live, stats[p].free, stats[p].hiwat);
+    }
+    return 0;
+}
+
+/**************************
+ * Client
+ **************************/
+static int
+cli_cmd_add(msg_broker_t *broker, cmd_op_t op, int argc, const char **argv)
+{
+    char buf[UINT16_MAX];
+    int  len = cmd_bin_encode(buf, sizeof(buf), op, argc, argv);
+    if (len < 0) {
+        return -1;
+    }
+
+    /* queued while the options are parsed, cli_loop sends them first */
+    msg_t *msg = mbr_grow(broker, MSG_TYP_CB | MSG_COMMIT, NULL);
+    return msg_add_bin(msg, buf, len);
+}
+
+static int
+cli_frame(cli_t *cli, uint16_t ops, const char *data, size_t len)
+{
+    msg_t *msg = pool_get(&pools[POOL_MSG]);
+    if (!msg) {
+        mbr_add_loge(&cli->state->mbroker, "can't queue a message to the server");
+        return -1;
+    }
+    msg->hdr.ops = ops;
+    msg->commit  = true;
+    if (len && msg_add_bin(msg, (char *)data, len) < 0) {
+        mbr_add_loge(&cli->state->mbroker, "can't queue a message to the server");
+        pool_put(&pools[POOL_MSG], msg);
+        return -1;
+    }
+    CIRCLEQ_INSERT_TAIL(&cli->out, msg, cq_entry);
+    cli->out_bytes += sizeof(msg->hdr) + msg->hdr.len;
+    return 0;
+}
+
+static void
+cli_line(cli_t *cli, const char *line, size_t len)
+{
+    if (len && line[len - 1] == '\r') {
+        len--;
+    }
+    if (!len) {
+        return;
+    }
+
+    /* commands go as text, the server parses them the same way as the binary ones */
+    if (line[0] == ':') {
+        cmd_t cmd;
+        if (cmd_text_parse(line, len, &cmd) == 0 && cmd.op == CMD_OP_QUIT) {
+            cli->is_in_eof = true;
+            return;
+        }
+        cli_frame(cli, MSG_TYP_CC, line, len);
+    } else {
+        cli_frame(cli, MSG_TYP_CM, line, len);
+    }
+}
+
+static void
+cli_stdin(cli_t *cli)
+{
+    /* one read per wakeup, so a level-triggered stdin never blocks */
+    ssize_t rd = read(STDIN_FILENO, cli->line + cli->line_len, CLI_LINE_SZ - cli->line_len);
+    if (rd < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            mbr_add_loge(&cli->state->mbroker, "can't read stdin");
+            cli->is_in_eof = true;
+        }
+        return;
+    }
+    if (rd == 0) {
+        /* the unfinished line goes as well */
+        cli_line(cli, cli->line, cli->line_len);
+        cli->line_len  = 0;
+        cli->is_in_eof = true;
+        return;
+    }
+    cli->line_len += rd;
+
+    char *line = cli->line;
+    char *end  = cli->line + cli->line_len;
+    char *eol;
+    while (!cli->is_in_eof && (eol = memchr(line, '\n', end - line)) != NULL) {
+        cli_line(cli, line, eol - line);
+        line = eol + 1;
+    }
+    if (cli->is_in_eof) {
+        /* the lines after :quit are not sent */
+        cli->line_len = 0;
+    } else if (line == cli->line && cli->line_len == CLI_LINE_SZ) {
+        /* a line over a frame goes in pieces */
+        cli_line(cli, cli->line, cli->line_len);
+        cli->line_len = 0;
+    } else {
+        cli->line_len = end - line;
+        memmove(cli->line, line, cli->line_len);
+    }
+}
+
+static void
+cli_send(cli_t *cli)
+{
+    struct iovec iov[CONN_IOV_MAX];
+
+    /* the queue goes in as few writev as it takes, no reply is waited for */
+    while (!CIRCLEQ_EMPTY(&cli->out)) {
+        int     iovcnt   = 0;
+        size_t  cursor   = cli->cursor_out;
+        size_t  expected = 0;
+        msg_t  *msg;
+        CIRCLEQ_FOREACH(msg, &cli->out, cq_entry) {
+            if (iovcnt + 2 > CONN_IOV_MAX) {
+                break;
+            }
+            int cnt = msg_io_iov(msg, cursor, &iov[iovcnt]);
+            for (int i = 0; i < cnt; i++) {
+                expected += iov[iovcnt + i].iov_len;
+            }
+            iovcnt += cnt;
+            cursor = 0;
+        }
+
+        ssize_t wr = writev(cli->fd, iov, iovcnt);
+        if (wr < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                mbr_add_loge(&cli->state->mbroker, "can't send to the server");
+                cli->is_down = true;
+            }
+            cli->is_epout = true;
+            return;
+        }
+
+        /* the frames written through leave the queue */
+        size_t sent = (size_t)wr;
+        cli->out_bytes -= sent;
+        while (sent) {
+            msg = CIRCLEQ_FIRST(&cli->out);
+            size_t left = sizeof(msg->hdr) + msg->hdr.len - cli->cursor_out;
+            if (sent < left) {
+                cli->cursor_out += sent;
+                break;
+            }
+            sent -= left;
+            cli->cursor_out = 0;
+            CIRCLEQ_REMOVE(&cli->out, msg, cq_entry);
+            free(msg->data);
+            pool_put(&pools[POOL_MSG], msg);
+        }
+        if ((size_t)wr < expected) {
+            /* the socket is full, EPOLLOUT tells when it takes more */
+            cli->is_epout = true;
+            return;
+        }
+    }
+    cli->is_epout = false;
+}
+
+static void
+cli_render(cli_t *cli, msg_t *msg)
+{
+    const char *data = msg->data;
+    size_t      len  = msg->hdr.len;
+    const char *mark;
+    char        raw[UINT16_MAX];
+
+    switch (MSG_TYP_MASK(msg->hdr.ops)) {
+    case MSG_TYP_CM:
+        mark = "";
+        break;
+    case MSG_TYP_SC:
+        if (len == 5 && memcmp(data, ":ping", 5) == 0) {
+            /* answered at once, any frame keeps the connection alive */
+            const char op = CMD_OP_PONG;
+            cli_frame(cli, MSG_TYP_CB, &op, 1);
+            return;
+        }
+        /* fall through */
+    case MSG_TYP_SI:
+        mark = "* ";
+        break;
+    case MSG_TYP_SE:
+        mark = "! ";
+        break;
+    default:
+        return;
+    }
+
+    /* frames of the :compress and :proto extensions the user may have asked for */
+    if (msg->hdr.ops & MSG_ZIP) {
+        msg_zip_t zip;
+        int       raw_len = -1;
+        if (len >= sizeof(zip)) {
+            memcpy(&zip, data, sizeof(zip));
+            raw_len = lz_decompress((const uint8_t *)data + sizeof(zip), len - sizeof(zip), (uint8_t *)raw, zip.len);
+        }
+        if (raw_len < 0 || raw_len != zip.len) {
+            mbr_add_loge(&cli->state->mbroker, "malformed compressed message from the server");
+            return;
+        }
+        data = raw;
+        len  = (size_t)raw_len;
+    }
+    bool is_tail = true;
+    if (msg->hdr.ops & (MSG_CHUNK | MSG_CHUNK_END)) {
+        if (len < sizeof(msg_chunk_t)) {
+            return;
+        }
+        msg_chunk_t chunk;
+        memcpy(&chunk, data, sizeof(chunk));
+        data   += sizeof(chunk);
+        len    -= sizeof(chunk);
+        is_tail = msg->hdr.ops & MSG_CHUNK_END;
+        mark    = chunk.offset ? "" : mark;
+    }
+
+    /* the terminal buffer keeps room for one frame over CLI_TERM_SZ */
+    size_t mark_len = strlen(mark);
+    memcpy(cli->term + cli->term_len, mark, mark_len);
+    cli->term_len += mark_len;
+    if (len) {
+        memcpy(cli->term + cli->term_len, data, len);
+        cli->term_len += len;
+    }
+    if (is_tail && (!len || data[len - 1] != '\n')) {
+        /* listing pages end with a newline of their own */
+        cli->term[cli->term_len++] = '\n';
+    }
+}
+
+static bool
+cli_frames(cli_t *cli)
+{
+    conn_ring_t *ring = &cli->ring_in;
+
+    /* a batch for the terminal at most, the rest waits for the next wakeup */
+    while (ring->tail - ring->head >= sizeof(struct msg_hdr_s)) {
+        msg_t msg = {0};
+        memcpy(&msg.hdr, ring->buf + ring->head, sizeof(msg.hdr));
+        if (ring->tail - ring->head < sizeof(msg.hdr) + msg.hdr.len) {
+            return false;
+        }
+        if (cli->term_len >= CLI_TERM_SZ) {
+            return true;
+        }
+        msg.data    = ring->buf + ring->head + sizeof(msg.hdr);
+        ring->head += sizeof(msg.hdr) + msg.hdr.len;
+        cli_render(cli, &msg);
+    }
+    return false;
+}
+
+static void
+cli_recv(cli_t *cli)
+{
+    conn_ring_t *ring = &cli->ring_in;
+
+    /* the ring is drained of whole frames here, so it has room for one */
+    size_t  expected = conn_ring_reserve(ring);
+    ssize_t rd       = recv(cli->fd, ring->buf + ring->tail, expected, 0);
+    if (rd < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            mbr_add_loge(&cli->state->mbroker, "can't receive from the server");
+            cli->is_down = true;
+        }
+        return;
+    }
+    if (rd == 0) {
+        cli->is_down = true;
+        return;
+    }
+    ring->tail += rd;
+}
+
+static void
+cli_term_flush(cli_t *cli)
+{
+    size_t off = 0;
+
+    /* one write for all the frames of the wakeup */
+    while (off < cli->term_len) {
+        ssize_t wr = write(STDOUT_FILENO, cli->term + off, cli->term_len - off);
+        if (wr < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                struct pollfd pfd = {.fd = STDOUT_FILENO, .events = POLLOUT};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            /* nobody reads the output, nothing to stay for */
+            cli->is_down = true;
+            break;
+        }
+        off += wr;
+    }
+    cli->term_len = 0;
+}
+
+static int
+cli_poll(cli_t *cli)
+{
+    uint32_t fd_events = EPOLLIN | (cli->is_epout ? EPOLLOUT : 0);
+    if (fd_events != cli->fd_events) {
+        struct epoll_event epev_ctl = {.events = fd_events, .data.fd = cli->fd};
+        if (epoll_ctl(cli->epoll_fd, EPOLL_CTL_MOD, cli->fd, &epev_ctl) < 0) {
+            return -1;
+        }
+        cli->fd_events = fd_events;
+    }
+
+    /* stdin waits while the server doesn't take the output, it leaves epoll
+     * rather than stays with no events, a hung up pipe is reported anyway */
+    uint32_t in_events = (!cli->is_in_eof && cli->out_bytes < CLI_OUT_MAX) ? EPOLLIN : 0;
+    if (!cli->is_in_file && in_events != cli->in_events) {
+        struct epoll_event epev_ctl = {.events = in_events, .data.fd = STDIN_FILENO};
+        if (epoll_ctl(cli->epoll_fd, in_events ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDIN_FILENO, &epev_ctl) < 0) {
             return -1;
         }
-        void *pmate = tfind(&kmate, mates, roommates_compar);
-        if (pmate) {
-            roommate_t *tmate = *(roommate_t **)pmate;
-            tsearch(tmate, &room->mates, roommates_compar);
-            tsearch(room, &tmate->rooms, rooms_compar);
-        }
-        free(kmate.name);
+        cli->in_events = in_events;
     }
     return 0;
 }
 
 static int
-room_del_mates(rooms_t *rooms, char *name, size_t name_sz, cfg_objlist_t *cfgmates)
+cli_connect(state_t *state)
 {
-    /* find the room by name */
-    roommate_t kroom = {
-        .name = strndup(name, name_sz)
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port   = state->net_port,
+        .sin_addr   = state->net_addr
     };
-    if (!kroom.name) {
-        /* allocation error */
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        mbr_add_loge(&state->mbroker, "can't create client socket");
         return -1;
     }
-    void *proom = tfind(&kroom, rooms, rooms_compar);
-    free(kroom.name);
-    if (!proom) {
-        /* the room does not exists */
+
+    /* the connect blocks, nothing else is going on yet */
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        mbr_add_loge(&state->mbroker, "can't connect to %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+        close(fd);
+        return -1;
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        mbr_add_loge(&state->mbroker, "can't make client socket non-blocking");
+        close(fd);
         return -1;
     }
+    return fd;
+}
 
-    /* delete mates from the room */
-    room_t *troom = *(room_t **)proom;
-    cfg_obj_t *cmate;
-    LIST_FOREACH(cmate, cfgmates, lentry) {
-        if (cmate->val_sz == 1 && cmate->val[0] == '*') {
-            troom->is_open = false;
-            continue;
+static int
+cli_loop(state_t *state)
+{
+    struct sigaction sigact;
+    sigact.sa_handler = signal_quit_handler;
+    sigemptyset(&sigact.sa_mask);
+    sigact.sa_flags = 0;
+
+    sigaction(SIGHUP,  &sigact, NULL);
+    sigaction(SIGINT,  &sigact, NULL);
+    sigaction(SIGTERM, &sigact, NULL);
+
+    sigact.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sigact, NULL);
+
+    cli_t cli = {
+        .state    = state,
+        .fd       = -1,
+        .epoll_fd = -1
+    };
+    CIRCLEQ_INIT(&cli.out);
+    int rc = -1;
+
+    cli.line        = malloc(CLI_LINE_SZ);
+    cli.ring_in.buf = malloc(CONN_RING_SZ);
+    cli.term        = malloc(CLI_TERM_SZ + UINT16_MAX + 3);
+    if (!cli.line || !cli.ring_in.buf || !cli.term) {
+        mbr_add_loge(&state->mbroker, "can't allocate client buffers");
+        goto finalize;
+    }
+    if ((cli.fd = cli_connect(state)) < 0) {
+        goto finalize;
+    }
+
+    cli.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (cli.epoll_fd < 0) {
+        mbr_add_loge(&state->mbroker, "epoll instance creation error");
+        goto finalize;
+    }
+    struct epoll_event epev_ctl = {.events = EPOLLIN, .data.fd = cli.fd};
+    if (epoll_ctl(cli.epoll_fd, EPOLL_CTL_ADD, cli.fd, &epev_ctl) < 0) {
+        mbr_add_loge(&state->mbroker, "can't add client socket to epoll");
+        goto finalize;
+    }
+    cli.fd_events = EPOLLIN;
+    epev_ctl.data.fd = STDIN_FILENO;
+    if (epoll_ctl(cli.epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &epev_ctl) == 0) {
+        cli.in_events = EPOLLIN;
+    } else if (errno == EPERM) {
+        /* a regular file, it is always ready */
+        cli.is_in_file = true;
+    } else {
+        mbr_add_loge(&state->mbroker, "can't add stdin to epoll");
+        goto finalize;
+    }
+
+    /* the login frames queued by cfg_cmdline_parse go first */
+    msg_t *msg = CIRCLEQ_FIRST(&state->mbroker.ml_pool);
+    while (msg != (void *)&state->mbroker.ml_pool) {
+        msg_t *next = CIRCLEQ_NEXT(msg, cq_entry);
+        if (MSG_TYP_MASK(msg->hdr.ops) == MSG_TYP_CB) {
+            CIRCLEQ_REMOVE(&state->mbroker.ml_pool, msg, cq_entry);
+            CIRCLEQ_INSERT_TAIL(&cli.out, msg, cq_entry);
+            cli.out_bytes += sizeof(msg->hdr) + msg->hdr.len;
         }
-        roommate_t kmate = {
-            .name = strndup(cmate->val, cmate->val_sz)
-        };
-        if (!kmate.name) {
-            /* allocation error */
-            continue;
+        msg = next;
+    }
+    cli_send(&cli);
+
+    bool is_backlog = false;
+    while (!cli.is_down && cli_poll(&cli) == 0) {
+        bool is_in_ready = cli.is_in_file && !cli.is_in_eof && cli.out_bytes < CLI_OUT_MAX;
+        bool is_linger   = cli.is_in_eof && CIRCLEQ_EMPTY(&cli.out) && !cli.is_shut;
+        int  timeout     = (is_backlog || is_in_ready) ? 0 : (is_linger ? CLI_LINGER_MS : -1);
+
+        struct epoll_event epev_wpool[CLI_EVENTS];
+        int epev_cnt = epoll_wait(cli.epoll_fd, epev_wpool, CLI_EVENTS, timeout);
+        if (signal_quit_flag) {
+            break;
         }
-        void *pmate = tfind(&kmate, &troom->mates, roommates_compar);
-        if (!pmate) {
-            continue;
+        if (epev_cnt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            mbr_add_loge(&state->mbroker, "epoll_wait error");
+            break;
+        }
+        if (is_linger && !epev_cnt) {
+            /* the replies to the last lines had their time, the server closes on our EOF */
+            shutdown(cli.fd, SHUT_WR);
+            cli.is_shut = true;
+        }
+
+        for (int iev = 0; iev < epev_cnt; iev++) {
+            if (epev_wpool[iev].data.fd == STDIN_FILENO) {
+                cli_stdin(&cli);
+            } else if ((epev_wpool[iev].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !is_backlog) {
+                cli_recv(&cli);
+            }
         }
-        roommate_t *tmate = *(roommate_t **)pmate;
+        if (is_in_ready) {
+            cli_stdin(&cli);
+        }
+        is_backlog = cli_frames(&cli);
+        cli_send(&cli);
+        cli_term_flush(&cli);
+        mbr_flush_locals(&state->mbroker);
+    }
 
-        tdelete(troom, &tmate->rooms, rooms_compar);
-        tdelete(tmate, &troom->mates, roommates_compar);
+    /* what the server sent before it closed the connection is shown still */
+    while (cli_frames(&cli)) {
+        cli_term_flush(&cli);
     }
-    return 0;
+    cli_term_flush(&cli);
+    rc = 0;
+
+finalize:
+    while (!CIRCLEQ_EMPTY(&cli.out)) {
+        msg = CIRCLEQ_FIRST(&cli.out);
+        CIRCLEQ_REMOVE(&cli.out, msg, cq_entry);
+        free(msg->data);
+        pool_put(&pools[POOL_MSG], msg);
+    }
+    if (cli.epoll_fd >= 0) {
+        close(cli.epoll_fd);
+    }
+    if (cli.fd >= 0) {
+        close(cli.fd);
+    }
+    free(cli.line);
+    free(cli.ring_in.buf);
+    free(cli.term);
+    return rc;
 }
 
+/**************************
+ * io_uring backend
+ **************************/
 static int
-room_clear_mates(room_t *room)
+uring_init(reactor_t *reactor)
 {
-    while (room->mates) {
-        roommate_t *tmate = *(roommate_t **)(room->mates);
-        tdelete(room, &tmate->rooms, rooms_compar);
-        tdelete(tmate, &room->mates, roommates_compar);
+    uring_t *uring = calloc(1, sizeof(uring_t));
+    if (!uring) {
+        return -1;
+    }
+    uring->fd   = -1;
+    uring->ring = uring->sqes = MAP_FAILED;
+    uring->br   = MAP_FAILED;
+    reactor->uring = uring;
+
+    struct io_uring_params params = {.flags = IORING_SETUP_COOP_TASKRUN};
+    uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring->fd < 0 && errno == EINVAL) {
+        params = (struct io_uring_params){0};
+        uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (uring->fd < 0) {
+        goto error;
+    }
+
+    /* multishot recv with provided buffers came along with the linked files feature */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+        || !(params.features & IORING_FEAT_EXT_ARG)
+        || !(params.features & IORING_FEAT_LINKED_FILE)
+       ) {
+        errno = ENOTSUP;
+        goto error;
+    }
+
+    size_t sq_sz  = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_sz  = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    uring->ring    = mmap(NULL, uring->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          uring->fd, IORING_OFF_SQ_RING);
+    if (uring->ring == MAP_FAILED) {
+        goto error;
+    }
+    uring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes    = mmap(NULL, uring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        goto error;
+    }
+
+    char *ring = uring->ring;
+    uring->sq_head    = (unsigned *)(ring + params.sq_off.head);
+    uring->sq_tail    = (unsigned *)(ring + params.sq_off.tail);
+    uring->sq_mask    = *(unsigned *)(ring + params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+    uring->sq_local   = *uring->sq_tail;
+    uring->cq_head    = (unsigned *)(ring + params.cq_off.head);
+    uring->cq_tail    = (unsigned *)(ring + params.cq_off.tail);
+    uring->cq_mask    = *(unsigned *)(ring + params.cq_off.ring_mask);
+    uring->cqes       = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    /* submission entries are taken in order, so the indirection array stays identity */
+    unsigned *sq_array = (unsigned *)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    /*
+     * provided buffers for multishot recv
+     */
+    uring->br_sz = URING_BUF_CNT * sizeof(struct io_uring_buf);
+    uring->br    = mmap(NULL, uring->br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->br == MAP_FAILED) {
+        goto error;
+    }
+    uring->bufs = malloc((size_t)URING_BUF_CNT * URING_BUF_SZ);
+    if (!uring->bufs) {
+        goto error;
+    }
+    struct io_uring_buf_reg breg = {
+        .ring_addr    = (uint64_t)(uintptr_t)uring->br,
+        .ring_entries = URING_BUF_CNT,
+        .bgid         = URING_BUF_GROUP
+    };
+    if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &breg, 1) < 0) {
+        goto error;
+    }
+    for (int bid = 0; bid < URING_BUF_CNT; bid++) {
+        uring_buf_put(uring, bid);
     }
     return 0;
+
+error:
+    uring_free(reactor);
+    return -1;
 }
 
-static int
-rooms_clear(rooms_t **rooms)
+static void
+uring_free(reactor_t *reactor)
 {
-    while (*rooms) {
-        room_t *troom = *(room_t **)(*rooms);
-        tdelete(troom, rooms, rooms_compar);
-        room_del(troom);
+    uring_t *uring = reactor->uring;
+    if (!uring) {
+        return;
     }
-    return 0;
+
+    /* closing the ring cancels whatever is left, nothing refers to the connections afterwards */
+    if (uring->fd >= 0) {
+        close(uring->fd);
+    }
+    CONN_TAB_FOREACH(&reactor->conns, fd) {
+        reactor->conns.conns[fd]->uring_ops = 0;
+    }
+    if (uring->ring != MAP_FAILED) {
+        munmap(uring->ring, uring->ring_sz);
+    }
+    if (uring->sqes != MAP_FAILED) {
+        munmap(uring->sqes, uring->sqes_sz);
+    }
+    if (uring->br != MAP_FAILED) {
+        munmap(uring->br, uring->br_sz);
+    }
+    free(uring->bufs);
+    free(uring);
+    reactor->uring = NULL;
 }
 
-/**************************
- * State of the process
- **************************/
 static int
-state_init(state_t *state)
+uring_enter(uring_t *uring, unsigned wait_nr, int timeout_ms)
 {
-    *state = (state_t){0};
-    CIRCLEQ_INIT(&state->mbroker.ml_pool);
-    CIRCLEQ_INIT(&state->mbroker.mpl_local);
-    return 0;
+    unsigned submit = uring->sq_local - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(uring->sq_tail, uring->sq_local, __ATOMIC_RELEASE);
+
+    unsigned                      flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec      ts;
+    struct io_uring_getevents_arg arg = {0};
+    if (wait_nr && timeout_ms >= 0) {
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts     = (uint64_t)(uintptr_t)&ts;
+        flags     |= IORING_ENTER_EXT_ARG;
+        return syscall(__NR_io_uring_enter, uring->fd, submit, wait_nr, flags, &arg, sizeof(arg));
+    }
+    return syscall(__NR_io_uring_enter, uring->fd, submit, wait_nr, flags, NULL, 0);
 }
 
-static void
-state_free(state_t *state)
+static struct io_uring_sqe *
+uring_sqe(uring_t *uring)
 {
-    return;
+    if (uring->sq_local - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+        /* submission queue is full, hand it over to the kernel right away */
+        if (uring_enter(uring, 0, -1) < 0
+            || uring->sq_local - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &uring->sqes[uring->sq_local & uring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sq_local++;
+    return sqe;
 }
 
 static void
-state_status_mates_wlk_short(const void *ptr, VISIT order, void *ctx)
+uring_buf_put(uring_t *uring, uint16_t bid)
+{
+    struct io_uring_buf *buf = &uring->br->bufs[uring->br_tail & (URING_BUF_CNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(uring->bufs + (size_t)bid * URING_BUF_SZ);
+    buf->len  = URING_BUF_SZ;
+    buf->bid  = bid;
+    uring->br_tail++;
+    __atomic_store_n(&uring->br->tail, uring->br_tail, __ATOMIC_RELEASE);
+}
+
+static int
+uring_arm_accept(reactor_t *reactor)
 {
-    if (order == postorder || order == leaf) {
-//        roommate_t *mate = *(roommate_t **) ptr;
-//        msg_add(NULL, *(int *)ctx | MSG_NOFIN, "%s  ", mate->name);
+    struct io_uring_sqe *sqe = uring_sqe(reactor->uring);
+    if (!sqe) {
+        return -1;
     }
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = reactor->listen_fd;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data    = URING_UDATA(URING_OP_ACCEPT, 0);
+    return 0;
 }
-static void
-state_status_mates_wlk_long(const void *ptr, VISIT order, void *ctx)
+
+static int
+uring_arm_event(reactor_t *reactor)
 {
-    if (order == postorder || order == leaf) {
-//        roommate_t *mate = *(roommate_t **) ptr;
-//        msg_add(NULL, *(int *)ctx | MSG_NOFIN, "  * name: %s, passwd: %s\n", mate->name, mate->passwd);
-//        msg_add(NULL, *(int *)ctx | MSG_NOFIN, "    rooms: ");
-//        twalk_r(mate->rooms, state_status_rooms_wlk_short, ctx);
-//        msg_add(NULL, *(int *)ctx | MSG_NOFIN, "\n");
+    struct io_uring_sqe *sqe = uring_sqe(reactor->uring);
+    if (!sqe) {
+        return -1;
     }
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = reactor->event_fd;
+    sqe->addr      = (uint64_t)(uintptr_t)&reactor->uring->evbuf;
+    sqe->len       = sizeof(reactor->uring->evbuf);
+    sqe->user_data = URING_UDATA(URING_OP_EVENT, 0);
+    return 0;
 }
-static void
-state_status_rooms_wlk_short(const void *ptr, VISIT order, void *ctx)
+
+static int
+uring_arm_recv(reactor_t *reactor, conn_t *conn)
 {
-    if (order == postorder || order == leaf) {
-//        room_t *room = *(room_t **) ptr;
-//        msg_add(NULL, *(int *)ctx | MSG_NOFIN, "%s  ", room->name);
+    struct io_uring_sqe *sqe = uring_sqe(reactor->uring);
+    if (!sqe) {
+        return -1;
     }
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = conn->fd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = URING_UDATA(URING_OP_RECV, CONN_TAB_KEY(conn));
+    conn->uring_ops++;
+    return 0;
 }
+
 static void
-state_status_rooms_wlk_long(const void *ptr, VISIT order, void *ctx)
+uring_cancel(reactor_t *reactor, int fd)
 {
-    if (order == postorder || order == leaf) {
-//        room_t *room = *(room_t **) ptr;
-//        msg_add(NULL, *(int *)ctx | MSG_NOFIN, "  * name: %s, open: %s\n", room->name, room->is_open ? "yes" : "no");
-//        msg_add(NULL, *(int *)ctx | MSG_NOFIN, "    roommates: ");
-//        twalk_r(room->mates, state_status_mates_wlk_short, ctx);
-//        msg_add(NULL, *(int *)ctx | MSG_NOFIN, "\n");
+    struct io_uring_sqe *sqe = uring_sqe(reactor->uring);
+    if (!sqe) {
+        /* the pending submissions complete with an error anyway */
+        shutdown(fd, SHUT_RDWR);
+        return;
     }
+    sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+    sqe->fd           = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data    = URING_UDATA(URING_OP_CANCEL, 0);
 }
 
-static void
-state_status_take(state_t *state, int msg_opts)
+static int
+uring_conn_output(reactor_t *reactor, conn_t *conn)
 {
-//    msg_add(NULL, msg_opts | MSG_NOFIN, "preset roommates: \n");
-    twalk_r(state->mates, state_status_mates_wlk_long, &msg_opts);
-//    msg_add(NULL, msg_opts | MSG_NOFIN, "\n");
+    /* one writev per connection is in flight, its completion submits the next one */
+    if (conn->is_closed || conn->is_epout) {
+        return conn->is_epout ? MSG_IO_AGAIN : MSG_IO_OK;
+    }
+    if (conn->room && conn->room->bcast) {
+        /* a member of a large room is flushed in place, ring frames waiting for the next
+         * submission or parked on a full socket would be gone over by the other reactors */
+        int rc = conn_flush(conn);
+        if (rc == MSG_IO_ERR || rc == MSG_IO_DOWN) {
+            conn_close(reactor, conn);
+            return rc;
+        }
+        if (rc == MSG_IO_AGAIN && uring_arm_pollout(reactor, conn) < 0) {
+            mbr_add_loge(&reactor->mbroker, "can't submit output of connection %d", conn->fd);
+            conn_close(reactor, conn);
+            return MSG_IO_ERR;
+        }
+        return rc;
+    }
+    conn_listing(reactor, conn);
+    if (!conn_has_output(conn)) {
+        return MSG_IO_OK;
+    }
 
-//    msg_add(NULL, msg_opts | MSG_NOFIN, "preset rooms: \n");
-    twalk_r(state->rooms, state_status_rooms_wlk_long, &msg_opts);
-//    msg_add(NULL, msg_opts, "");
-}
+    /* history is sent synchronously, the socket is non-blocking */
+    int rrc = conn_replay(reactor, conn);
+    if (rrc == MSG_IO_AGAIN) {
+        if (uring_arm_pollout(reactor, conn) < 0) {
+            mbr_add_loge(&reactor->mbroker, "can't submit output of connection %d", conn->fd);
+            conn_close(reactor, conn);
+            return MSG_IO_ERR;
+        }
+        return MSG_IO_AGAIN;
+    }
+    if (rrc != MSG_IO_OK) {
+        conn_close(reactor, conn);
+        return MSG_IO_ERR;
+    }
+    if (!conn_has_output(conn)) {
+        return MSG_IO_OK;
+    }
+    if (!conn->iov_out) {
+        conn->iov_out = malloc(CONN_IOV_MAX * sizeof(struct iovec));
+    }
 
-/**************************
- * Network communication
- **************************/
+    size_t expected;
+    int    iovcnt = conn->iov_out ? conn_gather(conn, conn->iov_out, &expected) : -1;
+    if (iovcnt == 0) {
+        /* nothing but own frames of the room were left */
+        return MSG_IO_OK;
+    }
+    struct io_uring_sqe *sqe = iovcnt > 0 ? uring_sqe(reactor->uring) : NULL;
+    if (!sqe) {
+        mbr_add_loge(&reactor->mbroker, "can't submit output of connection %d", conn->fd);
+        conn_close(reactor, conn);
+        return MSG_IO_ERR;
+    }
 
-int  signal_quit_flag;
+    sqe->opcode    = IORING_OP_WRITEV;
+    sqe->fd        = conn->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)conn->iov_out;
+    sqe->len       = iovcnt;
+    sqe->user_data = URING_UDATA(URING_OP_WRITEV, CONN_TAB_KEY(conn));
+    conn->uring_ops++;
+    conn->is_epout = true;
+    return MSG_IO_AGAIN;
+}
 
-void signal_quit_handler(int signum)
+static void
+uring_recv_done(reactor_t *reactor, struct io_uring_cqe *cqe)
 {
-    signal_quit_flag = signum;
+    uring_t *uring = reactor->uring;
+    conn_t  *conn  = conn_tab_get(&reactor->conns, URING_UDATA_KEY(cqe->user_data));
+    bool     more  = cqe->flags & IORING_CQE_F_MORE;
+    char    *buf   = NULL;
+    uint16_t bid   = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = uring->bufs + (size_t)bid * URING_BUF_SZ;
+    }
+    if (conn && !more) {
+        conn->uring_ops--;
+    }
+    if (!conn || conn->is_closed) {
+        if (buf) {
+            uring_buf_put(uring, bid);
+        }
+        if (conn && !conn->uring_ops) {
+            conn_close(reactor, conn);
+        }
+        return;
+    }
+
+    if (cqe->res > 0 && buf) {
+        conn_ring_t *ring = &conn->ring_in;
+        conn_ring_reserve(ring);
+        memcpy(ring->buf + ring->tail, buf, cqe->res);
+        ring->tail += cqe->res;
+        uring_buf_put(uring, bid);
+        srv_conn_input_frames(reactor, conn);
+    } else if (cqe->res != -ENOBUFS) {
+        /* connection is down, running out of provided buffers only stops the multishot */
+        if (buf) {
+            uring_buf_put(uring, bid);
+        }
+        conn_close(reactor, conn);
+        return;
+    }
+    if (!more && uring_arm_recv(reactor, conn) < 0) {
+        mbr_add_loge(&reactor->mbroker, "can't submit input of connection %d", conn->fd);
+        conn_close(reactor, conn);
+    }
 }
 
 static int
-cli_loop(state_t *state)
+uring_arm_pollout(reactor_t *reactor, conn_t *conn)
 {
-    int c;
-    // read(fileno(stdin), &c, 1);
-    // printf("characted is: %c\n", c);
-    // STDIN_FILENO
-    while((c=getchar())!= 'e') {
-        putchar(c);
+    struct io_uring_sqe *sqe = uring_sqe(reactor->uring);
+    if (!sqe) {
+        return -1;
     }
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data     = URING_UDATA(URING_OP_POLLOUT, CONN_TAB_KEY(conn));
+    conn->uring_ops++;
+    conn->is_epout = true;
     return 0;
 }
 
-static int
-srv_loop(state_t *state)
+static void
+uring_writev_done(reactor_t *reactor, struct io_uring_cqe *cqe)
 {
-    struct sigaction sigact;
-    sigact.sa_handler = signal_quit_handler;
-    sigemptyset(&sigact.sa_mask);
-    sigact.sa_flags = 0;
-
-    sigaction(SIGHUP,  &sigact, NULL);
-    sigaction(SIGINT,  &sigact, NULL);
-    sigaction(SIGTERM, &sigact, NULL);
+    conn_t *conn = conn_tab_get(&reactor->conns, URING_UDATA_KEY(cqe->user_data));
+    if (!conn) {
+        return;
+    }
+    conn->uring_ops--;
+    conn->is_epout = false;
+    if (conn->is_closed) {
+        if (!conn->uring_ops) {
+            conn_close(reactor, conn);
+        }
+        return;
+    }
 
-    /*
-     * configure listening socket
-     */
-    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-        mbr_add_loge(&state->mbroker, "can't create listen socket");
-        return -1;
+    if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        conn_close(reactor, conn);
+        return;
     }
-    int sockopt = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+    if (URING_UDATA_OP(cqe->user_data) == URING_OP_POLLOUT) {
+        /* socket has room again, the ring is gathered anew */
+        uring_conn_output(reactor, conn);
+        return;
+    }
+    if (cqe->res == -EAGAIN) {
+        if (uring_arm_pollout(reactor, conn) < 0) {
+            mbr_add_loge(&reactor->mbroker, "can't submit output of connection %d", conn->fd);
+            conn_close(reactor, conn);
+        }
+        return;
+    }
+    if (cqe->res > 0 && conn_advance(conn, cqe->res) != MSG_IO_OK) {
+        conn_close(reactor, conn);
+        return;
+    }
+    uring_conn_output(reactor, conn);
+}
 
-    struct sockaddr_in listen_addr = {0};
-    listen_addr.sin_family = AF_INET;
-    listen_addr.sin_port = state->net_port;
-    listen_addr.sin_addr = state->net_addr;
+static void
+uring_complete(reactor_t *reactor, struct io_uring_cqe *cqe)
+{
+    uring_t *uring = reactor->uring;
 
-    if (bind(listen_fd, (struct sockaddr *)(&listen_addr), sizeof(listen_addr)) < 0) {
-        mbr_add_loge(
-                &state->mbroker, "can't bind listen socket to %s:%d",
-                inet_ntoa(listen_addr.sin_addr),
-                ntohs(listen_addr.sin_port));
-        close(listen_fd);
-        return -1;
-    }
-    if (listen(listen_fd, INT32_MAX) < 0) {
-        mbr_add_loge(&state->mbroker, "listen socket error");
-        close(listen_fd);
-        return -1;
+    switch (URING_UDATA_OP(cqe->user_data)) {
+    case URING_OP_ACCEPT:
+        if (cqe->res >= 0) {
+            if (uring->is_stopping) {
+                close(cqe->res);
+                break;
+            }
+            struct sockaddr_in addr     = {0};
+            socklen_t          addr_len = sizeof(addr);
+            getpeername(cqe->res, (struct sockaddr *)&addr, &addr_len);
+
+            conn_t *conn = srv_conn_new(reactor, cqe->res, &addr, addr_len);
+            if (conn && uring_arm_recv(reactor, conn) < 0) {
+                mbr_add_loge(&reactor->mbroker, "can't submit input of connection %d", conn->fd);
+                conn_close(reactor, conn);
+            }
+            reactor_acc_count(reactor, 1);
+        } else if (cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            mbr_add_loge(&reactor->mbroker, "can't accept new client connection");
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE) && !uring->is_stopping
+            && cqe->res != -EINVAL && uring_arm_accept(reactor) < 0) {
+            mbr_add_loge(&reactor->mbroker, "can't submit accept of reactor %d", reactor->id);
+        }
+        break;
+
+    case URING_OP_EVENT:
+        /* messages routed by the other reactors */
+        if (cqe->res != -ECANCELED && !uring->is_stopping) {
+            reactor_inbox(reactor);
+            uring_arm_event(reactor);
+        }
+        break;
+
+    case URING_OP_RECV:
+        uring_recv_done(reactor, cqe);
+        break;
+
+    case URING_OP_WRITEV:
+    case URING_OP_POLLOUT:
+        uring_writev_done(reactor, cqe);
+        break;
+
+    default:
+        break;
     }
+}
 
-    /*
-     * configure event poll
-     */
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0) {
-        mbr_add_loge(&state->mbroker, "epoll instance creation error");
-        close(listen_fd);
-        return -1;
+static int
+uring_reap(reactor_t *reactor)
+{
+    uring_t *uring = reactor->uring;
+    unsigned head  = *uring->cq_head;
+    int      count = 0;
+
+    for (;;) {
+        if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        struct io_uring_cqe cqe = uring->cqes[head & uring->cq_mask];
+        __atomic_store_n(uring->cq_head, ++head, __ATOMIC_RELEASE);
+        uring_complete(reactor, &cqe);
+        count++;
     }
-    const  int         EPEV_WPOOL = 16;
-    struct epoll_event epev_wpool[EPEV_WPOOL];
-    struct epoll_event epev_ctl;
+    return count;
+}
 
-    epev_ctl.data.ptr = NULL;
-    epev_ctl.events   = EPOLLIN;
+static void
+uring_stop(reactor_t *reactor)
+{
+    uring_t *uring = reactor->uring;
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &epev_ctl) < 0) {
-        mbr_add_loge(&state->mbroker, "can't add listen socket to epoll");
-        close(epoll_fd);
-        close(listen_fd);
-        return -1;
+    uring->is_stopping = true;
+    uring_cancel(reactor, reactor->listen_fd);
+    uring_cancel(reactor, reactor->event_fd);
+    CONN_TAB_FOREACH(&reactor->conns, fd) {
+        conn_close(reactor, reactor->conns.conns[fd]);
     }
 
-    for (;;) {
-        int epev_cnt = epoll_wait(epoll_fd, epev_wpool, EPEV_WPOOL, -1);
-        if (epev_cnt < 0) {
-            mbr_add_loge(&state->mbroker, "epoll_wait error");
+    /* wait for the cancelled submissions to give the buffers back */
+    while (reactor->conns.count) {
+        int rc = uring_enter(uring, 1, URING_DRAIN_MS);
+        if (rc < 0 && errno != EINTR) {
             break;
         }
-        if (signal_quit_flag) {
-            mbr_add_loge(&state->mbroker, "interrupted by %d signal", signal_quit_flag);
+        unsigned head = *uring->cq_head;
+        if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
             break;
         }
+        uring_reap(reactor);
+    }
+}
 
-        for (int iev = 0; iev < epev_cnt; iev++) {
-            if (epev_wpool[iev].data.ptr == NULL) {
-                /* got input event from the listen_fd. Establish new connection */
-                conn_t *conn = calloc(1, sizeof(conn_t));
-                if (!conn) {
-                    mbr_add_loge(&state->mbroker, "can't create new client connection");
-                    continue;
-                }
-                conn->fd = accept(listen_fd, (struct sockaddr *)&conn->addr, &conn->addr_len);
-                if (conn->fd < 0) {
-                    mbr_add_loge(&state->mbroker, "can't accept new client connection");
-                    free(conn);
-                    continue;
-                }
-                fcntl(conn->fd, F_SETFL, O_NONBLOCK);
-                epev_ctl.data.ptr = conn;
-                epev_ctl.events   = EPOLLIN;
-                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &epev_ctl) < 0) {
-                    fprintf(stderr, "can't add client socket to epoll");
-                    close(conn->fd);
-                    free(conn);
-                    continue;
-                }
-                conn_t *pconn = tsearch(conn, &state->conns, conns_compar);
-                if (!pconn || (*(conn_t **)pconn != conn)) {
-                    fprintf(stderr, "can't add new connection to the state tree");
-                    close(conn->fd);
-                    free(conn);
-                    continue;
-                }
+static void
+reactor_loop_uring(reactor_t *reactor)
+{
+    state_t *state = reactor->state;
 
-            } else if (epev_wpool[iev].events & EPOLLIN) {
-                /* input event from the client connection */
-                conn_t *conn = epev_wpool[iev].data.ptr;
-                msg_io_read(&conn->msg_in, conn->fd, &conn->cursor_in);
-                msg_io_write(&conn->msg_in, conn->fd, &conn->cursor_out);
+    if (uring_arm_accept(reactor) < 0 || uring_arm_event(reactor) < 0) {
+        mbr_add_loge(&reactor->mbroker, "can't submit accept of reactor %d", reactor->id);
+        return;
+    }
+    for (;;) {
+        /* the signal breaks the wait, the dump goes before the next one so errno stays for it */
+        if (signal_stats_flag && reactor->id == 0) {
+            signal_stats_flag = 0;
+            state_stats_dump(reactor);
+        }
+        /* one syscall submits the output of the previous batch and waits for the next one */
+        int rc = uring_enter(reactor->uring, 1, wheel_timeout(&reactor->wheel, state_clock()));
+        if (reactor_stopped(reactor)) {
+            break;
+        }
+        if (rc < 0 && errno != ETIME) {
+            if (errno == EINTR || errno == EBUSY) {
+                continue;
             }
+            mbr_add_loge(&reactor->mbroker, "io_uring_enter error");
+            break;
         }
-    }
 
-    close(epoll_fd);
-    close(listen_fd);
+        reactor_mem_check(reactor);
+        pthread_rwlock_rdlock(&state->lock);
+        wheel_advance(&reactor->wheel, reactor, state_clock());
+        int cqe_cnt = uring_reap(reactor);
+        reactor_pending(reactor);
+        pthread_rwlock_unlock(&state->lock);
+        mbr_flush_locals(&reactor->mbroker);
 
-    return 0;
+        REACTOR_STAT_ADD(reactor, wakeups, 1);
+        REACTOR_STAT_ADD(reactor, events, cqe_cnt);
+    }
 }
 
 /**************************************
@@ -734,13 +6465,13 @@ cfg_objstring_parse(char *objstring, size_t objstring_sz, cfg_objlist_t *objlist
 
     for (obj_b = 0, obj_e = 0 ; obj_b < objstring_sz;) {
         /* skip outer delimiters */
-        for (; CFG_OBJ_OUTER_DELIMS(objstring[obj_b]) && (obj_b < objstring_sz); obj_b++);
+        for (; (obj_b < objstring_sz) && CFG_OBJ_OUTER_DELIMS(objstring[obj_b]); obj_b++);
         /* take object */
-        for (obj_e = obj_b; !CFG_OBJ_OUTER_DELIMS(objstring[obj_e]) && (obj_e < objstring_sz); obj_e++);
+        for (obj_e = obj_b; (obj_e < objstring_sz) && !CFG_OBJ_OUTER_DELIMS(objstring[obj_e]); obj_e++);
 
         if (objtype == CFG_OBJ_VE) {
             /* take object name */
-            for (name_b = name_e = obj_b; !CFG_OBJ_INNER_DELIMS(objstring[name_e]) && (name_e < obj_e); name_e++);
+            for (name_b = name_e = obj_b; (name_e < obj_e) && !CFG_OBJ_INNER_DELIMS(objstring[name_e]); name_e++);
             /* take object extension */
             ext_b = (name_e < obj_e) ? name_e + 1 : name_e;
             ext_e = obj_e;
@@ -750,8 +6481,15 @@ cfg_objstring_parse(char *objstring, size_t objstring_sz, cfg_objlist_t *objlist
             ext_b = ext_e = name_e;
         }
 
+        if (name_e - name_b > UINT16_MAX || ext_e - ext_b > UINT16_MAX) {
+            /* the sizes of a snapshot record, as cfg_tok_push takes them */
+            return -1;
+        }
         if (name_b < name_e) {
-            cfg_obj_t *obj = calloc(1, sizeof(cfg_obj_t));
+            cfg_obj_t *obj = pool_get(&pools[POOL_CFGOBJ]);
+            if (!obj) {
+                return -1;
+            }
             obj->val = &objstring[name_b];
             obj->val_sz = name_e - name_b;
             if (ext_b < ext_e) {
@@ -771,109 +6509,422 @@ cfg_objlist_clear(cfg_objlist_t *objlist)
     while (!LIST_EMPTY(objlist)) {
         cfg_obj_t *cfg_obj = LIST_FIRST(objlist);
         LIST_REMOVE(cfg_obj, lentry);
-        free(cfg_obj);
+        pool_put(&pools[POOL_CFGOBJ], cfg_obj);
     }
     return 0;
 }
 
-static int
-cfg_admline_parse(char *cmdline, state_t *state, bool *quit)
+static uint32_t
+cfg_delims_mask(const char *p)
 {
-    int   retcode = 0;
-    char *cmdline_sptr = NULL;
-    char *cmdline_sdup = strdup(cmdline);
+    /* bit per byte of the 16 at p which may end a token */
+#ifdef __SSE2__
+    __m128i v   = _mm_loadu_si128((const __m128i *)p);
+    __m128i ctl = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i m   = _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8('\r' - '\t')), ctl);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(':')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('@')));
+    return (uint32_t)_mm_movemask_epi8(m);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < 16; i++) {
+        mask |= (uint32_t)CFG_FILE_DELIMS((unsigned char)p[i]) << i;
+    }
+    return mask;
+#endif
+}
+
+static const char *
+cfg_scan_next(cfg_scan_t *scan)
+{
+    while (!scan->mask) {
+        if (scan->next >= scan->end) {
+            return scan->end;
+        }
+        scan->blk = scan->next;
+        if (scan->end - scan->blk >= 16) {
+            scan->mask = cfg_delims_mask(scan->blk);
+            scan->next = scan->blk + 16;
+        } else {
+            /* the tail is scanned bytewise, a load past the chunk may run off the mapping */
+            for (const char *c = scan->blk; c < scan->end; c++) {
+                scan->mask |= (uint32_t)CFG_FILE_DELIMS((unsigned char)*c) << (c - scan->blk);
+            }
+            scan->next = scan->end;
+        }
+    }
+    int bit = __builtin_ctz(scan->mask);
+    scan->mask &= scan->mask - 1;
+    return scan->blk + bit;
+}
 
-    char *command = !cmdline_sdup ? NULL : strtok_r(cmdline_sdup, " ", &cmdline_sptr);
-    if (!command) {
-        free(cmdline_sdup);
+static int
+cfg_tok_push(cfg_chunk_t *chunk, cfg_tok_kind_t kind, const char *val, size_t val_sz, const char *ext, size_t ext_sz)
+{
+    if (val_sz > UINT16_MAX || ext_sz > UINT16_MAX) {
         return -1;
     }
-    if (strcmp(command, ":quit") == 0) {
-        *quit = true;
-        return 0;
-    } else {
-        *quit = false;
+    if (chunk->toks_cn == chunk->toks_sz) {
+        size_t     toks_sz = chunk->toks_sz ? chunk->toks_sz * 2 : (size_t)(chunk->e - chunk->b) / 16 + 16;
+        cfg_tok_t *toks    = realloc(chunk->toks, toks_sz * sizeof(cfg_tok_t));
+        if (!toks) {
+            chunk->is_nomem = true;
+            return -1;
+        }
+        chunk->toks    = toks;
+        chunk->toks_sz = toks_sz;
     }
+    chunk->toks[chunk->toks_cn++] = (cfg_tok_t){
+        .val    = val,
+        .ext    = ext,
+        .val_sz = (uint32_t)val_sz,
+        .ext_sz = (uint32_t)ext_sz,
+        .hash   = val_sz ? htab_hash(val, val_sz) : 0,
+        .kind   = kind
+    };
+    chunk->mates += (kind == CFG_TOK_MATE);
+    return 0;
+}
 
-    if (state->workmode == WORKMODE_ADM) {
-        if (strcmp(command, ":roommates") == 0) {
-            char *subcmd = strtok_r(NULL, " ", &cmdline_sptr);
+static void *
+cfg_file_tokenize(void *arg)
+{
+    cfg_chunk_t *chunk  = arg;
+    cfg_scan_t   scan   = {.next = chunk->b, .end = chunk->e};
+    cfg_line_t   line   = CFG_LINE_START;
+    const char  *line_b = chunk->b;
+    const char  *obj_b  = chunk->b;     /* start of the current object   */
+    const char  *val_e  = NULL;         /* ':' of a mate, NULL before it */
 
-            if (subcmd && (strcmp(subcmd, "add") == 0) && cmdline_sptr) {
-                cfg_objlist_t col_mates;
-                LIST_INIT(&col_mates);
-                cfg_objstring_parse(cmdline_sptr, strlen(cmdline_sptr), &col_mates, CFG_OBJ_VE);
+    for (;;) {
+        const char *d = cfg_scan_next(&scan);
+        char        c = d < chunk->e ? *d : '\n';
 
-                if (!LIST_EMPTY(&col_mates)) {
-                    roommates_add(&state->mates, &col_mates);
-                    cfg_objlist_clear(&col_mates);
-                }
-            } else if (subcmd && (strcmp(subcmd, "del") == 0) && cmdline_sptr) {
-                cfg_objlist_t col_mates;
-                LIST_INIT(&col_mates);
-                cfg_objstring_parse(cmdline_sptr, strlen(cmdline_sptr), &col_mates, CFG_OBJ_VE);
-
-                if (!LIST_EMPTY(&col_mates)) {
-                    roommates_del(&state->mates, &col_mates);
-                    cfg_objlist_clear(&col_mates);
-                }
-            } else if (subcmd && strcmp(subcmd, "clear") == 0) {
-                roommates_clear(&state->mates);
+        /* a delimiter out of its place belongs to the object */
+        if ((c == ':' && (line != CFG_LINE_MATES || val_e)) || (c == '@' && line != CFG_LINE_ROOM_MATES)) {
+            continue;
+        }
+        if (c == ':') {
+            val_e = d;
+            continue;
+        }
 
-            } else if (subcmd && strcmp(subcmd, "show") == 0) {
-                // TODO: show status here
+        size_t obj_sz = d - obj_b;
+        int    rc     = 0;
+        switch (line) {
+        case CFG_LINE_START:
+            if (!obj_sz) {
+                break;
+            }
+            if (*obj_b == '#') {
+                line = CFG_LINE_SKIP;
+            } else if (obj_sz == strlen("roommates") && memcmp(obj_b, "roommates", obj_sz) == 0) {
+                line = CFG_LINE_MATES;
+            } else if (obj_sz == strlen("rooms") && memcmp(obj_b, "rooms", obj_sz) == 0) {
+                line = CFG_LINE_ROOM_MATES;
+                rc = cfg_tok_push(chunk, CFG_TOK_ROOMS, NULL, 0, NULL, 0);
+            } else {
+                rc = -1;
+            }
+            break;
+        case CFG_LINE_MATES:
+            /* objects without a name or a password are skipped, as by --roommates */
+            if (val_e && val_e > obj_b && d > val_e + 1) {
+                rc = cfg_tok_push(chunk, CFG_TOK_MATE, obj_b, val_e - obj_b, val_e + 1, d - val_e - 1);
+            }
+            break;
+        case CFG_LINE_ROOM_MATES:
+        case CFG_LINE_ROOMS:
+            if (obj_sz) {
+                rc = cfg_tok_push(chunk, line == CFG_LINE_ROOMS ? CFG_TOK_ROOM : CFG_TOK_ROOM_MATE,
+                        obj_b, obj_sz, NULL, 0);
+            }
+            if (c == '@') {
+                line = CFG_LINE_ROOMS;
             }
+            break;
+        case CFG_LINE_SKIP:
+            break;
         }
+        if (chunk->is_nomem) {
+            return NULL;
+        }
+        if (rc < 0) {
+            /* the first line not understood is reported, the rest of it is ignored */
+            chunk->err = chunk->err ? chunk->err : line_b;
+            line = CFG_LINE_SKIP;
+        }
+        if (c == '\n') {
+            line   = CFG_LINE_START;
+            line_b = d + 1;
+        }
+        obj_b = d + 1;
+        val_e = NULL;
+        if (d >= chunk->e) {
+            return NULL;
+        }
+    }
+}
 
-        if (strcmp(command, ":rooms") == 0) {
-            char *subcmd = strtok_r(NULL, " ", &cmdline_sptr);
-
-            if (subcmd && strcmp(subcmd, "addmates") == 0) {
-                char *rname = strtok_r(NULL, " ", &cmdline_sptr);
-                if (rname && cmdline_sptr) {
-                    cfg_objlist_t col_mates;
-                    LIST_INIT(&col_mates);
-                    cfg_objstring_parse(cmdline_sptr, strlen(cmdline_sptr), &col_mates, CFG_OBJ_VE);
+static int
+cfg_file_build(state_t *state, cfg_chunk_t *chunks, int chunks_cn)
+{
+    size_t mates_cn = state->mates.count;
+    for (int i = 0; i < chunks_cn; i++) {
+        mates_cn += chunks[i].mates;
+    }
+    if (htab_reserve(&state->mates, mates_cn) < 0) {
+        return -1;
+    }
 
-                    if (!LIST_EMPTY(&col_mates)) {
-                        room_add_mates(&state->rooms, &state->mates, rname, strlen(rname), &col_mates);
-                        cfg_objlist_clear(&col_mates);
-                    }
+    /* all the mates go first, a rooms line may name the mates of any roommates line */
+    for (int i = 0; i < chunks_cn; i++) {
+        for (cfg_tok_t *tok = chunks[i].toks; tok < chunks[i].toks + chunks[i].toks_cn; tok++) {
+            if (tok->kind != CFG_TOK_MATE) {
+                continue;
+            }
+            cfg_obj_t   cmate = {.val = (char *)tok->val, .val_sz = tok->val_sz, .ext = (char *)tok->ext, .ext_sz = tok->ext_sz};
+            roommate_t *mate;
+            if (roommate_create(&mate, &cmate) < 0) {
+                return -1;
+            }
+            int rc = htab_insert_hashed(&state->mates, tok->hash, mate->name, tok->val_sz, mate);
+            if (rc != 0) {
+                /* the first of the same name is kept */
+                roommate_del(mate, NULL);
+                if (rc < 0) {
+                    return -1;
                 }
             }
-            if (subcmd && strcmp(subcmd, "delmates") == 0) {
-                char *rname = strtok_r(NULL, " ", &cmdline_sptr);
-                if (rname && cmdline_sptr) {
-                    cfg_objlist_t col_mates;
-                    LIST_INIT(&col_mates);
-                    cfg_objstring_parse(cmdline_sptr, strlen(cmdline_sptr), &col_mates, CFG_OBJ_VE);
+        }
+    }
+
+    /* then every rooms line, its mates are added to each of its rooms */
+    for (int i = 0; i < chunks_cn; i++) {
+        cfg_tok_t *toks_e = chunks[i].toks + chunks[i].toks_cn;
+        for (cfg_tok_t *tok = chunks[i].toks; tok < toks_e; tok++) {
+            if (tok->kind != CFG_TOK_ROOMS) {
+                continue;
+            }
+            cfg_tok_t *mates_b = tok + 1, *mates_e = mates_b;
+            for (; mates_e < toks_e && mates_e->kind == CFG_TOK_ROOM_MATE; mates_e++);
 
-                    if (!LIST_EMPTY(&col_mates)) {
-                        room_del_mates(&state->rooms, rname, strlen(rname), &col_mates);
-                        cfg_objlist_clear(&col_mates);
+            for (tok = mates_e; tok < toks_e && tok->kind == CFG_TOK_ROOM; tok++) {
+                room_t *room = room_take(&state->rooms, tok->hash, tok->val, tok->val_sz);
+                if (!room || pset_reserve(&room->mates, room->mates.count + (mates_e - mates_b)) < 0) {
+                    return -1;
+                }
+                for (cfg_tok_t *mtok = mates_b; mtok < mates_e; mtok++) {
+                    if (mtok->val_sz == 1 && mtok->val[0] == '*') {
+                        room->is_open = true;
+                        continue;
+                    }
+                    roommate_t *mate = htab_find_hashed(&state->mates, mtok->hash, mtok->val, mtok->val_sz);
+                    if (mate && (pset_add(&room->mates, mate) < 0 || pset_add(&mate->rooms, room) < 0)) {
+                        /* allocation error */
+                        pset_del(&room->mates, mate);
+                        return -1;
                     }
                 }
             }
+            tok--;
+        }
+    }
+    return 0;
+}
+
+static int
+cfg_file_load(const char *path, state_t *state)
+{
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+    struct stat st;
+    int         fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        mbr_add_loge(&state->mbroker, "can't open config %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
         }
+        return -1;
+    }
+    size_t size = st.st_size;
+    char  *map  = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED) {
+        mbr_add_loge(&state->mbroker, "can't map config %s: %s", path, strerror(errno));
+        return -1;
+    }
 
-        if (strcmp(command, ":status") == 0) {
-            // TODO: show status here
+    /* a chunk per thread, cut at line boundaries */
+    cfg_chunk_t chunks[CFG_FILE_THREADS_MAX] = {0};
+    long        cpus      = sysconf(_SC_NPROCESSORS_ONLN);
+    int         chunks_cn = (int)(size / CFG_FILE_CHUNK_MIN) + 1;
+    chunks_cn = chunks_cn < cpus ? chunks_cn : (cpus > 0 ? (int)cpus : 1);
+    chunks_cn = chunks_cn < CFG_FILE_THREADS_MAX ? chunks_cn : CFG_FILE_THREADS_MAX;
+
+    const char *b = map, *end = map + size;
+    for (int i = 0; i < chunks_cn; i++) {
+        const char *e = (i + 1 == chunks_cn) ? end : map + size / chunks_cn * (i + 1);
+        if (e <= b) {
+            e = b;
+        } else if (e < end) {
+            const char *nl = memchr(e - 1, '\n', end - e + 1);
+            e = nl ? nl + 1 : end;
         }
+        chunks[i].b = b;
+        chunks[i].e = e;
+        b = e;
     }
-    free(cmdline_sdup);
-    return retcode;
+    for (int i = 1; i < chunks_cn; i++) {
+        chunks[i].is_thread = pthread_create(&chunks[i].thread, NULL, cfg_file_tokenize, &chunks[i]) == 0;
+    }
+    for (int i = 0; i < chunks_cn; i++) {
+        if (i == 0 || !chunks[i].is_thread) {
+            cfg_file_tokenize(&chunks[i]);
+        } else {
+            pthread_join(chunks[i].thread, NULL);
+        }
+    }
+
+    int rc = 0;
+    for (int i = 0; i < chunks_cn && !rc; i++) {
+        if (chunks[i].is_nomem) {
+            mbr_add_loge(&state->mbroker, "config %s: out of memory", path);
+            rc = -1;
+        } else if (chunks[i].err) {
+            size_t line = 1;
+            for (const char *p = map; (p = memchr(p, '\n', chunks[i].err - p)) != NULL; p++, line++);
+            mbr_add_loge(&state->mbroker, "config %s:%zu: unexpected line", path, line);
+            rc = -1;
+        }
+    }
+    if (!rc && cfg_file_build(state, chunks, chunks_cn) < 0) {
+        mbr_add_loge(&state->mbroker, "config %s: out of memory", path);
+        rc = -1;
+    }
+    for (int i = 0; i < chunks_cn; i++) {
+        free(chunks[i].toks);
+    }
+    if (map) {
+        munmap(map, size);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    if (!rc) {
+        mbr_add_logi(&state->mbroker, "config %s: %zu room mates, %zu rooms, %d threads, %.1f ms", path,
+                state->mates.count, state->rooms.count, chunks_cn,
+                (ts1.tv_sec - ts0.tv_sec) * 1e3 + (ts1.tv_nsec - ts0.tv_nsec) / 1e6);
+    }
+    return rc;
+}
+
+static int
+cfg_admline_parse(char *cmdline, state_t *state, bool *quit)
+{
+    cmd_t cmd;
+
+    /* the same text commands as the server takes, parsed in place */
+    if (cmd_text_parse(cmdline, strlen(cmdline), &cmd) < 0) {
+        return -1;
+    }
+    *quit = cmd.op == CMD_OP_QUIT;
+    if (*quit || state->workmode != WORKMODE_ADM) {
+        return 0;
+    }
+
+    switch (cmd.op) {
+    case CMD_OP_ROOMMATES:
+        if (cmd.argc && cmd_arg_is(&cmd.argv[0], "show")) {
+            status_text_t *text = state_status_cached(state, &state->status_mates, state_status_mates);
+            mbr_add_logi(&state->mbroker, "%.*s", text ? (int)text->len : 0, text ? text->buf : "");
+            state_status_unref(text);
+            break;
+        }
+        /* fall through */
+    case CMD_OP_ROOMS:
+        pthread_rwlock_wrlock(&state->lock);
+        state_registry_edit(state, &state->mbroker, &cmd);
+        pthread_rwlock_unlock(&state->lock);
+        break;
+    case CMD_OP_STATUS: {
+        status_text_t *text = state_status_render(state, state_status_take);
+        mbr_add_logi(&state->mbroker, "%.*s", text ? (int)text->len : 0, text ? text->buf : "");
+        state_status_unref(text);
+        break;
+    }
+    default:
+        break;
+    }
+    return 0;
+}
+
+static int
+cfg_optnum_parse(const char *optval, long min, long max, long *val)
+{
+    char *optval_e = NULL;
+
+    errno = 0;
+    *val  = strtol(optval, &optval_e, 10);
+    if (errno || optval_e == optval || *optval_e || *val < min || *val > max) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+cfg_outpolicy_parse(const char *optval, conn_out_policy_t *policy)
+{
+    if (strcmp(optval, "oldest") == 0) {
+        *policy = CONN_OUT_DROP_OLDEST;
+    } else if (strcmp(optval, "chat") == 0) {
+        *policy = CONN_OUT_DROP_CHAT;
+    } else if (strcmp(optval, "disconnect") == 0) {
+        *policy = CONN_OUT_DISCONNECT;
+    } else {
+        return -1;
+    }
+    return 0;
 }
 
 static int
 cfg_cmdline_parse(int argc, char **argv, state_t *state, bool *helpshow)
 {
     int   retcode = 0;
-    char *shortopts = "s:a:m:R:c:L:l:r:h";
+    char *shortopts = "s:a:m:R:C:N:w:A:b:e:EUS:B:Z:P:j:k:g:O:o:M:W:z:Y:T:I:H:G:c:L:l:r:h";
     struct option longopts[] = {
             {"server",    required_argument, NULL, 's'},
             {"admin",     required_argument, NULL, 'a'},
             {"roommates", required_argument, NULL, 'm'},
             {"rooms",     required_argument, NULL, 'R'},
+            {"config",    required_argument, NULL, 'C'},
+            {"snapshot",  required_argument, NULL, 'N'},
+            {"workers",   required_argument, NULL, 'w'},
+            {"accept-burst", required_argument, NULL, 'A'},
+            {"backlog",   required_argument, NULL, 'b'},
+            {"events",    required_argument, NULL, 'e'},
+            {"edge",      no_argument,       NULL, 'E'},
+            {"uring",     no_argument,       NULL, 'U'},
+            {"stats",     required_argument, NULL, 'S'},
+            {"bcast-min", required_argument, NULL, 'B'},
+            {"bcast-ring", required_argument, NULL, 'Z'},
+            {"bcast-lag", required_argument, NULL, 'P'},
+            {"journal",   required_argument, NULL, 'j'},
+            {"journal-keep", required_argument, NULL, 'k'},
+            {"journal-age", required_argument, NULL, 'g'},
+            {"out-limit", required_argument, NULL, 'O'},
+            {"out-policy", required_argument, NULL, 'o'},
+            {"mem-mark",  required_argument, NULL, 'M'},
+            {"mem-policy", required_argument, NULL, 'W'},
+            {"compress-min", required_argument, NULL, 'z'},
+            {"resume-window", required_argument, NULL, 'Y'},
+            {"resume-ttl", required_argument, NULL, 'T'},
+            {"idle-timeout", required_argument, NULL, 'I'},
+            {"heartbeat", required_argument, NULL, 'H'},
+            {"login-timeout", required_argument, NULL, 'G'},
 
             {"connect",   required_argument, NULL, 'c'},
             {"logadm",    required_argument, NULL, 'L'},
@@ -892,6 +6943,31 @@ cfg_cmdline_parse(int argc, char **argv, state_t *state, bool *helpshow)
         char   **rooms;
         size_t   rooms_cn;
         size_t   rooms_sz;
+        char    *config;
+        char    *snapshot;
+        char    *workers;
+        char    *accept_burst;
+        char    *backlog;
+        char    *events;
+        bool     edge;
+        bool     uring;
+        char    *stats;
+        char    *bcast_min;
+        char    *bcast_ring;
+        char    *bcast_lag;
+        char    *journal;
+        char    *journal_keep;
+        char    *journal_age;
+        char    *out_limit;
+        char    *out_policy;
+        char    *mem_mark;
+        char    *mem_policy;
+        char    *compress_min;
+        char    *resume_window;
+        char    *resume_ttl;
+        char    *idle_timeout;
+        char    *heartbeat;
+        char    *login_timeout;
 
         char    *connect;
         char    *logadm;
@@ -920,6 +6996,81 @@ cfg_cmdline_parse(int argc, char **argv, state_t *state, bool *helpshow)
             valopts.rooms = realloc(valopts.rooms, valopts.rooms_sz * sizeof(valopts.rooms[0]));
             valopts.rooms[valopts.rooms_cn++] = optarg;
             break;
+        case 'C':
+            valopts.config = strdup(optarg);
+            break;
+        case 'N':
+            valopts.snapshot = strdup(optarg);
+            break;
+        case 'w':
+            valopts.workers = strdup(optarg);
+            break;
+        case 'A':
+            valopts.accept_burst = strdup(optarg);
+            break;
+        case 'b':
+            valopts.backlog = strdup(optarg);
+            break;
+        case 'e':
+            valopts.events = strdup(optarg);
+            break;
+        case 'E':
+            valopts.edge = true;
+            break;
+        case 'U':
+            valopts.uring = true;
+            break;
+        case 'S':
+            valopts.stats = strdup(optarg);
+            break;
+        case 'B':
+            valopts.bcast_min = strdup(optarg);
+            break;
+        case 'Z':
+            valopts.bcast_ring = strdup(optarg);
+            break;
+        case 'P':
+            valopts.bcast_lag = strdup(optarg);
+            break;
+        case 'j':
+            valopts.journal = strdup(optarg);
+            break;
+        case 'k':
+            valopts.journal_keep = strdup(optarg);
+            break;
+        case 'g':
+            valopts.journal_age = strdup(optarg);
+            break;
+        case 'O':
+            valopts.out_limit = strdup(optarg);
+            break;
+        case 'o':
+            valopts.out_policy = strdup(optarg);
+            break;
+        case 'M':
+            valopts.mem_mark = strdup(optarg);
+            break;
+        case 'W':
+            valopts.mem_policy = strdup(optarg);
+            break;
+        case 'z':
+            valopts.compress_min = strdup(optarg);
+            break;
+        case 'Y':
+            valopts.resume_window = strdup(optarg);
+            break;
+        case 'T':
+            valopts.resume_ttl = strdup(optarg);
+            break;
+        case 'I':
+            valopts.idle_timeout = strdup(optarg);
+            break;
+        case 'H':
+            valopts.heartbeat = strdup(optarg);
+            break;
+        case 'G':
+            valopts.login_timeout = strdup(optarg);
+            break;
         case 'c':
             valopts.connect = strdup(optarg);
             break;
@@ -960,7 +7111,13 @@ cfg_cmdline_parse(int argc, char **argv, state_t *state, bool *helpshow)
         mbr_add_loge(&state->mbroker, "incorrect command line options combination");
         retcode = -1;
     }
-    if (!retcode && valopts.connect && (valopts.admin || valopts.roommates || valopts.rooms)) {
+    if (!retcode && valopts.connect && (valopts.admin || valopts.roommates || valopts.rooms || valopts.config || valopts.snapshot || valopts.workers
+                                 || valopts.accept_burst || valopts.backlog || valopts.events || valopts.edge || valopts.uring
+                                 || valopts.stats || valopts.bcast_min || valopts.bcast_ring || valopts.bcast_lag
+                                 || valopts.journal || valopts.journal_keep || valopts.journal_age
+                                 || valopts.out_limit || valopts.out_policy || valopts.mem_mark || valopts.mem_policy
+                                 || valopts.compress_min || valopts.resume_window || valopts.resume_ttl
+                                 || valopts.idle_timeout || valopts.heartbeat || valopts.login_timeout)) {
         mbr_add_loge(&state->mbroker, "incorrect command line options combination");
         retcode = -1;
     }
@@ -1040,31 +7197,237 @@ cfg_cmdline_parse(int argc, char **argv, state_t *state, bool *helpshow)
             name = cobj->val;
             pass = cobj->ext;
             name[cobj->val_sz] = '\0';
+            pass[cobj->ext_sz] = '\0';
         } else {
             name = NULL;
             pass = cobj->val;
+            pass[cobj->val_sz] = '\0';
         }
 
         if (state->workmode == WORKMODE_SRV) {
             state->admin.passwd = strdup(pass);
         } else if (state->workmode == WORKMODE_ADM) {
-//            retcode = msg_add(&state->msg_broker, MSG_TYP_CC, ":logadm %s", pass);
+            retcode = cli_cmd_add(&state->mbroker, CMD_OP_LOGADM, 1, (const char *[]){pass});
         } else if (state->workmode == WORKMODE_MATE) {
-//            retcode = msg_add(&state->msg_broker, MSG_TYP_CC, ":logmate %s %s", name, pass);
+            retcode = cli_cmd_add(&state->mbroker, CMD_OP_LOGMATE, 2, (const char *[]){name, pass});
+        }
+    }
+
+    /* reactor threads */
+    if (!retcode && valopts.workers) {
+        long workers;
+        if (cfg_optnum_parse(valopts.workers, 1, SRV_WORKERS_MAX, &workers) < 0) {
+            mbr_add_loge(&state->mbroker, "--workers option must be in range 1..%d", SRV_WORKERS_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+        state->workers = (int)workers;
+    }
+
+    /* reactor tuning */
+    if (!retcode && valopts.accept_burst) {
+        long accept_burst;
+        if (cfg_optnum_parse(valopts.accept_burst, 1, SRV_ACCEPT_BURST_MAX, &accept_burst) < 0) {
+            mbr_add_loge(&state->mbroker, "--accept-burst option must be in range 1..%d", SRV_ACCEPT_BURST_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+        state->accept_burst = (int)accept_burst;
+    }
+    if (!retcode && valopts.backlog) {
+        long backlog;
+        if (cfg_optnum_parse(valopts.backlog, 1, INT32_MAX, &backlog) < 0) {
+            mbr_add_loge(&state->mbroker, "--backlog option must be in range 1..%d", INT32_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+        state->listen_backlog = (int)backlog;
+    }
+    if (!retcode && valopts.events) {
+        long events;
+        if (cfg_optnum_parse(valopts.events, 1, SRV_EPOLL_BATCH_MAX, &events) < 0) {
+            mbr_add_loge(&state->mbroker, "--events option must be in range 1..%d", SRV_EPOLL_BATCH_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+        state->epoll_batch = (int)events;
+    }
+    state->edge_input = valopts.edge;
+    state->use_uring  = valopts.uring;
+    if (!retcode && valopts.stats) {
+        state->stats_path = valopts.stats;
+        valopts.stats     = NULL;
+    }
+
+    /* large rooms */
+    if (!retcode && valopts.bcast_min) {
+        if (cfg_optnum_parse(valopts.bcast_min, 0, INT32_MAX, &state->bcast_min) < 0) {
+            mbr_add_loge(&state->mbroker, "--bcast-min option must be in range 0..%d", INT32_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+    }
+    if (!retcode && valopts.bcast_ring) {
+        long ring;
+        if (cfg_optnum_parse(valopts.bcast_ring, ROOM_BCAST_RING_MIN, ROOM_BCAST_RING_MAX, &ring) < 0) {
+            mbr_add_loge(&state->mbroker, "--bcast-ring option must be in range %d..%d",
+                    ROOM_BCAST_RING_MIN, ROOM_BCAST_RING_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+        /* positions are masked into the ring */
+        for (state->bcast_ring = ROOM_BCAST_RING_MIN; state->bcast_ring < (size_t)ring; state->bcast_ring *= 2);
+    }
+    if (!retcode && valopts.bcast_lag) {
+        if (strcmp(valopts.bcast_lag, "skip") == 0) {
+            state->bcast_lag = ROOM_BCAST_SKIP;
+        } else if (strcmp(valopts.bcast_lag, "resync") == 0) {
+            state->bcast_lag = ROOM_BCAST_RESYNC;
+        } else if (strcmp(valopts.bcast_lag, "disconnect") == 0) {
+            state->bcast_lag = ROOM_BCAST_DISCONNECT;
+        } else {
+            mbr_add_loge(&state->mbroker, "--bcast-lag option must be one of skip, resync, disconnect");
+            retcode = -1;
+            goto finalize;
+        }
+    }
+
+    /* room history */
+    if (!retcode && (valopts.journal_keep || valopts.journal_age) && !valopts.journal) {
+        mbr_add_loge(&state->mbroker, "--journal-keep and --journal-age options need --journal");
+        retcode = -1;
+        goto finalize;
+    }
+    if (!retcode && valopts.journal) {
+        state->journals.dir = valopts.journal;
+        valopts.journal     = NULL;
+    }
+    if (!retcode && valopts.journal_keep) {
+        long keep;
+        if (cfg_optnum_parse(valopts.journal_keep, JOURNAL_KEEP_MIN, LONG_MAX, &keep) < 0) {
+            mbr_add_loge(&state->mbroker, "--journal-keep option must be %ld bytes at least", JOURNAL_KEEP_MIN);
+            retcode = -1;
+            goto finalize;
+        }
+        state->journals.keep = (size_t)keep;
+    }
+    if (!retcode && valopts.journal_age) {
+        if (cfg_optnum_parse(valopts.journal_age, 0, LONG_MAX / 1000000000L, &state->journals.age) < 0) {
+            mbr_add_loge(&state->mbroker, "--journal-age option must be in range 0..%ld seconds", LONG_MAX / 1000000000L);
+            retcode = -1;
+            goto finalize;
+        }
+    }
+
+    /* output backpressure */
+    if (!retcode && valopts.out_limit) {
+        long limit;
+        if (cfg_optnum_parse(valopts.out_limit, 0, LONG_MAX, &limit) < 0 || (limit && limit < CONN_OUT_LIMIT_MIN)) {
+            mbr_add_loge(&state->mbroker, "--out-limit option must be 0 or %d bytes at least", CONN_OUT_LIMIT_MIN);
+            retcode = -1;
+            goto finalize;
+        }
+        state->out_limit = (size_t)limit;
+    }
+    if (!retcode && valopts.out_policy && cfg_outpolicy_parse(valopts.out_policy, &state->out_policy) < 0) {
+        mbr_add_loge(&state->mbroker, "--out-policy option must be one of oldest, chat, disconnect");
+        retcode = -1;
+        goto finalize;
+    }
+    if (!retcode && valopts.mem_mark) {
+        long mark;
+        if (cfg_optnum_parse(valopts.mem_mark, 0, LONG_MAX, &mark) < 0) {
+            mbr_add_loge(&state->mbroker, "--mem-mark option must be a number of bytes");
+            retcode = -1;
+            goto finalize;
+        }
+        state->mem_mark = (size_t)mark;
+    }
+    if (!retcode && valopts.mem_policy && cfg_outpolicy_parse(valopts.mem_policy, &state->mem_policy) < 0) {
+        mbr_add_loge(&state->mbroker, "--mem-policy option must be one of oldest, chat, disconnect");
+        retcode = -1;
+        goto finalize;
+    }
+
+    /* compression */
+    if (!retcode && valopts.compress_min) {
+        long zip_min;
+        if (cfg_optnum_parse(valopts.compress_min, sizeof(msg_zip_t) + 1, UINT16_MAX, &zip_min) < 0) {
+            mbr_add_loge(&state->mbroker, "--compress-min option must be in range %zu..%d bytes", sizeof(msg_zip_t) + 1, UINT16_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+        state->zip_min = (size_t)zip_min;
+    }
+
+    /* resumed sessions */
+    if (!retcode && valopts.resume_window) {
+        long window;
+        if (cfg_optnum_parse(valopts.resume_window, 0, ROOM_WINDOW_MAX, &window) < 0) {
+            mbr_add_loge(&state->mbroker, "--resume-window option must be in range 0..%d messages", ROOM_WINDOW_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+        state->sessions.window = (uint32_t)window;
+    }
+    if (!retcode && valopts.resume_ttl) {
+        if (cfg_optnum_parse(valopts.resume_ttl, 1, LONG_MAX / 1000000000L, &state->sessions.ttl) < 0) {
+            mbr_add_loge(&state->mbroker, "--resume-ttl option must be in range 1..%ld seconds", LONG_MAX / 1000000000L);
+            retcode = -1;
+            goto finalize;
+        }
+    }
+
+    /* connection timers */
+    if (!retcode && valopts.idle_timeout) {
+        if (cfg_optnum_parse(valopts.idle_timeout, 0, CONN_TIMEOUT_MAX, &state->idle_timeout) < 0) {
+            mbr_add_loge(&state->mbroker, "--idle-timeout option must be in range 0..%ld seconds", CONN_TIMEOUT_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+    }
+    if (!retcode && valopts.heartbeat) {
+        if (cfg_optnum_parse(valopts.heartbeat, 0, CONN_TIMEOUT_MAX, &state->heartbeat) < 0) {
+            mbr_add_loge(&state->mbroker, "--heartbeat option must be in range 0..%ld seconds", CONN_TIMEOUT_MAX);
+            retcode = -1;
+            goto finalize;
+        }
+    }
+    if (!retcode && valopts.login_timeout) {
+        if (cfg_optnum_parse(valopts.login_timeout, 0, CONN_TIMEOUT_MAX, &state->login_timeout) < 0) {
+            mbr_add_loge(&state->mbroker, "--login-timeout option must be in range 0..%ld seconds", CONN_TIMEOUT_MAX);
+            retcode = -1;
+            goto finalize;
         }
     }
 
     /* predefined room */
     if (!retcode && valopts.room) {
-//        retcode = msg_add(&state->msg_broker, MSG_TYP_CC, ":enter %s", valopts.room);
+        retcode = cli_cmd_add(&state->mbroker, CMD_OP_ENTER, 1, (const char *[]){valopts.room});
+    }
+
+    /* a snapshot of the previous run takes the place of the predefined mates and rooms */
+    bool is_snap = false;
+    if (!retcode && valopts.snapshot) {
+        state->snap_path = valopts.snapshot;
+        valopts.snapshot = NULL;
+        retcode = snap_load(state);
+        is_snap = retcode == 0;
+        retcode = retcode < 0 ? -1 : 0;
+        if (is_snap && (valopts.roommates || valopts.rooms || valopts.config)) {
+            mbr_add_logi(&state->mbroker, "--roommates, --rooms and --config are taken from the snapshot");
+        }
     }
 
     /* predefined mates */
-    if (!retcode && valopts.roommates) {
+    if (!retcode && !is_snap && valopts.roommates) {
         for (size_t i = 0; i < valopts.roommates_cn; i++) {
             cfg_objlist_t mates;
             LIST_INIT(&mates);
-            cfg_objstring_parse(valopts.roommates[i], strlen(valopts.roommates[i]), &mates, CFG_OBJ_VE);
+            if (cfg_objstring_parse(valopts.roommates[i], strlen(valopts.roommates[i]), &mates, CFG_OBJ_VE) < 0) {
+                mbr_add_loge(&state->mbroker, "unexpected value of --roommates option, a name or password is over %d bytes", UINT16_MAX);
+                retcode = -1;
+            }
             if (!retcode) {
                 retcode = roommates_add(&state->mates, &mates);
             }
@@ -1072,8 +7435,13 @@ cfg_cmdline_parse(int argc, char **argv, state_t *state, bool *helpshow)
         }
     }
 
+    /* mates and rooms of the config file, its rooms may take the mates above */
+    if (!retcode && !is_snap && valopts.config) {
+        retcode = cfg_file_load(valopts.config, state);
+    }
+
     /* predefined rooms */
-    if (!retcode && valopts.rooms) {
+    if (!retcode && !is_snap && valopts.rooms) {
         for (size_t i = 0; i < valopts.rooms_cn; i++) {
             char *delim = strchr(valopts.rooms[i], '@');
             if (delim) {
@@ -1087,8 +7455,11 @@ cfg_cmdline_parse(int argc, char **argv, state_t *state, bool *helpshow)
                 LIST_INIT(&mates);
                 LIST_INIT(&rooms);
 
-                cfg_objstring_parse(&valopts.rooms[i][mates_b], (mates_e - mates_b), &mates, CFG_OBJ_V);
-                cfg_objstring_parse(&valopts.rooms[i][rooms_b], (rooms_e - rooms_b), &rooms, CFG_OBJ_V);
+                if (cfg_objstring_parse(&valopts.rooms[i][mates_b], (mates_e - mates_b), &mates, CFG_OBJ_V) < 0
+                    || cfg_objstring_parse(&valopts.rooms[i][rooms_b], (rooms_e - rooms_b), &rooms, CFG_OBJ_V) < 0) {
+                    mbr_add_loge(&state->mbroker, "unexpected value of --rooms option, a name is over %d bytes", UINT16_MAX);
+                    retcode = -1;
+                }
                 LIST_FOREACH(room, &rooms, lentry) {
                     if (!retcode) {
                         retcode = room_add_mates(&state->rooms, &state->mates, room->val, room->val_sz, &mates);
@@ -1108,6 +7479,29 @@ finalize:
     free(valopts.admin);
     free(valopts.roommates);
     free(valopts.rooms);
+    free(valopts.config);
+    free(valopts.snapshot);
+    free(valopts.workers);
+    free(valopts.accept_burst);
+    free(valopts.backlog);
+    free(valopts.events);
+    free(valopts.stats);
+    free(valopts.bcast_min);
+    free(valopts.bcast_ring);
+    free(valopts.bcast_lag);
+    free(valopts.journal);
+    free(valopts.journal_keep);
+    free(valopts.journal_age);
+    free(valopts.out_limit);
+    free(valopts.out_policy);
+    free(valopts.mem_mark);
+    free(valopts.mem_policy);
+    free(valopts.compress_min);
+    free(valopts.resume_window);
+    free(valopts.resume_ttl);
+    free(valopts.idle_timeout);
+    free(valopts.heartbeat);
+    free(valopts.login_timeout);
 
     free(valopts.connect);
     free(valopts.logadm);
@@ -1156,10 +7550,24 @@ int main(int argc, char **argv)
     bool helpshow = false;
     if (cfg_cmdline_parse(argc, argv, &state, &helpshow) < 0) {
         mbr_flush_locals(&state.mbroker);
+        state_free(&state);
+        return 1;
     }
 
-    srv_loop(&state);
+    /* from now on the log lines are written by their own thread */
+    mbr_flush_locals(&state.mbroker);
+    mbr_log_start();
+    int rc = WORKMODE_CLI(state.workmode) ? cli_loop(&state) : srv_loop(&state);
+    if (state.snap_path && rc == 0) {
+        /* a loop that failed may have left the registries half built */
+        snap_save(&state, &state.mbroker);
+    }
+    mbr_flush_locals(&state.mbroker);
+    mbr_log_stop();
 
     state_free(&state);
-    return 0;
+    for (int p = 0; p < POOL_ID_MAX; p++) {
+        pool_destroy(&pools[p]);
+    }
+    return rc < 0 ? 1 : 0;
 }
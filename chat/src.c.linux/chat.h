@@ -1,30 +1,247 @@
 #ifndef _CHAT_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <search.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include <arpa/inet.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/***********************
+ * Object pools
+ ***********************/
+typedef enum pool_id_e {
+    POOL_MSG,       /* msg_t            */
+    POOL_MSGP,      /* msgp_t           */
+    POOL_CONN,      /* conn_t           */
+    POOL_CFGOBJ,    /* cfg_obj_t        */
+    POOL_XFER,      /* reactor_xfer_t   */
+    POOL_ID_MAX
+} pool_id_t;
+
+typedef struct pool_obj_s {
+    struct pool_obj_s  *next;
+} pool_obj_t;
+
+typedef struct pool_slab_s {
+    struct pool_slab_s *next;
+} pool_slab_t;
+
+typedef struct pool_s {
+    pool_id_t        id;
+    const char      *name;
+    size_t           obj_sz;
+    size_t           slab_objs;     /* objects carved from one slab                 */
+    size_t           cache_max;     /* per-thread cache size, 0 disables the caches */
+
+    pthread_mutex_t  lock;          /* guards free, slabs & total                   */
+    pool_obj_t      *free;
+    pool_slab_t     *slabs;
+    size_t           total;
+    size_t           live;          /* atomic */
+    size_t           hiwat;         /* atomic */
+} pool_t;
+
+typedef struct pool_cache_s {
+    pool_obj_t      *free;
+    size_t           count;
+} pool_cache_t;
+
+typedef struct pool_stats_s {
+    size_t           live;
+    size_t           free;
+    size_t           hiwat;
+} pool_stats_t;
+
+#define POOL_INITIALIZER(ID, NAME, TYPE, SLAB_OBJS, CACHE_MAX) { \
+    .id        = ID,                                            \
+    .name      = NAME,                                          \
+    .obj_sz    = sizeof(TYPE),                                  \
+    .slab_objs = SLAB_OBJS,                                     \
+    .cache_max = CACHE_MAX,                                     \
+    .lock      = PTHREAD_MUTEX_INITIALIZER                      \
+}
+#define POOL_STRIDE(SZ) (((SZ) + 15) & ~(size_t)15)
+
+static int
+pool_grow(pool_t *pool);
+static void *
+pool_get(pool_t *pool);
+static void
+pool_put(pool_t *pool, void *ptr);
+static void
+pool_stats(pool_t *pool, pool_stats_t *stats);
+static void
+pool_destroy(pool_t *pool);
+
+/***********************
+ * Hash tables
+ ***********************/
+#define HTAB_KEY_INLINE (18)    /* key bytes kept in the slot, longer keys are compared via key_of */
+
+typedef const char *(*htab_key_of_t)(const void *val);
+
+/* open addressing, linear probing, backward shift deletion */
+typedef struct htab_slot_s {
+    uint32_t         hash;      /* 0 marks an empty slot */
+    uint16_t         key_sz;
+    char             key[HTAB_KEY_INLINE];
+    void            *val;
+} htab_slot_t;
+
+typedef struct htab_s {
+    htab_slot_t     *slots;
+    size_t           cap;       /* power of two */
+    size_t           count;
+    htab_key_of_t    key_of;
+} htab_t;
+
+/* set of pointers, same probing scheme, NULL marks an empty slot */
+typedef struct pset_s {
+    void           **slots;
+    size_t           cap;
+    size_t           count;
+} pset_t;
+
+#define HTAB_FOREACH(HTAB, IDX) \
+    for (size_t IDX = 0; IDX < (HTAB)->cap; IDX++) if ((HTAB)->slots[IDX].hash)
+#define PSET_FOREACH(SET, IDX) \
+    for (size_t IDX = 0; IDX < (SET)->cap; IDX++) if ((SET)->slots[IDX])
+
+static uint32_t
+htab_hash(const char *key, size_t key_sz);
+static void
+htab_init(htab_t *htab, htab_key_of_t key_of);
+static int
+htab_reserve(htab_t *htab, size_t count);
+static void *
+htab_find(htab_t *htab, const char *key, size_t key_sz);
+static void *
+htab_find_hashed(htab_t *htab, uint32_t hash, const char *key, size_t key_sz);
+static int
+htab_insert(htab_t *htab, const char *key, size_t key_sz, void *val);
+static int
+htab_insert_hashed(htab_t *htab, uint32_t hash, const char *key, size_t key_sz, void *val);
+static void *
+htab_remove(htab_t *htab, const char *key, size_t key_sz);
+static void
+htab_free(htab_t *htab);
+
+static int
+pset_reserve(pset_t *set, size_t count);
+static int
+pset_add(pset_t *set, void *ptr);
+static bool
+pset_has(pset_t *set, const void *ptr);
+static bool
+pset_del(pset_t *set, const void *ptr);
+static void
+pset_free(pset_t *set);
+
+/***********************
+ * LZ codec
+ ***********************/
+/* LZ4 block format, a frame is small enough for 16-bit positions in the table */
+#define LZ_HASH_LOG         (12)
+#define LZ_MIN_MATCH        (4)
+#define LZ_LAST_LITERALS    (5)     /* a block ends with literals       */
+#define LZ_MFLIMIT          (12)    /* no match starts closer to the end */
+
+static size_t
+lz_len_put(uint8_t *op, size_t len);
+static int
+lz_compress(const uint8_t *src, size_t src_sz, uint8_t *dst, size_t dst_cap);
+static int
+lz_decompress(const uint8_t *src, size_t src_sz, uint8_t *dst, size_t dst_cap);
+
+/***********************
+ * Timer wheel
+ ***********************/
+/* hierarchical wheel of a reactor, a timer sits in the level its delay fits in and
+ * moves down as its tick comes closer, so arming, cancelling and a tick cost O(1)
+ * whatever the number of the armed ones */
+#define WHEEL_TICK_MS       (100)
+#define WHEEL_BITS          (6)
+#define WHEEL_SLOTS         (1 << WHEEL_BITS)
+#define WHEEL_LEVELS        (4)     /* 2^24 ticks, longer delays are cut to that */
+#define WHEEL_SPAN          (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_TICKS(MS)     (((uint64_t)(MS) + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS)
+
+struct reactor_s;
+struct wheel_timer_s;
+typedef void (*wheel_cb_t)(struct reactor_s *reactor, struct wheel_timer_s *timer);
+
+typedef struct wheel_timer_s {
+    uint64_t    expires;    /* tick */
+    wheel_cb_t  cb;
+    uint8_t     level;
+    uint8_t     slot;
+    bool        is_armed;
+    LIST_ENTRY(wheel_timer_s) lentry;
+} wheel_timer_t;
+typedef LIST_HEAD(wheel_slot_s, wheel_timer_s) wheel_slot_t;
+
+typedef struct wheel_s {
+    uint64_t        now;        /* tick passed, the timers up to it have fired */
+    uint64_t        origin;     /* CLOCK_MONOTONIC ns of tick 0 */
+    size_t          armed;
+    uint64_t        occupied[WHEEL_LEVELS];     /* a bit per non-empty slot */
+    wheel_slot_t    slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+static void
+wheel_init(wheel_t *wheel, uint64_t ts);
+static void
+wheel_place(wheel_t *wheel, wheel_timer_t *timer);
+static void
+wheel_arm(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires);
+static void
+wheel_cancel(wheel_t *wheel, wheel_timer_t *timer);
+static void
+wheel_advance(wheel_t *wheel, struct reactor_s *reactor, uint64_t ts);
+static int
+wheel_timeout(wheel_t *wheel, uint64_t ts);
 
 /***********************
  * Message Broker
  ***********************/
 typedef struct conn_s conn_t;
+typedef struct reactor_s reactor_t;
+typedef struct uring_s uring_t;
+typedef struct cfg_obj_s cfg_obj_t;
+typedef LIST_HEAD(cfg_objlist_s, cfg_obj_s) cfg_objlist_t;
 
 /* Message Types */
 #define MSG_TYP_CM      (0x1)   /* Chat Message, from Client to Client      */
@@ -34,6 +251,7 @@ typedef struct conn_s conn_t;
 #define MSG_TYP_SE      (0x5)   /* Server Error Message, Server -> Client   */
 #define MSG_TYP_LI      (0x6)   /* Server Info Message, Server -> Local     */
 #define MSG_TYP_LE      (0x7)   /* Server Error Message, Server -> Local    */
+#define MSG_TYP_CB      (0x8)   /* Client Command in binary, Client -> Server */
 #define MSG_TYP_MASK(X) (X & 0x0F)
 
 /* Message broadcast width */
@@ -46,6 +264,31 @@ typedef struct conn_s conn_t;
 
 #define MSG_COMMIT      (0x1 << 8)  /*    */
 #define MSG_NET_FIN     (0x2 << 8)  /* disconnect client when sent the message */
+#define MSG_CHUNK       (0x4 << 8)  /* part of a streamed payload, starts with msg_chunk_t */
+#define MSG_CHUNK_END   (0x8 << 8)  /* the last part of a streamed payload */
+#define MSG_ZIP         (0x10 << 8) /* the payload is msg_zip_t followed by a compressed block */
+
+/* payload codecs, a connection gets compressed frames once it asks with :compress */
+#define MSG_CODEC_NONE      (0)
+#define MSG_CODEC_LZ        (1)     /* LZ4 block format */
+#define MSG_ZIP_MIN_DEF     (256)   /* smaller frames go out raw */
+
+/* wire protocols, a connection speaks the base one until it asks for more with :proto */
+#define MSG_PROTO_BASE      (1)     /* frames of 16-bit length only   */
+#define MSG_PROTO_STREAM    (2)     /* and streamed payloads in chunks */
+
+/* a payload over 64 KiB goes as a stream of chunks, each is relayed as it comes,
+ * so the server never holds more than a frame of it; the sender numbers its streams,
+ * the server gives them ids unique across connections before they are relayed */
+typedef struct msg_chunk_s {
+    uint32_t stream;
+    uint32_t total;     /* bytes of the whole payload, chunk headers excluded */
+    uint32_t offset;    /* of this chunk in the payload                       */
+} __attribute__((packed)) msg_chunk_t;
+
+typedef struct msg_zip_s {
+    uint16_t len;       /* of the raw payload */
+} __attribute__((packed)) msg_zip_t;
 
 typedef struct msg_s {
     struct  msg_hdr_s {
@@ -55,7 +298,9 @@ typedef struct msg_s {
     char   *data;
     size_t  data_sz;
     bool    commit;
+    bool    is_routed;  /* left ml_pool, lives while referenced, refs are atomic */
     int     refs;
+    struct msg_s *zip;  /* compressed twin, the message itself when it doesn't shrink, atomic */
     CIRCLEQ_ENTRY(msg_s) cq_entry;
 } msg_t;
 typedef CIRCLEQ_HEAD(msg_list_s, msg_s) msg_list_t;
@@ -66,11 +311,36 @@ typedef struct msgp_s {
 } msgp_t;
 typedef CIRCLEQ_HEAD(msgp_list_s, msgp_s) msgp_list_t;
 
+typedef LIST_HEAD(conn_list_s, conn_s) conn_list_t;
+
 typedef struct msg_broker_s {
     msg_list_t  ml_pool;
     msgp_list_t mpl_local;
+    conn_list_t cl_pending;     /* connections with not yet flushed mpl_out     */
 } msg_broker_t;
 
+/* local log lines are handed over to a writer thread through a bounded MPSC ring */
+#define MBR_LOG_RING_SZ     (4096)          /* power of two */
+#define MBR_LOG_BATCH_SZ    (64 * 1024)     /* bytes per write(2) of the writer */
+
+typedef struct mbr_log_slot_s {
+    uint64_t    seq;        /* position the slot is ready for, atomic   */
+    uint64_t    ts;         /* CLOCK_MONOTONIC ns of the flush          */
+    bool        is_err;
+    char       *data;       /* taken over from the message, may be NULL */
+} mbr_log_slot_t;
+
+typedef struct mbr_log_s {
+    mbr_log_slot_t *slots;
+    uint64_t        head;       /* next position to fill, atomic        */
+    uint64_t        tail;       /* next position to write, writer only  */
+    uint64_t        dropped;    /* lines lost to a full ring, atomic    */
+    int             event_fd;   /* wakes the writer when it sleeps      */
+    bool            sleeping;   /* atomic                               */
+    bool            running;    /* atomic                               */
+    pthread_t       thread;
+} mbr_log_t;
+
 #define MSG_IO_AGAIN  ( 1)
 #define MSG_IO_DOWN   (-2)
 #define MSG_IO_ERR    (-1)
@@ -86,8 +356,10 @@ msg_add_va(msg_t *msg, const char * format, va_list args);
 static int
 msg_io_read(msg_t *msg, int fd, size_t *cursor);
 static int
-msg_io_write(msg_t *msg, int fd, size_t *cursor);
+msg_io_iov(msg_t *msg, size_t cursor, struct iovec *iov);
 
+static void
+mbr_init(msg_broker_t *broker);
 static int
 mbr_add_logi(msg_broker_t *broker, const char * format, ...);
 static int
@@ -97,50 +369,502 @@ static msg_t *
 mbr_grow(msg_broker_t *broker, uint16_t options, conn_t *conn);
 static void
 mbr_flush_locals(msg_broker_t *broker);
+static size_t
+mbr_log_prefix(char *buf, size_t buf_sz, uint64_t ts, bool is_err, const char *data);
+static int
+mbr_log_push(uint64_t ts, bool is_err, char *data);
+static void *
+mbr_log_writer(void *arg);
+static int
+mbr_log_start(void);
+static void
+mbr_log_stop(void);
 static void
 mbr_clean(msg_broker_t *broker);
 
+static msgp_t *
+mbr_msgp_get(msg_t *msg);
+static void
+mbr_msgp_put(msgp_t *msgp);
+static void
+mbr_release(msg_broker_t *broker, msg_t *msg);
+static void
+mbr_unref(msg_t *msg);
+static msg_t *
+mbr_zip(reactor_t *reactor, msg_t *msg);
+static int
+mbr_add_reply(msg_broker_t *broker, conn_t *conn, uint16_t options, const char * format, ...);
+static msg_t *
+mbr_adopt(msg_broker_t *broker, msg_t *msg_in, conn_t *conn);
+static msg_t *
+mbr_clone(msg_broker_t *broker, msg_t *msg_in, conn_t *conn);
+typedef struct mbr_route_ctx_s {
+    msg_broker_t *broker;
+    msg_t        *msg;
+    conn_t       *except;
+    int           count;
+} mbr_route_ctx_t;
+
+static void
+mbr_route_set(mbr_route_ctx_t *rctx, pset_t *conns);
+static int
+mbr_route(msg_broker_t *broker, msg_t *msg, conn_t *conn);
+
+/***********************************
+ * Commands
+ ***********************************/
+/* a MSG_TYP_CB frame is the opcode byte followed by the arguments, each one prefixed
+ * by its length in one byte, or in two when the high bit of the first one is set;
+ * a MSG_TYP_CC frame is the same command as a line of text, both are parsed in place */
+typedef enum cmd_op_e {
+    CMD_OP_NONE,
+    CMD_OP_LOGMATE,     /* name password        */
+    CMD_OP_LOGADM,      /* password             */
+    CMD_OP_ENTER,       /* room                 */
+    CMD_OP_HISTORY,     /* [seq | @unixtime]    */
+    CMD_OP_PROTO,       /* version              */
+    CMD_OP_COMPRESS,    /* lz | none            */
+    CMD_OP_STATUS,
+    CMD_OP_ROOMMATES,   /* show | add | del | clear [mates]  */
+    CMD_OP_ROOMS,       /* addmates | delmates room mates    */
+    CMD_OP_QUIT,
+    CMD_OP_SNAPSHOT,    /* the codes above are kept by binary clients */
+    CMD_OP_RESUME,      /* token seq            */
+    CMD_OP_PONG,        /* answer to a :ping    */
+    CMD_OP_MAX
+} cmd_op_t;
+
+#define CMD_ARGS_MAX    (4)
+#define CMD_ARG_MAX     (0x7FFF)
+#define CMD_BLANK(C)    ((C) == ' ' || (C) == '\r' || (C) == '\n')
+
+typedef struct cmd_arg_s {
+    const char *ptr;    /* not terminated */
+    size_t      len;
+} cmd_arg_t;
+
+typedef struct cmd_s {
+    cmd_op_t    op;
+    cmd_arg_t   name;   /* the text form, empty for binary */
+    int         argc;
+    cmd_arg_t   argv[CMD_ARGS_MAX];
+} cmd_t;
+
+typedef int (*cmd_handler_t)(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+
+typedef struct cmd_def_s {
+    const char     *name;
+    int             argc_max;
+    bool            is_rest;    /* the last argument of a text line takes the rest of it */
+    cmd_handler_t   handler;    /* of a server connection, NULL for the local admin only */
+} cmd_def_t;
+
+static const char *
+cmd_text_token(const char *p, const char *end, cmd_arg_t *token);
+static int
+cmd_text_parse(const char *line, size_t len, cmd_t *cmd);
+static int
+cmd_bin_parse(const char *data, size_t len, cmd_t *cmd);
+static int
+cmd_bin_encode(char *buf, size_t cap, cmd_op_t op, int argc, const char **argv);
+static bool
+cmd_arg_is(const cmd_arg_t *arg, const char *str);
+static int
+cmd_arg_num(const cmd_arg_t *arg, uint64_t *val);
+
 /***********************************
  * Room mates, Rooms & Connections
  ***********************************/
-typedef void roommates_t;
-typedef void rooms_t;
-typedef void conns_t;
+typedef htab_t roommates_t;
+typedef htab_t rooms_t;
+
+/* connections joined to a room mate or a room, split by the owning reactor */
+typedef struct conns_set_s {
+    pset_t      *slots;     /* one set per reactor, touched by that reactor only */
+    uint64_t     reactors;  /* bit per reactor with a non-empty slot, atomic     */
+} conns_set_t;
 
 typedef struct admin_s {
     char        *passwd;
-    conns_t     *conns;
+    conns_set_t  conns;
 } admin_t;
 
 typedef struct roommate_s {
     char        *name;
     char        *passwd;
-    rooms_t     *rooms;
-    conns_t     *conns;
+    pset_t       rooms;
+    conns_set_t  conns;
+    uint32_t     snap_idx;  /* position in the snapshot being written */
+    bool         is_slab;   /* loaded from a snapshot, freed with state_t.snap_slab */
 } roommate_t;
 
+/* frames of a large room written once and read by every member from its own cursor,
+ * a record is the origin connection and flags followed by the frame as it goes to the wire */
+typedef struct room_bcast_s {
+    struct room_s   *room;
+    char            *buf;
+    size_t           cap;       /* power of two                                 */
+    uint64_t         head;      /* bytes ever appended, atomic                  */
+    uint64_t         seq;       /* frames ever appended, taken under the lock   */
+    uint64_t         dirty;     /* bit per reactor with a flush pending, atomic */
+    pthread_rwlock_t lock;      /* appends write, a flush of a member reads     */
+} room_bcast_t;
+
+typedef struct room_bcast_rec_s {
+    uint64_t          origin;   /* sending connection, skipped by MSG_WID_RM    */
+    uint32_t          flags;    /* ROOM_BCAST_REC_*                             */
+    struct msg_hdr_s  hdr;
+} __attribute__((packed)) room_bcast_rec_t;
+
+/* a raw frame followed by its compressed twin, a reader takes one of the two */
+#define ROOM_BCAST_REC_TWINNED  (0x1)
+
+#define ROOM_BCAST_RING_DEF     (16 * 1024 * 1024)
+#define ROOM_BCAST_RING_MIN     (1024 * 1024)       /* more than a batch of input */
+#define ROOM_BCAST_RING_MAX     (1024 * 1024 * 1024)
+#define ROOM_BCAST_LAG(BCAST)   ((BCAST)->cap - (BCAST)->cap / 4)   /* lag of a slow reader */
+
+typedef enum room_bcast_policy_e {
+    ROOM_BCAST_SKIP,        /* jump to the newest frame                       */
+    ROOM_BCAST_RESYNC,      /* jump and tell the client how many were skipped */
+    ROOM_BCAST_DISCONNECT
+} room_bcast_policy_t;
+
+/* the latest chat frames of a room kept for the resumed sessions, numbered from the
+ * server start, the frame of a seq is in the window while it is one of the cap latest */
+#define ROOM_WINDOW_DEF     (256)
+#define ROOM_WINDOW_MAX     (65536)
+
+typedef struct room_window_s {
+    msg_t          **msgs;      /* referenced, a frame at seq % cap   */
+    uint32_t         cap;
+    uint64_t         seq;       /* of the next frame, under the lock  */
+    pthread_mutex_t  lock;      /* appends of the reactors and resumes */
+} room_window_t;
+
 typedef struct room_s {
     char        *name;
     bool         is_open;
-    roommates_t *mates;
-    conns_t     *conns;
+    pset_t       mates;
+    conns_set_t  conns;
+    uint64_t     msgs;      /* chat messages sent to the room, atomic       */
+    uint64_t     msgs_mark; /* msgs at the previous status, gives the rate  */
+    room_bcast_t *bcast;    /* large room mode, NULL while the room is small */
+    struct journal_s *journal;  /* on-disk history, NULL without --journal  */
+    room_window_t *window;  /* frames for the resumed sessions, NULL for none */
 } room_t;
 
+/* what happens to a connection whose output queue is over its limit */
+typedef enum conn_out_policy_e {
+    CONN_OUT_DROP_OLDEST,   /* the oldest queued frames make room         */
+    CONN_OUT_DROP_CHAT,     /* chat frames are dropped, replies still go  */
+    CONN_OUT_DISCONNECT     /* the queue is dropped for a MSG_NET_FIN notice */
+} conn_out_policy_t;
+
+/* input of an edge-triggered connection, frames are parsed in place */
+typedef struct conn_ring_s {
+    char               *buf;
+    size_t              head;   /* first byte of the unparsed frames */
+    size_t              tail;   /* end of the received data          */
+} conn_ring_t;
+
 typedef struct conn_s {
     int                 fd;
+    uint32_t            gen;
+    reactor_t          *reactor;
     struct sockaddr_in  addr;
     socklen_t           addr_len;
 
     bool                is_adm;
     roommate_t         *roommate;
     room_t             *room;
+    int                 proto;          /* MSG_PROTO_*, chunks are not sent to the base one */
+    int                 codec;          /* MSG_CODEC_*, of the frames sent to the connection */
+
+    /* the stream being received, chunks are relayed in place, only the position is kept */
+    uint32_t            stream_id;
+    uint32_t            stream_total;
+    uint32_t            stream_left;    /* 0 when no stream is open */
 
     msg_t               msg_in;
     size_t              cursor_in;
+    conn_ring_t         ring_in;
     msgp_list_t         mpl_out;
     size_t              cursor_out;
+    size_t              out_bytes;  /* unsent bytes of mpl_out                   */
+    bool                is_finishing;   /* a FIN notice is queued, nothing else goes */
+
+    bool                is_pending;
+    bool                is_epout;   /* waits for the socket to take more output */
+    bool                is_closed;
+    LIST_ENTRY(conn_s)  lentry_pending;
+
+    /* io_uring backend, the kernel refers to the buffers while uring_ops are in flight */
+    int                 uring_ops;
+    struct iovec       *iov_out;
+
+    /* large room output, written from the room ring after mpl_out, a partially
+     * written frame is copied to the head of mpl_out, so the cursor stays on records */
+    room_bcast_t       *bcast;          /* ring being read, follows room->bcast         */
+    uint64_t            bcast_pos;      /* next record                                  */
+    uint64_t            bcast_seq;      /* records passed                               */
+    uint64_t            bcast_join;     /* position in the ring of the entered room     */
+    uint64_t            bcast_join_seq;
+    size_t              gather_out;     /* bytes of mpl_out in the last gather          */
+
+    struct journal_replay_s *replay;    /* history requested by :history                */
+    struct status_listing_s *listing;   /* :status or :roommates show being paged out   */
+    struct session_s        *session;   /* of the room mate login, under the sessions lock */
+
+    /* deadlines in ticks of the reactor wheel, one timer goes off at the nearest of them */
+    wheel_timer_t       timer;
+    uint64_t            born;
+    uint64_t            last_in;        /* the last frame received  */
+    uint64_t            last_beat;      /* the last :ping sent      */
+    uint64_t            fin_at;         /* closed anyway once the FIN notice is this late */
 } conn_t;
 
+/* connections of a reactor indexed by fd, the generation changes with every
+ * connection taking the fd, so a (fd, gen) key of a closed connection goes stale */
+typedef struct conn_tab_s {
+    conn_t     **conns;
+    uint32_t    *gens;
+    size_t       cap;
+    size_t       count;
+} conn_tab_t;
+
+#define CONN_TAB_GEN_MASK       (0xFFFFFF)  /* the top byte of the key is left to io_uring */
+#define CONN_TAB_KEY(CONN)      (((uint64_t)(CONN)->gen << 32) | (uint32_t)(CONN)->fd)
+#define CONN_TAB_KEY_FD(KEY)    ((int)(uint32_t)(KEY))
+#define CONN_TAB_KEY_GEN(KEY)   ((uint32_t)((KEY) >> 32))
+#define CONN_TAB_FOREACH(TAB, FD) \
+    for (size_t FD = 0; FD < (TAB)->cap; FD++) if ((TAB)->conns[FD])
+
+static int
+conn_tab_add(conn_tab_t *tab, conn_t *conn);
+static void
+conn_tab_del(conn_tab_t *tab, conn_t *conn);
+static conn_t *
+conn_tab_get(conn_tab_t *tab, uint64_t key);
+static void
+conn_tab_free(conn_tab_t *tab);
+
+static int
+roommate_create(roommate_t **mate, cfg_obj_t *cfgmate);
+static void
+roommate_del(roommate_t *mate, pset_t *gone);
+static int
+roommates_add(roommates_t *mates, cfg_objlist_t *cfgmates);
+static int
+roommates_del(roommates_t *mates, cfg_objlist_t *cfgmates, pset_t *gone);
+static int
+roommates_clear(roommates_t *mates, pset_t *gone);
+
+static int
+room_create(room_t **room, char *name, size_t name_sz);
+static void
+room_del(room_t *room);
+static room_t *
+room_take(rooms_t *rooms, uint32_t hash, const char *name, size_t name_sz);
+static int
+room_add_mates(rooms_t *rooms, roommates_t *mates, char *room_name, size_t room_name_sz, cfg_objlist_t *cfgmates);
+static int
+room_del_mates(rooms_t *rooms, roommates_t *mates, char *name, size_t name_sz, cfg_objlist_t *cfgmates);
+static int
+room_clear_mates(room_t *room);
+static int
+room_bcast_create(room_t *room, size_t cap);
+static void
+room_bcast_free(room_t *room);
+static void
+room_bcast_join(room_bcast_t *bcast, conn_t *conn);
+static void
+room_bcast_copy(room_bcast_t *bcast, uint64_t pos, const void *data, size_t size);
+static uint64_t
+room_bcast_append(room_bcast_t *bcast, msg_t *msg, msg_t *zip, conn_t *except);
+static void
+room_bcast_read(room_bcast_t *bcast, uint64_t pos, void *data, size_t size);
+static void
+room_bcast_peek(room_bcast_t *bcast, uint64_t pos, room_bcast_rec_t *rec);
+static int
+room_bcast_iov(room_bcast_t *bcast, uint64_t pos, size_t size, struct iovec *iov);
+static int
+room_window_create(room_t *room, uint32_t cap);
+static void
+room_window_free(room_t *room);
+static void
+room_window_append(room_window_t *window, msg_t *msg);
+static uint64_t
+room_window_seq(room_window_t *window);
+static int
+room_window_copy(room_window_t *window, uint64_t *seq, uint64_t *lost, char **buf, size_t *len);
+static int
+rooms_clear(rooms_t *rooms);
+
+/***************************
+ * Room journal
+ ***************************/
+/* history of a room in fixed-size segment files mapped in memory, a segment is
+ * a header, a sparse index and the frames exactly as they go to the wire */
+#define JOURNAL_MAGIC       (0x314E524A54414843ULL)    /* "CHATJRN1" */
+#define JOURNAL_SEG_SZ      (16 * 1024 * 1024)
+#define JOURNAL_IDX_STEP    (4096)          /* frame bytes per index entry */
+#define JOURNAL_IDX_CNT     (JOURNAL_SEG_SZ / JOURNAL_IDX_STEP)
+#define JOURNAL_DATA_OFF    (sizeof(journal_seg_hdr_t) + JOURNAL_IDX_CNT * sizeof(journal_idx_t))
+#define JOURNAL_COMMIT_MS   (10)            /* group commit period of the flusher */
+#define JOURNAL_KEEP_DEF    (1024L * 1024 * 1024)   /* bytes per room */
+#define JOURNAL_KEEP_MIN    (2L * JOURNAL_SEG_SZ)
+#define JOURNAL_SYNC_MAX    (4)             /* segments synced per room and commit */
+
+typedef struct journal_idx_s {
+    uint64_t    seq;
+    uint64_t    ts;         /* CLOCK_REALTIME ns */
+    uint64_t    off;        /* of the frame in the segment file */
+} journal_idx_t;
+
+typedef struct journal_seg_hdr_s {
+    uint64_t    magic;      /* set once the segment takes frames, a spare has none */
+    uint64_t    first_seq;
+    uint64_t    first_ts;
+    uint64_t    reserved[5];
+} journal_seg_hdr_t;
+
+typedef struct journal_seg_s {
+    uint64_t         no;        /* file name, the order is given by first_seq */
+    int              fd;
+    char            *map;
+    uint64_t         first_seq;
+    uint64_t         first_ts;
+    size_t           end;       /* end of the frames, under the journal lock  */
+    size_t           synced;    /* end at the last msync, the flusher only    */
+    size_t           idx_cnt;
+    int              refs;      /* the journal and the replays, atomic        */
+    bool             is_dropped;
+    TAILQ_ENTRY(journal_seg_s) tq_entry;
+} journal_seg_t;
+typedef TAILQ_HEAD(journal_seg_list_s, journal_seg_s) journal_seg_list_t;
+
+typedef struct journal_s {
+    struct room_s      *room;
+    struct journals_s  *owner;
+    char               *dir;
+    pthread_mutex_t     lock;       /* appends of the reactors, the flusher and the replays */
+    journal_seg_list_t  segs;       /* oldest first, the last one takes the frames          */
+    journal_seg_t      *spare;      /* created ahead by the flusher                         */
+    uint64_t            next_no;
+    uint64_t            seq;        /* of the next frame                                    */
+    uint64_t            bytes;      /* of the kept segments                                 */
+    uint64_t            failed;     /* frames lost to the disk, atomic                      */
+    int                 refs;       /* the room and the replays, atomic                     */
+    LIST_ENTRY(journal_s) lentry;
+} journal_t;
+
+/* the journals of all rooms, committed and trimmed by one flusher thread */
+typedef struct journals_s {
+    char                   *dir;
+    size_t                  keep;   /* bytes per room                    */
+    long                    age;    /* seconds, 0 keeps them all         */
+    pthread_mutex_t         lock;   /* the list, the flusher walks it    */
+    LIST_HEAD(, journal_s)  list;
+    pthread_t               thread;
+    bool                    running;    /* atomic */
+} journals_t;
+
+/* history sent to a connection, it goes out after the output queued before the request,
+ * the frames of a room window missed by a resumed session are copied to buf instead */
+typedef struct journal_replay_s {
+    journal_t      *journal;    /* referenced, NULL for a window */
+    journal_seg_t  *seg;        /* referenced, NULL for a window */
+    size_t          off;
+    uint64_t        stop_no;    /* journal end at the request */
+    size_t          stop_off;
+    char           *buf;        /* window frames as they go to the wire */
+    size_t          len;
+    msgp_t         *anchor;     /* last output queued before, NULL once it is sent */
+} journal_replay_t;
+
+static uint64_t
+journal_clock(void);
+static void
+journal_seg_path(journal_t *journal, uint64_t no, char *path, size_t path_sz);
+static journal_seg_t *
+journal_seg_create(journal_t *journal, uint64_t no);
+static journal_seg_t *
+journal_seg_load(journal_t *journal, uint64_t no);
+static void
+journal_seg_unref(journal_seg_t *seg);
+static int
+journal_seg_cmp(const void *a, const void *b);
+static int
+journal_open(journals_t *journals, room_t *room);
+static void
+journal_unref(journal_t *journal);
+static void
+journal_close(room_t *room);
+static journal_seg_t *
+journal_roll(journal_t *journal, uint64_t ts);
+static int
+journal_append(journal_t *journal, msg_t *msg);
+static size_t
+journal_seek(journal_seg_t *seg, uint64_t seq, uint64_t ts, uint64_t *at);
+static void
+journal_commit(journal_t *journal);
+static void *
+journal_flusher(void *arg);
+static int
+journals_start(journals_t *journals);
+static void
+journals_stop(journals_t *journals);
+static int
+journal_replay_start(journal_t *journal, conn_t *conn, uint64_t *seq, uint64_t ts, uint64_t *count);
+static void
+journal_replay_free(conn_t *conn);
+static int
+conn_replay(reactor_t *reactor, conn_t *conn);
+
+/***************************
+ * Sessions
+ ***************************/
+/* a room mate login remembered by its token, a new connection presenting it with :resume
+ * takes it over without the password and gets the frames it missed from the room window */
+#define SESSION_TOKEN_SZ    (16)        /* hex digits of 64 random bits         */
+#define SESSION_TTL_DEF     (300)       /* seconds a closed session is kept     */
+#define SESSIONS_MAX        (1024 * 1024)
+
+typedef struct session_s {
+    char             token[SESSION_TOKEN_SZ + 1];
+    roommate_t      *roommate;
+    room_t          *room;          /* entered last, NULL for none                      */
+    conn_t          *conn;          /* logged in, NULL once the connection is closed    */
+    uint64_t         gen;           /* registry_gen of the login, stale pointers after it */
+    uint64_t         closed;        /* CLOCK_MONOTONIC ns of the close                  */
+    TAILQ_ENTRY(session_s) tq_entry;
+} session_t;
+
+typedef struct sessions_s {
+    htab_t           tab;           /* by token */
+    TAILQ_HEAD(, session_s) closed; /* the ones without a connection, oldest first */
+    uint32_t         window;        /* frames of a room window, 0 keeps no sessions */
+    long             ttl;           /* seconds */
+    pthread_mutex_t  lock;          /* the table and session_t.conn of every session */
+} sessions_t;
+
+static const char *
+session_key(const void *val);
+static void
+sessions_expire(sessions_t *sessions, uint64_t now);
+static int
+session_open(sessions_t *sessions, conn_t *conn, uint64_t gen, char *token);
+static void
+session_enter(sessions_t *sessions, conn_t *conn);
+static int
+session_take(sessions_t *sessions, conn_t *conn, const char *token, size_t token_sz, uint64_t gen,
+        roommate_t **mate, room_t **room);
+static void
+session_close(sessions_t *sessions, conn_t *conn);
+static void
+sessions_free(sessions_t *sessions);
+
 /***************************
  * State of the process
  ***************************/
@@ -149,7 +873,7 @@ typedef enum workmode_s {
     WORKMODE_ADM,
     WORKMODE_MATE
 } workmode_t;
-#define WORKMODE_CLI(MODE) ((MODE == WORKMODE_CLIADM) || (MODE == WORKMODE_CLIMATE))
+#define WORKMODE_CLI(MODE) ((MODE == WORKMODE_ADM) || (MODE == WORKMODE_MATE))
 
 typedef struct state_s {
     workmode_t      workmode;
@@ -158,35 +882,528 @@ typedef struct state_s {
     admin_t         admin;
     msg_broker_t    mbroker;
 
-    roommates_t    *mates;
-    rooms_t        *rooms;
-    conns_t        *conns;
+    /* registries are shared by the reactors, each one holds the read lock
+     * while it handles a batch of events, mutations take the write lock */
+    pthread_rwlock_t lock;
+    roommates_t     mates;
+    rooms_t         rooms;
+    uint64_t        registry_gen;   /* bumped by every change of mates and rooms, atomic */
+    pset_t          mates_gone;     /* deleted at runtime, the inboxes may still point at them */
+
+    /* listings of the registries rendered once per registry_gen */
+    pthread_mutex_t status_lock;
+    struct status_text_s *status_mates;     /* :roommates show          */
+    struct status_text_s *status_members;   /* roommates of the rooms   */
+
+    int             workers;
+    reactor_t      *reactors;
+    bool            quit;
+
+    int             accept_burst;   /* connections accepted per listen wakeup */
+    int             listen_backlog;
+    int             epoll_batch;    /* events taken per epoll_wait */
+    bool            edge_input;     /* edge-triggered connections read into conn_t.ring_in */
+    bool            use_uring;      /* io_uring backend, epoll when it is not available */
+
+    long            bcast_min;      /* preset mates of a large room, -1 for none       */
+    size_t          bcast_ring;     /* ring bytes of a large room                      */
+    room_bcast_policy_t bcast_lag;  /* what happens to the readers left behind         */
+
+    journals_t      journals;       /* room history on disk, dir is NULL without --journal */
+    sessions_t      sessions;       /* logins taken over by :resume */
+
+    size_t          out_limit;      /* queued bytes per connection, 0 for no limit     */
+    conn_out_policy_t out_policy;
+    size_t          mem_mark;       /* queued bytes of all reactors, 0 for no mark     */
+    conn_out_policy_t mem_policy;   /* for the slow connections over the mark          */
+
+    uint32_t        streams;        /* stream ids given out, atomic */
+    size_t          zip_min;        /* payload bytes worth compressing         */
+    int             zip_conns;      /* connections with a codec, atomic        */
+
+    long            idle_timeout;   /* seconds without input before a close, 0 for none */
+    long            heartbeat;      /* seconds of silence before a :ping, 0 for none    */
+    long            login_timeout;  /* seconds to log in, 0 for no limit                */
+
+    uint64_t        started;        /* CLOCK_MONOTONIC ns, the server start           */
+    uint64_t        stats_mark;     /* CLOCK_MONOTONIC ns of the previous status, atomic */
+    char           *stats_path;     /* SIGUSR1 dumps the counters here, stderr if NULL */
+
+    char           *snap_path;      /* registries saved on exit and by :snapshot, NULL for none */
+    pthread_mutex_t snap_lock;      /* one writer of the snapshot at a time */
+    void           *snap_slab;      /* the mates loaded from it, in one block */
 } state_t;
 
+/* room rates of the text status are measured since the previous status */
+typedef struct state_status_ctx_s {
+    FILE           *out;
+    double          elapsed;
+} state_status_ctx_t;
+
+/* rendered listing, shared by the cache and the connections paging it out */
+typedef struct status_text_s {
+    char           *buf;
+    size_t          len;
+    uint64_t        gen;        /* registry_gen it was rendered at */
+    int             refs;       /* atomic                          */
+} status_text_t;
+typedef void (*status_render_t)(state_t *state, FILE *out);
+
+/* a listing goes out a page per output turn of the connection, a page ends on a line */
+#define STATUS_PAGE_SZ          (32 * 1024)
+#define STATUS_LISTING_TEXTS    2
+typedef struct status_listing_s {
+    status_text_t  *texts[STATUS_LISTING_TEXTS];    /* referenced, sent in order */
+    int             texts_cnt;
+    int             cur;
+    size_t          off;
+} status_listing_t;
+
 static int
 state_init(state_t *state);
 static void
 state_free(state_t *state);
+static void
+rooms_bcast_update(state_t *state, msg_broker_t *broker);
+static void
+rooms_journal_update(state_t *state, msg_broker_t *broker);
+static void
+rooms_window_update(state_t *state, msg_broker_t *broker);
 
 static void
-state_status_mates_wlk_short(const void *ptr, VISIT order, void *ctx);
+state_status_mates_wlk_short(const void *ptr, void *ctx);
+static void
+state_status_mates_wlk_long(const void *ptr, void *ctx);
 static void
-state_status_mates_wlk_long(const void *ptr, VISIT order, void *ctx);
+state_status_rooms_wlk_short(const void *ptr, void *ctx);
+static void
+state_status_rooms_wlk_long(const void *ptr, void *ctx);
+static void
+state_registry_touch(state_t *state);
+static int
+state_registry_edit(state_t *state, msg_broker_t *broker, cmd_t *cmd);
+static uint64_t
+state_clock(void);
+static void
+state_status_take(state_t *state, FILE *out);
+static void
+state_status_mates(state_t *state, FILE *out);
+static void
+state_status_members(state_t *state, FILE *out);
+static status_text_t *
+state_status_render(state_t *state, status_render_t render);
+static status_text_t *
+state_status_cached(state_t *state, status_text_t **cache, status_render_t render);
+static void
+state_status_unref(status_text_t *text);
+static int
+conn_listing_start(conn_t *conn, status_text_t **texts, int texts_cnt);
 static void
-state_status_rooms_wlk_short(const void *ptr, VISIT order, void *ctx);
+conn_listing_free(conn_t *conn);
 static void
-state_status_rooms_wlk_long(const void *ptr, VISIT order, void *ctx);
+conn_listing(reactor_t *reactor, conn_t *conn);
 static void
-state_status_take(state_t *state, int msg_opts);
+state_status_json_str(FILE *out, const char *str);
+static void
+state_status_json(state_t *state, FILE *out);
+static void
+state_stats_dump(reactor_t *reactor);
+
+/**************************
+ * Snapshot
+ **************************/
+/* the registries in one file, mapped at start and indexed in one pass: a header,
+ * the mates, the rooms, the mate indexes of the room members and the strings */
+#define SNAP_MAGIC          (0x31504E5354414843ULL)    /* "CHATSNP1" */
+#define SNAP_ROOM_OPEN      (0x1)
+
+typedef struct snap_hdr_s {
+    uint64_t    magic;
+    uint64_t    mates_cnt;
+    uint64_t    rooms_cnt;
+    uint64_t    links_cnt;  /* room members, padded to 8 bytes in the file */
+    uint64_t    strs_sz;
+    uint64_t    mates_cap;  /* of the table, the mates go in its slot order */
+    uint64_t    reserved[2];
+} snap_hdr_t;
+
+/* the hashes are the htab_hash ones, the table is filled without hashing */
+typedef struct snap_mate_s {
+    uint64_t    str;        /* name, the password follows it */
+    uint32_t    hash;
+    uint16_t    name_sz;
+    uint16_t    passwd_sz;
+} snap_mate_t;
+
+typedef struct snap_room_s {
+    uint64_t    str;
+    uint32_t    hash;
+    uint32_t    mates_cnt;  /* the next links of the file */
+    uint16_t    name_sz;
+    uint16_t    flags;      /* SNAP_ROOM_* */
+    uint32_t    reserved;
+} snap_room_t;
+
+static int
+snap_idx_cmp(const void *a, const void *b);
+static int
+snap_save(state_t *state, msg_broker_t *broker);
+static int
+snap_load(state_t *state);
+
+/**************************
+ * Reactors
+ **************************/
+#define SRV_WORKERS_MAX (64)    /* limited by the bits of conns_set_t.reactors */
+
+#define SRV_ACCEPT_BURST_DEF    (64)
+#define SRV_ACCEPT_BURST_MAX    (65536)
+#define SRV_LISTEN_BACKLOG_DEF  (INT32_MAX)     /* clamped by net.core.somaxconn */
+#define SRV_EPOLL_BATCH_DEF     (16)
+#define SRV_EPOLL_BATCH_MAX     (4096)
+#define SRV_HOUSEKEEP_MS        (1000)
+
+/* hot path counters, every reactor bumps its own ones and the readers sum them up */
+typedef struct reactor_stats_s {
+    uint64_t     conns;         /* open connections                     */
+    uint64_t     msgs_in;       /* frames received                      */
+    uint64_t     bytes_in;
+    uint64_t     bytes_out;
+    uint64_t     queued;        /* output bytes waiting in mpl_out      */
+    uint64_t     wakeups;       /* epoll_wait or io_uring_enter returns */
+    uint64_t     events;        /* epoll events or io_uring completions */
+    uint64_t     drops_oldest;  /* frames dropped to make room          */
+    uint64_t     drops_chat;    /* chat frames not queued               */
+    uint64_t     kicks;         /* connections finished for their queue */
+    uint64_t     refused;       /* chat input refused over the mark     */
+    uint64_t     zip_frames;    /* compressed twins made                */
+    uint64_t     zip_in;        /* their raw bytes                      */
+    uint64_t     zip_out;       /* their compressed bytes               */
+    uint64_t     zip_ns;        /* thread CPU time spent compressing    */
+} reactor_stats_t;
+
+/* single writer, so a relaxed store is enough to keep the readers tear-free */
+#define REACTOR_STAT_ADD(REACTOR, FIELD, N) \
+    __atomic_store_n(&(REACTOR)->stats.FIELD, (REACTOR)->stats.FIELD + (N), __ATOMIC_RELAXED)
+#define REACTOR_STAT_SUB(REACTOR, FIELD, N) \
+    __atomic_store_n(&(REACTOR)->stats.FIELD, (REACTOR)->stats.FIELD - (N), __ATOMIC_RELAXED)
+#define REACTOR_STAT_GET(REACTOR, FIELD) \
+    __atomic_load_n(&(REACTOR)->stats.FIELD, __ATOMIC_RELAXED)
+
+/* routed message handed over to another reactor */
+typedef struct reactor_xfer_s {
+    msg_t                  *msg;
+    conns_set_t            *targets;
+    room_bcast_t           *bcast;      /* ring with new frames instead of msg */
+    struct reactor_xfer_s  *next;
+} reactor_xfer_t;
+
+typedef struct reactor_s {
+    int              id;
+    pthread_t        thread;
+    int              epoll_fd;
+    int              listen_fd;
+    int              event_fd;  /* wakes the reactor up when inbox gets filled */
+    msg_broker_t     mbroker;
+    conn_tab_t       conns;
+    reactor_xfer_t  *inbox;     /* lock-free LIFO, pushed by the other reactors */
+    state_t         *state;
+    uring_t         *uring;     /* io_uring backend, NULL for epoll */
+    bool             mem_over;  /* queued output is over the watermark, taken per batch */
+    wheel_t          wheel;     /* timers of the connections, advanced per batch */
+    wheel_timer_t    housekeep;
+
+    /* accept counters, the rate is measured over one second windows */
+    uint64_t         acc_total;
+    uint64_t         acc_capped;    /* wakeups which hit the accept burst cap */
+    time_t           acc_win;
+    uint32_t         acc_win_cnt;
+    uint32_t         acc_rate_peak;
+
+    /* large rooms with new frames for the local members */
+    room_bcast_t   **bcast_dirty;
+    size_t           bcast_dirty_cnt;
+    size_t           bcast_dirty_cap;
+
+    /* a cache line of its own, the other reactors only read it */
+    reactor_stats_t  stats __attribute__((aligned(64)));
+} reactor_t;
+
+static int
+conns_join(conns_set_t *set, conn_t *conn);
+static void
+conns_leave(conns_set_t *set, conn_t *conn);
+static pset_t *
+conns_local(conns_set_t *set, int reactor_id);
+static size_t
+conns_count(conns_set_t *set);
+static void
+conns_free(conns_set_t *set);
+
+static int
+reactor_init(reactor_t *reactor, state_t *state, int id);
+static void
+reactor_free(reactor_t *reactor);
+static void
+reactor_push(reactor_t *reactor, reactor_xfer_t *xfer);
+static void
+reactor_xfer(reactor_t *reactor, conns_set_t *targets, msg_t *msg);
+static void
+reactor_bcast_kick(reactor_t *reactor, room_bcast_t *bcast);
+static void
+reactor_bcast_dirty(reactor_t *reactor, room_bcast_t *bcast);
+static void
+reactor_inbox(reactor_t *reactor);
+static void
+reactor_acc_count(reactor_t *reactor, int accepted);
+static void
+reactor_stats_sum(state_t *state, reactor_stats_t *sum);
+static void
+reactor_mem_check(reactor_t *reactor);
+static void
+reactor_pending(reactor_t *reactor);
+static void
+reactor_housekeep(reactor_t *reactor, wheel_timer_t *timer);
+static bool
+reactor_stopped(reactor_t *reactor);
+static void
+reactor_loop_epoll(reactor_t *reactor);
+static void *
+reactor_loop(void *arg);
 
 /**************************
  * Network communication
  **************************/
+#define CONN_IOV_MAX  (128)   /* iovec entries per writev, a frame takes up to two */
+#define CONN_RING_SZ  (128 * 1024)  /* holds the largest frame with room to spare */
+
+#define CONN_OUT_LIMIT_DEF  (64 * 1024 * 1024)
+#define CONN_OUT_LIMIT_MIN  (256 * 1024)    /* a few of the largest frames */
+#define CONN_OUT_SLOW       (256 * 1024)    /* a queue that meets the watermark policy */
+
+#define CONN_HEARTBEAT_DEF  (30)            /* seconds */
+#define CONN_LOGIN_DEF      (60)            /* seconds */
+#define CONN_FIN_GRACE_MS   (5000)          /* for a FIN notice to leave */
+#define CONN_TIMEOUT_MAX    ((long)((WHEEL_SPAN - 1) * WHEEL_TICK_MS / 1000))  /* seconds the wheel holds */
+
+static void
+conn_enqueue(msg_broker_t *broker, conn_t *conn, msg_t *msg);
+static bool
+conn_out_admit(msg_broker_t *broker, conn_t *conn, msg_t *msg);
+static size_t
+conn_out_drop(conn_t *conn, size_t keep);
+static void
+conn_out_fin(msg_broker_t *broker, conn_t *conn, size_t limit);
 static int
-cli_loop(state_t *state);
+conn_gather(conn_t *conn, struct iovec *iov, size_t *expected);
+static int
+conn_advance(conn_t *conn, size_t sent);
+static bool
+conn_has_output(conn_t *conn);
+static bool
+conn_bcast_skips(conn_t *conn, room_bcast_rec_t *rec);
+static int
+conn_gather_bcast(conn_t *conn, struct iovec *iov, int iovmax, size_t *expected);
+static int
+conn_advance_bcast(conn_t *conn, size_t sent);
+static int
+conn_bcast_lag(reactor_t *reactor, conn_t *conn);
+static int
+conn_flush(conn_t *conn);
+static int
+conn_write(conn_t *conn, struct iovec *iov, bool *idle);
+static size_t
+conn_ring_reserve(conn_ring_t *ring);
+static int
+srv_conn_output(reactor_t *reactor, conn_t *conn);
+static int
+srv_conn_input(reactor_t *reactor, conn_t *conn);
+static void
+srv_conn_input_frames(reactor_t *reactor, conn_t *conn);
+static int
+srv_conn_input_ring(reactor_t *reactor, conn_t *conn);
+static void
+conn_close(reactor_t *reactor, conn_t *conn);
+static void
+conn_fin_deadline(reactor_t *reactor, conn_t *conn);
+static void
+conn_timer(reactor_t *reactor, wheel_timer_t *timer);
+static conn_t *
+srv_conn_new(reactor_t *reactor, int fd, struct sockaddr_in *addr, socklen_t addr_len);
+static int
+srv_conn_accept(reactor_t *reactor);
+static int
+srv_cmd_exec(reactor_t *reactor, conn_t *conn, msg_t *msg);
+static int
+srv_cmd_logmate(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_logadm(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_enter(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_history(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_proto(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_compress(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_status(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_registry(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_snapshot(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_resume(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_cmd_pong(reactor_t *reactor, conn_t *conn, cmd_t *cmd);
+static int
+srv_msg_input(reactor_t *reactor, conn_t *conn, msg_t *msg_in);
+static int
+srv_msg_chunk(reactor_t *reactor, conn_t *conn, msg_t *msg_in);
+
 static int
 srv_loop(state_t *state);
 
+/**************************
+ * Client
+ **************************/
+/* stdin lines go out as frames without waiting for the replies, the frames coming back
+ * are rendered into one buffer, which is written to the terminal once per wakeup */
+#define CLI_LINE_SZ     (UINT16_MAX)        /* a longer chat line goes in several frames */
+#define CLI_OUT_MAX     (1024 * 1024)       /* queued output, stdin waits above it       */
+#define CLI_TERM_SZ     (256 * 1024)        /* rendered bytes per wakeup                 */
+#define CLI_LINGER_MS   (500)               /* for the replies after the last line        */
+#define CLI_EVENTS      (4)
+
+typedef struct cli_s {
+    state_t        *state;
+    int             fd;
+    int             epoll_fd;
+    uint32_t        fd_events;      /* of the socket in epoll     */
+    uint32_t        in_events;      /* of stdin in epoll          */
+    bool            is_in_file;     /* stdin can't be polled, it is read on every wakeup */
+    bool            is_in_eof;      /* no more lines, :quit included */
+    bool            is_shut;        /* the server got our EOF     */
+    bool            is_down;
+
+    char           *line;           /* stdin bytes of an unfinished line */
+    size_t          line_len;
+    conn_ring_t     ring_in;
+    msg_list_t      out;
+    size_t          cursor_out;
+    size_t          out_bytes;      /* unsent bytes of out        */
+    bool            is_epout;
+    char           *term;           /* CLI_TERM_SZ and a frame to spare */
+    size_t          term_len;
+} cli_t;
+
+static int
+cli_cmd_add(msg_broker_t *broker, cmd_op_t op, int argc, const char **argv);
+static int
+cli_frame(cli_t *cli, uint16_t ops, const char *data, size_t len);
+static void
+cli_line(cli_t *cli, const char *line, size_t len);
+static void
+cli_stdin(cli_t *cli);
+static void
+cli_send(cli_t *cli);
+static void
+cli_render(cli_t *cli, msg_t *msg);
+static bool
+cli_frames(cli_t *cli);
+static void
+cli_recv(cli_t *cli);
+static void
+cli_term_flush(cli_t *cli);
+static int
+cli_poll(cli_t *cli);
+static int
+cli_connect(state_t *state);
+static int
+cli_loop(state_t *state);
+
+/**************************
+ * io_uring backend
+ **************************/
+#define URING_ENTRIES       (1024)
+#define URING_BUF_CNT       (256)           /* provided recv buffers, power of two */
+#define URING_BUF_SZ        (16 * 1024)     /* fits conn_t.ring_in after conn_ring_reserve */
+#define URING_BUF_GROUP     (0)
+#define URING_DRAIN_MS      (100)           /* wait for cancelled submissions on stop */
+
+/* submission user_data: operation in the top byte, CONN_TAB_KEY below */
+#define URING_OP_ACCEPT     (1)
+#define URING_OP_EVENT      (2)
+#define URING_OP_RECV       (3)
+#define URING_OP_WRITEV     (4)
+#define URING_OP_CANCEL     (5)
+#define URING_OP_POLLOUT    (6)             /* a ring writev would block */
+#define URING_UDATA(OP, KEY)    (((uint64_t)(OP) << 56) | (KEY))
+#define URING_UDATA_OP(UD)      ((int)((UD) >> 56))
+#define URING_UDATA_KEY(UD)     ((UD) & ((1ULL << 56) - 1))
+
+struct uring_s {
+    int                       fd;
+    void                     *ring;
+    size_t                    ring_sz;
+    struct io_uring_sqe      *sqes;
+    size_t                    sqes_sz;
+
+    unsigned                 *sq_head;
+    unsigned                 *sq_tail;
+    unsigned                  sq_mask;
+    unsigned                  sq_entries;
+    unsigned                  sq_local;     /* tail of the not yet submitted entries */
+
+    unsigned                 *cq_head;
+    unsigned                 *cq_tail;
+    unsigned                  cq_mask;
+    struct io_uring_cqe      *cqes;
+
+    struct io_uring_buf_ring *br;           /* provided buffers shared by multishot recvs */
+    size_t                    br_sz;
+    uint16_t                  br_tail;
+    char                     *bufs;
+
+    uint64_t                  evbuf;        /* eventfd counter read by URING_OP_EVENT */
+    bool                      is_stopping;
+};
+
+static int
+uring_init(reactor_t *reactor);
+static void
+uring_free(reactor_t *reactor);
+static int
+uring_enter(uring_t *uring, unsigned wait_nr, int timeout_ms);
+static struct io_uring_sqe *
+uring_sqe(uring_t *uring);
+static void
+uring_buf_put(uring_t *uring, uint16_t bid);
+static int
+uring_arm_accept(reactor_t *reactor);
+static int
+uring_arm_event(reactor_t *reactor);
+static int
+uring_arm_recv(reactor_t *reactor, conn_t *conn);
+static void
+uring_cancel(reactor_t *reactor, int fd);
+static int
+uring_conn_output(reactor_t *reactor, conn_t *conn);
+static void
+uring_recv_done(reactor_t *reactor, struct io_uring_cqe *cqe);
+static int
+uring_arm_pollout(reactor_t *reactor, conn_t *conn);
+static void
+uring_writev_done(reactor_t *reactor, struct io_uring_cqe *cqe);
+static void
+uring_complete(reactor_t *reactor, struct io_uring_cqe *cqe);
+static int
+uring_reap(reactor_t *reactor);
+static void
+uring_stop(reactor_t *reactor);
+static void
+reactor_loop_uring(reactor_t *reactor);
+
 /**************************************
  * configure with admin line parser
  * configure with command line options
@@ -196,24 +1413,92 @@ typedef enum cfg_objtype_e {
     CFG_OBJ_VE
 } cfg_objtype_t;
 
-typedef struct cfg_obj_s {
+struct cfg_obj_s {
     char   *val;
     size_t  val_sz;
     char   *ext;
     size_t  ext_sz;
     LIST_ENTRY(cfg_obj_s) lentry;
-} cfg_obj_t;
-typedef LIST_HEAD(cfg_objlist_s, cfg_obj_s) cfg_objlist_t;
+};
 
 #define CFG_OBJ_OUTER_DELIMS(c) (isspace(c) || c == ',' || c == ';')
 #define CFG_OBJ_INNER_DELIMS(c) (c == ':')
+
+/* --config FILE, lines of "roommates NAME:PASS,..." and "rooms MATE,...@ROOM,..."
+ * taking the values of the same options, '#' starts a comment line */
+#define CFG_FILE_DELIMS(c)      (CFG_OBJ_OUTER_DELIMS(c) || CFG_OBJ_INNER_DELIMS(c) || c == '@')
+#define CFG_FILE_CHUNK_MIN      (1024 * 1024)   /* smaller files aren't worth a thread */
+#define CFG_FILE_THREADS_MAX    (16)
+
+typedef enum cfg_line_e {
+    CFG_LINE_START,
+    CFG_LINE_MATES,         /* after "roommates"          */
+    CFG_LINE_ROOM_MATES,    /* after "rooms", before '@'  */
+    CFG_LINE_ROOMS,         /* after '@'                  */
+    CFG_LINE_SKIP           /* comment or unexpected line */
+} cfg_line_t;
+
+typedef enum cfg_tok_kind_e {
+    CFG_TOK_MATE,           /* NAME:PASS of a roommates line */
+    CFG_TOK_ROOMS,          /* start of a rooms line         */
+    CFG_TOK_ROOM_MATE,
+    CFG_TOK_ROOM
+} cfg_tok_kind_t;
+
+/* tokens point into the mapped file, the hash is taken by the tokenizing thread */
+typedef struct cfg_tok_s {
+    const char *val;
+    const char *ext;
+    uint32_t    val_sz;
+    uint32_t    ext_sz;
+    uint32_t    hash;
+    uint32_t    kind;
+} cfg_tok_t;
+
+/* candidate delimiters of a chunk, found 16 bytes at a time */
+typedef struct cfg_scan_s {
+    const char *blk;        /* block the mask belongs to */
+    const char *next;       /* next block to scan        */
+    const char *end;
+    uint32_t    mask;       /* delimiters not taken yet  */
+} cfg_scan_t;
+
+typedef struct cfg_chunk_s {
+    const char *b;
+    const char *e;          /* past a newline or the end of the file */
+    cfg_tok_t  *toks;
+    size_t      toks_cn;
+    size_t      toks_sz;
+    size_t      mates;      /* CFG_TOK_MATE tokens, sizes the registry */
+    const char *err;        /* first unexpected line, NULL for none    */
+    bool        is_nomem;
+    bool        is_thread;
+    pthread_t   thread;
+} cfg_chunk_t;
+
 static int
 cfg_objstring_parse(char *objstring, size_t objstring_sz, cfg_objlist_t *objlist, cfg_objtype_t objtype);
 static int
 cfg_objlist_clear(cfg_objlist_t *objlist);
+static uint32_t
+cfg_delims_mask(const char *p);
+static const char *
+cfg_scan_next(cfg_scan_t *scan);
+static int
+cfg_tok_push(cfg_chunk_t *chunk, cfg_tok_kind_t kind, const char *val, size_t val_sz, const char *ext, size_t ext_sz);
+static void *
+cfg_file_tokenize(void *arg);
+static int
+cfg_file_build(state_t *state, cfg_chunk_t *chunks, int chunks_cn);
+static int
+cfg_file_load(const char *path, state_t *state);
 static int
 cfg_admline_parse(char *cmdline, state_t *state, bool *quit);
 static int
+cfg_optnum_parse(const char *optval, long min, long max, long *val);
+static int
+cfg_outpolicy_parse(const char *optval, conn_out_policy_t *policy);
+static int
 cfg_cmdline_parse(int argc, char **argv, state_t *state,  bool *helpshow);
 
 #endif
@@ -0,0 +1,720 @@
+/*
+ * Load generator and latency benchmark for the chat server.
+ *
+ * Opens --conns client connections, logs them in as one room mate, spreads
+ * them over --rooms rooms and sends MSG_TYP_CM frames at --rate messages per
+ * second in total. Every frame carries its send time, so each delivery to the
+ * other connections of the room gives one end-to-end latency sample.
+ *
+ * Build alongside the server:
+ *     gcc -O2 -pthread -o chat_bench chat_bench.c -lm
+ *
+ * Run against a server having the mate and the rooms, e.g.
+ *     chat --server 127.0.0.1:7000 --admin adm --roommates bench:pw \
+ *          --rooms 'bench@r0,r1,r2,r3,r4,r5,r6,r7,r8,r9'
+ *     chat_bench --server 127.0.0.1:7000 --mate bench:pw --rooms 10 \
+ *          --conns 2000 --rate 20000 --duration 10 --out bench.json
+ */
+#define main chat_main
+#include "chat.c"
+#undef main
+
+#include <math.h>
+#include <sys/resource.h>
+
+/***********************
+ * Latency histogram
+ ***********************/
+#define BHIST_SUB       (16)    /* linear sub-buckets per power of two, ~6% precision */
+#define BHIST_BUCKETS   (61 * BHIST_SUB)
+
+typedef struct bhist_s {
+    uint64_t cnt[BHIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} bhist_t;
+
+static int
+bhist_index(uint64_t val)
+{
+    if (val < BHIST_SUB) {
+        return (int)val;
+    }
+    int msb = 63 - __builtin_clzll(val);
+    return (msb - 3) * BHIST_SUB + (int)((val >> (msb - 4)) & (BHIST_SUB - 1));
+}
+
+static uint64_t
+bhist_value(int idx)
+{
+    if (idx < BHIST_SUB) {
+        return idx;
+    }
+    int      msb   = idx / BHIST_SUB + 3;
+    uint64_t lower = (uint64_t)(BHIST_SUB + idx % BHIST_SUB) << (msb - 4);
+    return lower + ((1ULL << (msb - 4)) >> 1);
+}
+
+static void
+bhist_add(bhist_t *hist, uint64_t val)
+{
+    hist->cnt[bhist_index(val)]++;
+    hist->total++;
+    if (val > hist->max) {
+        hist->max = val;
+    }
+}
+
+static void
+bhist_merge(bhist_t *dst, bhist_t *src)
+{
+    for (int i = 0; i < BHIST_BUCKETS; i++) {
+        dst->cnt[i] += src->cnt[i];
+    }
+    dst->total += src->total;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+static uint64_t
+bhist_percentile(bhist_t *hist, double pct)
+{
+    uint64_t rank = (uint64_t)ceil(hist->total * pct / 100.0);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < BHIST_BUCKETS; i++) {
+        seen += hist->cnt[i];
+        if (seen >= rank && seen) {
+            uint64_t val = bhist_value(i);
+            return val < hist->max ? val : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/***********************
+ * Bench state
+ ***********************/
+typedef enum bphase_e {
+    BPHASE_CONNECT,
+    BPHASE_WARMUP,
+    BPHASE_MEASURE,
+    BPHASE_DONE
+} bphase_t;
+
+typedef enum bconn_state_e {
+    BCONN_LOGIN,        /* waits for "welcome"      */
+    BCONN_ENTER,        /* waits for "entered"      */
+    BCONN_READY
+} bconn_state_t;
+
+typedef struct bconn_s {
+    int             fd;
+    int             room;
+    bconn_state_t   state;
+    char           *in;
+    size_t          in_len;
+    char           *out;
+    size_t          out_len;
+    size_t          out_sz;
+    bool            is_epout;
+} bconn_t;
+
+typedef struct bench_s bench_t;
+
+typedef struct bworker_s {
+    int         id;
+    pthread_t   thread;
+    int         epoll_fd;
+    bconn_t    *conns;
+    int         conns_cnt;
+    int         next;           /* round-robin sender */
+    uint64_t    sent;           /* since the warmup start */
+    uint64_t    sent_measured;
+    uint64_t    delivered;
+    uint64_t    errors;
+    bhist_t     hist;
+    bench_t    *bench;
+} bworker_t;
+
+struct bench_s {
+    struct sockaddr_in  addr;
+    char               *mate;
+    char               *room_prefix;
+    int                 rooms;
+    int                 conns;
+    int                 threads;
+    double              rate;
+    double              duration;
+    double              warmup;
+    int                 size;
+    bool                binary;     /* log in with MSG_TYP_CB commands */
+    char               *out;
+
+    int                 ready;      /* logged in connections, atomic  */
+    bool                failed;
+    bphase_t            phase;      /* set by the main thread, atomic */
+    uint64_t            t_ready;    /* all the connections logged in */
+    uint64_t            t_warmup;
+    uint64_t            t_measure;
+    bworker_t          *workers;
+};
+
+#define BENCH_IN_SZ     (CONN_RING_SZ)
+#define BENCH_PAYLOAD   (sizeof(uint64_t) + sizeof(uint32_t))  /* send time and sender */
+#define BENCH_EVENTS    (256)
+
+static uint64_t
+bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/***********************
+ * Client connections
+ ***********************/
+static int
+bconn_push(bconn_t *bconn, uint16_t ops, const void *data, size_t size)
+{
+    struct msg_hdr_s hdr = {.ops = ops, .len = (uint16_t)size};
+
+    if (bconn->out_len + sizeof(hdr) + size > bconn->out_sz) {
+        size_t out_sz = (bconn->out_sz ? bconn->out_sz : 4096);
+        while (out_sz < bconn->out_len + sizeof(hdr) + size) {
+            out_sz *= 2;
+        }
+        char *out = realloc(bconn->out, out_sz);
+        if (!out) {
+            return -1;
+        }
+        bconn->out    = out;
+        bconn->out_sz = out_sz;
+    }
+    memcpy(bconn->out + bconn->out_len, &hdr, sizeof(hdr));
+    memcpy(bconn->out + bconn->out_len + sizeof(hdr), data, size);
+    bconn->out_len += sizeof(hdr) + size;
+    return 0;
+}
+
+static int
+bconn_flush(bworker_t *worker, bconn_t *bconn)
+{
+    size_t sent = 0;
+    while (sent < bconn->out_len) {
+        ssize_t rc = send(bconn->fd, bconn->out + sent, bconn->out_len - sent, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+        sent += rc;
+    }
+    memmove(bconn->out, bconn->out + sent, bconn->out_len - sent);
+    bconn->out_len -= sent;
+
+    /* wait for EPOLLOUT only while there is something left to send */
+    bool epout = bconn->out_len != 0;
+    if (epout != bconn->is_epout) {
+        struct epoll_event epev = {
+            .events   = EPOLLIN | (epout ? EPOLLOUT : 0),
+            .data.ptr = bconn
+        };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, bconn->fd, &epev) < 0) {
+            return -1;
+        }
+        bconn->is_epout = epout;
+    }
+    return 0;
+}
+
+static int
+bconn_cmd(bconn_t *bconn, const char *format, ...)
+{
+    char    cmd[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(cmd, sizeof(cmd), format, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= sizeof(cmd)) {
+        return -1;
+    }
+    return bconn_push(bconn, MSG_TYP_CC, cmd, len);
+}
+
+static void
+bconn_frame(bworker_t *worker, bconn_t *bconn, struct msg_hdr_s *hdr, char *data)
+{
+    bench_t *bench = worker->bench;
+
+    switch (MSG_TYP_MASK(hdr->ops)) {
+    case MSG_TYP_CM:
+        if (hdr->len >= BENCH_PAYLOAD
+            && __atomic_load_n(&bench->phase, __ATOMIC_ACQUIRE) == BPHASE_MEASURE) {
+            uint64_t sent_at;
+            memcpy(&sent_at, data, sizeof(sent_at));
+            if (sent_at >= bench->t_measure) {
+                bhist_add(&worker->hist, bench_now() - sent_at);
+                worker->delivered++;
+            }
+        }
+        break;
+    case MSG_TYP_SI:
+        if (bconn->state == BCONN_LOGIN && hdr->len >= 7 && memcmp(data, "welcome", 7) == 0) {
+            bconn->state = BCONN_ENTER;
+        } else if (bconn->state == BCONN_ENTER && hdr->len >= 7 && memcmp(data, "entered", 7) == 0) {
+            bconn->state = BCONN_READY;
+            __atomic_add_fetch(&bench->ready, 1, __ATOMIC_RELEASE);
+        }
+        break;
+    case MSG_TYP_SE:
+        fprintf(stderr, "server error: %.*s\n", (int)hdr->len, data);
+        worker->errors++;
+        if (bconn->state != BCONN_READY) {
+            bench->failed = true;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static int
+bconn_input(bworker_t *worker, bconn_t *bconn)
+{
+    for (;;) {
+        ssize_t rc = recv(bconn->fd, bconn->in + bconn->in_len, BENCH_IN_SZ - bconn->in_len, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        } else if (rc == 0) {
+            return -1;
+        }
+        bconn->in_len += rc;
+
+        size_t head = 0;
+        while (bconn->in_len - head >= sizeof(struct msg_hdr_s)) {
+            struct msg_hdr_s hdr;
+            memcpy(&hdr, bconn->in + head, sizeof(hdr));
+            if (bconn->in_len - head < sizeof(hdr) + hdr.len) {
+                break;
+            }
+            bconn_frame(worker, bconn, &hdr, bconn->in + head + sizeof(hdr));
+            head += sizeof(hdr) + hdr.len;
+        }
+        memmove(bconn->in, bconn->in + head, bconn->in_len - head);
+        bconn->in_len -= head;
+    }
+}
+
+static int
+bconn_open(bworker_t *worker, bconn_t *bconn, int room)
+{
+    bench_t *bench = worker->bench;
+
+    bconn->room = room;
+    bconn->in   = malloc(BENCH_IN_SZ);
+    bconn->fd   = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!bconn->in || bconn->fd < 0) {
+        return -1;
+    }
+    if (connect(bconn->fd, (struct sockaddr *)&bench->addr, sizeof(bench->addr)) < 0) {
+        return -1;
+    }
+    fcntl(bconn->fd, F_SETFL, O_NONBLOCK);
+
+    struct epoll_event epev = {
+        .events   = EPOLLIN,
+        .data.ptr = bconn
+    };
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, bconn->fd, &epev) < 0) {
+        return -1;
+    }
+
+    char *pass = strchr(bench->mate, ':');
+    if (bench->binary) {
+        char        name[256], room_name[256], cmd[600];
+        const char *argv[2] = {name, pass + 1};
+        snprintf(name, sizeof(name), "%.*s", (int)(pass - bench->mate), bench->mate);
+        snprintf(room_name, sizeof(room_name), "%s%d", bench->room_prefix, room);
+
+        int len = cmd_bin_encode(cmd, sizeof(cmd), CMD_OP_LOGMATE, 2, argv);
+        if (len < 0 || bconn_push(bconn, MSG_TYP_CB, cmd, len) < 0) {
+            return -1;
+        }
+        argv[0] = room_name;
+        len = cmd_bin_encode(cmd, sizeof(cmd), CMD_OP_ENTER, 1, argv);
+        if (len < 0 || bconn_push(bconn, MSG_TYP_CB, cmd, len) < 0) {
+            return -1;
+        }
+    } else if (bconn_cmd(bconn, ":logmate %.*s %s", (int)(pass - bench->mate), bench->mate, pass + 1) < 0
+               || bconn_cmd(bconn, ":enter %s%d", bench->room_prefix, room) < 0) {
+        return -1;
+    }
+    return bconn_flush(worker, bconn);
+}
+
+static void
+bconn_close(bconn_t *bconn)
+{
+    if (bconn->fd >= 0) {
+        close(bconn->fd);
+    }
+    free(bconn->in);
+    free(bconn->out);
+}
+
+/***********************
+ * Workers
+ ***********************/
+static void
+bworker_send(bworker_t *worker, uint64_t now)
+{
+    bench_t  *bench = worker->bench;
+    bphase_t  phase = __atomic_load_n(&bench->phase, __ATOMIC_ACQUIRE);
+    if (phase != BPHASE_WARMUP && phase != BPHASE_MEASURE) {
+        return;
+    }
+
+    /* keep the worker share of the rate since the warmup start */
+    double   rate = bench->rate / bench->threads;
+    uint64_t due  = (uint64_t)((now - bench->t_warmup) / 1e9 * rate);
+    uint64_t cap  = worker->sent + worker->conns_cnt;
+    due = due < cap ? due : cap;
+
+    char payload[UINT16_MAX];
+    memset(payload, 'x', bench->size);
+    while (worker->sent < due) {
+        bconn_t *bconn = &worker->conns[worker->next];
+        worker->next = (worker->next + 1) % worker->conns_cnt;
+        if (bconn->fd < 0) {
+            continue;
+        }
+
+        uint32_t sender = (uint32_t)(bconn - worker->conns);
+        memcpy(payload, &now, sizeof(now));
+        memcpy(payload + sizeof(now), &sender, sizeof(sender));
+        if (bconn_push(bconn, MSG_TYP_CM | MSG_WID_RM, payload, bench->size) < 0
+            || bconn_flush(worker, bconn) < 0) {
+            worker->errors++;
+            close(bconn->fd);
+            bconn->fd = -1;
+            continue;
+        }
+        worker->sent++;
+        if (phase == BPHASE_MEASURE && now >= bench->t_measure) {
+            worker->sent_measured++;
+        }
+    }
+}
+
+static void *
+bworker_loop(void *arg)
+{
+    bworker_t         *worker = arg;
+    bench_t           *bench  = worker->bench;
+    struct epoll_event events[BENCH_EVENTS];
+
+    for (int i = 0; i < worker->conns_cnt; i++) {
+        int room = (worker->id + i * bench->threads) % bench->rooms;
+        if (bconn_open(worker, &worker->conns[i], room) < 0) {
+            fprintf(stderr, "can't open connection %d: %s\n", i, strerror(errno));
+            bench->failed = true;
+            return NULL;
+        }
+    }
+
+    while (__atomic_load_n(&bench->phase, __ATOMIC_ACQUIRE) != BPHASE_DONE && !bench->failed) {
+        int cnt = epoll_wait(worker->epoll_fd, events, BENCH_EVENTS, 1);
+        for (int i = 0; i < cnt; i++) {
+            bconn_t *bconn = events[i].data.ptr;
+            if (bconn->fd < 0) {
+                continue;
+            }
+            if (((events[i].events & EPOLLOUT) && bconn_flush(worker, bconn) < 0)
+                || ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && bconn_input(worker, bconn) < 0)) {
+                fprintf(stderr, "connection %d is down\n", (int)(bconn - worker->conns));
+                worker->errors++;
+                close(bconn->fd);
+                bconn->fd = -1;
+            }
+        }
+        bworker_send(worker, bench_now());
+    }
+    return NULL;
+}
+
+/***********************
+ * Results
+ ***********************/
+static int
+bench_report(bench_t *bench, double elapsed)
+{
+    bhist_t  hist = {0};
+    uint64_t sent = 0, delivered = 0, errors = 0;
+
+    for (int t = 0; t < bench->threads; t++) {
+        bhist_merge(&hist, &bench->workers[t].hist);
+        sent      += bench->workers[t].sent_measured;
+        delivered += bench->workers[t].delivered;
+        errors    += bench->workers[t].errors;
+    }
+    double p50  = bhist_percentile(&hist, 50.0)  / 1e3;
+    double p99  = bhist_percentile(&hist, 99.0)  / 1e3;
+    double p999 = bhist_percentile(&hist, 99.9)  / 1e3;
+    double pmax = hist.max / 1e3;
+
+    printf("conns %d, rooms %d, rate %.0f/s, payload %d bytes, %.1f s measured\n",
+            bench->conns, bench->rooms, bench->rate, bench->size, elapsed);
+    printf("sent %llu (%.0f msgs/s), delivered %llu (%.0f deliveries/s), errors %llu\n",
+            (unsigned long long)sent, sent / elapsed,
+            (unsigned long long)delivered, delivered / elapsed,
+            (unsigned long long)errors);
+    printf("latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n", p50, p99, p999, pmax);
+    printf("login: %d conns ready in %.1f ms with %s commands\n",
+            bench->conns, bench->t_ready / 1e6, bench->binary ? "binary" : "text");
+
+    if (!bench->out) {
+        return 0;
+    }
+    FILE *out = fopen(bench->out, "w");
+    if (!out) {
+        fprintf(stderr, "can't open %s: %s\n", bench->out, strerror(errno));
+        return -1;
+    }
+    fprintf(out,
+            "{\n"
+            "  \"conns\": %d,\n"
+            "  \"rooms\": %d,\n"
+            "  \"threads\": %d,\n"
+            "  \"rate_target\": %.0f,\n"
+            "  \"payload_bytes\": %d,\n"
+            "  \"duration_s\": %.3f,\n"
+            "  \"sent\": %llu,\n"
+            "  \"msgs_per_sec\": %.1f,\n"
+            "  \"delivered\": %llu,\n"
+            "  \"deliveries_per_sec\": %.1f,\n"
+            "  \"errors\": %llu,\n"
+            "  \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f},\n"
+            "  \"login_ms\": %.1f,\n"
+            "  \"login_commands\": \"%s\"\n"
+            "}\n",
+            bench->conns, bench->rooms, bench->threads, bench->rate, bench->size, elapsed,
+            (unsigned long long)sent, sent / elapsed,
+            (unsigned long long)delivered, delivered / elapsed,
+            (unsigned long long)errors,
+            p50, p99, p999, pmax,
+            bench->t_ready / 1e6, bench->binary ? "binary" : "text");
+    fclose(out);
+    return 0;
+}
+
+/***********************
+ * Command line
+ ***********************/
+static int
+bench_cmdline_parse(int argc, char **argv, bench_t *bench)
+{
+    char *shortopts = "s:m:p:R:c:t:r:d:w:S:Bo:h";
+    struct option longopts[] = {
+            {"server",      required_argument, NULL, 's'},
+            {"mate",        required_argument, NULL, 'm'},
+            {"room-prefix", required_argument, NULL, 'p'},
+            {"rooms",       required_argument, NULL, 'R'},
+            {"conns",       required_argument, NULL, 'c'},
+            {"threads",     required_argument, NULL, 't'},
+            {"rate",        required_argument, NULL, 'r'},
+            {"duration",    required_argument, NULL, 'd'},
+            {"warmup",      required_argument, NULL, 'w'},
+            {"size",        required_argument, NULL, 'S'},
+            {"binary",      no_argument,       NULL, 'B'},
+            {"out",         required_argument, NULL, 'o'},
+            {"help",        no_argument,       NULL, 'h'},
+            {NULL,          0,                 NULL,  0}
+    };
+    char *server = NULL;
+    long  num;
+    int   opt;
+
+    while ((opt = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            server = optarg;
+            break;
+        case 'm':
+            bench->mate = optarg;
+            break;
+        case 'p':
+            bench->room_prefix = optarg;
+            break;
+        case 'R':
+            if (cfg_optnum_parse(optarg, 1, INT32_MAX, &num) < 0) {
+                fprintf(stderr, "--rooms must be a positive number\n");
+                return -1;
+            }
+            bench->rooms = (int)num;
+            break;
+        case 'c':
+            if (cfg_optnum_parse(optarg, 2, INT32_MAX, &num) < 0) {
+                fprintf(stderr, "--conns must be at least 2\n");
+                return -1;
+            }
+            bench->conns = (int)num;
+            break;
+        case 't':
+            if (cfg_optnum_parse(optarg, 1, 256, &num) < 0) {
+                fprintf(stderr, "--threads must be in range 1..256\n");
+                return -1;
+            }
+            bench->threads = (int)num;
+            break;
+        case 'r':
+            bench->rate = strtod(optarg, NULL);
+            break;
+        case 'd':
+            bench->duration = strtod(optarg, NULL);
+            break;
+        case 'w':
+            bench->warmup = strtod(optarg, NULL);
+            break;
+        case 'S':
+            if (cfg_optnum_parse(optarg, BENCH_PAYLOAD, UINT16_MAX, &num) < 0) {
+                fprintf(stderr, "--size must be in range %zu..%d\n", BENCH_PAYLOAD, UINT16_MAX);
+                return -1;
+            }
+            bench->size = (int)num;
+            break;
+        case 'B':
+            bench->binary = true;
+            break;
+        case 'o':
+            bench->out = optarg;
+            break;
+        default:
+            printf("usage: %s --server ADDR:PORT --mate NAME:PASS [--rooms N] [--room-prefix P]\n"
+                   "       [--conns N] [--threads N] [--rate MSGS] [--duration SEC] [--warmup SEC]\n"
+                   "       [--size BYTES] [--binary] [--out FILE]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    char *port = server ? strchr(server, ':') : NULL;
+    if (!port || !bench->mate || !strchr(bench->mate, ':')) {
+        fprintf(stderr, "--server ADDR:PORT and --mate NAME:PASS must be set\n");
+        return -1;
+    }
+    *port++ = '\0';
+    bench->addr.sin_family = AF_INET;
+    bench->addr.sin_port   = htons((uint16_t)atoi(port));
+    if (!inet_aton(server, &bench->addr.sin_addr) || atoi(port) <= 0 || atoi(port) > UINT16_MAX) {
+        fprintf(stderr, "unexpected value of --server option\n");
+        return -1;
+    }
+    if (bench->rate <= 0 || bench->duration <= 0 || bench->warmup < 0 || bench->threads > bench->conns) {
+        fprintf(stderr, "unexpected --rate, --duration, --warmup or --threads value\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_t bench = {
+        .room_prefix = "r",
+        .rooms       = 10,
+        .conns       = 1000,
+        .threads     = 1,
+        .rate        = 10000,
+        .duration    = 10,
+        .warmup      = 1,
+        .size        = 64
+    };
+    if (bench_cmdline_parse(argc, argv, &bench) < 0) {
+        return 1;
+    }
+
+    /* every client connection takes a descriptor */
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+
+    bench.workers = calloc(bench.threads, sizeof(bworker_t));
+    if (!bench.workers) {
+        return 1;
+    }
+    int started = 0;
+    for (; started < bench.threads; started++) {
+        bworker_t *worker = &bench.workers[started];
+        worker->id        = started;
+        worker->bench     = &bench;
+        worker->conns_cnt = bench.conns / bench.threads + (started < bench.conns % bench.threads);
+        worker->conns     = calloc(worker->conns_cnt, sizeof(bconn_t));
+        worker->epoll_fd  = epoll_create1(0);
+        for (int i = 0; worker->conns && i < worker->conns_cnt; i++) {
+            worker->conns[i].fd = -1;
+        }
+        if (!worker->conns || worker->epoll_fd < 0
+            || pthread_create(&worker->thread, NULL, bworker_loop, worker) != 0) {
+            fprintf(stderr, "can't start worker %d\n", started);
+            bench.failed = true;
+            break;
+        }
+    }
+
+    /* all the connections log in and enter their rooms before the load starts */
+    uint64_t t_start = bench_now();
+    while (!bench.failed && __atomic_load_n(&bench.ready, __ATOMIC_ACQUIRE) < bench.conns) {
+        if (bench_now() - t_start > 60 * 1000000000ULL) {
+            fprintf(stderr, "only %d of %d connections are ready\n", bench.ready, bench.conns);
+            bench.failed = true;
+            break;
+        }
+        usleep(10000);
+    }
+
+    double elapsed = 0;
+    if (!bench.failed) {
+        bench.t_ready   = bench_now() - t_start;
+        bench.t_warmup  = bench_now();
+        bench.t_measure = bench.t_warmup + (uint64_t)(bench.warmup * 1e9);
+        __atomic_store_n(&bench.phase, BPHASE_WARMUP, __ATOMIC_RELEASE);
+        usleep((useconds_t)(bench.warmup * 1e6));
+
+        __atomic_store_n(&bench.phase, BPHASE_MEASURE, __ATOMIC_RELEASE);
+        usleep((useconds_t)(bench.duration * 1e6));
+        elapsed = (bench_now() - bench.t_measure) / 1e9;
+    }
+    __atomic_store_n(&bench.phase, BPHASE_DONE, __ATOMIC_RELEASE);
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(bench.workers[t].thread, NULL);
+    }
+    int rc = bench.failed ? -1 : bench_report(&bench, elapsed);
+
+    for (int t = 0; t < bench.threads; t++) {
+        bworker_t *worker = &bench.workers[t];
+        if (!worker->bench) {
+            continue;
+        }
+        for (int i = 0; worker->conns && i < worker->conns_cnt; i++) {
+            bconn_close(&worker->conns[i]);
+        }
+        free(worker->conns);
+        if (worker->epoll_fd >= 0) {
+            close(worker->epoll_fd);
+        }
+    }
+    free(bench.workers);
+    return rc < 0 ? 1 : 0;
+}
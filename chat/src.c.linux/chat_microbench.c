@@ -0,0 +1,683 @@
+/*
+ * Microbenchmarks of the broker, parser and registry hot functions.
+ *
+ * Every case prints ns/op and allocations/op, an allocation being a call of
+ * malloc, calloc, realloc or strdup made by chat.c. Run it before and after
+ * a change to the measured paths and compare.
+ *
+ * Build alongside the server:
+ *     gcc -O2 -pthread -o chat_microbench chat_microbench.c
+ *
+ *     chat_microbench [--filter SUBSTR] [--max N] [--out FILE]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/***********************
+ * Allocation counters
+ ***********************/
+static uint64_t mb_allocs;
+
+static void *
+mb_malloc(size_t size)
+{
+    mb_allocs++;
+    return malloc(size);
+}
+
+static void *
+mb_calloc(size_t nmemb, size_t size)
+{
+    mb_allocs++;
+    return calloc(nmemb, size);
+}
+
+static void *
+mb_realloc(void *ptr, size_t size)
+{
+    mb_allocs++;
+    return realloc(ptr, size);
+}
+
+static char *
+mb_strdup(const char *s)
+{
+    mb_allocs++;
+    return strdup(s);
+}
+
+#undef strdup
+#define malloc(SIZE)            mb_malloc(SIZE)
+#define calloc(NMEMB, SIZE)     mb_calloc(NMEMB, SIZE)
+#define realloc(PTR, SIZE)      mb_realloc(PTR, SIZE)
+#define strdup(S)               mb_strdup(S)
+
+#define main chat_main
+#include "chat.c"
+#undef main
+
+/***********************
+ * Measurement
+ ***********************/
+#define MB_RESULTS_MAX  (64)
+
+typedef struct mb_result_s {
+    char        name[64];
+    uint64_t    ops;
+    double      ns_op;
+    double      allocs_op;
+} mb_result_t;
+
+static struct {
+    const char  *filter;
+    size_t       max;
+    uint64_t     t_start;
+    uint64_t     allocs_start;
+    mb_result_t  results[MB_RESULTS_MAX];
+    int          results_cnt;
+} mb = {.max = 1000000};
+
+static uint64_t
+mb_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool
+mb_selected(const char *name)
+{
+    return !mb.filter || strstr(name, mb.filter);
+}
+
+static void
+mb_start(void)
+{
+    mb.allocs_start = mb_allocs;
+    mb.t_start      = mb_now();
+}
+
+static void
+mb_stop(const char *name, uint64_t ops)
+{
+    uint64_t elapsed = mb_now() - mb.t_start;
+    uint64_t allocs  = mb_allocs - mb.allocs_start;
+
+    if (mb.results_cnt == MB_RESULTS_MAX) {
+        return;
+    }
+    mb_result_t *res = &mb.results[mb.results_cnt++];
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->ops       = ops;
+    res->ns_op     = (double)elapsed / ops;
+    res->allocs_op = (double)allocs / ops;
+    printf("%-40s %10llu ops %12.1f ns/op %10.3f allocs/op\n",
+            res->name, (unsigned long long)ops, res->ns_op, res->allocs_op);
+    fflush(stdout);
+}
+
+/***********************
+ * Message building
+ ***********************/
+#define MB_MSG_OPS      (1000000)
+
+static void
+mb_msg_add(void)
+{
+    msg_t msg = {0};
+
+    if (mb_selected("msg_add_fmt/single")) {
+        mb_start();
+        for (int i = 0; i < MB_MSG_OPS; i++) {
+            msg_add_fmt(&msg, "room '%s' is closed for %s", "lobby", "alice");
+            free(msg.data);
+            msg = (msg_t){0};
+        }
+        mb_stop("msg_add_fmt/single", MB_MSG_OPS);
+    }
+
+    /* status reports are built by appends, start over before reaching the frame limit */
+    if (mb_selected("msg_add_fmt/append")) {
+        mb_start();
+        for (int i = 0; i < MB_MSG_OPS; i++) {
+            if (msg.hdr.len > UINT16_MAX - 64) {
+                free(msg.data);
+                msg = (msg_t){0};
+            }
+            msg_add_fmt(&msg, "    %s: %d connections\n", "alice", i & 0xFF);
+        }
+        mb_stop("msg_add_fmt/append", MB_MSG_OPS);
+        free(msg.data);
+        msg = (msg_t){0};
+    }
+
+    if (mb_selected("msg_add_bin/append")) {
+        char chunk[32];
+        memset(chunk, 'x', sizeof(chunk));
+        mb_start();
+        for (int i = 0; i < MB_MSG_OPS; i++) {
+            if (msg.hdr.len > UINT16_MAX - sizeof(chunk)) {
+                free(msg.data);
+                msg = (msg_t){0};
+            }
+            msg_add_bin(&msg, chunk, sizeof(chunk));
+        }
+        mb_stop("msg_add_bin/append", MB_MSG_OPS);
+        free(msg.data);
+    }
+}
+
+/***********************
+ * Message broker
+ ***********************/
+static void
+mb_broker(void)
+{
+    msg_broker_t broker;
+    mbr_init(&broker);
+
+    if (mb_selected("mbr_grow+release")) {
+        mb_start();
+        for (int i = 0; i < MB_MSG_OPS; i++) {
+            msg_t *msg = mbr_grow(&broker, MSG_TYP_SI | MSG_WID_AC | MSG_COMMIT, NULL);
+            mbr_release(&broker, msg);
+        }
+        mb_stop("mbr_grow+release", MB_MSG_OPS);
+    }
+
+    /* local messages go to stderr, keep the terminal out of the numbers */
+    int stderr_fd = dup(STDERR_FILENO);
+    int null_fd   = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+
+    if (mb_selected("mbr_add_logi+flush_locals")) {
+        mb_start();
+        for (int i = 0; i < MB_MSG_OPS; i++) {
+            mbr_add_logi(&broker, "reactor %d: accepted %d", 0, i);
+            mbr_flush_locals(&broker);
+        }
+        mb_stop("mbr_add_logi+flush_locals", MB_MSG_OPS);
+    }
+    if (mb_selected("mbr_flush_locals/64")) {
+        mb_start();
+        for (int i = 0; i < MB_MSG_OPS; i += 64) {
+            for (int j = 0; j < 64; j++) {
+                mbr_add_logi(&broker, "reactor %d: accepted %d", 0, i + j);
+            }
+            mbr_flush_locals(&broker);
+        }
+        mb_stop("mbr_flush_locals/64", MB_MSG_OPS);
+    }
+    if (mb_selected("mbr_add_logi+log_push") && mbr_log_start() == 0) {
+        /* producer side only, a full ring drops the lines instead of waiting */
+        mb_start();
+        for (int i = 0; i < MB_MSG_OPS; i++) {
+            mbr_add_logi(&broker, "reactor %d: accepted %d", 0, i);
+            mbr_flush_locals(&broker);
+        }
+        mb_stop("mbr_add_logi+log_push", MB_MSG_OPS);
+        mbr_log_stop();
+    }
+
+    dup2(stderr_fd, STDERR_FILENO);
+    close(stderr_fd);
+    close(null_fd);
+}
+
+/***********************
+ * Config parsing & registries
+ ***********************/
+static char *
+mb_matestring(size_t count, size_t *size)
+{
+    /* "mate0:pass0,mate1:pass1,..." */
+    size_t cap = count * 32 + 1;
+    char  *str = malloc(cap);
+    size_t len = 0;
+
+    for (size_t i = 0; str && i < count; i++) {
+        len += snprintf(str + len, cap - len, "%smate%zu:pass%zu", i ? "," : "", i, i);
+    }
+    *size = len;
+    return str;
+}
+
+static void
+mb_registry(size_t count)
+{
+    char   name[64];
+    size_t size;
+    char  *matestring = mb_matestring(count, &size);
+    if (!matestring) {
+        return;
+    }
+
+    cfg_objlist_t cfgmates;
+    LIST_INIT(&cfgmates);
+
+    snprintf(name, sizeof(name), "cfg_objstring_parse/%zu", count);
+    if (mb_selected(name)) {
+        mb_start();
+        cfg_objstring_parse(matestring, size, &cfgmates, CFG_OBJ_VE);
+        mb_stop(name, count);
+        cfg_objlist_clear(&cfgmates);
+    }
+
+    /* the registries are measured per added entry */
+    cfg_objstring_parse(matestring, size, &cfgmates, CFG_OBJ_VE);
+    roommates_t mates;
+    rooms_t     rooms;
+    htab_init(&mates, roommate_key);
+    htab_init(&rooms, room_key);
+
+    snprintf(name, sizeof(name), "roommates_add/%zu", count);
+    bool mates_run = mb_selected(name);
+    if (mates_run) {
+        mb_start();
+    }
+    roommates_add(&mates, &cfgmates);
+    if (mates_run) {
+        mb_stop(name, count);
+    }
+
+    snprintf(name, sizeof(name), "room_add_mates/%zu", count);
+    if (mb_selected(name)) {
+        cfg_objlist_t cfgnames;
+        LIST_INIT(&cfgnames);
+        cfg_objstring_parse(matestring, size, &cfgnames, CFG_OBJ_V);
+
+        mb_start();
+        room_add_mates(&rooms, &mates, "lobby", 5, &cfgnames);
+        mb_stop(name, count);
+        cfg_objlist_clear(&cfgnames);
+    }
+
+    rooms_clear(&rooms);
+    roommates_clear(&mates, NULL);
+    cfg_objlist_clear(&cfgmates);
+    free(matestring);
+}
+
+static void
+mb_config(size_t count)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "cfg_file_load/%zu", count);
+    if (!mb_selected(name)) {
+        return;
+    }
+
+    /* lines of 100 mates, every mate in one of 10 rooms */
+    char  path[] = "/tmp/chat_microbench.XXXXXX";
+    int   fd     = mkstemp(path);
+    FILE *file   = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!file) {
+        perror("mkstemp");
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        fprintf(file, "%smate%zu:pass%zu%s", i % 100 ? "," : "roommates ", i, i, i % 100 == 99 ? "\n" : "");
+    }
+    for (size_t r = 0; r < 10; r++) {
+        fprintf(file, "\nrooms ");
+        for (size_t i = r; i < count; i += 10) {
+            fprintf(file, "%smate%zu", i == r ? "" : ",", i);
+        }
+        fprintf(file, "@room%zu", r);
+    }
+    fclose(file);
+
+    state_t state;
+    state_init(&state);
+    mb_start();
+    int rc = cfg_file_load(path, &state);
+    mb_stop(name, count);
+    if (rc < 0 || state.mates.count != count) {
+        fprintf(stderr, "%s: unexpected load\n", name);
+    }
+    unlink(path);
+    state_free(&state);
+}
+
+static void
+mb_status(size_t count)
+{
+    char   name[64];
+    char   name_cached[64];
+    size_t size;
+    snprintf(name, sizeof(name), "state_status_render/%zu", count);
+    snprintf(name_cached, sizeof(name_cached), "state_status_cached/%zu", count);
+    if (!mb_selected(name) && !mb_selected(name_cached)) {
+        return;
+    }
+    char *matestring = mb_matestring(count, &size);
+    if (!matestring) {
+        return;
+    }
+
+    cfg_objlist_t cfgmates;
+    LIST_INIT(&cfgmates);
+    cfg_objstring_parse(matestring, size, &cfgmates, CFG_OBJ_VE);
+    state_t state;
+    state_init(&state);
+    roommates_add(&state.mates, &cfgmates);
+
+    /* a listing rendered per request against one taken from the cache */
+    if (mb_selected(name)) {
+        mb_start();
+        for (int i = 0; i < 10; i++) {
+            state_status_unref(state_status_render(&state, state_status_mates));
+        }
+        mb_stop(name, 10);
+    }
+    if (mb_selected(name_cached)) {
+        state_status_unref(state_status_cached(&state, &state.status_mates, state_status_mates));
+        mb_start();
+        for (int i = 0; i < 1000; i++) {
+            state_status_unref(state_status_cached(&state, &state.status_mates, state_status_mates));
+        }
+        mb_stop(name_cached, 1000);
+    }
+
+    state_free(&state);
+    cfg_objlist_clear(&cfgmates);
+    free(matestring);
+}
+
+/***********************
+ * Socket I/O
+ ***********************/
+#define MB_IO_OPS   (200000)
+
+static void
+mb_io(size_t payload)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "msg_io_iov+read/%zu", payload);
+    if (!mb_selected(name)) {
+        return;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+        perror("socketpair");
+        return;
+    }
+    msg_t out = {0};
+    msg_t in  = {0};
+    char *data = malloc(payload);
+    memset(data, 'x', payload);
+    msg_add_bin(&out, data, payload);
+    out.hdr.ops = MSG_TYP_CM | MSG_WID_RM;
+
+    /* a frame goes out the way conn_gather puts it into the writev */
+    struct iovec iov[2];
+    int          iovcnt   = msg_io_iov(&out, 0, iov);
+    ssize_t      expected = sizeof(out.hdr) + out.hdr.len;
+
+    mb_start();
+    for (int i = 0; i < MB_IO_OPS; i++) {
+        size_t cursor_in = 0;
+        if (writev(sv[0], iov, iovcnt) != expected
+            || msg_io_read(&in, sv[1], &cursor_in) != MSG_IO_OK) {
+            fprintf(stderr, "%s: unexpected partial transfer\n", name);
+            break;
+        }
+    }
+    mb_stop(name, MB_IO_OPS);
+
+    free(data);
+    free(out.data);
+    free(in.data);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/***********************
+ * Compression
+ ***********************/
+#define MB_LZ_OPS   (20000)
+
+static void
+mb_lz(size_t payload)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "lz_compress+decompress/%zu", payload);
+    if (!mb_selected(name)) {
+        return;
+    }
+
+    /* chat-like text, words of a small vocabulary */
+    static const char *words[] = {"hello", "room", "message", "the", "server", "is", "back", "online", "see", "log"};
+    uint8_t *raw  = malloc(payload);
+    uint8_t *zip  = malloc(payload);
+    uint8_t *back = malloc(payload);
+    size_t   len  = 0;
+    for (unsigned seed = 1; len < payload; seed = seed * 1103515245 + 12345) {
+        const char *word = words[(seed >> 16) % 10];
+        for (size_t i = 0; word[i] && len < payload; i++) {
+            raw[len++] = word[i];
+        }
+        if (len < payload) {
+            raw[len++] = ' ';
+        }
+    }
+
+    int size = 0;
+    mb_start();
+    for (int i = 0; i < MB_LZ_OPS; i++) {
+        size = lz_compress(raw, payload, zip, payload);
+        if (size < 0 || lz_decompress(zip, size, back, payload) != (int)payload) {
+            fprintf(stderr, "%s: unexpected round trip\n", name);
+            break;
+        }
+    }
+    mb_stop(name, MB_LZ_OPS);
+    if (memcmp(raw, back, payload) != 0) {
+        fprintf(stderr, "%s: round trip differs\n", name);
+    }
+    printf("%-40s %10zu to %d bytes\n", name, payload, size);
+
+    free(raw);
+    free(zip);
+    free(back);
+}
+
+/***********************
+ * Commands
+ ***********************/
+#define MB_CMD_OPS  (1000000)
+
+static void
+mb_cmd(void)
+{
+    static const char  text[]  = "logmate alice secret";
+    static const char *argv[]  = {"alice", "secret"};
+    char               bin[64];
+    int                bin_len = cmd_bin_encode(bin, sizeof(bin), CMD_OP_LOGMATE, 2, argv);
+    cmd_t              cmd;
+    uint64_t           argc    = 0;
+
+    if (mb_selected("cmd_text_parse/logmate")) {
+        mb_start();
+        for (int i = 0; i < MB_CMD_OPS; i++) {
+            cmd_text_parse(text, sizeof(text) - 1, &cmd);
+            argc += cmd.argc;
+        }
+        mb_stop("cmd_text_parse/logmate", MB_CMD_OPS);
+    }
+    if (mb_selected("cmd_bin_parse/logmate") && bin_len > 0) {
+        mb_start();
+        for (int i = 0; i < MB_CMD_OPS; i++) {
+            cmd_bin_parse(bin, bin_len, &cmd);
+            argc += cmd.argc;
+        }
+        mb_stop("cmd_bin_parse/logmate", MB_CMD_OPS);
+    }
+    /* keep the parses observable */
+    if (argc % MB_CMD_OPS) {
+        fprintf(stderr, "cmd: unexpected argument count %llu\n", (unsigned long long)argc);
+    }
+}
+
+/***********************
+ * Timer wheel
+ ***********************/
+#define MB_WHEEL_SPAN   (36000)     /* ticks of the delays, an hour */
+
+static wheel_t *mb_wheel_cur;
+static uint64_t mb_wheel_fired;
+static uint64_t mb_wheel_late;
+
+static void
+mb_wheel_cb(reactor_t *reactor, wheel_timer_t *timer)
+{
+    (void)reactor;
+    mb_wheel_fired++;
+    if (timer->expires != mb_wheel_cur->now) {
+        mb_wheel_late++;
+    }
+}
+
+static void
+mb_wheel(size_t count)
+{
+    char name_arm[64];
+    char name_rearm[64];
+    char name_fire[64];
+    snprintf(name_arm, sizeof(name_arm), "wheel_arm/%zu", count);
+    snprintf(name_rearm, sizeof(name_rearm), "wheel_rearm/%zu", count);
+    snprintf(name_fire, sizeof(name_fire), "wheel_advance/%zu", count);
+    if (!mb_selected(name_arm) && !mb_selected(name_rearm) && !mb_selected(name_fire)) {
+        return;
+    }
+
+    wheel_t       *wheel  = malloc(sizeof(wheel_t));
+    wheel_timer_t *timers = calloc(count, sizeof(wheel_timer_t));
+    if (!wheel || !timers) {
+        free(wheel);
+        free(timers);
+        return;
+    }
+    wheel_init(wheel, 0);
+    mb_wheel_cur   = wheel;
+    mb_wheel_fired = 0;
+    mb_wheel_late  = 0;
+
+    /* connection timers spread over an hour */
+    unsigned seed = 1;
+    mb_start();
+    for (size_t i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        timers[i].cb = mb_wheel_cb;
+        wheel_arm(wheel, &timers[i], 1 + (seed >> 8) % MB_WHEEL_SPAN);
+    }
+    mb_stop(name_arm, count);
+
+    /* input pushes the deadlines on, every timer moves once */
+    mb_start();
+    for (size_t i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        wheel_arm(wheel, &timers[i], 1 + (seed >> 8) % MB_WHEEL_SPAN);
+    }
+    mb_stop(name_rearm, count);
+
+    /* the hour goes by in 100 ms steps, as a reactor waking up on the timeout */
+    mb_start();
+    for (uint64_t tick = 1; tick <= MB_WHEEL_SPAN; tick++) {
+        wheel_advance(wheel, NULL, tick * WHEEL_TICK_MS * 1000000ULL);
+    }
+    mb_stop(name_fire, count);
+    if (mb_wheel_fired != count || mb_wheel_late || wheel->armed) {
+        fprintf(stderr, "%s: %llu fired, %llu off their tick, %zu left\n", name_fire,
+                (unsigned long long)mb_wheel_fired, (unsigned long long)mb_wheel_late, wheel->armed);
+    }
+
+    free(timers);
+    free(wheel);
+}
+
+/***********************
+ * Results
+ ***********************/
+static int
+mb_report(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(out, "[\n");
+    for (int i = 0; i < mb.results_cnt; i++) {
+        mb_result_t *res = &mb.results[i];
+        fprintf(out, "  {\"name\": \"%s\", \"ops\": %llu, \"ns_op\": %.2f, \"allocs_op\": %.4f}%s\n",
+                res->name, (unsigned long long)res->ops, res->ns_op, res->allocs_op,
+                i + 1 < mb.results_cnt ? "," : "");
+    }
+    fprintf(out, "]\n");
+    fclose(out);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *shortopts = "f:m:o:h";
+    struct option longopts[] = {
+            {"filter",  required_argument, NULL, 'f'},
+            {"max",     required_argument, NULL, 'm'},
+            {"out",     required_argument, NULL, 'o'},
+            {"help",    no_argument,       NULL, 'h'},
+            {NULL,      0,                 NULL,  0}
+    };
+    char *out = NULL;
+    long  max;
+    int   opt;
+
+    while ((opt = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            mb.filter = optarg;
+            break;
+        case 'm':
+            if (cfg_optnum_parse(optarg, 1, INT32_MAX, &max) < 0) {
+                fprintf(stderr, "--max must be a positive number\n");
+                return 1;
+            }
+            mb.max = (size_t)max;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            printf("usage: %s [--filter SUBSTR] [--max REGISTRY_ENTRIES] [--out FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    mb_msg_add();
+    mb_broker();
+    for (size_t count = 10000; count <= mb.max; count *= 10) {
+        mb_registry(count);
+        mb_config(count);
+        mb_status(count);
+    }
+    mb_io(64);
+    mb_io(4096);
+    mb_lz(1024);
+    mb_lz(65535);
+    mb_cmd();
+    mb_wheel(mb.max);
+
+    if (out && mb_report(out) < 0) {
+        return 1;
+    }
+    for (int p = 0; p < POOL_ID_MAX; p++) {
+        pool_destroy(&pools[p]);
+    }
+    return 0;
+}
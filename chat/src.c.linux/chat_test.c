@@ -0,0 +1,324 @@
+/*
+ * Checks of the server behavior which the client and the load generator can't
+ * tell, run against a server started in the same process.
+ *
+ * Every case prints ok or FAIL with the reason, the exit code is the count of
+ * failed cases.
+ *
+ * Build alongside the server:
+ *     gcc -O2 -pthread -o chat_test chat_test.c
+ *
+ *     chat_test [--filter SUBSTR]
+ */
+#define main chat_main
+#include "chat.c"
+#undef main
+
+/***********************
+ * Server and clients
+ ***********************/
+#define CT_ADMIN        "adm"
+#define CT_TIMEOUT_MS   (2000)
+#define CT_LINE_MAX     (1024)
+#define CT_TEXT_MAX     (UINT16_MAX + 1)
+
+static struct {
+    const char  *filter;
+    int          port;
+    pthread_t    server;
+    int          failed;
+} ct;
+
+static void *
+ct_server(void *arg)
+{
+    char  listen[32];
+    char *argv[] = {
+        "chat", "--server", listen, "--admin", CT_ADMIN, "--workers", "2",
+        "--roommates", "bob:pw,carl:pw", "--rooms", "bob,carl@lobby", NULL
+    };
+
+    (void)arg;
+    snprintf(listen, sizeof(listen), "127.0.0.1:%d", ct.port);
+    chat_main(sizeof(argv) / sizeof(argv[0]) - 1, argv);
+    return NULL;
+}
+
+static int
+ct_port(void)
+{
+    struct sockaddr_in addr     = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t          addr_len = sizeof(addr);
+    int                fd       = socket(AF_INET, SOCK_STREAM, 0);
+
+    /* a free port, released right before the server takes it */
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, addr_len) < 0
+        || getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static int
+ct_connect(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(ct.port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    struct timeval     tv   = {.tv_sec = CT_TIMEOUT_MS / 1000, .tv_usec = CT_TIMEOUT_MS % 1000 * 1000};
+
+    /* the server may still be starting */
+    for (int i = 0; i < 50; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            return fd;
+        }
+        close(fd);
+        usleep(20000);
+    }
+    return -1;
+}
+
+static int
+ct_send(int fd, const char *format, ...)
+{
+    char    frame[sizeof(struct msg_hdr_s) + CT_LINE_MAX];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(frame + sizeof(struct msg_hdr_s), CT_LINE_MAX, format, args);
+    va_end(args);
+    if (len < 0 || len >= CT_LINE_MAX) {
+        return -1;
+    }
+
+    struct msg_hdr_s hdr = {.ops = MSG_TYP_CC | MSG_WID_AC, .len = len};
+    memcpy(frame, &hdr, sizeof(hdr));
+    return write(fd, frame, sizeof(hdr) + len) == (ssize_t)(sizeof(hdr) + len) ? 0 : -1;
+}
+
+static int
+ct_read(int fd, void *buf, size_t size)
+{
+    for (size_t off = 0; off < size;) {
+        ssize_t rd = read(fd, (char *)buf + off, size - off);
+        if (rd <= 0) {
+            return -1;
+        }
+        off += rd;
+    }
+    return 0;
+}
+
+static int
+ct_expect(int fd, const char *needle, char *text)
+{
+    struct msg_hdr_s hdr;
+
+    /* server frames until one has the needle, the others are answers to the earlier commands */
+    while (ct_read(fd, &hdr, sizeof(hdr)) == 0 && ct_read(fd, text, hdr.len) == 0) {
+        text[hdr.len] = '\0';
+        if (strstr(text, needle)) {
+            return 0;
+        }
+    }
+    snprintf(text, CT_TEXT_MAX, "no '%s' from the server", needle);
+    return -1;
+}
+
+static void
+ct_close(int *fd)
+{
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static bool
+ct_selected(const char *name)
+{
+    return !ct.filter || strstr(name, ct.filter);
+}
+
+static void
+ct_report(const char *name, const char *failure)
+{
+    printf("%-40s %s%s\n", name, failure ? "FAIL: " : "ok", failure ? failure : "");
+    fflush(stdout);
+    ct.failed += failure != NULL;
+}
+
+/***********************
+ * Sessions
+ ***********************/
+static const char *
+ct_session_open(int fd, char *token, char *text)
+{
+    /* "welcome, bob, session 0123456789abcdef" */
+    if (ct_send(fd, ":logmate bob pw") < 0 || ct_expect(fd, "session ", text) < 0) {
+        return "no session for bob";
+    }
+    snprintf(token, SESSION_TOKEN_SZ + 1, "%s", strstr(text, "session ") + strlen("session "));
+    if (ct_send(fd, ":enter lobby") < 0 || ct_expect(fd, "entered lobby", text) < 0) {
+        return "bob can't enter lobby";
+    }
+    return NULL;
+}
+
+static void
+ct_resume_stale(void)
+{
+    static char  text[CT_TEXT_MAX];
+    char         token[SESSION_TOKEN_SZ + 1];
+    const char  *failure = NULL;
+    int          adm     = ct_connect();
+    int          mate    = ct_connect();
+    int          back    = -1;
+
+    if (adm < 0 || mate < 0) {
+        failure = "can't connect";
+        goto done;
+    }
+    if (ct_send(adm, ":logadm %s", CT_ADMIN) < 0 || ct_expect(adm, "welcome, admin", text) < 0) {
+        failure = "admin can't log in";
+        goto done;
+    }
+
+    /* the same session is taken over while the registries stay */
+    if ((failure = ct_session_open(mate, token, text)) != NULL) {
+        goto done;
+    }
+    ct_close(&mate);
+    if ((back = ct_connect()) < 0 || ct_send(back, ":resume %s 0", token) < 0
+        || ct_expect(back, "welcome back, bob", text) < 0) {
+        failure = "resume without a registry change is refused";
+        goto done;
+    }
+    ct_close(&back);
+
+    /* a room mate added to the room makes the pointers of the session stale */
+    if ((mate = ct_connect()) < 0 || (failure = ct_session_open(mate, token, text)) != NULL) {
+        failure = failure ? failure : "can't connect";
+        goto done;
+    }
+    ct_close(&mate);
+    if (ct_send(adm, ":rooms addmates lobby carl") < 0 || ct_expect(adm, ":rooms addmates:", text) < 0) {
+        failure = "admin can't change room lobby";
+        goto done;
+    }
+    if ((back = ct_connect()) < 0 || ct_send(back, ":resume %s 0", token) < 0
+        || ct_expect(back, "session", text) < 0) {
+        failure = "no answer to resume";
+        goto done;
+    }
+    if (!strstr(text, "unknown or expired")) {
+        failure = text;
+    }
+
+done:
+    ct_report("resume_stale", failure);
+    ct_close(&adm);
+    ct_close(&mate);
+    ct_close(&back);
+}
+
+/***********************
+ * Listings
+ ***********************/
+static int
+ct_listing_has(int fd, const char *cmdline, const char *title, const char *needle, char *text)
+{
+    /* a registry this small fits one page, the title starts the page of the cached part */
+    if (ct_send(fd, "%s", cmdline) < 0 || ct_expect(fd, title, text) < 0) {
+        return -1;
+    }
+    return strstr(text, needle) != NULL;
+}
+
+static void
+ct_listing_fresh(void)
+{
+    static char  text[CT_TEXT_MAX];
+    const char  *failure = NULL;
+    int          adm     = ct_connect();
+
+    if (adm < 0) {
+        failure = "can't connect";
+        goto done;
+    }
+    if (ct_send(adm, ":logadm %s", CT_ADMIN) < 0 || ct_expect(adm, "welcome, admin", text) < 0) {
+        failure = "admin can't log in";
+        goto done;
+    }
+
+    /* rendered and cached before the change, then the new room mate must show up */
+    if (ct_listing_has(adm, ":roommates show", "roommates: \n", "name: dave\n", text) != 0) {
+        failure = "dave is listed before he is added";
+        goto done;
+    }
+    if (ct_send(adm, ":roommates add dave:pw") < 0 || ct_expect(adm, ":roommates add:", text) < 0) {
+        failure = "admin can't add dave";
+        goto done;
+    }
+    if (ct_listing_has(adm, ":roommates show", "roommates: \n", "name: dave\n", text) != 1) {
+        failure = ":roommates show is stale after :roommates add";
+        goto done;
+    }
+
+    /* the same for the roommates of rooms part of the status */
+    if (ct_listing_has(adm, ":status", "roommates of rooms: \n", "dave  ", text) != 0) {
+        failure = "dave is listed in a room before he enters it";
+        goto done;
+    }
+    if (ct_send(adm, ":rooms addmates lobby dave") < 0 || ct_expect(adm, ":rooms addmates:", text) < 0) {
+        failure = "admin can't change room lobby";
+        goto done;
+    }
+    if (ct_listing_has(adm, ":status", "roommates of rooms: \n", "dave  ", text) != 1) {
+        failure = ":status is stale after :rooms addmates";
+    }
+
+done:
+    ct_report("listing_fresh", failure);
+    ct_close(&adm);
+}
+
+int
+main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            ct.filter = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--filter SUBSTR]\n", argv[0]);
+            return 1;
+        }
+    }
+    if ((ct.port = ct_port()) < 0 || pthread_create(&ct.server, NULL, ct_server, NULL) != 0) {
+        fprintf(stderr, "can't start the server\n");
+        return 1;
+    }
+
+    if (ct_selected("resume_stale")) {
+        ct_resume_stale();
+    }
+    if (ct_selected("listing_fresh")) {
+        ct_listing_fresh();
+    }
+
+    /* the reactors see the flag at their next housekeeping at the latest */
+    signal_quit_flag = SIGINT;
+    pthread_join(ct.server, NULL);
+    return ct.failed;
+}